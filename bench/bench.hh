@@ -0,0 +1,84 @@
+// Helpers for the benchmark programs. {{{
+// Every result is written to standard output as one line of JSON, for example
+// {"bench":"webobject.load","case":"rpc-call","ops":2097152,"ns_per_op":412.3,"mb_per_s":180.2}
+// so the output of runs can be collected and compared over time. Anything else goes to standard error.
+// }}}
+
+#ifndef _WEBLOOP_BENCH_HH
+#define _WEBLOOP_BENCH_HH
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <initializer_list>
+#include <webloop.hh>
+
+namespace Bench {
+
+typedef std::chrono::steady_clock Clock;
+
+static inline double seconds_since(Clock::time_point start) { return std::chrono::duration <double> (Clock::now() - start).count(); }
+
+// Prevent the compiler from removing a computation whose result is not used.
+template <class T> static inline void keep(T const &value) { asm volatile("" : : "g"(&value) : "memory"); }
+
+// Print one result line. Names are used as they are; they must not need escaping.
+static inline void report(std::string const &bench, std::string const &variant, std::initializer_list <std::pair <char const *, double> > values) { // {{{
+	std::string line = "{\"bench\":\"" + bench + "\",\"case\":\"" + variant + "\"";
+	for (auto &value: values) {
+		char number[32];
+		snprintf(number, sizeof(number), "%.15g", value.second);
+		line += ",\"" + std::string(value.first) + "\":" + number;
+	}
+	std::cout << line << "}" << std::endl;
+} // }}}
+
+// Call op repeatedly for at least min_time seconds and return the average time per call in ns.
+// The calls are done in batches, which grow until reading the clock costs nothing in comparison.
+template <class Op> static double measure(Op &&op, size_t &total, double min_time = .3) { // {{{
+	size_t batch = 1;
+	total = 0;
+	op();	// Warm up.
+	auto start = Clock::now();
+	double elapsed;
+	while (true) {
+		for (size_t i = 0; i < batch; ++i)
+			op();
+		total += batch;
+		elapsed = seconds_since(start);
+		if (elapsed >= min_time)
+			break;
+		if (elapsed < min_time / 16)
+			batch *= 2;
+	}
+	return elapsed * 1e9 / total;
+} // }}}
+
+// Measure op and report the result; bytes is the amount of data that one call handles, or 0.
+template <class Op> static void run(std::string const &bench, std::string const &variant, size_t bytes, Op &&op) { // {{{
+	size_t total;
+	double ns = measure(op, total);
+	if (bytes > 0)
+		report(bench, variant, {{"ops", double(total)}, {"ns_per_op", ns}, {"mb_per_s", bytes * 1e3 / ns}});
+	else
+		report(bench, variant, {{"ops", double(total)}, {"ns_per_op", ns}});
+} // }}}
+
+// Report latencies in ns of calls which were done in seconds.
+static inline void report_latency(std::string const &bench, std::string const &variant, std::vector <double> &ns, double seconds) { // {{{
+	if (ns.empty()) {
+		std::cerr << bench << " " << variant << ": no calls completed" << std::endl;
+		return;
+	}
+	std::sort(ns.begin(), ns.end());
+	auto percentile = [&ns](double p) { return ns[std::min(ns.size() - 1, size_t(p * ns.size()))] / 1e3; };
+	report(bench, variant, {{"calls", double(ns.size())}, {"calls_per_s", ns.size() / seconds}, {"p50_us", percentile(.5)}, {"p99_us", percentile(.99)}, {"p999_us", percentile(.999)}, {"max_us", ns.back() / 1e3}});
+} // }}}
+
+}
+
+#endif
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,173 @@
+#define WEBLOOP_HELP "Memory that the server uses per idle connection."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-bench"
+
+#include <malloc.h>
+#include <csignal>
+#include <sys/wait.h>
+#include "bench.hh"
+
+using namespace Webloop;
+
+IntOption connections("connections", "Number of connections per test", 'c', 400);
+StringOption port("port", "Port for the server", 'p', "5392");
+
+// The clients run in a child process, so only the memory of the server is measured.
+// Every client connects, makes one request or sends one message, and then stays idle until it is told to disconnect.
+// All tests are done twice: with socket names, and without them (see SocketBase::set_debug_names()).
+enum Kind { HTTP, WEBSOCKET, RPC_CALL };
+char const *kind_name[] = {"http", "websocket", "rpc"};
+
+// Server. {{{
+struct Service;
+struct Service { // {{{
+	typedef RPC <Service>::Published Published;
+	std::map <std::string, Published> table;
+	std::map <std::string, Published> *published;
+	RPC <Service>::PublishedFallback published_fallback;
+	Kind kind;
+	size_t handled;	// Requests, messages or calls.
+	std::list <Websocket <Service> > websockets;
+	std::list <RPC <Service> > rpcs;
+	Service() : table(), published(&table), published_fallback(nullptr), kind(HTTP), handled(0), websockets(), rpcs() { table["echo"] = &Service::echo; }
+	coroutine echo(Args args, KwArgs) { ++handled; co_return (*args)[0]; }
+	void receive(std::string_view) { ++handled; }
+	void accept(Httpd <Service>::Connection &connection) {
+		if (kind == RPC_CALL) {
+			rpcs.emplace_back(connection, this);
+			return;
+		}
+		websockets.emplace_back(std::move(connection.socket), this, nullptr, Websocket <Service>::RunSettings {nullptr, Loop::Duration()});
+		websockets.back().set_view_receiver(&Service::receive);
+	}
+}; // }}}
+
+class Pages : public Httpd <Service> { // {{{
+	bool page(Connection &connection) override {
+		connection.reply(200, "ok", "text/plain");
+		++owner->handled;
+		return true;
+	}
+public:
+	Pages(Service *service) : Httpd <Service> (service, port.value, "") {}
+}; // }}}
+
+static size_t heap_in_use() { return mallinfo2().uordblks; }
+// }}}
+
+// Clients. {{{
+struct Client { // {{{
+	std::map <std::string, RPC <Client>::Published> *published;
+	RPC <Client>::PublishedFallback published_fallback;
+	std::unique_ptr <Socket <Client> > http;
+	std::unique_ptr <Websocket <Client> > websocket;
+	std::unique_ptr <RPC <Client> > rpc;
+	bool sent;
+	Client(Kind kind) : published(nullptr), published_fallback(nullptr), http(), websocket(), rpc(), sent(false) {
+		switch (kind) {
+		case HTTP:
+			http = std::make_unique <Socket <Client> > ("bench", port.value, this);
+			http->read(&Client::read);
+			http->send("GET /page HTTP/1.1\r\nHost: localhost\r\n\r\n");
+			sent = true;
+			break;
+		case WEBSOCKET:
+			websocket = std::make_unique <Websocket <Client> > ("ws://localhost:" + port.value + "/", Websocket <Client>::ConnectSettings(), this, nullptr, Websocket <Client>::RunSettings {nullptr, Loop::Duration()});
+			websocket->set_view_receiver(&Client::receive);
+			break;
+		case RPC_CALL:
+			rpc = std::make_unique <RPC <Client> > ("ws://localhost:" + port.value + "/", this);
+			break;
+		}
+	}
+	void poll() {
+		// Send the message or call once the connection is open.
+		if (sent)
+			return;
+		if (websocket && !websocket->closed()) {
+			websocket->send("hello", 2);
+			sent = true;
+		}
+		else if (rpc && rpc->is_open()) {
+			rpc->bgcall("echo", WV(42_wi), WM());
+			sent = true;
+		}
+	}
+	size_t read(std::string_view data) { return data.size(); }
+	void receive(std::string_view) {}
+}; // }}}
+
+void run_clients(int control) { // {{{
+	// For every test, the parent writes a byte to control to make the clients connect, and another one when it has measured, to make them disconnect.
+	Loop *loop = Loop::get();
+	for (int round = 0; round < 2; ++round) for (auto kind: {HTTP, WEBSOCKET, RPC_CALL}) {
+		char c;
+		if (::read(control, &c, 1) != 1)
+			return;
+		std::list <Client> clients;
+		for (int i = 0; i < connections.value; ++i)
+			clients.emplace_back(kind);
+		while (true) {
+			for (auto &client: clients)
+				client.poll();
+			struct pollfd p {control, POLLIN, 0};
+			if (::poll(&p, 1, 0) == 1)
+				break;
+			loop->iteration(false);
+			usleep(1000);
+		}
+		if (::read(control, &c, 1) != 1)
+			return;
+	}
+} // }}}
+// }}}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	int control[2];
+	if (pipe(control) < 0)
+		throw "unable to create pipe";
+	pid_t client_pid = fork();
+	if (client_pid < 0)
+		throw "unable to fork";
+	if (client_pid == 0) {
+		::close(control[1]);
+		// Give the server time to start listening.
+		usleep(200000);
+		run_clients(control[0]);
+		return 0;
+	}
+	::close(control[0]);
+	Loop *loop = Loop::get();
+	Service service;
+	Pages httpd(&service);
+	httpd.set_accept(&Service::accept);
+	for (int round = 0; round < 2; ++round) for (auto kind: {HTTP, WEBSOCKET, RPC_CALL}) {
+		SocketBase::set_debug_names(round == 0);
+		service.kind = kind;
+		service.handled = 0;
+		size_t before = heap_in_use();
+		if (::write(control[1], "c", 1) != 1)
+			throw "unable to signal client";
+		auto done = loop->now() + 10s;
+		while (service.handled < size_t(connections.value) && loop->now() < done)
+			loop->iteration(true);
+		// Let the replies be sent and temporary state be cleaned up.
+		for (int i = 0; i < 10; ++i)
+			loop->iteration(false);
+		size_t after = heap_in_use();
+		Bench::report("footprint.idle", std::string(kind_name[kind]) + (round == 0 ? "" : "-unnamed") + "-c" + std::to_string(connections.value), {{"connections", double(service.handled)}, {"bytes_per_connection", (double(after) - double(before)) / connections.value}});
+		// Disconnect the clients, and wait until the server has noticed.
+		service.websockets.clear();
+		service.rpcs.clear();
+		if (::write(control[1], "d", 1) != 1)
+			throw "unable to signal client";
+		done = loop->now() + 1s;
+		while (loop->now() < done)
+			loop->iteration(false);
+	}
+	waitpid(client_pid, nullptr, 0);
+	return 0;
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,139 @@
+#define WEBLOOP_HELP "Load generator for Httpd and RPC over loopback."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-bench"
+
+#include <csignal>
+#include <sys/wait.h>
+#include "bench.hh"
+
+using namespace Webloop;
+
+IntOption connections("connections", "Number of client connections", 'c', 16);
+DoubleOption duration("duration", "Seconds to run each test", 'd', 2);
+StringOption port("port", "Port for the server", 'p', "5390");
+
+// Service. {{{
+struct Service;
+std::list <RPC <Service> > rpcs;
+struct Service { // {{{
+	RPC <Service>::PublishedMap table;
+	RPC <Service>::PublishedMap *published;
+	RPC <Service>::PublishedFallback published_fallback;
+	Service() : table(), published(&table), published_fallback(nullptr) { table.set("echo", &Service::echo); }
+	coroutine echo(Args args, KwArgs) { co_return (*args)[0]; }
+	void accept(Httpd <Service>::Connection &connection) { rpcs.emplace_back(connection, this); }
+}; // }}}
+
+class Pages : public Httpd <Service> { // {{{
+	bool page(Connection &connection) override {
+		connection.reply(200, "ok", "text/plain");
+		return true;
+	}
+public:
+	// The clients connect all at once, so the listen queue must have room for all of them.
+	Pages(Service *service) : Httpd <Service> (service, port.value, "", nullptr, std::max(5, ::connections.value)) {}
+}; // }}}
+// }}}
+
+// Clients. {{{
+struct Stats { // {{{
+	Bench::Clock::time_point end;
+	std::vector <double> latencies;
+	size_t active;	// Clients that have not finished yet.
+	bool running() const { return Bench::Clock::now() < end; }
+	void record(Bench::Clock::time_point sent) { latencies.push_back(std::chrono::duration <double, std::nano> (Bench::Clock::now() - sent).count()); }
+	void done() { if (--active == 0) Loop::get()->stop(); }
+}; // }}}
+
+struct HttpClient { // {{{
+	// Sends GET requests over a persistent connection, one at a time.
+	Stats *stats;
+	Bench::Clock::time_point sent;
+	Socket <HttpClient> socket;
+	HttpClient(Stats *stats) : stats(stats), sent(), socket("bench", port.value, this) {
+		socket.read(&HttpClient::read);
+	}
+	bool ready() const { return true; }
+	void start() {
+		sent = Bench::Clock::now();
+		socket.send("GET /page HTTP/1.1\r\nHost: localhost\r\n\r\n");
+	}
+	size_t read(std::string_view data) {
+		auto eoh = data.find("\r\n\r\n");
+		if (eoh == std::string::npos)
+			return 0;
+		auto p = data.find("Content-Length:");
+		size_t length = p < eoh ? std::stoul(std::string(data.substr(p + 15, eoh - (p + 15)))) : 0;
+		if (data.size() < eoh + 4 + length)
+			return 0;
+		stats->record(sent);
+		if (stats->running())
+			start();
+		else
+			stats->done();
+		return eoh + 4 + length;
+	}
+}; // }}}
+
+struct RpcClient { // {{{
+	// Calls a function on the server, one call at a time.
+	std::map <std::string, RPC <RpcClient>::Published> *published;
+	RPC <RpcClient>::PublishedFallback published_fallback;
+	Stats *stats;
+	Bench::Clock::time_point sent;
+	RPC <RpcClient> rpc;
+	RpcClient(Stats *stats) : published(nullptr), published_fallback(nullptr), stats(stats), sent(), rpc("ws://localhost:" + port.value + "/", this) {}
+	bool ready() const { return rpc.is_open(); }
+	void start() {
+		sent = Bench::Clock::now();
+		rpc.bgcall("echo", WV(42_wi), WM(), &RpcClient::reply);
+	}
+	void reply(std::shared_ptr <WebObject>) {
+		stats->record(sent);
+		if (stats->running())
+			start();
+		else
+			stats->done();
+	}
+}; // }}}
+
+template <class Client> void run_clients(std::string const &name) { // {{{
+	Loop *loop = Loop::get();
+	Stats stats {{}, {}, size_t(connections.value)};
+	std::list <Client> clients;
+	for (int i = 0; i < connections.value; ++i)
+		clients.emplace_back(&stats);
+	// Connection setup is not part of the measurement.
+	while (!std::all_of(clients.begin(), clients.end(), [](Client const &client) { return client.ready(); }))
+		loop->iteration(true);
+	auto start = Bench::Clock::now();
+	stats.end = start + std::chrono::duration_cast <Bench::Clock::duration> (std::chrono::duration <double> (duration.value));
+	for (auto &client: clients)
+		client.start();
+	loop->run();
+	Bench::report_latency(name, "c" + std::to_string(connections.value), stats.latencies, Bench::seconds_since(start));
+} // }}}
+// }}}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	pid_t server_pid = fork();
+	if (server_pid < 0)
+		throw "unable to fork";
+	if (server_pid == 0) {
+		Service service;
+		Pages httpd(&service);
+		httpd.set_accept(&Service::accept);
+		Loop::get()->run();
+		return 0;
+	}
+	// Give the server time to start listening.
+	usleep(200000);
+	run_clients <HttpClient> ("load.http");
+	run_clients <RpcClient> ("load.rpc");
+	kill(server_pid, SIGTERM);
+	waitpid(server_pid, nullptr, 0);
+	return 0;
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,102 @@
+#define WEBLOOP_HELP "Benchmark for Loop dispatch and timers."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-bench"
+
+#include <sys/resource.h>
+#include "bench.hh"
+
+using namespace Webloop;
+
+// A pipe that is watched by the loop; every iteration makes one of them readable.
+struct Watched { // {{{
+	int fd;
+	size_t *calls;
+	bool readable() {
+		char c;
+		if (::read(fd, &c, 1) == 1)
+			++*calls;
+		return true;
+	}
+}; // }}}
+
+struct Timer { // {{{
+	size_t calls = 0;
+	bool expired() { ++calls; return false; }
+}; // }}}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+
+	// Allow enough fds for the largest case.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	getrlimit(RLIMIT_NOFILE, &limit);
+
+	// Dispatch cost against number of fds. {{{
+	for (auto backend: {std::pair <Loop::BackendType, char const *>(Loop::BACKEND_POLL, "poll"), {Loop::BACKEND_EPOLL, "epoll"}}) {
+		for (size_t num: {1, 10, 100, 1000, 10000}) {
+			if (num * 2 + 64 > limit.rlim_cur) {
+				std::cerr << "skipping " << num << " fds: not enough file descriptors allowed" << std::endl;
+				continue;
+			}
+			Loop loop(backend.first);
+			if (std::string(loop.backend_name()) != backend.second) {
+				std::cerr << "skipping backend " << backend.second << ": not available" << std::endl;
+				break;
+			}
+			size_t calls = 0;
+			std::vector <Watched> watched(num);
+			std::vector <int> write_fds(num);
+			for (size_t i = 0; i < num; ++i) {
+				int p[2];
+				if (::pipe(p) < 0)
+					throw "unable to create pipe";
+				watched[i] = Watched {p[0], &calls};
+				write_fds[i] = p[1];
+				loop.add_io(Loop::IoRecord("bench", &watched[i], p[0], POLLIN, &Watched::readable, static_cast <bool (Watched::*)()> (nullptr), static_cast <bool (Watched::*)()> (nullptr)));
+			}
+			size_t next = 0;
+			Bench::run("loop.dispatch", std::string(backend.second) + "-" + std::to_string(num), 0, [&]() {
+				if (::write(write_fds[next], "x", 1) != 1)
+					throw "unable to write to pipe";
+				next = (next + 1) % num;
+				loop.iteration(false);
+			});
+			for (size_t i = 0; i < num; ++i) {
+				::close(watched[i].fd);
+				::close(write_fds[i]);
+			}
+			if (calls == 0)
+				std::cerr << "no events were dispatched" << std::endl;
+		}
+	}
+	// }}}
+
+	// Timer cost against number of pending timers. {{{
+	for (size_t num: {0, 100, 10000, 100000}) {
+		Loop loop;
+		Timer timer;
+		std::vector <Loop::TimeoutHandle> pending;
+		auto now = loop.now();
+		// Pending timers, spread over the range of websocket keepalives.
+		for (size_t i = 0; i < num; ++i)
+			pending.push_back(loop.add_timeout(Loop::TimeoutRecord(now + 1s + (i * 50s) / std::max(num, size_t(1)), 0s, &timer, &Timer::expired, true)));
+		std::string variant = std::to_string(num);
+		Bench::run("loop.timeout_add_remove", variant, 0, [&]() {
+			loop.remove_timeout(loop.add_timeout(Loop::TimeoutRecord(loop.now() + 30s, 0s, &timer, &Timer::expired)));
+		});
+		Bench::run("loop.timeout_expire", variant, 0, [&]() {
+			loop.add_timeout(Loop::TimeoutRecord(loop.now(), 0s, &timer, &Timer::expired));
+			loop.handle_timeouts();
+		});
+		for (auto &handle: pending)
+			loop.remove_timeout(handle);
+	}
+	// }}}
+	return 0;
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,25 @@
+#define WEBLOOP_HELP "Benchmark for base64 and sha1."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-bench"
+
+#include "bench.hh"
+
+using namespace Webloop;
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	// The short input is the size of a websocket handshake key; the others are bulk data.
+	for (size_t size: {60, 1 << 10, 64 << 10}) {
+		std::string data(size, '\0');
+		for (size_t i = 0; i < size; ++i)
+			data[i] = char(i * 131 + (i >> 8));
+		std::string encoded = b64encode(data);
+		std::string variant = std::to_string(size);
+		Bench::run("tools.b64encode", variant, size, [&data]() { Bench::keep(b64encode(data)); });
+		Bench::run("tools.b64decode", variant, size, [&encoded]() { std::string::size_type pos = 0; Bench::keep(b64decode(encoded, pos)); });
+		Bench::run("tools.sha1", variant, size, [&data]() { Bench::keep(sha1(data)); });
+	}
+	return 0;
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,45 @@
+#define WEBLOOP_HELP "Benchmark for WebObject serialization."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-bench"
+
+#include "bench.hh"
+
+using namespace Webloop;
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+
+	// Payloads. {{{
+	std::vector <std::pair <std::string, std::shared_ptr <WebObject> > > payloads;
+	// A typical small RPC call.
+	payloads.emplace_back("rpc-call", WV("call"_ws, WV(12345_wi, "player.move"_ws, WV(3_wi, WebInt::create(-1), 2.5_wf), WM(WT("run", true), WT("target", "door \"north\""_ws)))));
+	// A large array of numbers.
+	auto numbers = WV();
+	for (int i = 0; i < 1000; ++i)
+		numbers->push_back(i % 3 == 0 ? std::shared_ptr <WebObject> (WebFloat::create(i * 1.25)) : std::shared_ptr <WebObject> (WebInt::create(i * 7919)));
+	payloads.emplace_back("numbers", numbers);
+	// A map of strings, some of which need escapes.
+	auto strings = WM();
+	for (int i = 0; i < 100; ++i)
+		(*strings)["key" + std::to_string(i)] = WebString::create(i % 10 == 0 ? "line\nwith \"quotes\" and \\ é" : "plain text value number " + std::to_string(i));
+	payloads.emplace_back("strings", strings);
+	// Deeply nested structure.
+	std::shared_ptr <WebObject> nested = WN();
+	for (int i = 0; i < 50; ++i)
+		nested = WV(WM(WT("level", WebInt::create(i)), WT("child", nested)));
+	payloads.emplace_back("nested", nested);
+	// }}}
+
+	for (auto &payload: payloads) {
+		std::string json = payload.second->dump();
+		std::string binary;
+		payload.second->dump_binary(binary);
+		Bench::run("webobject.dump", payload.first, json.size(), [&payload]() { Bench::keep(payload.second->dump()); });
+		Bench::run("webobject.load", payload.first, json.size(), [&json]() { Bench::keep(WebObject::load(json)); });
+		Bench::run("webobject.dump_binary", payload.first, binary.size(), [&payload]() { std::string out; payload.second->dump_binary(out); Bench::keep(out); });
+		Bench::run("webobject.load_binary", payload.first, binary.size(), [&binary]() { Bench::keep(WebObject::load_binary(binary)); });
+	}
+	return 0;
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,67 @@
+#define WEBLOOP_HELP "Benchmark for the websocket frame codec."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-bench"
+
+#include "bench.hh"
+
+using namespace Webloop;
+
+StringOption port("port", "Port for the server", 'p', "5391");
+
+// Both ends of a websocket over loopback, in one process.
+// Frames from the client are masked, so both directions are measured.
+struct Pair { // {{{
+	size_t received;
+	bool accepted;
+	Websocket <Pair> server;
+	Websocket <Pair> client;
+	void receive(std::string_view data) { (void)&data; ++received; }
+	void accept(Httpd <Pair>::Connection &connection) {
+		server = Websocket <Pair> (std::move(connection.socket), this, nullptr, {nullptr, Loop::Duration()});
+		server.set_view_receiver(&Pair::receive);
+		accepted = true;
+	}
+	Pair() : received(0), accepted(false), server(), client() {}
+}; // }}}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	Loop *loop = Loop::get();
+	Pair pair;
+	Httpd <Pair> httpd(&pair, port.value, "");
+	httpd.set_accept(&Pair::accept);
+	pair.client = Websocket <Pair> ("ws://localhost:" + port.value + "/", {}, &pair, nullptr, {nullptr, Loop::Duration()});
+	pair.client.set_view_receiver(&Pair::receive);
+	// The client is closed until the handshake reply has been parsed.
+	while (!pair.accepted || pair.client.closed())
+		loop->iteration(true);
+	for (auto direction: {std::pair <Websocket <Pair> *, char const *>(&pair.client, "client"), {&pair.server, "server"}}) {
+		for (size_t size: {16, 1 << 10, 64 << 10}) {
+			std::string payload(size, 'x');
+			// Send a burst of frames, then run the loop until they have all been parsed.
+			size_t burst = std::max(size_t(1), (256 << 10) / size);
+			Bench::run("websocket.send_receive", std::string(direction.second) + "-" + std::to_string(size) + "x" + std::to_string(burst), size * burst, [&]() {
+				size_t target = pair.received + burst;
+				for (size_t i = 0; i < burst; ++i)
+					direction.first->send(payload, 2);
+				while (pair.received < target)
+					loop->iteration(true);
+			});
+		}
+	}
+	// The same frames as a broadcast message, which is framed once for all of them.
+	for (size_t size: {16, 1 << 10, 64 << 10}) {
+		BroadcastMessage message(std::string(size, 'x'), 2);
+		size_t burst = std::max(size_t(1), (256 << 10) / size);
+		Bench::run("websocket.broadcast", "server-" + std::to_string(size) + "x" + std::to_string(burst), size * burst, [&]() {
+			size_t target = pair.received + burst;
+			for (size_t i = 0; i < burst; ++i)
+				pair.server.send(message);
+			while (pair.received < target)
+				loop->iteration(true);
+		});
+	}
+	return 0;
+}
+
+// vim: set foldmethod=marker :
@@ -4,6 +4,7 @@
 #include "webloop/coroutine.hh"
 #include "webloop/fhs.hh"
 #include "webloop/loop.hh"
+#include "webloop/metrics.hh"
 #include "webloop/network.hh"
 #include "webloop/tools.hh"
 #include "webloop/url.hh"
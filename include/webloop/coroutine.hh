@@ -18,6 +18,7 @@ For awaiters:
 #include <iostream>
 #include <vector>
 #include <map>
+#include <atomic>
 #include <cassert>
 #include <endian.h>
 #include <ieee754.h>
@@ -32,13 +33,13 @@ struct FinalSuspendAwaitable;
 extern std::shared_ptr <WebObject> *debug_ptr;
 
 struct coroutine { // {{{
-	static int next_name_id;
+	static std::atomic <int> next_name_id;	// Shared by all threads.
 	struct promise_type;
 	struct CbBase {};	// Not actually the base, the class just uses it as such.
 	using handle_type = std::coroutine_handle <promise_type>;
 	struct promise_type { // {{{
-		// For debugging: name.
-		std::string name;
+		// For debugging: name. The id is only assigned when the name is requested.
+		int name_id;
 		// from_coroutine = handle(to_coroutine); to_coroutine = Yield(from_coroutine);
 		std::shared_ptr <WebObject> from_coroutine;
 		std::shared_ptr <WebObject> to_coroutine;
@@ -53,12 +54,16 @@ struct coroutine { // {{{
 		handle_type continuation;	// Target coroutine to run when we are finished. Used by YieldFrom.
 
 		// Constructor and related functions.
-		promise_type() : name(std::to_string(next_name_id++)), from_coroutine(), to_coroutine(), is_done(nullptr), retval(nullptr), cb_base(nullptr), cb(), continuation() { STARTFUNC; }
+		promise_type() : name_id(-1), from_coroutine(), to_coroutine(), is_done(nullptr), retval(nullptr), cb_base(nullptr), cb(), continuation() { STARTFUNC; }
 		~promise_type() { STARTFUNC; }
+		std::string name() { if (name_id < 0) name_id = next_name_id++; return std::to_string(name_id); }
+		// Frames are allocated from the object pool; their size is fixed per coroutine function, so they fit in few size classes.
+		static void *operator new(size_t size) { return pool_allocate(size); }
+		static void operator delete(void *ptr, size_t size) noexcept { pool_deallocate(ptr, size); }
 		coroutine get_return_object() { STARTFUNC; return coroutine(handle_type::from_promise(*this)); }
 		std::suspend_always initial_suspend() noexcept { STARTFUNC; return {}; }
 		inline FinalSuspendAwaitable final_suspend() noexcept;
-		void unhandled_exception() { STARTFUNC; WL_log("Unhandled exception from coroutine"); }
+		void unhandled_exception() { STARTFUNC; WL_log("Unhandled exception from coroutine " + name()); }
 
 		// If co_yield is used, this function is called. If Yield is used, the YieldAwaiter class below is used.
 		std::suspend_always yield_value(std::shared_ptr <WebObject> v) { STARTFUNC; from_coroutine.swap(v); return {}; }
@@ -75,6 +80,8 @@ struct coroutine { // {{{
 		void set_cb(CbBase *base, Cb new_cb) { STARTFUNC; cb_base = base; cb = new_cb; }
 		// Set a coroutine continuation; used by YieldFrom.
 		void set_continuation(handle_type target) { STARTFUNC; continuation = target; }
+		// Resume a coroutine that waits for the loop, like in Loop::sleep().
+		static void resume_from_loop(void *address) { STARTFUNC; handle_type handle = handle_type::from_address(address); coroutine::activate(&handle, nullptr); }
 	}; // }}}
 	handle_type handle;
 	coroutine(handle_type handle) : handle(handle) { STARTFUNC; }
@@ -109,7 +116,8 @@ struct YieldAwaiter { // {{{
 struct YieldFromAwaiter { // {{{
 	// This class lets YieldFrom prepare another coroutine for yielding from it.
 	coroutine::handle_type target_handle;
-	YieldFromAwaiter(coroutine target) : target_handle(target.handle) { STARTFUNC; }
+	coroutine::handle_type handle;	// The coroutine that waits; the target passes its return value to it when it finishes.
+	YieldFromAwaiter(coroutine target) : target_handle(target.handle), handle() { STARTFUNC; }
 	bool await_ready() noexcept { STARTFUNC; return false; }
 	coroutine::handle_type await_suspend(coroutine::handle_type handle) noexcept;
 	std::shared_ptr <WebObject> await_resume() noexcept;
@@ -160,7 +160,9 @@ template <typename T> struct Option: public OptionBase { // {{{
 	void parse(std::string const &param) override {
 		std::istringstream p(param);
 		p >> value;
-		if (std::find_if_not(param.begin() + p.tellg(), param.end(), [](char c) { return std::isspace(c); }) != param.end())
+		if (p.fail())
+			throw "invalid option value";
+		if (!p.eof() && std::find_if_not(param.begin() + p.tellg(), param.end(), [](char c) { return std::isspace(c); }) != param.end())
 			throw "junk found after option value";
 	}
 
@@ -210,10 +212,13 @@ template <typename T> struct MultiOption: public OptionBase { // {{{
 	void parse(std::string const &param) override {
 		auto parts = split(param, -1, 0, ";");
 		for (auto part: parts) {
-			std::istringstream p(URL::decode(part));
+			std::string decoded = URL::decode(part);
+			std::istringstream p(decoded);
 			T single_value;
 			p >> single_value;
-			if (std::find_if_not(param.begin() + p.tellg(), param.end(), [](char c) { return std::isspace(c); }) != param.end())
+			if (p.fail())
+				throw "invalid option value";
+			if (!p.eof() && std::find_if_not(decoded.begin() + p.tellg(), decoded.end(), [](char c) { return std::isspace(c); }) != decoded.end())
 				throw "junk found after option value";
 			value.push_back(single_value);
 		}
@@ -398,6 +403,7 @@ std::filesystem::path write_log_dir(std::string const &name = std::string(), boo
 // }}}
 
 // Temporary files. {{{
+std::filesystem::path write_temp_name(std::string const &name = std::string());
 std::ofstream write_temp_file(std::string const &name = std::string());
 std::filesystem::path write_temp_dir(std::string const &name = std::string());
 // }}}
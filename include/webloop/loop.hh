@@ -5,9 +5,15 @@
 #include <set>
 #include <list>
 #include <vector>
+#include <memory>
 #include <chrono>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <coroutine>
 #include <poll.h>
 #include <cassert>
+#include "metrics.hh"
 
 namespace Webloop {
 
@@ -27,16 +33,18 @@ public:
 		Cb read;
 		Cb write;
 		Cb error;
-		std::string name;	// For debugging.
+		std::string name;	// For debugging, and as the label of its metrics.
+		Metrics::Histogram *timing;	// Time spent in the callbacks; if nullptr, Loop::add_io() looks it up with io_timing().
 		template <class UserType>
-		IoRecord(std::string const &name, UserType *obj, int fd, short events, bool (UserType::*r)(), bool (UserType::*w)(), bool (UserType::*e)()) :
+		IoRecord(std::string const &name, UserType *obj, int fd, short events, bool (UserType::*r)(), bool (UserType::*w)(), bool (UserType::*e)(), Metrics::Histogram *timing = nullptr) :
 			object(reinterpret_cast <CbBase *>(obj)),
 			fd(fd),
 			events(events),
 			read(reinterpret_cast <CbType>(r)),
 			write(reinterpret_cast <CbType>(w)),
 			error(reinterpret_cast <CbType>(e)),
-			name(name)
+			name(name),
+			timing(timing)
 		{}
 		void set_name(std::string const &n) { name = n; }
 	}; // }}}
@@ -48,70 +56,205 @@ public:
 		template <class Base> IdleRecord(Base *object, bool (Base::*cb)()) : object(reinterpret_cast <CbBase *>(object)), cb(reinterpret_cast <Cb>(cb)) {}
 	}; // }}}
 	typedef std::list <IdleRecord>::iterator IdleHandle;
+	// Deferred tasks use the same records; a task that returns true is deferred again.
+	typedef IdleRecord DeferRecord;
+	typedef uint64_t DeferHandle;
 
 	struct TimeoutRecord { // {{{
 		Time time;
 		Duration interval;	// 0 for single shot.
 		CbBase *object;
 		Cb cb;
-		bool operator<(TimeoutRecord const &other) const { return time < other.time; }
-		template <class Base> TimeoutRecord(Time const &time, Duration interval, Base *object, bool (Base::*cb)()) : time(time), interval(interval), object(reinterpret_cast <CbBase *>(object)), cb(reinterpret_cast <Cb>(cb)) {}
+		bool coarse;	// Coarse timeouts may fire up to 1/8 of their delay late, but are cheaper; use them for long timeouts that are often reset, like keepalives.
+		template <class Base> TimeoutRecord(Time const &time, Duration interval, Base *object, bool (Base::*cb)(), bool coarse = false) : time(time), interval(interval), object(reinterpret_cast <CbBase *>(object)), cb(reinterpret_cast <Cb>(cb)), coarse(coarse) {}
+	}; // }}}
+
+	struct TimeoutHandle { // {{{
+		// Default constructed handles are invalid. A handle stays valid while it is rescheduled (if it has an interval).
+		unsigned index;
+		unsigned serial;
+		TimeoutHandle(unsigned index = unsigned(-1), unsigned serial = 0) : index(index), serial(serial) {}
+		bool operator==(TimeoutHandle const &other) const = default;
 	}; // }}}
-	typedef std::set <TimeoutRecord>::iterator TimeoutHandle;
 
 	typedef int IoHandle;
+
+	struct SleepAwaiter : public CbBase { // {{{
+		// Returned by sleep(). The promise type of the waiting coroutine must have a static resume_from_loop(void *address) member.
+		Loop *loop;
+		Duration delay;
+		void *address;	// Of the waiting coroutine.
+		void (*resume)(void *address);
+		SleepAwaiter(Loop *loop, Duration delay) : loop(loop), delay(delay), address(nullptr), resume(nullptr) {}
+		bool await_ready() const noexcept { return false; }
+		template <class Promise> void await_suspend(std::coroutine_handle <Promise> handle) {
+			address = handle.address();
+			resume = &Promise::resume_from_loop;
+			if (delay > Duration())
+				loop->add_timeout(TimeoutRecord(loop->now() + delay, Duration(), this, &SleepAwaiter::fire));
+			else
+				loop->defer(DeferRecord(this, &SleepAwaiter::fire));
+		}
+		void await_resume() const noexcept {}
+		bool fire() { resume(address); return false; }
+	}; // }}}
 	// }}}
 
+	/// Kernel interface that is used to wait for events on file descriptors.
+	enum BackendType { BACKEND_DEFAULT, BACKEND_POLL, BACKEND_EPOLL };
+
+	struct Backend { // {{{
+		// Interface for the event backends. They only track fds; the IoRecords are stored in the Loop.
+		struct Event {
+			IoHandle handle;
+			short revents;
+			unsigned serial;	// Filled in by the Loop, to detect events for records that were removed while dispatching.
+		};
+		virtual ~Backend() {}
+		virtual char const *name() const = 0;
+		virtual void add(IoHandle handle, int fd, short events) = 0;
+		virtual void remove(IoHandle handle, int fd) = 0;
+		// Wait for events and append them to ready. A negative timeout blocks until an event arrives.
+		virtual void wait(int timeout, std::vector <Event> &ready) = 0;
+	}; // }}}
+
 private:
-	struct PollItems { // {{{
-		struct pollfd *data;
-		std::vector <IoRecord> items;
-		int num;
-		int capacity;
-		int min_capacity;
-		std::set <int> empty_items;	// Empty items that have lower index than num - 1.
-		PollItems(int initial_capacity = 32) : data(new struct pollfd[initial_capacity]), num(0), capacity(initial_capacity), min_capacity(initial_capacity) {}
-		~PollItems() { delete[] data; }
+	struct IoItems { // {{{
+		std::vector <IoRecord> items;	// Index is the IoHandle; removed records have fd -1.
+		std::vector <unsigned> serials;	// Bumped when an item is removed; never shrinks.
+		std::set <int> empty_items;	// Empty items that have lower index than items.size() - 1.
 		int add(IoRecord const &item);
 		void remove(int index);
+		bool valid(IoHandle handle, unsigned serial) const { return handle >= 0 && size_t(handle) < items.size() && items[handle].fd >= 0 && serials[handle] == serial; }
 		std::string print();
 		void update_name(IoHandle handle, std::string const &n) { items[handle].set_name(n); }
 	}; // }}}
 
-	static Loop fallback_loop;
-	static Loop *default_loop;
+	struct Timers { // {{{
+		// Precise timeouts are stored in a binary heap. Coarse timeouts are stored in a non-cascading hierarchical wheel, like the one in the Linux kernel:
+		// each level has 64 buckets that are 8 times as wide as those of the level below it; level 0 has 1 ms buckets.
+		// Timeouts are rounded up to the bucket size of the level that they end up in, so those far in the future are less precise, but nothing needs to be moved between levels.
+		static constexpr int LVL_BITS = 6;
+		static constexpr int LVL_SIZE = 1 << LVL_BITS;
+		static constexpr int LVL_CLK_SHIFT = 3;
+		static constexpr int LVL_DEPTH = 8;
+		struct Node {
+			enum State : uint8_t { FREE, HEAP, WHEEL, PENDING, RUNNING, CANCELLED };
+			Time time;
+			Duration interval;
+			CbBase *object;
+			Cb cb;
+			uint64_t expires;	// Tick of expiry, for the wheel.
+			unsigned serial;	// Bumped when the node is freed, so old handles are detected.
+			int pos;		// Index in heap, or bucket in wheel.
+			int prev, next;		// Siblings in wheel bucket; next is also used for the free list.
+			State state;
+			bool coarse;
+		};
+		std::vector <Node> nodes;
+		int free_node;
+		std::vector <int> heap;
+		Time epoch;		// Time of tick 0.
+		uint64_t clk;		// Next tick that the wheel will process.
+		uint64_t pending[LVL_DEPTH];	// Bitmaps of non-empty buckets per level.
+		int buckets[LVL_DEPTH * LVL_SIZE];
+		size_t wheel_size;
+		Timers();
+		TimeoutHandle add(TimeoutRecord const &record);
+		bool valid(TimeoutHandle handle) const { return handle.index < nodes.size() && nodes[handle.index].serial == handle.serial && nodes[handle.index].state != Node::FREE; }
+		void insert(int index);		// Insert node in heap or wheel.
+		void unlink(int index);		// Remove node from heap or wheel.
+		void release(int index);	// Put node on the free list.
+		void remove(TimeoutHandle handle);
+		void collect(Time current, std::vector <TimeoutHandle> &expired);
+		int next_timeout(Time current);	// In ms, rounded up; -1 if there are no timeouts.
+		uint64_t tick(Time time) const;	// Rounded up.
+		void heap_up(int pos);
+		void heap_down(int pos);
+		uint64_t wheel_next() const;	// First tick at which a bucket expires, or uint64_t(-1).
+		void wheel_collect(std::vector <TimeoutHandle> &expired);	// Collect buckets for tick clk.
+	}; // }}}
+
+	// The default loop is per thread, so every thread can run its own loop.
+	static thread_local Loop *default_loop;
 	bool running;
 	bool aborting;
 	std::list <IdleRecord> idle;
 	std::list <IdleRecord>::iterator next_idle_item;
-	PollItems items;
-	std::set <TimeoutRecord> timeouts;
+	IoItems items;
+	std::unique_ptr <Backend> backend;
+	std::vector <Backend::Event> ready;
+	Timers timeouts;
+	std::vector <TimeoutHandle> expired;
+
+	// Deferred tasks. {{{
+	// Tasks run at the end of the iteration in which they were deferred; tasks that they defer run in the next one.
+	static constexpr size_t max_deferred_batch = 4096;	// Tasks per iteration; the rest runs after the next poll, which doesn't block then.
+	std::vector <DeferRecord> deferred;	// Removed tasks have a null object.
+	size_t deferred_head;	// Tasks before this have run.
+	DeferHandle deferred_base;	// Handle of deferred[0]; handles are never reused.
+	void run_deferred();
+	// }}}
+
+	// Metrics. {{{
+	Metrics metric_data;
+	Metrics::Histogram &iteration_time;	// Time to handle the events of one iteration; waiting is not included.
+	Metrics::Histogram &timeout_lag;	// Time between the scheduled and the actual time of timeouts.
+	// }}}
+
+	// Tasks posted from other threads. {{{
+	struct PostNode {
+		std::function <void ()> task;
+		PostNode *next;
+	};
+	std::atomic <PostNode *> posted;	// Lock-free stack of posted tasks, newest first.
+	int wake_fd;		// Readable when tasks have been posted.
+	int wake_write_fd;	// Written to wake the loop; the same as wake_fd for an eventfd.
+	IoHandle wake_handle;
+	bool run_posted();
+	// }}}
 
 public:
 	static Loop *get(Loop *arg = nullptr);
-	Loop() : running(false), aborting(false), idle{}, next_idle_item(idle.end()) { if (!default_loop) default_loop = this; }
+	Loop(BackendType type = BACKEND_DEFAULT);
+	~Loop();
+	char const *backend_name() const { return backend->name(); }
 	Time now() { return std::chrono::steady_clock::now(); }
 	constexpr bool is_running () const { return running; }
 	int handle_timeouts();
 	void iteration(bool block = false);
 	void run();
 	void stop(bool force = false);
+	void post(std::function <void ()> &&task);	// Run task in this loop's thread. This is the only member that may be called from other threads.
 
-	IoHandle add_io(IoRecord const &item) { return items.add(item); }
-	TimeoutHandle add_timeout(TimeoutRecord const &timeout) { timeouts.insert(timeout); return --timeouts.end(); }
+	IoHandle add_io(IoRecord const &item);
+	TimeoutHandle add_timeout(TimeoutRecord const &timeout) { return timeouts.add(timeout); }
+	// Idle callbacks run after every iteration, and make run() poll without blocking while they exist; defer() is usually better.
 	IdleHandle add_idle(IdleRecord const &record) { idle.push_back(record); return --idle.end(); }
+	// Run a task once, at the end of the current iteration. This does not allocate, except to grow the queue.
+	DeferHandle defer(DeferRecord const &record) { deferred.push_back(record); return deferred_base + deferred.size() - 1; }
+	// Suspend a coroutine for a while: co_await loop->sleep(100ms). It is resumed from iteration(), without allocating.
+	// With a delay of 0, the coroutine is resumed as a deferred task, after the events that are pending now.
+	SleepAwaiter sleep(Duration delay) { return SleepAwaiter(this, delay); }
 
-	void remove_io(IoHandle handle) { items.remove(handle); }
-	void remove_timeout(TimeoutHandle handle) { timeouts.erase(handle); }
+	void remove_io(IoHandle handle);
+	void remove_timeout(TimeoutHandle handle) { timeouts.remove(handle); }
 	void remove_idle(IdleHandle handle);
+	void remove_deferred(DeferHandle handle) { if (handle >= deferred_base + deferred_head && handle < deferred_base + deferred.size()) deferred[handle - deferred_base].object = nullptr; }
 
 	IoHandle invalid_io() const { return -1; }
-	TimeoutHandle invalid_timeout() { return timeouts.end(); }
-	std::set <TimeoutRecord>::const_iterator invalid_timeout() const { return timeouts.end(); }
+	TimeoutHandle invalid_timeout() const { return TimeoutHandle(); }
 	IdleHandle invalid_idle() { return idle.end(); }
 	std::list <IdleRecord>::const_iterator invalid_idle() const { return idle.end(); }
+	DeferHandle invalid_deferred() const { return 0; }
+
+	void update_name(IoHandle handle, std::string const &n, Metrics::Histogram *timing = nullptr) { items.update_name(handle, n); items.items[handle].timing = timing != nullptr ? timing : &io_timing(n); }
+	// The histogram for the callbacks of file descriptors with this name. Looking it up takes a lock, so objects that
+	// register their fd often should get it once and pass it in their IoRecords.
+	Metrics::Histogram &io_timing(std::string const &name);
 
-	void update_name(IoHandle handle, std::string const &n) { items.update_name(handle, n); }
+	// Metrics of this loop and of everything that runs in it. Only use them from the thread that runs the loop.
+	Metrics &metrics() { return metric_data; }
 };
 
 }
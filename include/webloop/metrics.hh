@@ -0,0 +1,121 @@
+#ifndef _METRICS_HH
+#define _METRICS_HH
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <bit>
+#include <algorithm>
+#include <initializer_list>
+#include <vector>
+
+namespace Webloop {
+
+class Metrics { // {{{
+	/* Counters, gauges and histograms for monitoring.
+	Every Loop owns a Metrics object, which is updated by the loop and by
+	the protocol layers that run in it.  Metrics are created once (which
+	is slow) and then updated through a reference (which is fast).
+	Every metric is only written by the thread that runs its loop, so an
+	update is a relaxed load and store, which compiles to a plain add;
+	other threads can still read the values safely.  prometheus()
+	combines the metrics of all loops, in the Prometheus text format;
+	Httpd::set_metrics_path() serves it.
+	*/
+public:
+	typedef std::initializer_list <std::pair <std::string_view, std::string_view> > Labels;
+
+	class Counter { // {{{
+		std::atomic <uint64_t> value;
+	public:
+		Counter() : value(0) {}
+		void add(uint64_t amount = 1) { value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed); }
+		uint64_t get() const { return value.load(std::memory_order_relaxed); }
+	}; // }}}
+
+	class Gauge { // {{{
+		std::atomic <int64_t> value;
+	public:
+		Gauge() : value(0) {}
+		void add(int64_t amount = 1) { value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed); }
+		void set(int64_t amount) { value.store(amount, std::memory_order_relaxed); }
+		int64_t get() const { return value.load(std::memory_order_relaxed); }
+	}; // }}}
+
+	class Histogram { // {{{
+		// Durations, in buckets that are powers of two; bucket i holds values below 2**(i + first_bucket_bits) ns.
+		// The first bucket is below 1 µs, the last finite one below 17 s; the final bucket holds everything larger.
+	public:
+		static int const num_buckets = 26;
+		static int const first_bucket_bits = 10;
+	private:
+		std::atomic <uint64_t> counts[num_buckets];
+		std::atomic <uint64_t> sum;	// In ns.
+	public:
+		Histogram() : counts{}, sum(0) {}
+		void record_ns(uint64_t ns) {
+			int index = std::min(int(std::bit_width(ns >> first_bucket_bits)), num_buckets - 1);
+			counts[index].store(counts[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			sum.store(sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+		}
+		template <class Rep, class Period> void record(std::chrono::duration <Rep, Period> duration) {
+			auto ns = std::chrono::duration_cast <std::chrono::nanoseconds> (duration).count();
+			record_ns(ns > 0 ? ns : 0);
+		}
+		uint64_t get_bucket(int index) const { return counts[index].load(std::memory_order_relaxed); }
+		uint64_t get_sum_ns() const { return sum.load(std::memory_order_relaxed); }
+		static double upper_bound(int index) { return double(uint64_t(1) << (index + first_bucket_bits)) / 1e9; }	// In seconds.
+	}; // }}}
+
+	struct Traffic { // {{{
+		// Totals for a protocol; see traffic().
+		Counter &frames_in;
+		Counter &frames_out;
+		Counter &bytes_in;
+		Counter &bytes_out;
+	}; // }}}
+
+private:
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+	struct Family {
+		std::string help;
+		Type type;
+		// Keys are the formatted labels, like name="value",other="value".
+		std::map <std::string, std::unique_ptr <Counter> > counters;
+		std::map <std::string, std::unique_ptr <Gauge> > gauges;
+		std::map <std::string, std::unique_ptr <Histogram> > histograms;
+	};
+	std::map <std::string, Family> families;
+	std::map <std::string, std::unique_ptr <Traffic> > traffics;
+	mutable std::mutex lock;	// Taken when metrics are created and when they are exported, not when they are updated.
+	Family &family(std::string const &name, std::string const &help, Type type);
+	static std::string format_labels(Labels labels);
+	void collect(std::map <std::string, std::pair <Family const *, std::map <std::string, std::vector <double> > > > &target) const;
+public:
+	Metrics();
+	~Metrics();
+	Metrics(Metrics const &other) = delete;
+	Metrics &operator=(Metrics const &other) = delete;
+
+	// Get a metric, creating it if it doesn't exist. The reference stays valid for the lifetime of this object.
+	// Names should follow the Prometheus conventions, like webloop_some_thing_total for counters and webloop_some_thing_seconds for histograms.
+	Counter &counter(std::string const &name, std::string const &help, Labels labels = {});
+	Gauge &gauge(std::string const &name, std::string const &help, Labels labels = {});
+	Histogram &histogram(std::string const &name, std::string const &help, Labels labels = {});
+	// Frame and byte counters for a protocol, labeled with its name.
+	Traffic &traffic(std::string const &protocol);
+
+	// All metrics of all loops, in the Prometheus text exposition format. Metrics with the same name and labels are added together.
+	static std::string prometheus();
+}; // }}}
+
+}
+
+#endif
+
+// vim: set foldmethod=marker :
@@ -40,11 +40,15 @@ sockets.  Connection targets can be specified in several ways.
 #include <iostream>
 #include <vector>
 #include <list>
+#include <memory>
+#include <string_view>
+#include <initializer_list>
 #include <unistd.h>
 #include <set>
 #include <ctime>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -52,6 +56,7 @@ sockets.  Connection targets can be specified in several ways.
 #include "tools.hh"
 #include "loop.hh"
 #include "url.hh"
+#include "coroutine.hh"
 
 using namespace std::literals;
 // }}}
@@ -80,18 +85,93 @@ public:
 	struct UserBase {};	// Not actually a base for the user class, this class just pretends that it is.
 	typedef void (UserBase::*RawReadType)();
 	typedef void (UserBase::*ReadType)(std::string &data);
+	typedef size_t (UserBase::*ReadViewType)(std::string_view data);
 	typedef void (UserBase::*ReadLinesType)(std::string const &data);
 	typedef void (UserBase::*DisconnectType)();
 	typedef void (UserBase::*ErrorType)(std::string const &message);
+	typedef void (UserBase::*DrainType)();
+	typedef void (UserBase::*ConnectType)();
+	// Time that a client socket may take to connect, unless another value is passed to the constructor.
+	static constexpr Loop::Duration default_connect_timeout = std::chrono::seconds(30);
+	struct ReadAwaiter;
+	struct WriteAwaiter;
 private:
 
 	int fd;
-	size_t maxsize;	// For read operations.
+	size_t maxsize;	// Maximum number of bytes per read operation.
 	Loop *current_loop;
 	Loop::IoHandle read_handle;
+	Loop::IoHandle write_handle;	// Only registered while there is pending output.
 
-	// Pending received data.
+	// Pending received data. {{{
+	// Bytes before buffer_start have been consumed; they are discarded when that is cheap.
 	std::string buffer;
+	size_t buffer_start;
+	unsigned buffer_generation;	// Changed when the buffer is taken away, so a running dispatch() knows its position is invalid.
+	bool *dispatch_alive;	// Set while dispatch() runs; the destructor clears the flag it points to, so dispatch() can stop.
+	ReadAwaiter *read_waiter;	// Coroutine that waits for data; it gets the data before the read callbacks.
+	bool fill();
+	void dispatch();
+	void start_reading();
+	// }}}
+
+	// Pending output data. {{{
+	struct OutputChunk {
+		std::string data;
+		std::shared_ptr <std::string const> shared;	// If set, the chunk is sent from this buffer instead of data; see send_shared().
+		int file;	// If not -1, the chunk is sent from this file instead of data. The chunk owns the fd.
+		bool pipe;	// The file is a pipe, so it is sent with splice() instead of sendfile().
+		off_t file_offset;
+		size_t file_size;
+		OutputChunk(std::string &&data) : data(std::move(data)), shared(), file(-1), pipe(false), file_offset(0), file_size(0) {}
+		OutputChunk(std::shared_ptr <std::string const> const &shared) : data(), shared(shared), file(-1), pipe(false), file_offset(0), file_size(0) {}
+		OutputChunk(int file, bool pipe, off_t offset, size_t size) : data(), shared(), file(file), pipe(pipe), file_offset(offset), file_size(size) {}
+		OutputChunk(OutputChunk &&other) : data(std::move(other.data)), shared(std::move(other.shared)), file(other.file), pipe(other.pipe), file_offset(other.file_offset), file_size(other.file_size) { other.file = -1; }
+		OutputChunk &operator=(OutputChunk &&other);
+		~OutputChunk() { if (file >= 0) ::close(file); }
+		std::string_view view() const { return shared ? std::string_view(*shared) : std::string_view(data); }
+		size_t size() const { return file >= 0 ? file_size : view().size(); }
+	};
+	// Buffers are taken from a pool while data is pending, and given back when it has been handled, so idle sockets don't keep their capacity. {{{
+	struct BufferPool {
+		static constexpr size_t max_buffers = 64;	// Spare buffers of each kind that are kept.
+		static constexpr size_t max_capacity = 128 << 10;	// Larger receive buffers are freed instead of kept.
+		static constexpr size_t max_chunks = 64;	// Larger output queues are freed instead of kept.
+		std::vector <std::string> buffers;
+		std::vector <std::vector <OutputChunk> > queues;
+	};
+	static thread_local BufferPool pool;	// Sockets are only used by the thread that runs their loop.
+	static bool debug_names;
+	void take_buffer();
+	void release_buffer();
+	void release_output();
+	// }}}
+	std::vector <OutputChunk> output;	// Chunks before output_head have been written.
+	size_t output_head;
+	size_t output_offset;	// Number of bytes of the head chunk that have been written.
+	size_t output_size;	// Total number of bytes that are waiting to be written.
+	size_t high_watermark;	// When output_size exceeds this, the socket is congested.
+	size_t low_watermark;	// When a congested socket drains to this size, drain_cb is called.
+	bool congested;
+	bool not_socket;	// Set if send() is not supported on fd, so write() is used instead.
+	coroutine::handle_type flush_waiter;
+	WriteAwaiter *write_waiter;	// Coroutine that waits in write_all().
+	void queue_output(OutputChunk &&chunk);
+	static ssize_t write_output(int fd, bool &not_socket, std::vector <OutputChunk> &output, size_t &head, size_t &offset);
+	bool flush();
+	struct Linger;
+	bool write_impl();
+	void clear_output();
+	// }}}
+
+	// Connection setup for client sockets. {{{
+	// While the connection is set up, fd is -1 and connector is set; sent data is queued, and read callbacks are registered when it is done.
+	struct Connector;
+	std::shared_ptr <Connector> connector;
+	coroutine::handle_type connect_waiter;
+	void connected(int new_fd);
+	void connect_failed(std::string const &message);
+	// }}}
 
 	// For server sockets: the Server that accepted them; for client sockets: nullptr.
 	ServerBase *server;
@@ -99,23 +179,23 @@ private:
 	std::list <SocketBase *>::iterator server_data;
 
 	std::string name; // for debugging.
+	Metrics::Histogram *io_timing;	// Histogram for the callbacks of this socket in current_loop, which depends on name; nullptr until it is needed.
+	Metrics::Histogram *get_io_timing() { if (io_timing == nullptr) io_timing = &current_loop->io_timing(name); return io_timing; }
 
 	// Functions that are registered in the Loop.
 	typedef bool (SocketBase::*CbType)();
 	bool rawread_impl();
 	bool read_impl();
-	bool read_lines_impl();
 
 	// Pass errors to user object and close the socket.
 	bool error_impl() {
-		buffer += unread();
+		stop_reading();
 		if (error_cb != nullptr)
 			(user->*error_cb)("error on socket");
 		close();
 		return false;
 	}
 
-	bool handle_read_line_data(std::string &&data);
 	void finish_move(SocketBase &&other);
 
 protected:
@@ -125,16 +205,25 @@ protected:
 	// Functions that register the above functions (called through a wrapper that uses that UserType-bound callbacks).
 	std::string rawread_base(RawReadType callback);
 	void read_base(ReadType callback);
+	void read_base(ReadViewType callback);
 	void read_lines_base(ReadLinesType callback);
 
+	// Cancel read callbacks, but keep buffered data for the next reader.
+	void stop_reading();
+
 	// Read callbacks.
 	RawReadType rawread_cb;
 	ReadType read_cb;
+	ReadViewType read_view_cb;
 	ReadLinesType read_lines_cb;
 	// Callback when socket is disconnected.
 	DisconnectType disconnect_cb;
 	// Error callback.
 	ErrorType error_cb;
+	// Callback when a congested socket has drained.
+	DrainType drain_cb;
+	// Callback when a client socket has connected.
+	ConnectType connect_cb;
 
 	// For debugging.
 	int get_fd() const { return fd; }
@@ -144,33 +233,116 @@ public:
 	// Read only address components; these are filled from address in the constructor.
 	URL url;
 
-	// Constructor.
-	SocketBase(std::string const &name, int fd, URL const &url, UserBase *user, Loop *loop);
+	// Constructor. If fd is -1, a connection to url is set up in the background.
+	SocketBase(std::string const &name, int fd, URL const &url, UserBase *user, Loop *loop, Loop::Duration connect_timeout = default_connect_timeout);
 
 	// Move support.
 	SocketBase(std::string const &name = "unconnected");
 	SocketBase(SocketBase &&other);
 	SocketBase &operator=(SocketBase &&other);
 
+	// Close the socket without calling the disconnect callback; the loop must not keep pointers to destroyed sockets.
+	~SocketBase() { if (dispatch_alive != nullptr) *dispatch_alive = false; disconnect_cb = nullptr; close(); }
+
 	// Close the connection.
 	std::string close();
 
 	// Retrieve a string of data.
 	std::string recv();
 
-	// Write data.
-	// TODO: Sending data on a socket is currently blocking; it should instead be possible as coroutine and with callback.
-	void send(std::string const &data);
+	// Move up to size bytes of received data into file through pipe, from a rawread() callback.
+	ssize_t recv_file(int file, size_t size, int const pipe[2]);
+
+	// Write data. This never blocks; data that cannot be written immediately is queued.
+	// Returns false if the socket is closed or congested.
+	bool send(std::string_view data) { return send({data}); }
+	// Write several buffers with a single system call, without joining them first.
+	bool send(std::initializer_list <std::string_view> data);
+	// Send size bytes from file, starting at offset, without reading them into memory.
+	// The socket owns file after this call, and closes it when it has been sent.
+	bool send_file(int file, off_t offset, size_t size);
+	// Send a buffer that is shared with other sockets. The queue keeps a reference to it instead of copying it, so it must not be changed.
+	bool send_shared(std::shared_ptr <std::string const> const &data);
+
+	// Output queue state.
+	size_t pending_output() const { return output_size; }
+	bool is_congested() const { return congested; }
+	void set_watermarks(size_t high, size_t low) { high_watermark = high; low_watermark = low; }
+
+	// Wait until all queued data has been written (or the socket is closed); use with YieldFrom.
+	coroutine wait_for_flush();
+
+	// Check if a client socket is still connecting. Data that is sent meanwhile is queued.
+	bool is_connecting() const { return connector != nullptr; }
+	// Wait until a client socket has connected; use with YieldFrom. The result is a WebBool, which is false if the connection failed.
+	coroutine wait_for_connect();
+	// Set how long the results of name lookups are used; the default is 60 s. They are cached, because lookups are slow.
+	static void set_resolve_ttl(Loop::Duration ttl);
+
+	// Awaitables for coroutines. {{{
+	// Use them with co_await, like std::string line = co_await socket.read_until("\n");
+	// The awaiter lives in the coroutine frame and the loop resumes the coroutine directly, so waiting does not allocate.
+	// At most one coroutine can wait for reading, and one for writing. A waiting reader gets data before the read callbacks do.
+	// Closing the socket cancels the waits: reads then return an empty string and write_all() returns false.
+	struct ReadAwaiter {
+		SocketBase *socket;
+		std::string_view delimiter;	// Empty for read_some().
+		size_t limit;
+		size_t searched;	// Number of buffered bytes that are known not to contain the delimiter.
+		std::string result;
+		coroutine::handle_type handle;
+		ReadAwaiter(SocketBase *socket, std::string_view delimiter, size_t limit) : socket(socket), delimiter(delimiter), limit(limit), searched(0), result(), handle() {}
+		bool take();	// Move the requested data from the buffer into result; returns false if it has not been received yet.
+		bool await_ready() { return !*socket || take(); }
+		void await_suspend(coroutine::handle_type handle);
+		std::string await_resume() { return std::move(result); }
+	};
+	struct WriteAwaiter {
+		SocketBase *socket;
+		bool result;
+		coroutine::handle_type handle;
+		bool await_ready() { result = bool(*socket); return !result || socket->output_size == 0; }
+		void await_suspend(coroutine::handle_type handle);
+		bool await_resume() { return result; }
+	};
+	// Wait for received data and return it, but not more than limit bytes.
+	ReadAwaiter read_some(size_t limit = size_t(-1)) { return ReadAwaiter(this, std::string_view(), limit); }
+	// Wait until delimiter is received and return all data up to and including it.
+	// If limit bytes are received without a delimiter, they are returned without one. The delimiter must stay valid while waiting.
+	ReadAwaiter read_until(std::string_view delimiter, size_t limit = size_t(-1)) { return ReadAwaiter(this, delimiter, limit); }
+	// Send data and wait until all queued output has been written; returns false if the socket was closed before that.
+	WriteAwaiter write_all(std::string_view data) { send(data); return {this, false, coroutine::handle_type()}; }
+	// }}}
 
 	// Read event scheduling.
 	std::string unread();
 
-	// Check if socket is connected.
-	operator bool() const { return fd >= 0; }
+	// Mark bytes at the start of the received data as consumed.
+	// A view callback that hands the socket to another object must call this first; the count it returns includes these bytes.
+	void consume(size_t num) { buffer_start = std::min(buffer_start + num, buffer.size()); }
+
+	// Set the maximum number of bytes per read operation.
+	void set_maxsize(size_t size) { maxsize = size; }
+	size_t get_maxsize() const { return maxsize; }
+
+	// Check if socket is connected, or connecting.
+	operator bool() const { return fd >= 0 || connector != nullptr; }
 
 	// Set and get name.
 	constexpr std::string const &get_name() const { return name; }
-	void set_name(std::string const &n) { name = n; if (read_handle >= 0) current_loop->update_name(read_handle, n); }
+	void set_name(std::string const &n) { // {{{
+		if (!debug_names)
+			return;
+		name = n;
+		io_timing = nullptr;
+		if (read_handle >= 0)
+			current_loop->update_name(read_handle, n, get_io_timing());
+		if (write_handle >= 0)
+			current_loop->update_name(write_handle, n, get_io_timing());
+	} // }}}
+	// Names are used in log messages and as labels of the I/O metrics. Disabling them saves memory when there are many sockets.
+	// This affects sockets that are created or renamed afterwards; set it before the loop is started.
+	static void set_debug_names(bool enable) { debug_names = enable; }
 }; // }}}
 
 // Socket <UserType> {{{
@@ -179,12 +351,16 @@ class Socket : public SocketBase { // {{{
 public:
 	typedef void (UserType::*RawReadCb)();
 	typedef void (UserType::*ReadCb)(std::string &buffer);
+	// Returns the number of bytes that were used. The view points into the receive buffer; the callback may modify the data in place.
+	typedef size_t (UserType::*ReadViewCb)(std::string_view buffer);
 	typedef void (UserType::*ReadLinesCb)(std::string const &buffer);
 	typedef void (UserType::*DisconnectCb)();
 	typedef void (UserType::*ErrorCb)(std::string const &message);
+	typedef void (UserType::*DrainCb)();
+	typedef void (UserType::*ConnectCb)();
 
-	// Create client socket, which connects to server.
-	Socket(std::string const &name, std::string const &address, UserType *user = nullptr);
+	// Create client socket, which connects to server. This does not block; errors are reported to the error callback.
+	Socket(std::string const &name, std::string const &address, UserType *user = nullptr, Loop *loop = nullptr, Loop::Duration connect_timeout = default_connect_timeout);
 	// Use existing socket (or other fd). This is used by Server to handle accepted requests, and can be used to fake sockets.
 	Socket(std::string const &name, int fd = -1, UserType *user = nullptr, Loop *loop = nullptr)	 // Use an fd as a "socket", so it can use the functionality of this class. {{{
 		:
@@ -202,16 +378,19 @@ public:
 	// Read event scheduling.
 	std::string rawread(RawReadCb callback) { STARTFUNC; return rawread_base(reinterpret_cast <RawReadType>(callback)); }
 	void read(ReadCb callback) { STARTFUNC; read_base(reinterpret_cast <ReadType>(callback)); }
+	void read(ReadViewCb callback) { STARTFUNC; read_base(reinterpret_cast <ReadViewType>(callback)); }
 	void read_lines(ReadLinesCb callback) { STARTFUNC; read_lines_base(reinterpret_cast <ReadLinesType>(callback)); }
 	// Other events.
 	void set_disconnect_cb(DisconnectCb callback) { STARTFUNC; disconnect_cb = reinterpret_cast <DisconnectType>(callback); }
 	void set_error_cb(ErrorCb callback) { STARTFUNC; error_cb = reinterpret_cast <ErrorType>(callback); }
+	void set_drain_cb(DrainCb callback) { STARTFUNC; drain_cb = reinterpret_cast <DrainType>(callback); }
+	void set_connect_cb(ConnectCb callback) { STARTFUNC; connect_cb = reinterpret_cast <ConnectType>(callback); }
 }; // }}}
 
 template <class UserType>
-Socket <UserType>::Socket(std::string const &name, std::string const &address, UserType *user) // {{{
+Socket <UserType>::Socket(std::string const &name, std::string const &address, UserType *user, Loop *loop, Loop::Duration connect_timeout) // {{{
 	:
-		SocketBase(name, -1, address, reinterpret_cast <SocketBase::UserBase *>(user), Loop::get())
+		SocketBase(name, -1, address, reinterpret_cast <SocketBase::UserBase *>(user), Loop::get(loop), connect_timeout)
 {
 	STARTFUNC;
 } // }}}
@@ -221,7 +400,7 @@ Socket <UserType>::Socket(Socket <OtherType> &&other, UserType *new_user) : // {
 		SocketBase(std::move(other))
 {
 	STARTFUNC;
-	unread();
+	stop_reading();
 	user = reinterpret_cast <SocketBase::UserBase *>(new_user);
 } // }}}
 // }}}
@@ -239,16 +418,46 @@ private:
 		int fd;
 		Socket <Listener> socket;
 		std::string name;
-		Listener(std::string const &name, ServerBase *server, int fd) : server(server), fd(fd), socket("server listener " + name, fd, this), name(name) {}
+		bool tcp;
+		bool *alive;	// Set while accept_remote() runs; the destructor clears the flag it points to, so it can stop.
+		Listener(std::string const &name, ServerBase *server, int fd, Loop *loop, bool tcp) : server(server), fd(fd), socket("server listener " + name, fd, this, loop), name(name), tcp(tcp), alive(nullptr) {}
+		~Listener() { if (alive != nullptr) *alive = false; }
 		void accept_remote();
+		void create_remote(int new_fd, struct sockaddr_un &addr, socklen_t addrlen);
 	};
+	// Connections that are accepted per wakeup; the rest are accepted in the next iteration, so other events are not starved.
+	static constexpr int max_accept_batch = 256;
+	// Time before accepting is retried when the process has no free file descriptors.
+	static constexpr Loop::Duration accept_retry_delay = std::chrono::milliseconds(100);
 	Loop *listenloop;
 	std::list <Listener> listeners;
 	int active_backlog;
+	bool reuse_port;	// Allow other servers (usually in other threads) to listen on the same port; the kernel distributes connections over them.
 	std::list <SocketBase *> remotes;
 
+	// Admission control. {{{
+	// While a limit is reached, the listening sockets are not polled, so new connections wait in the backlog instead of being accepted and closed.
+	size_t max_connections;	// 0 for no limit.
+	double accept_rate;	// Connections per second; 0 for no limit.
+	double accept_burst;	// Connections that can be accepted at once after an idle period.
+	double accept_tokens;	// Token bucket for the rate limit.
+	Loop::Time accept_refill;	// Time when accept_tokens was last updated.
+	Loop::TimeoutHandle resume_handle;	// Pending resume, for the rate limit or after running out of file descriptors.
+	Loop::Time resume_time;
+	bool paused;
+	Metrics::Counter *pauses;
+	bool admit();	// Check the limits before accepting a connection; pause if one has been reached.
+	void pause();
+	bool resume();	// Poll the listening sockets again, if the limits allow it.
+	bool resume_timeout();
+	void schedule_resume(Loop::Time time);
+	void cancel_resume();
+	void take_resume(ServerBase &other);
+	// }}}
+
 	void open_socket(std::string const &service, int backlog);
 	void remote_disconnect(std::list <SocketBase *>::iterator socket);
+	void set_tcp_option(int option, int value, char const *name);
 protected:
 	OwnerBase *owner;
 	// Callbacks.
@@ -257,7 +466,7 @@ protected:
 	ErrorType error_cb;
 
 public:
-	ServerBase(std::string const &service, OwnerBase *owner, CreateType create, ClosedType closed, ErrorType error, Loop *loop, int backlog);
+	ServerBase(std::string const &service, OwnerBase *owner, CreateType create, ClosedType closed, ErrorType error, Loop *loop, int backlog, bool reuse_port = false);
 	void close();
 	~ServerBase() { close(); }
 
@@ -267,6 +476,19 @@ public:
 
 	void set_loop(Loop *loop);
 	void set_backlog(int backlog);
+
+	// Admission control: stop accepting while max connections are open (0 for no limit),
+	// and accept at most rate connections per second, with bursts of up to burst connections (rate 0 for no limit).
+	void set_max_connections(size_t max);
+	void set_accept_rate(double rate, double burst = 1);
+	size_t get_connection_count() const { return remotes.size(); }
+	bool is_paused() const { return paused; }
+
+	// Options for TCP listeners; they are ignored for unix domain sockets.
+	// Wake the server only when data has arrived on a new connection, or after timeout seconds (0 disables this).
+	void set_defer_accept(int timeout);
+	// Allow clients to send data with the SYN packet; queue_length limits pending fast open requests (0 disables this).
+	void set_fastopen(int queue_length);
 }; // }}}
 
 template <class UserType, class OwnerType>
@@ -284,8 +506,9 @@ public:
 			ClosedCb closed = nullptr,
 			ErrorCb error = nullptr,
 			Loop *loop = nullptr,
-			int backlog = 5)
-		: ServerBase (service, reinterpret_cast <OwnerBase *>(owner), reinterpret_cast <ServerBase::CreateType>(create), reinterpret_cast <ServerBase::ClosedType>(closed), reinterpret_cast <ServerBase::ErrorType>(error), loop, backlog) {}
+			int backlog = SOMAXCONN,
+			bool reuse_port = false)
+		: ServerBase (service, reinterpret_cast <OwnerBase *>(owner), reinterpret_cast <ServerBase::CreateType>(create), reinterpret_cast <ServerBase::ClosedType>(closed), reinterpret_cast <ServerBase::ErrorType>(error), loop, backlog, reuse_port) {}
 	// }}}
 
 	// Move support.
@@ -2,6 +2,7 @@
 #define _TOOLS_HH
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <iostream>
 
@@ -17,7 +18,8 @@ namespace Webloop {
 // * 6: Startfunc.
 extern int DEBUG;
 
-#if 1
+// Compile with -DWEBLOOP_NO_STARTFUNC to remove the function tracing of debug level 6 completely.
+#ifndef WEBLOOP_NO_STARTFUNC
 #define STARTFUNC do { if (Webloop::DEBUG > 5) std::cout << __FILE__ << ":" << __LINE__ << ": " << __FUNCTION__ << " entered." << std::endl; } while(0)
 #else
 #define STARTFUNC do {} while(0)
@@ -40,13 +42,26 @@ void log_impl(std::string const &message, std::string const &filename, std::stri
 #define WL_log(msg) Webloop::log_impl(msg, __FILE__, __PRETTY_FUNCTION__, __LINE__)
 // }}}
 
-// Implementation of RFC4648 (base64) and sha1, for use within websocket communication.
-// These are available with better performance from other libraries. However,
-// the performance is not relevant here and it's not much code. It is prefered
-// to avoid depending on other libraries when possible.
+// Implementation of RFC4648 (base64) and sha1, for use within websocket communication and for POST bodies.
+// These are used for every websocket handshake and for base64 encoded uploads, so they use SIMD kernels where the CPU supports them.
+// It is prefered to avoid depending on other libraries when possible.
 std::string b64encode(std::string const &src);
 std::string b64decode(std::string const &src, std::string::size_type &pos, bool allow_whitespace = false);
 
+// Incremental base64 decoder, for data that arrives in pieces. Whitespace between letters is ignored.
+class B64Decoder { // {{{
+	char pending[4];	// Letters of an incomplete unit, which may be split over pieces.
+	int num_pending;
+	bool padded;		// Padding was found; only whitespace may follow.
+public:
+	B64Decoder() : pending(), num_pending(0), padded(false) {}
+	// Decode a piece of data and append the result to target. Returns false if the data is invalid.
+	bool decode(std::string_view data, std::string &target);
+	// Returns false if the data ended in the middle of a unit. The decoder is reset for new data.
+	bool finish();
+	void reset() { num_pending = 0; padded = false; }
+}; // }}}
+
 std::string sha1(std::string const &src);
 
 }
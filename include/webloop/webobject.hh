@@ -8,10 +8,12 @@
 #include <map>
 #include <cassert>
 #include <endian.h>
-#include <ieee754.h>
+#include <string_view>
 #include <sstream>
 #include <memory>
 #include <iomanip>
+#include <algorithm>
+#include <stdexcept>
 #include "tools.hh"
 // }}}
 
@@ -20,8 +22,6 @@ namespace Webloop {
 // Declare this, so coroutine.hh does not need to be included.
 struct coroutine;
 
-#define WEBOBJECT_DUMPS_JSON
-
 class WebNone;
 class WebBool;
 class WebInt;
@@ -32,6 +32,110 @@ class WebMap;
 
 static constexpr int make_object_type(char const id[4]) { return (id[3] << 24) | (id[2] << 16) | (id[1] << 8) | id[0]; }
 
+// Allocation of WebObjects. {{{
+// Default objects are created with allocate_shared, so the object and its reference count are a single block.
+// Those blocks come from a per-thread pool of fixed size blocks, which avoids malloc for the many small objects in a tree.
+// The same pool is used for coroutine frames; blocks that are too large for it are passed to operator new.
+// Compile with -DWEBLOOP_NO_POOL to use operator new instead, for example when testing with a memory checker.
+void *pool_allocate(size_t size);
+void pool_deallocate(void *ptr, size_t size) noexcept;
+
+template <class T> struct PoolAllocator { // {{{
+	typedef T value_type;
+	PoolAllocator() noexcept {}
+	template <class U> PoolAllocator(PoolAllocator <U> const &) noexcept {}
+	static_assert(alignof(T) <= 16, "PoolAllocator blocks are only 16 byte aligned");
+	T *allocate(size_t n) { return static_cast <T *>(pool_allocate(n * sizeof(T))); }
+	void deallocate(T *ptr, size_t n) noexcept { pool_deallocate(ptr, n * sizeof(T)); }
+	template <class U> bool operator==(PoolAllocator <U> const &) const noexcept { return true; }
+}; // }}}
+
+template <class T, typename... Ts> std::shared_ptr <T> make_pooled(Ts &&... args) { return std::allocate_shared <T> (PoolAllocator <T> (), std::forward <Ts> (args)...); }
+// }}}
+
+class WebObject;
+
+// Storage of WebMap items. {{{
+// Items are kept in a vector, sorted by key, so iteration order is the same as for std::map. For the few keys that
+// maps (keyword arguments in particular) usually have, this avoids a node allocation per item and pointer chasing
+// on lookup. Keys can be looked up with a string_view, so no std::string needs to be constructed for that.
+// Unlike std::map, inserting or erasing an item invalidates iterators and references to other items.
+class FlatMap { // {{{
+public:
+	typedef std::string key_type;
+	typedef std::shared_ptr <WebObject> mapped_type;
+	typedef std::pair <std::string, std::shared_ptr <WebObject> > value_type;
+	typedef std::vector <value_type>::iterator iterator;
+	typedef std::vector <value_type>::const_iterator const_iterator;
+private:
+	std::vector <value_type> items;
+	static size_t const linear_limit = 8;	// Smaller maps are searched linearly.
+	size_t lower(std::string_view key) const { // {{{
+		if (items.size() <= linear_limit) {
+			size_t i = 0;
+			while (i < items.size() && std::string_view(items[i].first) < key)
+				++i;
+			return i;
+		}
+		return std::lower_bound(items.begin(), items.end(), key, [](value_type const &item, std::string_view k) { return std::string_view(item.first) < k; }) - items.begin();
+	} // }}}
+public:
+	FlatMap() : items() {}
+	FlatMap(std::initializer_list <value_type> init) : items() { for (auto &i: init) insert(i); }
+	iterator begin() { return items.begin(); }
+	iterator end() { return items.end(); }
+	const_iterator begin() const { return items.begin(); }
+	const_iterator end() const { return items.end(); }
+	size_t size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+	void clear() { items.clear(); }
+	void reserve(size_t n) { items.reserve(n); }
+	iterator find(std::string_view key) { size_t i = lower(key); return i < items.size() && items[i].first == key ? items.begin() + i : items.end(); }
+	const_iterator find(std::string_view key) const { size_t i = lower(key); return i < items.size() && items[i].first == key ? items.begin() + i : items.end(); }
+	bool contains(std::string_view key) const { return find(key) != end(); }
+	std::pair <iterator, bool> insert(value_type const &item) { // {{{
+		size_t i = lower(item.first);
+		if (i < items.size() && items[i].first == item.first)
+			return {items.begin() + i, false};
+		return {items.insert(items.begin() + i, item), true};
+	} // }}}
+	mapped_type &operator[](std::string_view key) { // {{{
+		size_t i = lower(key);
+		if (i == items.size() || items[i].first != key)
+			items.emplace(items.begin() + i, std::string(key), nullptr);
+		return items[i].second;
+	} // }}}
+	mapped_type &at(std::string_view key) { auto i = find(key); if (i == end()) throw std::out_of_range("FlatMap::at"); return i->second; }
+	mapped_type const &at(std::string_view key) const { auto i = find(key); if (i == end()) throw std::out_of_range("FlatMap::at"); return i->second; }
+	iterator erase(const_iterator position) { return items.erase(position); }
+	size_t erase(std::string_view key) { auto i = find(key); if (i == end()) return 0; items.erase(i); return 1; }
+	// For building a large map: append items in any order with append_unsorted(), then call sort(), which keeps
+	// the last item for duplicate keys. Lookups don't work in between.
+	void append_unsorted(std::string &&key, mapped_type &&value) { items.emplace_back(std::move(key), std::move(value)); }
+	void sort() { // {{{
+		auto less = [](value_type const &a, value_type const &b) { return a.first < b.first; };
+		if (items.size() <= linear_limit) {
+			// Insertion sort; unlike stable_sort, this does not allocate a buffer.
+			for (size_t i = 1; i < items.size(); ++i) {
+				for (size_t j = i; j > 0 && less(items[j], items[j - 1]); --j)
+					std::swap(items[j], items[j - 1]);
+			}
+		}
+		else if (!std::is_sorted(items.begin(), items.end(), less))
+			std::stable_sort(items.begin(), items.end(), less);
+		size_t target = 0;
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (i + 1 < items.size() && items[i].first == items[i + 1].first)
+				continue;
+			if (target != i)
+				items[target] = std::move(items[i]);
+			++target;
+		}
+		items.resize(target);
+	} // }}}
+}; // }}}
+// }}}
+
 class WebObject { // {{{
 public:		// Types
 	// Default types all end with '\0'. Libraries should not do that, and
@@ -45,7 +149,7 @@ public:		// Types
 	static int const VECTOR = make_object_type("VEC\0");
 	static int const MAP = make_object_type("MAP\0");
 	typedef std::vector <std::shared_ptr <WebObject> > VectorType;
-	typedef std::map <std::string, std::shared_ptr <WebObject> > MapType;
+	typedef FlatMap MapType;
 	typedef int64_t IntType;
 	typedef double FloatType;
 private:	// Data members
@@ -72,14 +176,18 @@ public:		// Member functions
 	virtual std::shared_ptr <WebObject> copy() const = 0;
 
 	// Serialization.
-	virtual std::string dump() const { throw "Attempt to serialize invalid object"; };
+	// dump_to() appends the JSON form to out, so nested objects and callers that reuse a buffer do not allocate a string per element.
+	// dump_size_hint() is a cheap estimate of the length of that output, used to reserve space up front.
+	std::string dump() const { std::string ret; ret.reserve(dump_size_hint()); dump_to(ret); return ret; }
+	virtual void dump_to(std::string &out) const { (void)&out; throw "Attempt to serialize invalid object"; }
+	virtual size_t dump_size_hint() const { return 16; }
 	virtual std::string print() const = 0;
-	static std::shared_ptr <WebObject> load(std::string const &data);
+	static std::shared_ptr <WebObject> load(std::string_view data, size_t max_depth = 256);
+	// Compact binary serialization, which is appended to out. The format is described at load_binary().
+	virtual void dump_binary(std::string &out) const { (void)&out; throw "Attempt to serialize invalid object"; }
+	static std::shared_ptr <WebObject> load_binary(std::string_view data);
 	friend std::ostream &operator<<(std::ostream &s, WebObject const &o) { s << o.print(); return s; }
 private:
-#ifndef WEBOBJECT_DUMPS_JSON
-	virtual void load_impl(std::string const &data) = 0;
-#endif
 	typedef std::shared_ptr <WebObject> (*unary_operator_impl)(WebObject &obj, char op);
 	typedef std::shared_ptr <WebObject> (*binary_operator_impl)(WebObject &lhs, WebObject &rhs, char op);
 	typedef coroutine (*function_operator_impl)(WebObject &obj, std::shared_ptr <WebObject> args, std::shared_ptr <WebObject> kwargs);
@@ -135,21 +243,16 @@ public:
 
 // Object class definitions.
 class WebNone : public WebObject { // {{{
-#ifndef WEBOBJECT_DUMPS_JSON
-	void load_impl(std::string const &data) override { assert(data.length() == 1); }
-#endif
 	static std::shared_ptr <WebNone> instance; // While it is allowed to construct more of them, create() will always return this one.
 public:
 	static int const type = NONE;
 	WebNone() : WebObject(NONE) {}
 	static std::shared_ptr <WebNone> create() { return instance; }
-	std::shared_ptr <WebObject> copy() const override { return std::shared_ptr <WebObject> (new WebNone()); }
+	std::shared_ptr <WebObject> copy() const override { return instance; }
 	std::string print() const override { return "None"; }
-#ifdef WEBOBJECT_DUMPS_JSON
-	std::string dump() const override { return "null"; }
-#else
-	std::string dump() const override { return "N"; }
-#endif
+	void dump_to(std::string &out) const override { out += "null"; }
+	size_t dump_size_hint() const override { return 4; }
+	void dump_binary(std::string &out) const override { out += 'N'; }
 }; // }}}
 
 class WebBool : public WebObject { // {{{
@@ -157,23 +260,18 @@ class WebBool : public WebObject { // {{{
 	friend class WebVector;
 	friend class WebMap;
 	bool value;
-#ifndef WEBOBJECT_DUMPS_JSON
-	void load_impl(std::string const &data) override { assert(data.length() == 1); }
-#endif
 public:
 	static int const type = BOOL;
 	WebBool() : WebObject(BOOL), value(false) {}
 	WebBool(bool value) : WebObject(BOOL), value(value) {}
-	static std::shared_ptr <WebBool> create(bool value) { return std::shared_ptr <WebBool> (new WebBool(value)); }
-	std::shared_ptr <WebObject> copy() const override { return std::shared_ptr <WebObject> (new WebBool(*this)); }
+	static std::shared_ptr <WebBool> create(bool value) { return make_pooled <WebBool> (value); }
+	std::shared_ptr <WebObject> copy() const override { return make_pooled <WebBool> (*this); }
 	operator bool() const { return value; }
 	operator bool &() { return value; }
 	std::string print() const override { return value ? "true" : "false"; }
-#ifdef WEBOBJECT_DUMPS_JSON
-	std::string dump() const override { return value ? "true" : "false"; }
-#else
-	std::string dump() const override { return value ? "T" : "F"; }
-#endif
+	void dump_to(std::string &out) const override { out += value ? "true" : "false"; }
+	size_t dump_size_hint() const override { return 5; }
+	void dump_binary(std::string &out) const override { out += value ? 'T' : 'F'; }
 }; // }}}
 
 class WebInt : public WebObject { // {{{
@@ -181,81 +279,73 @@ class WebInt : public WebObject { // {{{
 	friend class WebVector;
 	friend class WebMap;
 	IntType value;
-#ifndef WEBOBJECT_DUMPS_JSON
-	void load_impl(std::string const &data) override {
-		assert(data.length() == 1 + sizeof(uint64_t));
-		uint64_t v = *reinterpret_cast <uint64_t const *>(&data.data()[1]);
-		value = le64toh(v);
-	}
-#endif
 public:
 	static int const type = INT;
 	WebInt() : WebObject(INT), value() {}
 	WebInt(IntType value) : WebObject(INT), value(value) {}
-	static std::shared_ptr <WebInt> create(IntType value) { return std::shared_ptr <WebInt> (new WebInt(value)); }
-	std::shared_ptr <WebObject> copy() const override { return std::shared_ptr <WebObject> (new WebInt(*this)); }
+	static std::shared_ptr <WebInt> create(IntType value) { return make_pooled <WebInt> (value); }
+	std::shared_ptr <WebObject> copy() const override { return make_pooled <WebInt> (*this); }
 	operator IntType() const { return value; }
 	operator IntType &() { return value; }
 	std::string print() const override { return (std::ostringstream() << value).str(); }
-#ifdef WEBOBJECT_DUMPS_JSON
-	std::string dump() const override { return (std::ostringstream() << value).str(); }
-#else
-	std::string dump() const override { uint64_t v = htole64(value); return "I" + std::string(reinterpret_cast <char const *>(&v), sizeof(uint64_t)); }
-#endif
+	void dump_to(std::string &out) const override;
+	size_t dump_size_hint() const override { return 20; }
+	void dump_binary(std::string &out) const override;
 }; // }}}
 
 class WebFloat : public WebObject { // {{{
 	FloatType value;
-#ifndef WEBOBJECT_DUMPS_JSON
-	void load_impl(std::string const &data) override;
-#endif
 public:
 	static int const type = FLOAT;
-	std::string dump() const override;
+	void dump_to(std::string &out) const override;
+	size_t dump_size_hint() const override { return 24; }
+	void dump_binary(std::string &out) const override;
 	std::string print() const override { return (std::ostringstream() << value).str(); }
 	WebFloat() : WebObject(FLOAT), value() {}
 	WebFloat(FloatType value) : WebObject(FLOAT), value(value) {}
-	static std::shared_ptr <WebFloat> create(FloatType value) { return std::shared_ptr <WebFloat> (new WebFloat(value)); }
-	std::shared_ptr <WebObject> copy() const override { return std::shared_ptr <WebObject> (new WebFloat(*this)); }
+	static std::shared_ptr <WebFloat> create(FloatType value) { return make_pooled <WebFloat> (value); }
+	std::shared_ptr <WebObject> copy() const override { return make_pooled <WebFloat> (*this); }
 	operator FloatType() const { return value; }
 	operator FloatType &() { return value; }
 }; // }}}
 
 class WebString : public WebObject { // {{{
 	std::string value;
-#ifndef WEBOBJECT_DUMPS_JSON
-	void load_impl(std::string const &data) override { value = data.substr(1); }
-#endif
 public:
 	static int const type = STRING;
-	std::string dump() const override;
+	void dump_to(std::string &out) const override { dump_string(value, out); }
+	size_t dump_size_hint() const override { return value.size() + 2; }
+	// Append s as a quoted string; this is also used for map keys, which are not WebStrings.
+	static void dump_string(std::string_view s, std::string &out);
+	void dump_binary(std::string &out) const override { dump_binary_string(value, out); }
+	static void dump_binary_string(std::string_view s, std::string &out);
 	std::string print() const override { return "\"" + value + "\""; }
 	WebString() : WebObject(STRING), value() {}
 	WebString(std::string const &value) : WebObject(STRING), value(value) {}
-	static std::shared_ptr <WebString> create(std::string const &value) { return std::shared_ptr <WebString> (new WebString(value)); }
-	std::shared_ptr <WebObject> copy() const override { return std::shared_ptr <WebObject> (new WebString(*this)); }
-	WebString(std::string &&value) : WebObject(STRING), value(value) {}
+	static std::shared_ptr <WebString> create(std::string const &value) { return make_pooled <WebString> (value); }
+	std::shared_ptr <WebObject> copy() const override { return make_pooled <WebString> (*this); }
+	WebString(std::string &&value) : WebObject(STRING), value(std::move(value)) {}
+	static std::shared_ptr <WebString> create(std::string &&value) { return make_pooled <WebString> (std::move(value)); }
 	operator std::string const &() const { return value; }
 	operator std::string &() { return value; }
 }; // }}}
 
 class WebVector : public WebObject { // {{{
 	VectorType value;
-#ifndef WEBOBJECT_DUMPS_JSON
-	void load_impl(std::string const &data) override;
-#endif
 public:
 	static int const type = VECTOR;
-	std::string dump() const override;
+	void dump_to(std::string &out) const override;
+	size_t dump_size_hint() const override;
+	void dump_binary(std::string &out) const override;
 	std::string print() const override;
 	WebVector() : WebObject(VECTOR), value() {}
 	WebVector(WebVector const &other) : WebObject(VECTOR), value() { for (auto i: other.value) value.push_back(i->copy()); }
 	WebVector(WebVector &&other) : WebObject(VECTOR), value(other.value) { other.value.clear(); }
 	template <typename... Ts> WebVector(Ts... args) : WebObject(VECTOR), value() { value.assign({args...}); }
-	template <typename... Ts> static std::shared_ptr <WebVector> create(Ts... args) { return std::shared_ptr <WebVector> (new WebVector(args...)); }
+	template <typename... Ts> static std::shared_ptr <WebVector> create(Ts... args) { return make_pooled <WebVector> (std::move(args)...); }
 	WebVector(std::initializer_list <WebHelper> args) : WebObject(VECTOR), value() { for (unsigned i = 0; i < args.size(); ++i) value.push_back(args.begin()[i]); }
-	static std::shared_ptr <WebVector> build(std::initializer_list <WebHelper> args) { return std::shared_ptr <WebVector> (new WebVector(args)); }
-	std::shared_ptr <WebObject> copy() const override { return std::shared_ptr <WebObject> (new WebVector(*this)); }
+	static std::shared_ptr <WebVector> build(std::initializer_list <WebHelper> args) { return make_pooled <WebVector> (args); }
+	std::shared_ptr <WebObject> copy() const override { return make_pooled <WebVector> (*this); }
 	//operator VectorType const &() const { return value; }
 	//operator VectorType &() { return value; }
 	std::shared_ptr <WebObject> &operator[](size_t index) { STARTFUNC; return value[index]; }
@@ -263,7 +353,7 @@ public:
 	~WebVector() override { STARTFUNC; value.clear(); }
 	bool empty() const { return value.empty(); }
 	size_t size() const { return value.size(); }
-	void push_back(std::shared_ptr <WebObject> item) { value.push_back(item); }
+	void push_back(std::shared_ptr <WebObject> item) { value.push_back(std::move(item)); }
 	void pop_back() { value.pop_back(); }
 	void insert(size_t position, std::shared_ptr <WebObject> item) { value.insert(value.begin() + position, item); }
 }; // }}}
@@ -274,23 +364,26 @@ class WebMap : public WebObject { // {{{
 	friend std::shared_ptr <WebObject> binary_map_string(WebObject &lhs, WebObject &rhs, char op);
 	MapType value;
 	bool inverted;	// True after using operator~; used by &, |, ^.
-#ifndef WEBOBJECT_DUMPS_JSON
-	void load_impl(std::string const &data) override;
-#endif
 public:
 	static int const type = MAP;
-	std::string dump() const override;
+	void dump_to(std::string &out) const override;
+	size_t dump_size_hint() const override;
+	void dump_binary(std::string &out) const override;
 	std::string print() const override;
-	WebMap() : WebObject(MAP), value() {}
-	WebMap(WebMap const &other) : WebObject(MAP), value() { for (auto i: other.value) value[i.first] = i.second->copy(); }
-	WebMap(WebMap &&other) : WebObject(MAP), value(other.value) { other.value.clear(); }
-	template <typename... Ts> WebMap(Ts... args) : WebObject(MAP), value({args...}) {}
-	template <typename... Ts> static std::shared_ptr <WebMap> create(Ts... args) { return std::shared_ptr <WebMap> (new WebMap(args...)); }
-	WebMap(std::initializer_list <std::tuple <std::string, WebHelper> > args) : WebObject(MAP), value() { for (unsigned i = 0; i < args.size(); ++i) value.insert(std::pair <std::string, std::shared_ptr <WebObject> > (std::get <0> (args.begin()[i]), std::get <1> (args.begin()[i]))); }
-	static std::shared_ptr <WebMap> build(std::initializer_list <std::tuple <std::string, WebHelper> > args) { return std::shared_ptr <WebMap> (new WebMap(args)); }
-	std::shared_ptr <WebObject> copy() const override { return std::shared_ptr <WebObject> (new WebMap(*this)); }
-	std::shared_ptr <WebObject> &operator[](std::string const &key) { STARTFUNC; return value[key]; }
-	std::shared_ptr <WebObject> const &operator[](std::string const &key) const { STARTFUNC; return value.at(key); }
+	WebMap() : WebObject(MAP), value(), inverted(false) {}
+	WebMap(WebMap const &other) : WebObject(MAP), value(), inverted(other.inverted) { value.reserve(other.value.size()); for (auto const &i: other.value) value.append_unsorted(std::string(i.first), i.second->copy()); }
+	WebMap(WebMap &&other) : WebObject(MAP), value(std::move(other.value)), inverted(other.inverted) { other.value.clear(); }
+	WebMap(MapType &&items) : WebObject(MAP), value(std::move(items)), inverted(false) {}
+	template <typename... Ts> WebMap(Ts... args) : WebObject(MAP), value({args...}), inverted(false) {}
+	template <typename... Ts> static std::shared_ptr <WebMap> create(Ts... args) { return make_pooled <WebMap> (std::move(args)...); }
+	WebMap(std::initializer_list <std::tuple <std::string, WebHelper> > args) : WebObject(MAP), value(), inverted(false) { for (unsigned i = 0; i < args.size(); ++i) value.insert(std::pair <std::string, std::shared_ptr <WebObject> > (std::get <0> (args.begin()[i]), std::get <1> (args.begin()[i]))); }
+	static std::shared_ptr <WebMap> build(std::initializer_list <std::tuple <std::string, WebHelper> > args) { return make_pooled <WebMap> (args); }
+	std::shared_ptr <WebObject> copy() const override { return make_pooled <WebMap> (*this); }
+	std::shared_ptr <WebObject> &operator[](std::string_view key) { STARTFUNC; return value[key]; }
+	std::shared_ptr <WebObject> const &operator[](std::string_view key) const { STARTFUNC; return value.at(key); }
+	// Lookup without inserting; returns nullptr if the key is not in the map.
+	std::shared_ptr <WebObject> get(std::string_view key) const { STARTFUNC; auto i = value.find(key); return i == value.end() ? nullptr : i->second; }
+	bool contains(std::string_view key) const { STARTFUNC; return value.contains(key); }
 	size_t size() const { STARTFUNC; return value.size(); }
 	~WebMap() override { STARTFUNC; value.clear(); }
 }; // }}}
@@ -30,11 +30,17 @@ proxy to this server just for the websocket.
 // includes.  {{{
 #include <string>
 #include <map>
+#include <atomic>
+#include <unordered_map>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <cctype>
+#include <cstring>
 #include <filesystem>
+#include <charconv>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "network.hh"
 #include "webobject.hh"
 #include "coroutine.hh"
@@ -55,6 +61,230 @@ typedef std::shared_ptr <WebMap> KwArgs;
 /// Http response codes.
 extern std::map <int, char const *> http_response;
 
+/// Format a time for use in HTTP headers, such as Last-Modified.
+std::string http_date(time_t time);
+
+/// Result of parse_range().
+enum RangeResult { RANGE_IGNORE, RANGE_OK, RANGE_UNSATISFIABLE };
+
+/// Parse the value of a Range header for a resource of size bytes. On RANGE_OK, first and last are the (inclusive) range to send.
+RangeResult parse_range(std::string_view header, size_t size, size_t &first, size_t &last);
+
+/// Parse an HTTP date. Return -1 if it is invalid.
+time_t parse_http_date(std::string_view date);
+
+/// Compute the entity tag of a file, identifying this version of it. Different encodings of the file get different tags.
+std::string http_etag(struct stat const &st, std::string_view encoding = {});
+
+/// Check if an entity tag matches the value of an If-None-Match header (using weak comparison).
+bool http_etag_match(std::string_view header, std::string_view etag);
+
+/// Check if the value of an Accept-Encoding header allows the given content coding.
+bool http_accepts_encoding(std::string_view header, std::string_view coding);
+
+/// Check if a comma separated header value, such as Connection, contains a token (compared case insensitively).
+bool http_has_token(std::string_view header, std::string_view token);
+
+// Request headers. {{{
+/// This class holds the header of an HTTP request.
+/// The header block is copied once; the request line and the fields are views into that copy. Field names are converted
+/// to lower case. The fields that Httpd needs for every request are indexed, so they are found without a search.
+/// The memory is reused for following requests on the same connection.
+class HttpHeaders { // {{{
+public:
+	/// Fields that are indexed.
+	enum Known { HOST, UPGRADE, CONNECTION, SEC_WEBSOCKET_KEY, CONTENT_LENGTH, AUTHORIZATION, TRANSFER_ENCODING, NUM_KNOWN };
+	/// Result of parse(). BAD_REQUEST means that the request line is valid, but the framing of the message is not clear
+	/// (RFC 9112, sections 5.1, 6.1 and 6.3), so it must be refused with 400 and the connection must be closed.
+	enum Result { OK, INVALID, TOO_MANY_FIELDS, BAD_REQUEST };
+	typedef std::pair <std::string_view, std::string_view> Field;
+	typedef std::vector <Field>::const_iterator const_iterator;
+private:
+	std::string data;
+	std::vector <Field> fields;
+	int known[NUM_KNOWN];	// Index in fields, or -1 if the field is not present.
+	void rebase(char const *old_base);
+public:
+	std::string_view method;	///< Request method, as it was sent.
+	std::string_view target;	///< Request target (path and query).
+	std::string_view version;	///< Protocol version, such as HTTP/1.1.
+	HttpHeaders();
+	HttpHeaders(HttpHeaders const &other);
+	HttpHeaders(HttpHeaders &&other);
+	HttpHeaders &operator=(HttpHeaders const &other);
+	HttpHeaders &operator=(HttpHeaders &&other);
+	/// Parse a complete header, from the request line up to and including the empty line. The previous contents are replaced.
+	/// White space before the colon of a field, Content-Length fields with different or invalid values, a Transfer-Encoding
+	/// that does not end with chunked, and a request with both Transfer-Encoding and Content-Length are refused.
+	Result parse(std::string_view header, size_t max_fields);
+	/// Remove all fields; the memory is kept.
+	void clear();
+	/// Get an indexed field. An empty view is returned if the field is not present.
+	std::string_view get(Known field) const { return known[field] < 0 ? std::string_view() : fields[known[field]].second; }
+	/// Check if an indexed field is present.
+	bool has(Known field) const { return known[field] >= 0; }
+	/// Find a field by its (lower case) name. If it was sent more than once, the last one is returned.
+	const_iterator find(std::string_view name) const;
+	bool contains(std::string_view name) const { return find(name) != end(); }
+	const_iterator begin() const { return fields.begin(); }
+	const_iterator end() const { return fields.end(); }
+	size_t size() const { return fields.size(); }
+	bool empty() const { return fields.empty(); }
+}; // }}}
+// }}}
+
+// Multipart boundaries. {{{
+/// This class searches for a fixed string, such as the boundary between the parts of a multipart body, with Boyer-Moore-Horspool.
+/// It is used on data that arrives in pieces: when the string is not found, only the last size() - 1 bytes can be the
+/// start of a match, so a following search can start at safe_size() of the current data.
+class BoundarySearch { // {{{
+	std::string needle;
+	size_t skip[256];	// Distance to shift when the last byte of the window has this value.
+public:
+	BoundarySearch(std::string const &needle = {});
+	/// Set a new string to search for.
+	void set(std::string const &new_needle);
+	std::string const &get() const { return needle; }
+	size_t size() const { return needle.size(); }
+	/// Find the first match at or after pos, or return std::string::npos.
+	size_t find(std::string_view haystack, size_t pos = 0) const;
+	/// Number of bytes at the start of haystack that cannot be part of a match, if find() returned npos.
+	size_t safe_size(std::string_view haystack) const { return haystack.size() - std::min(haystack.size(), needle.size() - std::min(needle.size(), size_t(1))); }
+}; // }}}
+// }}}
+
+// Static file cache. {{{
+/// This class holds the contents and response headers of static files, so they don't need to be read for every request.
+/// It is bounded in size; the least recently used files are evicted first.
+/// Files are checked with stat() on every lookup and dropped when they have changed.
+class AssetCache { // {{{
+public:
+	/// A cached file.
+	struct Asset {
+		std::string content;		///< File contents.
+		std::string headers;		///< Response headers, except Content-Length, each terminated by CRLF.
+		std::string etag;		///< Entity tag for this version of the file.
+		std::string last_modified;	///< Modification time, formatted as an HTTP date.
+	};
+private:
+	struct Entry {
+		std::string key;
+		Asset asset;
+		dev_t dev;
+		ino_t ino;
+		off_t size;
+		struct timespec mtime;
+	};
+	std::list <Entry> lru;		// Most recently used entry is at the front.
+	std::unordered_map <std::string, std::list <Entry>::iterator> index;
+	size_t max_size;		// Total size of file contents that may be cached.
+	size_t max_file;		// Largest file that is cached.
+	size_t used;			// Total size of file contents that is currently cached.
+	void evict(size_t needed);
+public:
+	AssetCache(size_t max_size = 0, size_t max_file = 1 << 20) : lru(), index(), max_size(max_size), max_file(max_file), used(0) {}
+	/// Change the limits; a max_size of 0 disables the cache.
+	void set_limits(size_t max_size, size_t max_file);
+	/// Check if a file of this size will be cached.
+	bool fits(size_t size) const { return size <= max_file && size <= max_size; }
+	/// Look up a file; return nullptr if it is not cached, or has changed since it was cached.
+	Asset const *get(std::string const &key, struct stat const &st);
+	/// Read a file and store it in the cache. Return nullptr if reading fails.
+	Asset const *load(std::string const &key, int fd, struct stat const &st, std::string &&headers, std::string &&etag, std::string &&last_modified);
+	/// Remove all files from the cache.
+	void clear() { lru.clear(); index.clear(); used = 0; }
+	/// Total size of the cached file contents.
+	size_t size() const { return used; }
+}; // }}}
+// }}}
+
+/// Unmask websocket payload in place. The mask bytes are in the order in which they were received.
+void websocket_unmask(char *data, size_t size, uint32_t mask);
+
+// Websocket compression. {{{
+/// This class implements the permessage-deflate extension (RFC 7692) for one websocket connection.
+/// It is only functional if the library was built with zlib; otherwise the extension is never negotiated.
+/// The zlib streams are created on first use and are kept (and reset when needed) for the lifetime of the connection.
+class WebsocketDeflate { // {{{
+public:
+	/// Settings for compression. The same struct is used by servers and clients.
+	struct Settings {
+		bool enable = false;			///< Offer (client) or accept (server) the extension at all.
+		int window_bits = 15;			///< Largest window (9-15) for compressing, and requested from the peer; smaller uses less memory.
+		bool context_takeover = true;		///< Keep the compression context between sent messages; false saves memory but compresses worse.
+		bool peer_context_takeover = true;	///< Allow the peer to keep its context; false asks it not to.
+		size_t threshold = 64;			///< Messages shorter than this are sent uncompressed.
+		int level = -1;				///< Compression level 1-9, or -1 for the zlib default.
+		int mem_level = 8;			///< Memory level 1-9 for the compressor (zlib's memLevel).
+	};
+private:
+	struct State;
+	std::unique_ptr <State> state;		// Negotiated parameters and zlib streams; nullptr if the extension is not in use.
+	void configure(Settings const &settings, int send_window, bool send_reset, int receive_window, bool receive_reset);
+public:
+	WebsocketDeflate();
+	WebsocketDeflate(WebsocketDeflate &&other);
+	WebsocketDeflate &operator=(WebsocketDeflate &&other);
+	~WebsocketDeflate();
+	/// Check if the library was built with compression support.
+	static bool available();
+	/// Check if the extension was negotiated for this connection.
+	bool active() const { return state != nullptr; }
+	/// Client: the value of the Sec-WebSocket-Extensions request header; empty if nothing should be offered.
+	static std::string offer(Settings const &settings);
+	/// Client: configure from the Sec-WebSocket-Extensions response header. Return false if the response is invalid.
+	bool accept_response(std::string_view response, Settings const &settings);
+	/// Server: pick an acceptable offer from a Sec-WebSocket-Extensions request header and configure for it.
+	/// Return the value of the response header, or an empty string if the extension is not used.
+	std::string accept_offer(std::string_view offers, Settings const &settings);
+	/// Check if a message of this size should be compressed.
+	bool should_compress(size_t size) const;
+	/// Compress a message. The result points into a buffer of this object and is valid until the next call.
+	/// Return false on error.
+	bool compress(std::string_view data, std::string_view &result);
+	/// Result of decompress().
+	enum Status {
+		OK,		///< The message was decompressed.
+		INVALID,	///< The data is not a valid compressed message.
+		TOO_LARGE	///< The decompressed message would be larger than the maximum; inflating was stopped.
+	};
+	/// Decompress a message. The result points into a buffer of this object and is valid until the next call.
+	/// If max_size is not 0, inflating stops as soon as the output would become larger than it.
+	Status decompress(std::string_view data, std::string_view &result, size_t max_size = 0);
+}; // }}}
+// }}}
+
+// Broadcasting. {{{
+/// Write the header of a websocket frame into header, which must have room for 14 bytes, and return its size.
+/// If mask is set, an all zero mask is included.
+size_t websocket_frame_header(char *header, int opcode, bool compressed, size_t length, bool mask);
+
+/// A message that is framed once and sent to any number of websockets with Websocket::send(BroadcastMessage const &).
+/// The frame is shared by the output queues of the sockets, so queueing it for a slow receiver does not copy it.
+/// Websockets that mask or compress their frames cannot use it as is; they frame the payload themselves.
+class BroadcastMessage { // {{{
+public:
+	/// What Websocket::send(BroadcastMessage const &) does with a message for a congested websocket; see Websocket::set_broadcast_policy().
+	enum Policy {
+		QUEUE,		///< Queue it, like any other frame.
+		DROP,		///< Drop it.
+		COALESCE,	///< Keep only the latest message, and send it when the websocket has drained.
+		DISCONNECT	///< Close the connection.
+	};
+private:
+	std::shared_ptr <std::string const> frame;	// Header and payload.
+	size_t header_size;
+	int opcode;
+public:
+	BroadcastMessage() : frame(), header_size(0), opcode(0) {}
+	explicit BroadcastMessage(std::string_view data, int opcode = 1);
+	explicit operator bool() const { return frame != nullptr; }
+	std::shared_ptr <std::string const> const &get_frame() const { return frame; }
+	std::string_view payload() const { return std::string_view(*frame).substr(header_size); }
+	int get_opcode() const { return opcode; }
+}; // }}}
+// }}}
+
 // Websockets. {{{
 /// This class implements the Websocket protocol over a Webloop::Socket object.
 template <class UserType>
@@ -63,30 +293,86 @@ public:
 	/// This is the function signature for the callback to inform the owner of a new packet.
 	typedef void (UserType::*Receiver)(std::string const &data);
 
+	/// This is the function signature for the callback to inform the owner of a new packet, without copying it.
+	/// The data is only valid during the call.
+	typedef void (UserType::*ViewReceiver)(std::string_view data);
+
+	/// This is the function signature for the callback that receives messages in parts, as they arrive.
+	/// first is set for the first part of a message, and last for its final part; a short message can be a single part with both set.
+	/// The data is only valid during the call.
+	typedef void (UserType::*StreamReceiver)(std::string_view data, bool first, bool last);
+
 	/// This is the function signature for the callback to inform the owner that the connection is lost.
 	typedef void (UserType::*DisconnectCb)();
 
 	/// This is the function signature for the callback to inform the owner that there was an error.
 	typedef void (UserType::*ErrorCb)(std::string const &message);
+
+	/// This is the function signature for the callback to inform the owner that a congested connection has drained.
+	typedef void (UserType::*DrainCb)();
+
+	/// This is the function signature for the callback to inform the owner that the handshake of a connecting websocket has completed.
+	typedef void (UserType::*ConnectCb)();
+
+	/// Default for the maximum size of received frames and messages; see set_max_sizes().
+	static constexpr size_t default_max_size = size_t(64) << 20;
+
+	/// Traffic on this connection, including framing; the totals of all websockets are in the metrics of the loop.
+	struct Stats {
+		uint64_t frames_in;
+		uint64_t frames_out;
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+		uint64_t frames_dropped;	// Broadcast messages that were not sent, because of the broadcast policy.
+	};
 private:
-	std::string buffer;	// Data that is currently being received.
 	std::string fragments;	// Fragments for packet that is being received; data is added to it when new packets arrive.
 	Loop::TimeoutHandle keepalive_handle;
 	bool is_closed;		// true if the connection is not open.
 	bool pong_seen;		// true if a pong was seen since last ping command.
 	uint8_t current_opcode;
+	uint8_t message_opcode;	// Opcode of the message that is passed to the receiver.
+	bool message_compressed;	// The message that is being received has RSV1 set on its first frame.
 	Receiver receiver;	// callback for new data packets.
+	ViewReceiver view_receiver;	// callback for new data packets; used instead of receiver if set.
 	bool send_mask;		// whether masks are used to sent data (true for client, false for server).
 	UserType *user;		// callback functions are called on this object.
 	DisconnectCb disconnect_cb;
 	ErrorCb error_cb;
-	void inject(std::string &data);	// Make the class handle incoming data.
-	void disconnect_impl() { if (disconnect_cb != nullptr) (user->*disconnect_cb)(); else WL_log("disconnect"); }
+	DrainCb drain_cb;
+	ConnectCb connect_cb;
+	WebsocketDeflate deflate;	// Compression state, if permessage-deflate was negotiated.
+	Stats stats;
+	Metrics::Traffic *traffic;	// Totals in the metrics of the loop.
+	BroadcastMessage::Policy broadcast_policy;
+	BroadcastMessage coalesced;	// Latest broadcast message that waits for the socket to drain, for the COALESCE policy.
+	StreamReceiver stream_receiver;	// callback for parts of data packets; used instead of the others if set.
+	size_t max_frame_size;	// Larger frames close the connection; 0 for no limit.
+	size_t max_message_size;	// Larger messages close the connection; 0 for no limit.
+	size_t message_size;	// Payload of the message that is being received, so far.
+	struct StreamState {
+		// State of a frame that is passed to the stream receiver while it arrives.
+		uint64_t remaining;	// Payload bytes that have not been received yet; if 0, the next data starts with a frame header.
+		uint64_t offset;	// Payload bytes that have been received; needed for unmasking.
+		uint32_t mask;
+		bool final;		// The frame is the last of its message.
+		bool started;		// A part of the current message has been passed to the receiver.
+	};
+	StreamState stream;
+	size_t stream_payload(std::string_view data);
+	bool begin_data_frame(uint8_t header);
+	void too_large(char const *what);
+	void close_connection();	// Close the socket and stop the keepalive timer, without sending a close frame.
+	size_t inject(std::string_view data);	// Make the class handle incoming data; returns the number of bytes used.
+	void disconnect_impl() { wake_init_waiter(); if (disconnect_cb != nullptr) (user->*disconnect_cb)(); else WL_log("disconnect"); }
 	void error_impl(std::string const &message) { if (error_cb != nullptr) (user->*error_cb)(message); else WL_log("error: " + message); }
+	void drain_impl();
 	enum HttpState { HTTP_INACTIVE, HTTP_START, HTTP_HEADER, HTTP_DONE };
 	HttpState http_state;
 	coroutine::handle_type init_waiter;
-	void recv_http(std::string &hdrdata);	// Receive http headers and non-websocket body data.
+	void wake_init_waiter() { if (init_waiter != coroutine::handle_type()) { auto waiter = init_waiter; init_waiter = coroutine::handle_type(); coroutine::activate(&waiter); } }
+	size_t recv_http(std::string_view hdrdata);	// Receive http headers and non-websocket body data.
+	void resume() { if (!is_closed && (http_state == HTTP_INACTIVE || http_state == HTTP_DONE)) socket.read(&Websocket <UserType>::inject); }	// Handle data that was kept while there was no receiver.
 public:
 	/// Settings that are only used for connecting websockets.
 	struct ConnectSettings {
@@ -94,20 +380,23 @@ public:
 		std::string user;				// login name; if both this and password are empty: don't send them.
 		std::string password;				// login password
 		std::map <std::string, std::string> sent_headers;	// extra headers, sent to server.
-		ConnectSettings(std::string const &method = "GET", std::string const &user = {}, std::string const &password = {}, std::map <std::string, std::string> const &sent_headers = {}) : method(method), user(user), password(password), sent_headers(sent_headers) {}
+		WebsocketDeflate::Settings deflate;		// Compression to offer; disabled by default.
+		Loop::Duration timeout;				// Time to set up the connection, including the name lookup; 0 for no limit.
+		ConnectSettings(std::string const &method = "GET", std::string const &user = {}, std::string const &password = {}, std::map <std::string, std::string> const &sent_headers = {}) : method(method), user(user), password(password), sent_headers(sent_headers), deflate(), timeout(SocketBase::default_connect_timeout) {}
 	};
 	/// Settings used for all websockets (both connecting and accepted).
 	struct RunSettings {
 		Loop *loop;					// Main loop to use; usually nullptr, so the default is used.
 		Loop::Duration keepalive;			// keepalive timer.
 	};
-	/// Connection settings; not used for websockets that are accepted through Httpd.
+	/// Connection settings; not used for websockets that are accepted through Httpd. They are reset when the connection is open.
 	ConnectSettings connect_settings;
 	/// Settings that are used by all websockets (both connecting and accepted).
 	RunSettings run_settings;
 
-	/// For accepted websockets only: Http headers that were received from the browser.
-	std::map <std::string, std::string> received_headers;	// Headers that are received from server. (Only for accepted websockets.)
+	/// For connecting websockets only: Http headers of the reply from the server. They are kept while the connection is
+	/// open, so they can be used at any time.
+	std::map <std::string, std::string> received_headers;
 private:
 	// Make this the last member, so all other members are initialized before it.
 	Socket <Websocket <UserType> > socket;
@@ -131,14 +420,14 @@ public:
 	template <class ServerType>
 	Websocket(Socket <ServerType> &&src, UserType *user = nullptr, Receiver receiver = nullptr, RunSettings const &run_settings = {});
 
+	/// Wait until the handshake of a connecting websocket has completed; use with YieldFrom.
+	/// The result is a WebBool, which is false if the connection failed.
 	coroutine wait_for_init() {
-		if (http_state != HTTP_DONE) {
-			std::cout << "yielding " << std::hex << (long)this << std::dec << std::endl;
+		if (is_closed && socket) {
 			init_waiter = GetHandle();
 			co_yield WebNone::create();
 		}
-		std::cout << "returning " << std::hex << (long)this << std::dec << std::endl;
-		co_return WebNone::create();
+		co_return WebBool::create(!is_closed);
 	}
 
 	/// Websocket move constructor.
@@ -160,10 +449,60 @@ public:
 	void set_error_cb(ErrorCb callback) { error_cb = callback; }
 
 	/// Register callback that is called when the websocket receives a data packet.
-	void set_receiver(Receiver callback) { receiver = callback; }
+	void set_receiver(Receiver callback) { receiver = callback; resume(); }
+
+	/// Register callback that is called when the websocket receives a data packet; the packet is passed without copying it.
+	/// If this is set, the callback that was set with set_receiver is not used.
+	void set_view_receiver(ViewReceiver callback) { view_receiver = callback; resume(); }
+
+	/// Register callback that receives messages in parts, as the data arrives, so large messages don't need to be kept in memory.
+	/// If this is set, the other receivers are not used. Compressed messages are still collected, and passed as a single part.
+	/// Don't change receivers in the middle of a message.
+	void set_stream_receiver(StreamReceiver callback) { stream_receiver = callback; resume(); }
+
+	/// Set the maximum size of received frames and messages; 0 means no limit. The defaults are default_max_size.
+	/// The connection is closed (with status 1009) when the header of a frame announces too much data, or when a compressed message inflates to more than the message limit.
+	void set_max_sizes(size_t frame, size_t message) { max_frame_size = frame; max_message_size = message; }
+
+	/// Register callback that is called when the output queue of a congested websocket has drained.
+	void set_drain_cb(DrainCb callback) { drain_cb = callback; }
+
+	/// Register callback that is called when the handshake of a connecting websocket has completed.
+	/// If the connection fails, the error and disconnect callbacks are called instead.
+	void set_connect_cb(ConnectCb callback) { connect_cb = callback; }
+
+	/// For accepted websockets: use the compression that was negotiated by Httpd (in Connection::deflate).
+	void set_deflate(WebsocketDeflate &&negotiated) { deflate = std::move(negotiated); }
+
+	/// Check if messages are compressed with permessage-deflate.
+	bool is_compressed() const { return deflate.active(); }
+
+	/// Get the traffic counts of this connection.
+	Stats const &get_stats() const { return stats; }
 
 	/// Send a data frame.
-	void send(std::string const &data, int opcode = 1); // Send a WebSocket frame.
+	/// @Returns: false if the websocket is closed or congested; the caller should pause until the drain callback is called.
+	bool send(std::string_view data, int opcode = 1); // Send a WebSocket frame.
+
+	/// Send a message that was framed once for many websockets. If the websocket is congested, the broadcast policy decides what happens to it.
+	/// @Returns: false if the message was not sent, or if the websocket is closed or congested.
+	bool send(BroadcastMessage const &message);
+
+	/// Set what happens to broadcast messages while the websocket is congested; the default is BroadcastMessage::QUEUE.
+	void set_broadcast_policy(BroadcastMessage::Policy policy) { broadcast_policy = policy; }
+
+	/// Check if the output queue is above its high watermark.
+	bool is_congested() const { return socket.is_congested(); }
+	bool is_open() const { return !is_closed; }
+
+	/// From a receiver: the opcode of the message that is received; 1 for text, 2 for binary.
+	int get_opcode() const { return message_opcode; }
+
+	/// Set the output queue watermarks.
+	void set_watermarks(size_t high, size_t low) { socket.set_watermarks(high, low); }
+
+	/// Wait until all queued output has been sent; use with YieldFrom.
+	coroutine wait_for_flush() { return socket.wait_for_flush(); }
 
 	/// Send a ping frame.
 	/// @Returns: true if a pong was received since previous ping was sent; false if not.
@@ -186,31 +525,53 @@ public:
 template <class UserType>
 void Websocket <UserType>::disconnect(bool send_to_websocket) { // {{{
 	STARTFUNC;
-	if (is_closed)
-		return;
+	// The connection may already be closed by send() or a protocol error; the rest of the teardown is still done.
+	if (!is_closed && send_to_websocket)
+		send(std::string(), 8);
+	close_connection();
+} // }}}
+
+template <class UserType>
+void Websocket <UserType>::close_connection() { // {{{
+	STARTFUNC;
+	// Every path that closes the connection comes here, so no keepalive timer is left that refers to this object.
 	is_closed = true;
 	if (keepalive_handle != Webloop::Loop::TimeoutHandle()) {
-		Loop::get()->remove_timeout(keepalive_handle);
+		Loop::get(run_settings.loop)->remove_timeout(keepalive_handle);
 		keepalive_handle = Webloop::Loop::TimeoutHandle();
 	}
-	if (send_to_websocket)
-		send(std::string(), 8);
 	socket.close();
+	// A message that was being received will not be completed.
+	std::string().swap(fragments);
 } // }}}
 
 template <class UserType>
 Websocket <UserType>::Websocket() : // {{{
-	buffer(),
 	fragments(),
 	keepalive_handle(),
 	is_closed(true),
 	pong_seen(true),
 	current_opcode(uint8_t(-1)),
+	message_opcode(0),
+	message_compressed(false),
 	receiver(),
+	view_receiver(),
 	send_mask(false),
 	user(),
 	disconnect_cb(),
 	error_cb(),
+	drain_cb(),
+	connect_cb(),
+	deflate(),
+	stats(),
+	traffic(nullptr),	// Closed websockets don't send or receive; this is set when a connection is moved in.
+	broadcast_policy(BroadcastMessage::QUEUE),
+	coalesced(),
+	stream_receiver(),
+	max_frame_size(default_max_size),
+	max_message_size(default_max_size),
+	message_size(0),
+	stream(),
 	http_state(HTTP_INACTIVE),
 	init_waiter(),
 	connect_settings(),
@@ -222,7 +583,8 @@ Websocket <UserType>::Websocket() : // {{{
 } // }}}
 
 template <class UserType>
-void Websocket <UserType>::recv_http(std::string &hdrdata) { // {{{
+size_t Websocket <UserType>::recv_http(std::string_view hdrdata) { // {{{
+	std::string::size_type used = 0;
 	switch (http_state) {
 	case HTTP_INACTIVE:
 		throw "receiving data before socket is active";
@@ -230,27 +592,27 @@ void Websocket <UserType>::recv_http(std::string &hdrdata) { // {{{
 	{
 		std::string::size_type pos = hdrdata.find("\n");
 		if (pos == std::string::npos)
-			return;
-		std::istringstream firstline(hdrdata.substr(0, pos));
+			return 0;
+		std::istringstream firstline(std::string(hdrdata.substr(0, pos)));
 		std::string namecode;
 		int numcode;
 		firstline >> namecode >> numcode;
 		if (numcode != 101) {
-			WL_log("Unexpected reply: " + hdrdata);
+			WL_log("Unexpected reply: " + std::string(hdrdata));
 			throw "wrong reply code";
 		}
-		hdrdata = hdrdata.substr(pos + 1);
+		used = pos + 1;
 		http_state = HTTP_HEADER;
 	}
 		// Fall through.
 	case HTTP_HEADER:
 	{
 		while (true) {
-			std::string::size_type pos = hdrdata.find("\n");
+			std::string::size_type pos = hdrdata.find("\n", used);
 			if (pos == std::string::npos)
-				return;
-			std::string line = hdrdata.substr(0, pos);
-			hdrdata = hdrdata.substr(pos + 1);
+				return used;
+			std::string line(hdrdata.substr(used, pos - used));
+			used = pos + 1;
 			if (strip(line).empty())
 				break;
 			if (DEBUG > 2)
@@ -265,57 +627,75 @@ void Websocket <UserType>::recv_http(std::string &hdrdata) { // {{{
 			received_headers[strip(key)] = strip(value);
 			continue;
 		}
+		for (auto &h: received_headers) {
+			if (lower(h.first) != "sec-websocket-extensions")
+				continue;
+			if (!deflate.accept_response(h.second, connect_settings.deflate)) {
+				WL_log("Unexpected websocket extensions: " + h.second);
+				throw "invalid websocket extension response";
+			}
+		}
+		// The connection settings are only needed for the handshake; don't keep them (or the password) while the connection is open.
+		connect_settings = ConnectSettings();
 		is_closed = false;
 		socket.read(&Websocket <UserType>::inject);
 		socket.set_disconnect_cb(&Websocket <UserType>::disconnect_impl);
 		socket.set_error_cb(&Websocket <UserType>::error_impl);
+		socket.set_drain_cb(&Websocket <UserType>::drain_impl);
 		// Set up keepalive heartbeat.
 		if (run_settings.keepalive != Loop::Duration()) {
 			Loop *loop = Loop::get(run_settings.loop);
-			keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive));
+			keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive, true));
 		}
-		if (!hdrdata.empty())
-			inject(hdrdata);
+		// Data after the header is passed to inject() when this function returns.
 		if (DEBUG > 2)
 			WL_log("opened websocket " + get_name());
 		http_state = HTTP_DONE;
 
-		// Wake init waiter.
-		if (init_waiter != coroutine::handle_type()) {
-			if (DEBUG > 3)
-				WL_log("waking init waiter");
-			init_waiter();
-		}
-		else {
-			if (DEBUG > 3)
-				WL_log("not waking");
-		}
+		if (connect_cb != nullptr)
+			(user->*connect_cb)();
+		wake_init_waiter();
 		break;
 	}
 	default:
 		throw "Invalid HttpState in Websocket";
 	}
+	return used;
 } // }}}
 
 template <class UserType>
 Websocket <UserType>::Websocket(std::string const &address, ConnectSettings const &connect_settings, UserType *user, Receiver receiver, RunSettings const &run_settings) : // {{{
-	buffer(),
 	fragments(),
 	keepalive_handle(),
 	is_closed(true),
 	pong_seen(true),
 	current_opcode(uint8_t(-1)),
+	message_opcode(0),
+	message_compressed(false),
 	receiver(receiver),
+	view_receiver(),
 	send_mask(true),
 	user(user),
 	disconnect_cb(),
 	error_cb(),
+	drain_cb(),
+	connect_cb(),
+	deflate(),
+	stats(),
+	traffic(&Loop::get(run_settings.loop)->metrics().traffic("websocket")),
+	broadcast_policy(BroadcastMessage::QUEUE),
+	coalesced(),
+	stream_receiver(),
+	max_frame_size(default_max_size),
+	max_message_size(default_max_size),
+	message_size(0),
+	stream(),
 	http_state(HTTP_INACTIVE),
 	init_waiter(),
 	connect_settings(connect_settings),
 	run_settings(run_settings),
 	received_headers(),
-	socket("websocket to " + address, address, this)
+	socket("websocket to " + address, address, this, run_settings.loop, connect_settings.timeout)
 {
 	STARTFUNC;
 	/* When constructing a Websocket, a connection is made to the
@@ -363,8 +743,15 @@ Websocket <UserType>::Websocket(std::string const &address, ConnectSettings cons
 	else:
 		self.remote = socket.remote}*/
 	std::string extra_headers;
-	for (auto e: connect_settings.sent_headers)
+	bool custom_extensions = false;
+	for (auto e: connect_settings.sent_headers) {
 		extra_headers += e.first + ": " + e.second + "\r\n";
+		if (lower(e.first) == "sec-websocket-extensions")
+			custom_extensions = true;
+	}
+	std::string offer = WebsocketDeflate::offer(connect_settings.deflate);
+	if (!offer.empty() && !custom_extensions)
+		extra_headers += "Sec-WebSocket-Extensions: " + offer + "\r\n";
 	std::string userpwd;
 	if (!connect_settings.user.empty() || !connect_settings.password.empty())
 		userpwd = connect_settings.user + ":" + connect_settings.password + "\r\n";
@@ -383,29 +770,45 @@ Websocket <UserType>::Websocket(std::string const &address, ConnectSettings cons
 		extra_headers +
 		"\r\n");
 	http_state = HTTP_START;
-	// TODO: Set special error and disconnect callbacks for connection startup.
+	// The handshake is sent when the connection has been set up; failures before it completes are reported through these callbacks as well.
+	socket.set_disconnect_cb(&Websocket <UserType>::disconnect_impl);
+	socket.set_error_cb(&Websocket <UserType>::error_impl);
 	socket.read(&Websocket <UserType>::recv_http);
 } // }}}
 
 template <class UserType>
 Websocket <UserType>::Websocket(int socket_fd, UserType *user, Receiver receiver, RunSettings const &run_settings) : // {{{
-	buffer(),
 	fragments(),
 	keepalive_handle(),
 	is_closed(false),
 	pong_seen(true),
 	current_opcode(uint8_t(-1)),
+	message_opcode(0),
+	message_compressed(false),
 	receiver(receiver),
+	view_receiver(),
 	send_mask(false),
 	user(user),
 	disconnect_cb(),
 	error_cb(),
+	drain_cb(),
+	connect_cb(),
+	deflate(),
+	stats(),
+	traffic(&Loop::get(run_settings.loop)->metrics().traffic("websocket")),
+	broadcast_policy(BroadcastMessage::QUEUE),
+	coalesced(),
+	stream_receiver(),
+	max_frame_size(default_max_size),
+	max_message_size(default_max_size),
+	message_size(0),
+	stream(),
 	http_state(HTTP_INACTIVE),
 	init_waiter(),
 	connect_settings(),
 	run_settings(run_settings),
 	received_headers(),
-	socket(socket_fd, this)
+	socket("websocket", socket_fd, this, run_settings.loop)
 {
 	STARTFUNC;
 	/* When constructing a Websocket, a connection is made to the
@@ -447,29 +850,43 @@ Websocket <UserType>::Websocket(int socket_fd, UserType *user, Receiver receiver
 	// Set up keepalive heartbeat.
 	if (run_settings.keepalive != Loop::Duration()) {
 		Loop *loop = Loop::get(run_settings.loop);
-		keepalive_handle = loop->add_timeout({loop->now() + run_settings.keepalive, run_settings.keepalive, keepalive, this});
+		keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive, true));
 	}
 	if (DEBUG > 2)
 		WL_log("accepted websocket");
-	socket.user_data = this;
 	socket.set_disconnect_cb(&Websocket <UserType>::disconnect_impl);
 	socket.set_error_cb(&Websocket <UserType>::error_impl);
+	socket.set_drain_cb(&Websocket <UserType>::drain_impl);
 	socket.read(&Websocket <UserType>::inject);
 } // }}}
 
 template <class UserType> template <class ServerType>
 Websocket <UserType>::Websocket(Socket <ServerType> &&src, UserType *user, Receiver receiver, RunSettings const &run_settings) : // {{{
-	buffer(),
 	fragments(),
 	keepalive_handle(),
 	is_closed(false),
 	pong_seen(true),
 	current_opcode(uint8_t(-1)),
+	message_opcode(0),
+	message_compressed(false),
 	receiver(receiver),
+	view_receiver(),
 	send_mask(false),
 	user(user),
 	disconnect_cb(),
 	error_cb(),
+	drain_cb(),
+	connect_cb(),
+	deflate(),
+	stats(),
+	traffic(&Loop::get(run_settings.loop)->metrics().traffic("websocket")),
+	broadcast_policy(BroadcastMessage::QUEUE),
+	coalesced(),
+	stream_receiver(),
+	max_frame_size(default_max_size),
+	max_message_size(default_max_size),
+	message_size(0),
+	stream(),
 	http_state(HTTP_INACTIVE),
 	connect_settings(),
 	run_settings(run_settings),
@@ -480,51 +897,66 @@ Websocket <UserType>::Websocket(Socket <ServerType> &&src, UserType *user, Recei
 	// Set up keepalive heartbeat.
 	if (run_settings.keepalive != Loop::Duration()) {
 		Loop *loop = Loop::get(run_settings.loop);
-		keepalive_handle = loop->add_timeout(Loop::TimeoutRecord {loop->now() + run_settings.keepalive, run_settings.keepalive, reinterpret_cast <Loop::CbBase *>(this), reinterpret_cast <Loop::Cb>(&Websocket <UserType>::keepalive)});
+		keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive, true));
 	}
 	if (DEBUG > 2)
 		WL_log("accepted websocket");
 	socket.set_disconnect_cb(&Websocket <UserType>::disconnect_impl);
 	socket.set_error_cb(&Websocket <UserType>::error_impl);
+	socket.set_drain_cb(&Websocket <UserType>::drain_impl);
 	socket.read(&Websocket <UserType>::inject);
 } // }}}
 
 template <class UserType>
 Websocket <UserType>::Websocket(Websocket <UserType> &&other) : // {{{
-	buffer(std::move(other.buffer)),
 	fragments(std::move(other.fragments)),
 	keepalive_handle(),
 	is_closed(other.is_closed),
 	pong_seen(other.pong_seen),
 	current_opcode(other.current_opcode),
+	message_opcode(other.message_opcode),
+	message_compressed(other.message_compressed),
 	receiver(other.receiver),
+	view_receiver(other.view_receiver),
 	send_mask(other.send_mask),
 	user(other.user),
 	disconnect_cb(other.disconnect_cb),
 	error_cb(other.error_cb),
+	drain_cb(other.drain_cb),
+	connect_cb(other.connect_cb),
+	deflate(std::move(other.deflate)),
+	stats(other.stats),
+	traffic(other.traffic),
+	broadcast_policy(other.broadcast_policy),
+	coalesced(std::move(other.coalesced)),
+	stream_receiver(other.stream_receiver),
+	max_frame_size(other.max_frame_size),
+	max_message_size(other.max_message_size),
+	message_size(other.message_size),
+	stream(other.stream),
 	http_state(other.http_state),
 	init_waiter(other.init_waiter),
 	connect_settings(other.connect_settings),
 	run_settings(other.run_settings),
 	received_headers(std::move(other.received_headers)),
-	socket(std::move(other))
+	socket(std::move(other.socket))
 {
 	socket.update_user(this);
 	other.init_waiter = coroutine::handle_type();
-	other.buffer.clear();
 	other.fragments.clear();
 	other.received_headers.clear();
-	WL_log("buffer moved");
 	if (!other.is_closed) {
 		if (run_settings.keepalive != Loop::Duration()) {
 			Loop::get(other.run_settings.loop)->remove_timeout(other.keepalive_handle);
+			other.keepalive_handle = Loop::TimeoutHandle();
 			Loop *loop = Loop::get(run_settings.loop);
-			keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive));
+			keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive, true));
 		}
 	}
 	other.is_closed = true;
 	socket.set_disconnect_cb(&Websocket <UserType>::disconnect_impl);
 	socket.set_error_cb(&Websocket <UserType>::error_impl);
+	socket.set_drain_cb(&Websocket <UserType>::drain_impl);
 } // }}}
 
 template <class UserType>
@@ -533,18 +965,31 @@ Websocket <UserType> &Websocket <UserType>::operator=(Websocket <UserType> &&oth
 	disconnect();
 	socket = std::move(other.socket);
 	socket.update_user(this);
-	buffer = std::move(other.buffer);
-	other.buffer.clear();
 	fragments = std::move(other.fragments);
 	other.fragments.clear();
 	is_closed = other.is_closed;
 	pong_seen = other.pong_seen;
 	current_opcode = other.current_opcode;
+	message_opcode = other.message_opcode;
+	message_compressed = other.message_compressed;
 	receiver = other.receiver;
+	view_receiver = other.view_receiver;
 	send_mask = other.send_mask;
 	user = other.user;
 	disconnect_cb = other.disconnect_cb;
 	error_cb = other.error_cb;
+	drain_cb = other.drain_cb;
+	connect_cb = other.connect_cb;
+	deflate = std::move(other.deflate);
+	stats = other.stats;
+	traffic = other.traffic;
+	broadcast_policy = other.broadcast_policy;
+	coalesced = std::move(other.coalesced);
+	stream_receiver = other.stream_receiver;
+	max_frame_size = other.max_frame_size;
+	max_message_size = other.max_message_size;
+	message_size = other.message_size;
+	stream = other.stream;
 	http_state = other.http_state;
 	init_waiter = other.init_waiter;
 	connect_settings = other.connect_settings;
@@ -554,14 +999,16 @@ Websocket <UserType> &Websocket <UserType>::operator=(Websocket <UserType> &&oth
 	if (!other.is_closed) {
 		if (run_settings.keepalive != Loop::Duration()) {
 			Loop::get(other.run_settings.loop)->remove_timeout(other.keepalive_handle);
+			other.keepalive_handle = Loop::TimeoutHandle();
 			Loop *loop = Loop::get(run_settings.loop);
-			keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive));
+			keepalive_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + run_settings.keepalive, run_settings.keepalive, this, &Websocket <UserType>::keepalive, true));
 		}
 	}
 	other.init_waiter = coroutine::handle_type();
 	other.is_closed = true;
 	socket.set_disconnect_cb(&Websocket <UserType>::disconnect_impl);
 	socket.set_error_cb(&Websocket <UserType>::error_impl);
+	socket.set_drain_cb(&Websocket <UserType>::drain_impl);
 	return *this;
 } // }}}
 
@@ -574,13 +1021,22 @@ bool Websocket <UserType>::keepalive() { // {{{
 } // }}}
 
 template <class UserType>
-void Websocket <UserType>::inject(std::string &data) { // {{{
+size_t Websocket <UserType>::inject(std::string_view data) { // {{{
 	STARTFUNC;
-	// Handle received data. Return bool to use as read callback.
+	// Handle received data; this is used as read callback.
+	// One frame is handled per call. Return its size, or 0 if it is not complete yet.
+	// Without a receiver, data is kept until one is set.
+	if (receiver == nullptr && view_receiver == nullptr && stream_receiver == nullptr)
+		return 0;
+	if (stream.remaining > 0) {
+		// The rest of a frame that is being streamed.
+		pong_seen = true;
+		return stream_payload(data);
+	}
 	// Websocket data consists of:
 	// 1 byte:
 	//	bit 7: 1 for last (or only) fragment; 0 for other fragments.
-	//	bit 6-4: extension stuff; must be 0.
+	//	bit 6-4: extension stuff; bit 6 (RSV1) marks a compressed message if permessage-deflate is used. The others must be 0.
 	//	bit 3-0: opcode.
 	// 1 byte:
 	//	bit 7: 1 if masked, 0 otherwise.
@@ -595,134 +1051,135 @@ void Websocket <UserType>::inject(std::string &data) { // {{{
 
 	//WL_log("received: " + data);
 	if (DEBUG > 2)
-		WL_log((std::ostringstream() << "received " << data.length() << " bytes: " << WebString(data).dump()).str());
-	if (DEBUG > 3) {
-		//WL_log(std::format("waiting: ' + ' '.join(['%02x' % x for x in self.websocket_buffer]) + ''.join([chr(x) if 32 <= x < 127 else '.' for x in self.websocket_buffer]))
-		//WL_log('data: ' + ' '.join(['%02x' % x for x in data]) + ''.join([chr(x) if 32 <= x < 127 else '.' for x in data]))
-	}
-	buffer += std::move(data);
-	data.clear();
-	while (!buffer.empty()) {
-		if (buffer[0] & 0x70) {
-			// Protocol error.
-			WL_log("extension stuff is not supported!");
-			is_closed = true;
-			socket.close();
-			return;
+		WL_log((std::ostringstream() << "received " << data.length() << " bytes: " << WebString(std::string(data)).dump()).str());
+	if ((data[0] & 0x30) || ((data[0] & 0x40) && !deflate.active())) {
+		// Protocol error.
+		WL_log("extension stuff is not supported!");
+		close_connection();
+		return 0;
+	}
+	// Check that entire packet is received. {{{
+	if (data.size() < 2) {
+		// Not enough data for length bytes.
+		if (DEBUG > 2)
+			WL_log("no length yet");
+		return 0;
+	}
+	char b = data[1];
+	bool have_mask = bool(b & 0x80);
+	b &= 0x7f;
+	if ((have_mask && send_mask) || (!have_mask && !send_mask)) {
+		// Protocol error.
+		WL_log("mask error have mask:" + std::to_string(have_mask) + "; send mask:" + std::to_string(send_mask));
+		close_connection();
+		return 0;
+	}
+	std::string::size_type pos;
+	std::string::size_type len = 0;
+	if (b == 0x7f) {
+		if (data.length() < 10) {
+			// Not enough data for length bytes.
+			if (DEBUG > 2)
+				WL_log("no 10 length yet");
+			return 0;
 		}
-		// Check that entire packet is received. {{{
-		if (buffer.size() < 2) {
+		for (int i = 0; i < 8; ++i)
+			len |= std::string::size_type(data[2 + i] & 0xff) << (8 * (7 - i));
+		pos = 10;
+	}
+	else if (b == 0x7e) {
+		if (data.length() < 4) {
 			// Not enough data for length bytes.
 			if (DEBUG > 2)
-				WL_log("no length yet");
-			return;
+				WL_log("no 4 length yet");
+			return 0;
 		}
-		char b = buffer[1];
-		bool have_mask = bool(b & 0x80);
-		b &= 0x7f;
-		if ((have_mask && send_mask) || (!have_mask && !send_mask)) {
+		for (int i = 0; i < 2; ++i)
+			len |= std::string::size_type(data[2 + i] & 0xff) << (8 * (1 - i));
+		pos = 4;
+	}
+	else {
+		len = b;
+		pos = 2;
+	}
+	uint8_t header = data[0];
+	uint8_t opcode = header & 0xf;
+	// Refuse frames that are too large before they are received. {{{
+	if (opcode & 8) {
+		if (len > 125) {
 			// Protocol error.
-			WL_log("mask error have mask:" + std::to_string(have_mask) + "; send mask:" + std::to_string(send_mask));
-			is_closed = true;
-			socket.close();
-			return;
-		}
-		std::string::size_type pos;
-		std::string::size_type len = 0;
-		if (b == 0x7f) {
-			if (buffer.length() < 10) {
-				// Not enough data for length bytes.
-				if (DEBUG > 2)
-					WL_log("no 10 length yet");
-				return;
-			}
-			for (int i = 0; i < 8; ++i)
-				len |= (buffer[2 + i] & 0xff) << (8 * (7 - i));
-			pos = 10;
-		}
-		else if (b == 0x7e) {
-			if (buffer.length() < 4) {
-				// Not enough data for length bytes.
-				if (DEBUG > 2)
-					WL_log("no 4 length yet");
-				return;
-			}
-			for (int i = 0; i < 2; ++i)
-				len |= (buffer[2 + i] & 0xff) << (8 * (1 - i));
-			pos = 4;
-		}
-		else {
-			len = b;
-			pos = 2;
-		}
-		if (buffer.length() < pos + (have_mask ? 4 : 0) + len) {
-			// Not enough data for packet.
-			if (DEBUG > 2)
-				WL_log((std::ostringstream() << "no packet yet; length = " << buffer.length() << "; need " << pos << " + " << (have_mask ? 4 : 0) << " + " << len).str());
-			// Long packets should not cause ping timeouts.
-			pong_seen = true;
-			return;
+			WL_log("control frame too large");
+			close_connection();
+			return 0;
 		}
-		// }}}
-		std::string header = buffer.substr(0, pos);
-		uint8_t opcode = header[0] & 0xf;
-		std::string packet;
-		uint32_t mask;
+	}
+	else if (max_frame_size != 0 && len > max_frame_size) {
+		too_large("frame");
+		return 0;
+	}
+	else if (max_message_size != 0 && (opcode == 0 ? message_size : 0) + len > max_message_size) {
+		too_large("message");
+		return 0;
+	}
+	// }}}
+	bool continuation = current_opcode != uint8_t(-1);
+	if (stream_receiver != nullptr && !(opcode & 8) && !(continuation ? message_compressed : bool(header & 0x40))) {
+		// Pass the payload to the stream receiver while it arrives, instead of waiting for the whole frame.
+		if (data.length() < pos + (have_mask ? 4 : 0))
+			return 0;
+		if (!begin_data_frame(header))
+			return 0;
+		stream.mask = 0;
 		if (have_mask) {
-			mask = *(reinterpret_cast <uint32_t *> (&buffer.data()[pos]));
+			std::memcpy(&stream.mask, &data[pos], 4);
 			pos += 4;
 		}
-		if (have_mask && mask != 0) {
-			auto p = pos;
-			for (p = pos; p + 3 < buffer.size(); p += 4) {
-				auto word = *(reinterpret_cast <uint32_t const *> (&buffer.data()[p])) ^ mask;
-				packet += std::string(reinterpret_cast <char const *> (&word), 4);
-			}
-			uint8_t m[4];
-			*reinterpret_cast <uint32_t *>(m) = mask;
-			for (int i = 0; p < buffer.size(); ++p, ++i)
-				packet += std::string(1, buffer.data()[p] ^ m[i]);
-		}
-		else {
-			packet = buffer.substr(pos, len);
-		}
-		buffer = buffer.substr(pos + len);
-		if (current_opcode == uint8_t(-1))
-			current_opcode = opcode;
-		else if (opcode != 0) {
+		stream.remaining = len;
+		stream.offset = 0;
+		stream.final = header & 0x80;
+		message_size += len;
+		++stats.frames_in;
+		stats.bytes_in += pos;
+		traffic->frames_in.add();
+		traffic->bytes_in.add(pos);
+		return pos + stream_payload(data.substr(pos));
+	}
+	if (data.length() < pos + (have_mask ? 4 : 0) + len) {
+		// Not enough data for packet.
+		if (DEBUG > 2)
+			WL_log((std::ostringstream() << "no packet yet; length = " << data.length() << "; need " << pos << " + " << (have_mask ? 4 : 0) << " + " << len).str());
+		// Long packets should not cause ping timeouts.
+		pong_seen = true;
+		return 0;
+	}
+	// }}}
+	if (have_mask) {
+		uint32_t mask;
+		std::memcpy(&mask, &data[pos], 4);
+		pos += 4;
+		// The data is in the socket's receive buffer and is consumed by this call, so it can be unmasked in place.
+		if (mask != 0)
+			websocket_unmask(const_cast <char *> (data.data()) + pos, len, mask);
+	}
+	std::string_view packet = data.substr(pos, len);
+	size_t used = pos + len;
+	++stats.frames_in;
+	stats.bytes_in += used;
+	traffic->frames_in.add();
+	traffic->bytes_in.add(used);
+	if (opcode & 8) {
+		// Control frames are never fragmented or compressed, and they may arrive between the fragments of a message.
+		if ((header & 0xc0) != 0x80) {
 			// Protocol error.
-			// Exception: pongs are sometimes sent asynchronously.
-			// Theoretically the packet can be fragmented, but that should never happen; asynchronous pongs seem to be a protocol violation anyway...
-			if (opcode == 10) {
-				// Pong.
-				pong_seen = true;
-			}
-			else {
-				WL_log("invalid fragment");
-				is_closed = true;
-				socket.close();
-				return;
-			}
-			continue;
-		}
-		fragments += packet;
-		if ((header[0] & 0x80) != 0x80) {
-			// fragment found; not last.
-			pong_seen = true;
-			if (DEBUG > 2)
-				WL_log("fragment recorded");
-			continue;
+			WL_log("fragmented control frame");
+			close_connection();
+			return used;
 		}
-		// Complete frame has been received.
-		packet = std::move(fragments);
-		fragments.clear();
-		opcode = current_opcode;
-		current_opcode = uint8_t(-1);
-		switch(opcode) {
+		switch (opcode) {
 		case 8:
 			// Connection close request.
 			disconnect(false);
-			return;
+			break;
 		case 9:
 			// Ping.
 			send(packet, 10);	// Pong
@@ -731,74 +1188,246 @@ void Websocket <UserType>::inject(std::string &data) { // {{{
 			// Pong.
 			pong_seen = true;
 			break;
-		case 1:	// Text.
-		case 2:	// Binary.
-			(user->*receiver)(packet);
-			break;
 		default:
 			WL_log("invalid opcode");
-			is_closed = true;
-			socket.close();
-			return;
+			close_connection();
+			break;
+		}
+		return used;
+	}
+	if (!begin_data_frame(header))
+		return used;
+	message_size += len;
+	if ((header & 0x80) != 0x80) {
+		// fragment found; not last.
+		fragments += packet;
+		pong_seen = true;
+		if (DEBUG > 2)
+			WL_log("fragment recorded");
+		return used;
+	}
+	// Complete frame has been received.
+	// An unfragmented packet is passed on directly from the receive buffer; fragments are collected first.
+	std::string message;
+	if (continuation) {
+		fragments += packet;
+		// Take the buffer, so its capacity is released with the message instead of being kept for the next one.
+		message.swap(fragments);
+		packet = message;
+	}
+	opcode = current_opcode;
+	current_opcode = uint8_t(-1);
+	if (message_compressed) {
+		message_compressed = false;
+		// Inflating stops as soon as the message would become too large, so a small frame cannot expand into a huge buffer.
+		auto status = deflate.decompress(packet, packet, max_message_size);
+		if (status == WebsocketDeflate::TOO_LARGE) {
+			too_large("decompressed message");
+			return used;
+		}
+		if (status != WebsocketDeflate::OK) {
+			WL_log("invalid compressed message");
+			close_connection();
+			return used;
 		}
 	}
+	switch(opcode) {
+	case 1:	// Text.
+	case 2:	// Binary.
+		message_opcode = opcode;
+		if (stream_receiver != nullptr)
+			(user->*stream_receiver)(packet, true, true);
+		else if (view_receiver != nullptr)
+			(user->*view_receiver)(packet);
+		else if (continuation && packet.data() == message.data())
+			(user->*receiver)(message);
+		else
+			(user->*receiver)(std::string(packet));
+		break;
+	default:
+		WL_log("invalid opcode");
+		close_connection();
+		break;
+	}
+	return used;
+} // }}}
+
+template <class UserType>
+bool Websocket <UserType>::begin_data_frame(uint8_t header) { // {{{
+	STARTFUNC;
+	// Check the order of fragments, and start a new message if this is its first frame.
+	// Return false if there was a protocol error; the connection is closed then.
+	uint8_t opcode = header & 0xf;
+	bool continuation = current_opcode != uint8_t(-1);
+	if (continuation != (opcode == 0)) {
+		// Protocol error.
+		WL_log("invalid fragment");
+		close_connection();
+		return false;
+	}
+	if (continuation && (header & 0x40)) {
+		// Protocol error: only the first frame of a message is marked as compressed.
+		WL_log("RSV1 set on continuation frame");
+		close_connection();
+		return false;
+	}
+	if (!continuation) {
+		current_opcode = opcode;
+		message_compressed = bool(header & 0x40);
+		message_size = 0;
+	}
+	return true;
+} // }}}
+
+template <class UserType>
+size_t Websocket <UserType>::stream_payload(std::string_view data) { // {{{
+	STARTFUNC;
+	// Pass received payload of the current frame to the stream receiver. Return the number of bytes that were used.
+	size_t size = std::min(uint64_t(data.size()), stream.remaining);
+	bool last = stream.final && size == stream.remaining;
+	if (size == 0 && !last)
+		return 0;
+	char *part = const_cast <char *> (data.data());
+	if (stream.mask != 0) {
+		// Rotate the mask, so its first byte is the one for the first byte of this part.
+		uint8_t bytes[4], rotated[4];
+		std::memcpy(bytes, &stream.mask, 4);
+		for (int i = 0; i < 4; ++i)
+			rotated[i] = bytes[(i + stream.offset) % 4];
+		uint32_t mask;
+		std::memcpy(&mask, rotated, 4);
+		websocket_unmask(part, size, mask);
+	}
+	stream.remaining -= size;
+	stream.offset += size;
+	stats.bytes_in += size;
+	traffic->bytes_in.add(size);
+	bool first = !stream.started;
+	stream.started = !last;
+	message_opcode = current_opcode;
+	if (last)
+		current_opcode = uint8_t(-1);
+	if (message_opcode == 1 || message_opcode == 2)
+		(user->*stream_receiver)(std::string_view(part, size), first, last);
+	else {
+		WL_log("invalid opcode");
+		close_connection();
+	}
+	return size;
 } // }}}
 
 template <class UserType>
-void Websocket <UserType>::send(std::string const &data, int opcode) {	// Send a WebSocket frame.  {{{
+void Websocket <UserType>::too_large(char const *what) { // {{{
+	STARTFUNC;
+	// Refuse a frame or message that is larger than the limit, by closing the connection with status 1009 (message too big).
+	WL_log(std::string("closing websocket: received ") + what + " is too large");
+	send(std::string_view("\x03\xf1", 2), 8);
+	disconnect(false);
+} // }}}
+
+template <class UserType>
+bool Websocket <UserType>::send(std::string_view data, int opcode) {	// Send a WebSocket frame.  {{{
 	STARTFUNC;
 	/* Send a Websocket frame to the remote end of the connection.
 	@param data: Data to send.
 	@param opcode: Opcade to send.  0 = fragment, 1 = text packet, 2 = binary packet, 8 = close request, 9 = ping, 10 = pong.
+	@return False if the websocket is closed or congested.
 	*/
 	if (DEBUG > 3)
-		WL_log("websend: " + data);
+		WL_log("websend: " + std::string(data));
 	assert((opcode >= 0 && opcode <= 2) || (opcode >= 8 && opcode <=10));
 	if (is_closed)
-		return;
+		return false;
 	//if (opcode == 1)
 	//	data = data.encode('utf-8')
-	uint8_t maskchar;
-	std::string maskcode;
-	if (send_mask) {
-		maskchar = 0x80;
-		// Masks are stupid, but the standard requires them.  Don't waste time on encoding (or decoding, if also using this library).
-		maskcode = std::string("\0\0\0\0", 4);
-	}
-	else {
-		maskchar = 0;
+	// Compressed messages are marked with RSV1; data then points into the compression buffer.
+	bool compressed = (opcode == 1 || opcode == 2) && deflate.should_compress(data.size());
+	if (compressed && !deflate.compress(data, data)) {
+		WL_log("closing socket due to compression failure");
+		close_connection();
+		return false;
 	}
-	std::string len;
+	// Build the frame header; it is sent with the payload in one system call, without copying the payload.
+	char header[14];
 	size_t l = data.length();
-	if (l < 0x7e) {
-		char lenchar = maskchar | l;
-		len = std::string(&lenchar, 1);
-	}
-	else if (l < 1 << 16) {
-		char lendata[3] {char(maskchar | 0x7e), char((l >> 8) & 0xff), char(l & 0xff)};
-		len = std::string(lendata, 3);
-	}
-	else {
-		char header[9];
-		header[0] = maskchar | 0x7f;
-		for (int i = 0; i < 8; ++i)
-			header[1 + i] = (l >> (8 * (7 - i))) & 0xff;
-		len = std::string(header, 9);
-	}
+	size_t header_size = websocket_frame_header(header, opcode, compressed, l, send_mask);
+	bool ret = false;
+	++stats.frames_out;
+	stats.bytes_out += header_size + l;
+	traffic->frames_out.add();
+	traffic->bytes_out.add(header_size + l);
 	try {
-		char o = 0x80 | opcode;
-		socket.send(std::string(&o, 1) + len + maskcode + data);
+		ret = socket.send({std::string_view(header, header_size), data});
 	}
 	catch (char const *msg) {
 		// Something went wrong; close the socket(in case it wasn't yet).
 		WL_log(std::string("closing socket due to problem while sending: ") + msg);
-		is_closed = true;
-		socket.close();
+		close_connection();
 	}
 	if (opcode == 8) {
-		is_closed = true;
-		socket.close();
+		close_connection();
+		return false;
+	}
+	return ret;
+} // }}}
+
+template <class UserType>
+bool Websocket <UserType>::send(BroadcastMessage const &message) { // {{{
+	STARTFUNC;
+	/* Send a message that was framed once for many websockets.
+	The shared frame is queued without copying it.  Websockets that
+	mask or compress their frames send the payload with send().
+	If the websocket is congested, the broadcast policy decides if
+	the message is queued, dropped, kept until the websocket drains
+	(replacing the message that was kept before), or if the
+	connection is closed.
+	@param message: The message to send.
+	@return False if the message was not sent (yet), or if the
+		websocket is closed or congested.
+	*/
+	if (is_closed)
+		return false;
+	if (socket.is_congested()) {
+		switch (broadcast_policy) {
+		case BroadcastMessage::QUEUE:
+			break;
+		case BroadcastMessage::DROP:
+			++stats.frames_dropped;
+			return false;
+		case BroadcastMessage::COALESCE:
+			if (coalesced)
+				++stats.frames_dropped;
+			coalesced = message;
+			return false;
+		case BroadcastMessage::DISCONNECT:
+			WL_log("closing websocket, because it is too slow for broadcast messages");
+			++stats.frames_dropped;
+			disconnect(false);
+			return false;
+		}
+	}
+	if (send_mask || deflate.active())
+		return send(message.payload(), message.get_opcode());
+	size_t size = message.get_frame()->size();
+	++stats.frames_out;
+	stats.bytes_out += size;
+	traffic->frames_out.add();
+	traffic->bytes_out.add(size);
+	return socket.send_shared(message.get_frame());
+} // }}}
+
+template <class UserType>
+void Websocket <UserType>::drain_impl() { // {{{
+	STARTFUNC;
+	// Send the message that was kept for the COALESCE policy first; the user is only told when that has not congested the socket again.
+	if (coalesced) {
+		BroadcastMessage message = std::move(coalesced);
+		coalesced = BroadcastMessage();
+		if (!send(message))
+			return;
 	}
+	if (drain_cb != nullptr)
+		(user->*drain_cb)();
 } // }}}
 
 template <class UserType>
@@ -826,7 +1455,15 @@ class Httpd { // {{{
 public:
 	class Connection;
 	friend class Connection;
+	// Description of an uploaded file or a raw request body while it is received.
+	struct Upload {
+		std::string name;	// Name of the form field; empty for a raw request body.
+		std::string filename;	// File name that was sent by the client.
+		std::string mime;	// Content-Type of the data.
+		size_t received;	// Number of bytes that were passed to the callback before this call.
+	};
 	typedef void (OwnerType::*PostCb)(Connection &connection);
+	typedef void (OwnerType::*UploadCb)(Connection &connection, Upload const &upload, std::string_view data, bool last);
 	typedef void (OwnerType::*ClosedCb)();
 	typedef void (OwnerType::*ErrorCb)(std::string const &message);
 	typedef void (OwnerType::*AcceptCb)(Connection &connection);
@@ -837,12 +1474,20 @@ private:
 	std::list <std::filesystem::path> htmldirs;	// Directories where static web pages are searched.
 	std::list <std::string> proxy;			// Proxy prefixes which are ignored when received.
 	PostCb post_cb;					// Callback when a POST request is received.
+	UploadCb upload_cb;				// Callback for chunks of uploaded files; if not set, they are stored in temporary files.
 	AcceptCb accept_cb;				// Websocket accept callback.
 	ClosedCb closed_cb;				// Closed callback.
 	ErrorCb error_cb;				// Error callback.
 	std::map <std::string, std::string> exts;	// Handled extensions; key is extension (including '.'), value is mime type.
 	Loop *loop;					// Main loop for registering read events.
 	Loop::Duration keepalive;			// Default keepalive for accepted sockets.
+	WebsocketDeflate::Settings deflate_settings;	// Compression that is accepted for websockets.
+	size_t max_header_size;				// Largest request header that is accepted.
+	size_t max_header_fields;			// Largest number of fields in a request header.
+	AssetCache cache;				// Static files that were served recently.
+	std::string metrics_path;			// Path where the metrics are served; empty if they are not.
+	std::vector <typename std::list <Connection>::iterator> closed_connections;	// Connections that are removed by reap_connections().
+	Loop::DeferHandle reap_handle;			// Pending reap_connections() task.
 	Server <Connection, Httpd <OwnerType> > server;	// Network server which provides the interface.
 	virtual char const *authentication(Connection &connection) { (void)&connection; return nullptr; }	// Override to require authentication.
 	virtual bool valid_credentials(Connection &connection) { (void)&connection; return true; }	// Override to check credentials.
@@ -850,19 +1495,31 @@ private:
 	void server_closed();
 	void server_error(std::string const &message);
 	void create_connection(Socket <Connection> *socket);
+	// Connections are removed when they are closed, or when the socket has been taken over by a websocket.
+	// That happens in a deferred task, because it is noticed in the callbacks of the connection.
+	void reap(Connection &connection);
+	bool reap_connections();
+	void take_reaping(Httpd <OwnerType> &src);
 public:
-	Httpd(OwnerType *owner, std::string const &service, std::string const &htmldir = "html", Loop *loop = nullptr, int backlog = 5);
-	~Httpd() { STARTFUNC; WL_log("destructing http server " + std::to_string((long)this)); }
+	Httpd(OwnerType *owner, std::string const &service, std::string const &htmldir = "html", Loop *loop = nullptr, int backlog = SOMAXCONN, bool reuse_port = false);
+	~Httpd() { STARTFUNC; WL_log("destructing http server " + std::to_string((long)this)); server.close(); loop->remove_deferred(reap_handle); }
 	// Move support.
 	Httpd(Httpd <OwnerType> &&src);
 	Httpd <OwnerType> &operator=(Httpd <OwnerType> &&src);
 	void set_post(PostCb callback) { STARTFUNC; post_cb = callback; }
+	void set_upload(UploadCb callback) { STARTFUNC; upload_cb = callback; }	// Receive uploaded files and raw request bodies in chunks, instead of in temporary files.
 	void set_accept(AcceptCb callback) { STARTFUNC; accept_cb = callback; }
 	void set_closed(ClosedCb callback) { STARTFUNC; closed_cb = callback; }
 	void set_error(ErrorCb callback) { STARTFUNC; error_cb = callback; }
 	void set_default_keepalive(Loop::Duration duration) { STARTFUNC; keepalive = duration; }
 	Loop::Duration get_keepalive() const { return keepalive; }
+	void set_deflate(WebsocketDeflate::Settings const &settings) { STARTFUNC; deflate_settings = settings; }	// Accept permessage-deflate for websockets; disabled by default.
+	WebsocketDeflate::Settings const &get_deflate() const { return deflate_settings; }
+	void set_header_limits(size_t max_size, size_t max_fields = 100) { STARTFUNC; max_header_size = max_size; max_header_fields = max_fields; }	// Larger requests are refused with 431.
+	void set_cache_size(size_t max_size, size_t max_file = 1 << 20) { STARTFUNC; cache.set_limits(max_size, max_file); }	// Cache static files in memory; 0 disables the cache (the default).
+	void set_metrics_path(std::string const &path) { STARTFUNC; metrics_path = path; }	// Serve Metrics::prometheus() at this path, like "/metrics"; empty disables it (the default).
 	Loop *get_loop() { return loop; }
+	ServerBase &get_server() { return server; }	// For admission control and listener options.
 }; // }}}
 
 template <class OwnerType>
@@ -883,10 +1540,47 @@ template <class OwnerType>
 void Httpd <OwnerType>::create_connection(Socket <Connection> *socket) { // {{{
 	WL_log("received new connection " + std::to_string((long)this));
 	connections.emplace_back(std::move(socket), this);
+	connections.back().self = --connections.end();
+} // }}}
+
+template <class OwnerType>
+void Httpd <OwnerType>::reap(Connection &connection) { // {{{
+	if (connection.reaping)
+		return;
+	connection.reaping = true;
+	closed_connections.push_back(connection.self);
+	if (reap_handle == loop->invalid_deferred())
+		reap_handle = loop->defer(Loop::DeferRecord(this, &Httpd <OwnerType>::reap_connections));
+} // }}}
+
+template <class OwnerType>
+bool Httpd <OwnerType>::reap_connections() { // {{{
+	reap_handle = loop->invalid_deferred();
+	for (auto connection: closed_connections) {
+		connection->reaping = false;
+		if (!connection->socket)
+			connections.erase(connection);
+	}
+	closed_connections.clear();
+	return false;
+} // }}}
+
+template <class OwnerType>
+void Httpd <OwnerType>::take_reaping(Httpd <OwnerType> &src) { // {{{
+	// After moving: the connections must point to the new server, and so must the pending task.
+	for (auto &connection: connections)
+		connection.httpd = this;
+	closed_connections = std::move(src.closed_connections);
+	src.closed_connections.clear();
+	if (src.reap_handle != loop->invalid_deferred()) {
+		loop->remove_deferred(src.reap_handle);
+		src.reap_handle = loop->invalid_deferred();
+		reap_handle = loop->defer(Loop::DeferRecord(this, &Httpd <OwnerType>::reap_connections));
+	}
 } // }}}
 
 template <class OwnerType>
-Httpd <OwnerType>::Httpd(OwnerType *owner, std::string const &service, std::string const &htmldir, Loop *loop, int backlog) : // {{{
+Httpd <OwnerType>::Httpd(OwnerType *owner, std::string const &service, std::string const &htmldir, Loop *loop, int backlog, bool reuse_port) : // {{{
 		owner(owner),
 		service(service),
 		connections{},
@@ -894,13 +1588,21 @@ Httpd <OwnerType>::Httpd(OwnerType *owner, std::string const &service, std::stri
 		htmldirs(htmldir.empty() ? std::list <std::filesystem::path>() : read_data_names(htmldir, {}, true, true)),
 		proxy(),
 		post_cb(),
+		upload_cb(),
 		accept_cb(),
 		closed_cb(),
 		error_cb(),
 		exts(),
 		loop(Loop::get(loop)),
 		keepalive(50s),
-		server(service, this, &Httpd <OwnerType>::create_connection, &Httpd <OwnerType>::server_closed, &Httpd <OwnerType>::server_error, loop, backlog)
+		deflate_settings(),
+		max_header_size(16 << 10),
+		max_header_fields(100),
+		cache(),
+		metrics_path(),
+		closed_connections(),
+		reap_handle(this->loop->invalid_deferred()),
+		server(service, this, &Httpd <OwnerType>::create_connection, &Httpd <OwnerType>::server_closed, &Httpd <OwnerType>::server_error, loop, backlog, reuse_port)
 {
 	WL_log("created new http server " + std::to_string((long)this));
 	/* Create a webserver.
@@ -911,6 +1613,11 @@ Httpd <OwnerType>::Httpd(OwnerType *owner, std::string const &service, std::stri
 		serve.
 	@param proxy: Tuple of virtual proxy prefixes that
 		should be ignored if requested.
+	@param reuse_port: Allow other servers to listen on the same
+		port.  To use multiple cores, run a Loop in each thread
+		and create an Httpd with reuse_port for it; the kernel
+		spreads new connections over them, and each connection
+		stays in the thread that accepted it.
 	*/
 
 	// Automatically add all extensions for which a mime type exists. {{{
@@ -973,35 +1680,55 @@ Httpd <OwnerType>::Httpd(Httpd <OwnerType> &&src) : // {{{
 		htmldirs(std::move(src.htmldirs)),
 		proxy(std::move(src.proxy)),
 		post_cb(src.post_cb),
+		upload_cb(src.upload_cb),
 		accept_cb(src.accept_cb),
 		closed_cb(src.closed_cb),
 		error_cb(src.error_cb),
 		exts(std::move(src.exts)),
 		loop(src.loop),
 		keepalive(src.keepalive),
+		deflate_settings(src.deflate_settings),
+		max_header_size(src.max_header_size),
+		max_header_fields(src.max_header_fields),
+		cache(std::move(src.cache)),
+		metrics_path(std::move(src.metrics_path)),
+		closed_connections(),
+		reap_handle(loop->invalid_deferred()),
 		server(std::move(src.server), this, &Httpd <OwnerType>::create_connection, &Httpd <OwnerType>::server_closed, &Httpd <OwnerType>::server_error)
 {
 	STARTFUNC;
 	WL_log("moving http server " + std::to_string((long)&src) + " to " + std::to_string((long)this));
+	take_reaping(src);
 } // }}}
 
 template <class OwnerType>
 Httpd <OwnerType> &Httpd <OwnerType>::operator=(Httpd <OwnerType> &&src) { // {{{
 	STARTFUNC;
 	WL_log("move-assigning http server " + std::to_string((long)&src) + " to " + std::to_string((long)this));
+	// The old connections are dropped, so a pending reap of them must not run.
+	loop->remove_deferred(reap_handle);
+	reap_handle = loop->invalid_deferred();
 	owner = std::move(src.owner);
 	service = std::move(src.service);
 	connections = std::move(src.connections);
 	htmldirs = std::move(src.htmldirs);
 	proxy = std::move(src.proxy);
 	post_cb = src.post_cb;
+	upload_cb = src.upload_cb;
 	accept_cb = src.accept_cb;
 	closed_cb = src.closed_cb;
 	error_cb = src.error_cb;
 	exts = std::move(src.exts);
 	loop = src.loop;
 	keepalive = src.keepalive;
+	deflate_settings = src.deflate_settings;
+	max_header_size = src.max_header_size;
+	max_header_fields = src.max_header_fields;
+	cache = std::move(src.cache);
+	metrics_path = std::move(src.metrics_path);
 	server = std::move(src.server);
+	take_reaping(src);
+	return *this;
 } // }}}
 
 template <class OwnerType>
@@ -1017,20 +1744,38 @@ public:
 		std::string value;
 		std::map <std::string, std::pair <std::string, std::map <std::string, std::string> > > header;
 	};
-	// This struct is used to store file post data.
+	// This struct is used to store file post data, and raw request bodies.
+	// The file is removed after the POST callback returns; rename it to keep it.
 	struct PostFile {
-		std::ofstream file;
+		std::filesystem::path path;
+		size_t size;
 		std::string mime;
 		std::string filename;
 		std::map <std::string, std::pair <std::string, std::map <std::string, std::string> > > header;
 	};
 private:
 	friend class Httpd <OwnerType>;
-	std::string post_boundary;
+	static constexpr size_t post_io_size = 64 << 10;	// Size of reads from the socket and writes to files while a request body is received.
+	std::unique_ptr <BoundarySearch> post_boundary;	// "\r\n--" followed by the boundary from the Content-Type; only allocated while a multipart body is received.
+	bool post_first;	// True until the header of the first part has been read.
 	// Example post header field: Content-Type: text/plain; charset=utf-8
 	// This maps to {"Content-Type", {"text/plain", {"charset, "utf-8"} } }.
 	std::map <std::string, std::pair <std::string, std::map <std::string, std::string> > > post_header;
-	std::ofstream post_current_file;
+	size_t post_scanned;	// Length of the start of the buffer that has been searched for the boundary.
+	bool post_in_file;	// The current part is a file, which is passed on in chunks.
+	std::string post_decoded;	// Decoded data of the current part; the memory is reused.
+	B64Decoder post_base64;		// State of a base64 encoded part that is received in pieces.
+	Upload post_upload;	// The file or raw body that is being received.
+	PostFile *post_target;	// Entry in post_file, or body, that the upload is stored in; nullptr if it is passed to the upload callback.
+	int post_fd;	// File that the upload is written to, or -1.
+	int post_pipe[2];	// For moving a raw body from the socket to post_fd with splice(); -1 if not used.
+	size_t post_remaining;	// Bytes of the raw body, or of the current chunk, that have not been received yet.
+	bool post_chunked;	// The raw body uses chunked transfer encoding.
+	size_t saved_maxsize;	// Read size of the socket, which is restored when the body has been received.
+	size_t header_scanned;	// Length of the part of the pending request header that has been checked for its end.
+	bool keep_alive;	// The connection stays open after the reply to the current request.
+	typename std::list <Connection>::iterator self;	// Position in httpd->connections.
+	bool reaping;	// The connection is waiting to be removed by Httpd::reap_connections().
 	void reset() { // {{{
 		// Clean up state data after completed transaction.
 		received_headers.clear();
@@ -1041,67 +1786,52 @@ private:
 		password.clear();
 		prefix.clear();
 	} // }}}
-	void ignore_disconnect() {}
+	void closed() { httpd->reap(*this); }
 	std::map <std::string, std::string> parse_args(std::string const &args) { // {{{
+		// Parse the arguments of a header field, such as "; name=value; name="quoted value"".
 		std::map <std::string, std::string> ret;
 		std::string::size_type pos = 0;
 		while (pos < args.size()) {
 			auto p = args.find('=', pos);
 			if (p == std::string::npos) {
-				WL_log("ignoring incomplete header argument");
+				if (!strip(args.substr(pos)).empty())
+					WL_log("ignoring incomplete header argument");
 				break;
 			}
-			std::string key = lower(strip(args.substr(pos, p)));
-			pos = p + 1;
+			std::string key = lower(strip(args.substr(pos, p - pos)));
+			pos = args.find_first_not_of(" \t", p + 1);
+			if (pos == std::string::npos)
+				pos = args.size();
 			std::string value;
-			while (true) {
-				p = args.find_first_of("\\\";", pos);
-
-				// Nothing special: use rest of string.
-				if (p == std::string::npos) {
-					value += args.substr(pos);
-					pos = args.size();
-					break;
-				}
-
-				// Start by adding string up to token.
-				value += args.substr(pos, p);
-
-				// Semicolon marks end of value.
-				if (args[p] == ';') {
-					pos = p + 1;
-					break;
-				}
-
-				// Backslash escapes whatever follows it.
-				if (args[p] == '\\') {
-					value += args[++p];
-					pos = p + 1;
-					continue;
-				}
-
+			if (pos < args.size() && args[pos] == '"') {
 				// Double quote starts protected string.
-				assert(args[p] == '"');
-				value += args.substr(pos, p);
-				pos = p + 1;
+				++pos;
 				while (true) {
-					p = args.find_first_of("\\\"");
+					p = args.find_first_of("\\\"", pos);
 					if (p == std::string::npos) {
 						WL_log("missing end quote in argument");
 						return ret;
 					}
-					value += args.substr(pos, p);
-					// Backslash escapes whatever follows it.
-					if (args[p] == '\\') {
-						value += args[++p];
-						continue;
-					}
+					value += args.substr(pos, p - pos);
 					// Double quote ends quoted string.
-					assert(args[p] == '"');
-					pos = p + 1;
-					break;
+					if (args[p] == '"') {
+						pos = p + 1;
+						break;
+					}
+					// Backslash escapes whatever follows it.
+					if (p + 1 < args.size())
+						value += args[p + 1];
+					pos = p + 2;
 				}
+				// Ignore anything up to the semicolon that ends the argument.
+				p = args.find(';', pos);
+			}
+			else {
+				// Semicolon marks end of value.
+				p = args.find(';', pos);
+				value = strip(args.substr(pos, p == std::string::npos ? std::string::npos : p - pos));
 			}
+			pos = p == std::string::npos ? args.size() : p + 1;
 			if (ret.find(key) != ret.end()) {
 				WL_log("duplicate key in argument: " + key);
 				return ret;
@@ -1110,144 +1840,248 @@ private:
 		}
 		return ret;
 	} // }}}
-	std::string post_decode(std::string &data, bool finish) { // {{{
-		// Decode data in POST body, given post_header (with all relevant fields existing).
-		std::string &encoding = post_header["content-transfer-encoding"].first;
-		if (encoding == "7bit") {
-			std::string ret = std::move(data);
-			data.clear();
-			return ret;
+	bool post_error(int code, std::string const &message) { // {{{
+		// Refuse a request body; the connection is closed, because the rest of the body cannot be skipped.
+		WL_log("Error in request body: " + message);
+		discard_post();
+		keep_alive = false;
+		reply(code, {}, {}, {}, true);
+		return false;
+	} // }}}
+	void discard_post() { // {{{
+		// Remove all stored request body data, including temporary files that were not moved away.
+		if (post_fd >= 0)
+			::close(post_fd);
+		post_fd = -1;
+		for (int i = 0; i < 2; ++i) {
+			if (post_pipe[i] >= 0)
+				::close(post_pipe[i]);
+			post_pipe[i] = -1;
+		}
+		std::error_code ignored;
+		for (auto &file: post_file) {
+			if (!file.second.path.empty())
+				std::filesystem::remove(file.second.path, ignored);
+		}
+		if (!body.path.empty())
+			std::filesystem::remove(body.path, ignored);
+		post_file.clear();
+		post_data.clear();
+		body = PostFile();
+		post_header.clear();
+		post_boundary.reset();
+		post_base64.reset();
+		post_target = nullptr;
+		if (saved_maxsize != 0) {
+			socket.set_maxsize(saved_maxsize);
+			saved_maxsize = 0;
 		}
-		if (encoding == "quoted-printable") {
-			std::string ret;
-			std::string::size_type pos = 0;
-			while (true) {
-				auto p = data.find('=', pos);
-				if (p == std::string::npos) {
-					ret += data.substr(pos);
-					data.clear();
-					return ret;
-				}
-				ret += data.substr(pos, p);
-				if (p > data.size() - 3) {
-					if (finish) {
-						WL_log("invalid quoted printable");
-						reply(400, {}, {}, {}, false);
-						data.clear();
-						return ret;
-					}
-					data = data.substr(p);
-					return ret;
-				}
-				if (data.substr(p + 1, 2) == "\r\n") {
-					ret += "\n";
-					pos = p + 3;
-					continue;
+	} // }}}
+	void finish_post() { // {{{
+		// The request body has been received; call the POST callback and prepare for the next request.
+		if (saved_maxsize != 0) {
+			socket.set_maxsize(saved_maxsize);
+			saved_maxsize = 0;
+		}
+		if (httpd->post_cb != nullptr)
+			((httpd->owner)->*(httpd->post_cb))(*this);
+		discard_post();
+		reset();
+		if (socket)
+			socket.read(&Connection::read_header);
+	} // }}}
+	bool start_upload(std::string const &name, std::string const &filename, std::string const &mime, PostFile *target) { // {{{
+		// Prepare for receiving a file or raw body. If target is not nullptr, the data is stored in a temporary file.
+		post_upload = Upload {name, filename, mime, 0};
+		post_target = target;
+		if (target == nullptr)
+			return true;
+		// The client does not get to choose the directory.
+		std::string safe_name = filename;
+		std::replace(safe_name.begin(), safe_name.end(), '/', '_');
+		target->path = write_temp_name(safe_name);
+		post_fd = ::open(target->path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (post_fd < 0) {
+			target->path.clear();
+			return post_error(500, std::string("unable to create temporary file: ") + strerror(errno));
+		}
+		return true;
+	} // }}}
+	bool upload_data(std::string_view data) { // {{{
+		// Pass a chunk of the current upload to the callback, or write it to its file.
+		if (data.empty())
+			return true;
+		if (post_target == nullptr) {
+			if (httpd->upload_cb != nullptr)
+				((httpd->owner)->*(httpd->upload_cb))(*this, post_upload, data, false);
+		}
+		else {
+			for (std::string_view rest = data; !rest.empty(); ) {
+				ssize_t num = ::write(post_fd, rest.data(), rest.size());
+				if (num < 0) {
+					if (errno == EINTR)
+						continue;
+					return post_error(500, std::string("unable to write uploaded data: ") + strerror(errno));
 				}
-				char num;
-				try {
-					num = std::stoi(data.substr(p + 1, 2), nullptr, 16);
+				rest.remove_prefix(num);
+			}
+		}
+		post_upload.received += data.size();
+		return true;
+	} // }}}
+	void finish_upload() { // {{{
+		// The current upload is complete.
+		if (post_target == nullptr) {
+			if (httpd->upload_cb != nullptr)
+				((httpd->owner)->*(httpd->upload_cb))(*this, post_upload, {}, true);
+			return;
+		}
+		::close(post_fd);
+		post_fd = -1;
+		post_target->size = post_upload.received;
+		post_target = nullptr;
+	} // }}}
+	bool post_decode(std::string_view &data, bool finish, std::string_view &result) { // {{{
+		// Decode data in POST body, given post_header (with all relevant fields existing).
+		// Decoded data is removed from the start of data; an incomplete code at the end is kept, unless finish is set.
+		// The result is a view of data, or of post_decoded.
+		std::string const &encoding = post_header["content-transfer-encoding"].first;
+		if (encoding == "quoted-printable") {
+			post_decoded.clear();
+			std::string::size_type pos = 0;
+			while (true) {
+				auto p = data.find('=', pos);
+				if (p == std::string::npos) {
+					post_decoded += data.substr(pos);
+					data = {};
+					break;
 				}
-				catch (...) {
-					WL_log("invalid quoted printable");
-					reply(400, {}, {}, {}, false);
-					data.clear();
-					return ret;
+				post_decoded += data.substr(pos, p - pos);
+				if (p + 3 > data.size()) {
+					if (finish)
+						return post_error(400, "invalid quoted printable");
+					data.remove_prefix(p);
+					break;
 				}
-				ret += num;
 				pos = p + 3;
+				// An = at the end of a line is a soft line break, which is removed.
+				if (data.substr(p + 1, 2) == "\r\n")
+					continue;
+				unsigned char num;
+				auto r = std::from_chars(data.data() + p + 1, data.data() + p + 3, num, 16);
+				if (r.ec != std::errc() || r.ptr != data.data() + p + 3)
+					return post_error(400, "invalid quoted printable");
+				post_decoded += char(num);
 			}
+			result = post_decoded;
+			return true;
 		}
 		if (encoding == "base64") {
-			std::string::size_type pos = 0;
-			std::string ret = b64decode(data, pos, true);
-			if (pos == std::string::npos) {
-				WL_log("invalid base64 data");
-				reply(400, {}, {}, {}, false);
-				data.clear();
-				return ret;
+			// Letters of an incomplete unit are kept in post_base64, so all data is used.
+			post_decoded.clear();
+			if (!post_base64.decode(data, post_decoded) || (finish && !post_base64.finish()))
+				return post_error(400, "invalid base64 data");
+			data = {};
+			result = post_decoded;
+			return true;
+		}
+		// 7bit, 8bit and binary data is passed on as it is.
+		result = data;
+		data = {};
+		return true;
+	} // }}}
+	size_t read_post_body(std::string_view buffer) { // {{{
+		// Only data that was not searched before is searched for the boundary.
+		// Field values are kept in the socket buffer until they are complete; files are passed on in large chunks.
+		auto p = post_boundary->find(buffer, post_scanned);
+		size_t end = p == std::string::npos ? post_boundary->safe_size(buffer) : p;
+		if (p == std::string::npos && (!post_in_file || end < post_io_size)) {
+			post_scanned = end;
+			return 0;
+		}
+		auto part = buffer.substr(0, end);
+		std::string_view decoded;
+		if (!post_decode(part, p != std::string::npos, decoded))
+			return buffer.size();
+		if (post_in_file) {
+			if (!upload_data(decoded))
+				return buffer.size();
+			if (p == std::string::npos) {
+				size_t used = end - part.size();
+				post_scanned = end - used;
+				return used;
 			}
-			data = data.substr(pos);
-			return ret;
+			finish_upload();
 		}
-		WL_log("unrecognized Content-Transfer-Encoding in POST: " + encoding);
-		return {};
-	} // }}}
-	void read_post_body(std::string &buffer) { // {{{
-		auto p = buffer.find(post_boundary);
-		if (p != std::string::npos) {
-			auto part = buffer.substr(0, p);
-			buffer = buffer.substr(p);
-			post_current_file << post_decode(part, true);
-
-			// Store data.
+		else {
+			// Store data in post member.
 			std::string &name = post_header["content-disposition"].second["name"];
-			post_file.emplace(name, PostFile {std::move(post_current_file), post_header["content-type"].first, post_header["content-disposition"].second["filename"], std::move(post_header)});
-
-			// Prepare for next chunk.
-			post_current_file.close(); // Just in case.
-			post_header.clear();
-			socket.read(&Connection::read_post_header);
-			return;
-		}
-		post_current_file << post_decode(buffer, false);
+			post_data.emplace(name, PostData{std::string(decoded), std::move(post_header)});
+		}
+		// Prepare for next part.
+		post_header.clear();
+		post_base64.reset();
+		post_scanned = 0;
+		socket.read(&Connection::read_post_header);
+		return p;
 	} // }}}
-	void read_post_header(std::string &buffer) { // {{{
-		std::string::size_type bs = post_boundary.size();
+	size_t read_post_header(std::string_view buffer) { // {{{
+		// The first boundary is at the start of the body, so it is not preceded by a line break.
+		std::string_view boundary = std::string_view(post_boundary->get()).substr(post_first ? 2 : 0);
+		std::string::size_type bs = boundary.size();
 		if (buffer.size() < bs + 4) {
 			// Not enough data yet.
-			return;
+			return 0;
+		}
+		if (buffer.substr(0, bs) != boundary) {
+			post_error(400, "missing boundary in POST body");
+			return buffer.size();
 		}
 		if (buffer.substr(bs, 4) == "--\r\n") {
 			// Final boundary; finish up.
-			buffer = buffer.substr(bs + 4);
-			// call POST callback.
-			if (httpd->post_cb != nullptr)
-				((httpd->owner)->*(httpd->post_cb))(*this);
-			// TODO: unlink all POST files (that are still there).
-			reset();
-			if (socket)
-				socket.read(&Connection::read_header);
-			return;
+			socket.consume(bs + 4);
+			finish_post();
+			return 0;
 		}
 
 		if (buffer.substr(bs, 2) != "\r\n") {
 			// Invalid data.
-			WL_log("invalid POST header");
-			reply(400, {}, {}, {}, false);
-			return;
+			post_error(400, "invalid POST header");
+			return buffer.size();
 		}
 
 		// Find end of header.
 		std::string::size_type eoh = buffer.find("\r\n\r\n", bs);
 		if (eoh == std::string::npos) {
 			// End of header not yet found.
-			return;
+			if (buffer.size() > httpd->max_header_size)
+				post_error(431, "POST part header is too large");
+			return 0;
 		}
 
 		// Header complete; parse it.
-		auto headerlines = split(buffer.substr(bs + 2, eoh - (bs + 2)), -1, 0, "\n");
+		post_header.clear();
+		auto headerlines = split(std::string(buffer.substr(bs + 2, eoh - (bs + 2))), -1, 0, "\n");
 
 		for (auto ln: headerlines) {
 			assert(!ln.empty());
 			if (std::string(" \t\r\n\v\f").find(ln[0]) != std::string::npos) {
-				WL_log("refusing continuation in POST content");
-				reply(400, {}, {}, {}, false);
-				return;
+				post_error(400, "refusing continuation in POST content");
+				return buffer.size();
 			}
-			auto equal = ln.find('=');
-			if (equal == std::string::npos) {
-				WL_log("no = sign in POST header");
+			auto colon = ln.find(':');
+			if (colon == std::string::npos) {
+				post_error(400, "no colon in POST header");
+				return buffer.size();
 			}
-			auto key = lower(strip(ln.substr(0, equal)));
-			auto value = strip(ln.substr(equal + 1));
+			auto key = lower(strip(ln.substr(0, colon)));
+			auto value = strip(ln.substr(colon + 1));
 			if (post_header.contains(key)) {
-				WL_log("duplicate header in POST content: " + key);
-				reply(400, {}, {}, {}, false);
-				return;
+				post_error(400, "duplicate header in POST content: " + key);
+				return buffer.size();
 			}
 			auto parts = split(value, 1, 0, ";");
-			post_header[key] = {parts[0], parts.size() == 2 ? parse_args(parts[1]) : std::map <std::string, std::string>() };
+			post_header[key] = {parts.empty() ? std::string() : parts[0], parts.size() == 2 ? parse_args(parts[1]) : std::map <std::string, std::string>() };
 		}
 
 		if (!post_header.contains("content-type"))
@@ -1256,90 +2090,223 @@ private:
 			post_header["content-transfer-encoding"] = {"7bit", {}};
 		else
 			post_header["content-transfer-encoding"].first = lower(post_header["content-transfer-encoding"].first);
+		auto &encoding = post_header["content-transfer-encoding"].first;
+		if (encoding != "7bit" && encoding != "8bit" && encoding != "binary" && encoding != "quoted-printable" && encoding != "base64") {
+			post_error(400, "unrecognized Content-Transfer-Encoding in POST: " + encoding);
+			return buffer.size();
+		}
 		if (!post_header.contains("content-disposition") || lower(post_header["content-disposition"].first) != "form-data" || !post_header["content-disposition"].second.contains("name")) {
-			WL_log("Content-Disposition must be form-data and contain at least a name");
-			reply(400, {}, {}, {}, false);
-			return;
+			post_error(400, "Content-Disposition must be form-data and contain at least a name");
+			return buffer.size();
+		}
+
+		// If there is a filename, pass the contents on in chunks. Otherwise, collect the content and store it in post_data.
+		auto &disposition = post_header["content-disposition"].second;
+		post_in_file = disposition.contains("filename");
+		if (post_in_file) {
+			PostFile *target = nullptr;
+			if (httpd->upload_cb == nullptr) {
+				auto file = post_file.try_emplace(disposition["name"], PostFile {{}, 0, post_header["content-type"].first, disposition["filename"], post_header});
+				if (!file.second) {
+					post_error(400, "duplicate file in POST content: " + disposition["name"]);
+					return buffer.size();
+				}
+				target = &file.first->second;
+			}
+			if (!start_upload(disposition["name"], disposition["filename"], post_header["content-type"].first, target))
+				return buffer.size();
 		}
-
-		// If there is a filename, allow storing file contents in chunks. Otherwise, read and store content here.
-		if (post_header["content-disposition"].second.contains("filename")) {
-			buffer = buffer.substr(eoh + 4);
-			// Prepare output file.
-			post_current_file = write_temp_file(post_header["content-disposition"].second["filename"]);
-			socket.read(&Connection::read_post_body);
+		post_first = false;
+		post_scanned = 0;
+		socket.read(&Connection::read_post_body);
+		return eoh + 4;
+	} // }}}
+	void start_body(std::string const &mime) { // {{{
+		// Receive a request body that is not multipart/form-data. It is handled like a single uploaded file.
+		post_chunked = false;
+		if (received_headers.has(HttpHeaders::TRANSFER_ENCODING)) {
+			// The parser has checked that chunked is the final coding; no other codings are supported.
+			for (auto &field: received_headers) {
+				if (field.first == "transfer-encoding" && lower(std::string(field.second)) != "chunked") {
+					post_error(501, "unsupported Transfer-Encoding: " + std::string(field.second));
+					return;
+				}
+			}
+			post_chunked = true;
+			post_remaining = 0;
+		}
+		else {
+			auto length = received_headers.get(HttpHeaders::CONTENT_LENGTH);
+			if (length.empty()) {
+				post_error(411, "no Content-Length for request body");
+				return;
+			}
+			auto r = std::from_chars(length.data(), length.data() + length.size(), post_remaining);
+			if (r.ec != std::errc() || r.ptr != length.data() + length.size()) {
+				post_error(400, "invalid Content-Length");
+				return;
+			}
+		}
+		body.mime = mime;
+		if (!start_upload({}, {}, mime, httpd->upload_cb == nullptr ? &body : nullptr))
+			return;
+		if (!post_chunked && post_remaining == 0) {
+			finish_upload();
+			finish_post();
 			return;
 		}
-
-		// Check if boundary after body is received yet.
-		auto eob = buffer.find(post_boundary, eoh + 2);
-		if (eob == std::string::npos) {
-			// Not received yet.
+		// Large bodies that are stored in a file go from the socket to the file with splice().
+		if (!post_chunked && post_target != nullptr && post_remaining > post_io_size && ::pipe2(post_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+			post_pipe[0] = post_pipe[1] = -1;
+		socket.read(post_chunked ? &Connection::read_chunk_header : &Connection::read_body);
+	} // }}}
+	size_t read_body(std::string_view buffer) { // {{{
+		// Receive (a chunk of) a raw request body.
+		size_t used = std::min(buffer.size(), post_remaining);
+		if (!upload_data(buffer.substr(0, used)))
+			return buffer.size();
+		post_remaining -= used;
+		if (post_remaining > 0) {
+			if (post_pipe[0] >= 0) {
+				// All buffered data has been used; receive the rest without copying it.
+				socket.consume(used);
+				socket.rawread(&Connection::splice_body);
+			}
+			return used;
+		}
+		if (post_chunked) {
+			socket.read(&Connection::read_chunk_end);
+			return used;
+		}
+		socket.consume(used);
+		finish_upload();
+		finish_post();
+		return 0;
+	} // }}}
+	void splice_body() { // {{{
+		ssize_t num = socket.recv_file(post_fd, std::min(post_remaining, size_t(1) << 20), post_pipe);
+		if (num < 0) {
+			// Connection lost.
+			discard_post();
 			return;
 		}
-		auto part = buffer.substr(eoh + 4, eob - (eoh + 4));
-		buffer = buffer.substr(eob);
-		auto body = post_decode(part, true);
-		// Store data in post member.
-		std::string &name = post_header["content-disposition"].second["name"];
-		post_data.emplace(name, PostData{std::move(body), std::move(post_header)});
-		post_header.clear();	// Start new chunk with empty header.
-		socket.read(&Connection::read_header);
+		post_upload.received += num;
+		post_remaining -= num;
+		if (post_remaining > 0)
+			return;
+		finish_upload();
+		finish_post();
+	} // }}}
+	size_t read_chunk_header(std::string_view buffer) { // {{{
+		// Read the size line of a chunk: hexadecimal size, optionally followed by extensions, which are ignored.
+		auto eol = buffer.find('\n');
+		if (eol == std::string::npos) {
+			if (buffer.size() > httpd->max_header_size)
+				post_error(400, "chunk header is too long");
+			return 0;
+		}
+		auto r = std::from_chars(buffer.data(), buffer.data() + eol, post_remaining, 16);
+		if (r.ec != std::errc() || (*r.ptr != ';' && *r.ptr != '\r' && *r.ptr != ' ' && *r.ptr != '\t' && *r.ptr != '\n')) {
+			post_error(400, "invalid chunk header");
+			return buffer.size();
+		}
+		socket.read(post_remaining == 0 ? &Connection::read_chunk_trailer : &Connection::read_body);
+		return eol + 1;
+	} // }}}
+	size_t read_chunk_end(std::string_view buffer) { // {{{
+		// The data of a chunk is followed by a line break.
+		if (buffer.size() < 2)
+			return 0;
+		if (buffer.substr(0, 2) != "\r\n") {
+			post_error(400, "missing line break after chunk");
+			return buffer.size();
+		}
+		socket.read(&Connection::read_chunk_header);
+		return 2;
 	} // }}}
-	void read_header(std::string &buffer) { // {{{
+	size_t read_chunk_trailer(std::string_view buffer) { // {{{
+		// Trailer fields are ignored; an empty line ends the body.
+		auto eol = buffer.find('\n');
+		if (eol == std::string::npos) {
+			if (buffer.size() > httpd->max_header_size)
+				post_error(431, "chunked body trailer is too large");
+			return 0;
+		}
+		if (eol > 1 || (eol == 1 && buffer[0] != '\r'))
+			return eol + 1;
+		socket.consume(eol + 1);
+		finish_upload();
+		finish_post();
+		return 0;
+	} // }}}
+	size_t read_header(std::string_view buffer) { // {{{
 		if (DEBUG > 4)
 			WL_log("reading header");
-		std::string::size_type p = 0;
-		std::list <std::string> lines;
-		// Read header lines. {{{
+		// Lines are only checked once: header_scanned is the start of the first line that was not complete yet.
+		if (header_scanned == 0) {
+			// HTTP says we SHOULD allow at least one empty line before the request, so do that and ignore the empty lines.
+			size_t skip = 0;
+			while (skip < buffer.size() && (buffer[skip] == '\r' || buffer[skip] == '\n'))
+				++skip;
+			if (skip > 0)
+				return skip;
+		}
 		while (true) {
-			auto q = buffer.find('\n', p);
-			if (q == std::string::npos) {
-				// Header is not complete yet.
-				return;
-			}
-			std::string line = buffer.substr(p, q - p);
-			p = q + 1;
-			if (line.empty() && lines.empty()) {
-				// HTTP says we SHOULD allow at least one empty line before the request, so do that and ignore the empty line.
-				continue;
-			}
-			if (!line.empty() && (line[0] == ' ' || line[0] == '\t')) {
-				if (lines.empty()) {
-					WL_log("Error: http request starts with continuation");
-					socket.close();
-					return;
-				}
-				else if (lines.size() == 1) {
-					// A continuation on the request line MUST be rejected (or ignored) according to HTTP.
-					WL_log("Error: http request contains a continuation");
-					socket.close();
-					return;
+			auto q = buffer.find('\n', header_scanned);
+			if (q == std::string::npos || q >= httpd->max_header_size) {
+				if (buffer.size() < httpd->max_header_size) {
+					// Header is not complete yet.
+					return 0;
 				}
-				else
-					lines.back() += " " + strip(line);
-				continue;
+				WL_log("Error: http request header is too large");
+				header_scanned = 0;
+				keep_alive = false;
+				reply(431, {}, {}, {}, true);
+				return buffer.size();
 			}
-			line = strip(line);
-			if (line.empty())
-				break;
-			if (DEBUG > 3)
-				WL_log("Header line: " + line);
-			lines.push_back(line);
+			size_t line_start = header_scanned;
+			header_scanned = q + 1;
+			if (q == line_start || (q == line_start + 1 && buffer[line_start] == '\r'))
+				break;	// Empty line: end of header.
+		}
+		size_t size = header_scanned;
+		header_scanned = 0;
+		// Header complete; consume it before handling the request, because that may move the socket to a Websocket.
+		reset();
+		auto result = received_headers.parse(buffer.substr(0, size), httpd->max_header_fields);
+		socket.consume(size);
+		switch (result) {
+		case HttpHeaders::OK:
+			handle_request();
+			break;
+		case HttpHeaders::INVALID:
+			WL_log("Warning: ignoring invalid request " + std::string(buffer.substr(0, buffer.find('\n'))));
+			socket.close();
+			break;
+		case HttpHeaders::TOO_MANY_FIELDS:
+			WL_log("Error: http request has too many header fields");
+			keep_alive = false;
+			reply(431, {}, {}, {}, true);
+			break;
+		case HttpHeaders::BAD_REQUEST:
+			// The end of the request is not known, so nothing after it can be trusted.
+			WL_log("Warning: refusing request with unclear message framing");
+			keep_alive = false;
+			reply(400, {}, {}, {}, true);
+			break;
 		}
-		// }}}
-		// Header complete; parse it.
+		return size;
+	} // }}}
+	void handle_request() { // {{{
 		// Parse request. {{{
-		buffer = buffer.substr(p);
-		auto request = split(lines.front(), 2);
-		if (request.size() != 3 || request[1][0] != '/') {
-			WL_log("Warning: ignoring invalid request " + lines.front());
+		if (received_headers.target.empty() || received_headers.target[0] != '/') {
+			WL_log("Warning: ignoring invalid request for " + std::string(received_headers.target));
 			socket.close();
 			return;
 		}
-		method = upper(request[0]);
-		std::string path = request[1];
-		http_version = request[2];
+		method = upper(std::string(received_headers.method));
+		std::string path(received_headers.target);
+		http_version = received_headers.version;
 		for (auto current_prefix: httpd->proxy) {
 			if (startswith(path, "/" + current_prefix + "/") || path == "/" + current_prefix) {
 				prefix = "/" + current_prefix;
@@ -1349,40 +2316,41 @@ private:
 		std::string noprefix_path = path.substr(prefix.size());
 		if (noprefix_path.empty() || noprefix_path[0] != '/')
 			noprefix_path = "/" + noprefix_path;
+		if (DEBUG > 2) {
+			for (auto &field: received_headers)
+				WL_log("Header field: '" + std::string(field.first) + "' = '" + std::string(field.second) + "'");
+		}
+		// HTTP/1.1 connections are persistent by default, HTTP/1.0 connections only if requested.
+		auto connection = received_headers.get(HttpHeaders::CONNECTION);
+		if (http_version == "HTTP/1.1")
+			keep_alive = !http_has_token(connection, "close");
+		else
+			keep_alive = http_version == "HTTP/1.0" && http_has_token(connection, "keep-alive");
+		// A request body that is not read would be taken for the next request; close the connection after such a request.
+		auto content_length = received_headers.get(HttpHeaders::CONTENT_LENGTH);
+		if (method != "POST" && method != "PUT" && ((!content_length.empty() && content_length != "0") || received_headers.has(HttpHeaders::TRANSFER_ENCODING)))
+			keep_alive = false;
+		// Transfer-Encoding in an older protocol version is faulty framing (RFC 9112, section 6.1).
+		if (received_headers.has(HttpHeaders::TRANSFER_ENCODING) && http_version != "HTTP/1.1")
+			keep_alive = false;
 		// }}}
-		// Store attributes. {{{
-		for (auto line = ++lines.begin(); line != lines.end(); ++line) {
-			p = line->find(':');
-			if (p == std::string::npos) {
-				WL_log("Warning: ignoring http header without : " + *line);
-				continue;
-			}
-			auto key = lower(strip(line->substr(0, p)));
-			auto value = strip(line->substr(p + 1));
-			received_headers[key] = value;
-			if (DEBUG > 2)
-				WL_log("Header field: '" + key + "' = '" + value + "'");
-		}
-		// }}}
-		if (!received_headers.contains("host")) {
+		if (!received_headers.has(HttpHeaders::HOST)) {
 			WL_log("Error in request: no Host header");
 			socket.close();
 			return;
 		}
-		std::string host = received_headers["host"];
-		url = URL(host + noprefix_path);
+		url = URL(std::string(received_headers.get(HttpHeaders::HOST)) + noprefix_path);
 		// Check if authorization is required and provided. {{{
 		auto message = httpd->authentication(*this);
 		if (message) {
 			// Authentication required; check if it was present.
-			auto i = received_headers.find("authorization");
-			if (i == received_headers.end()) {
+			if (!received_headers.has(HttpHeaders::AUTHORIZATION)) {
 				// No authorization requested; reply 401.
 				reply(401, {}, {}, {{"WWW-Authenticate", std::string("Basic realm=\"") + message + "\""}}, true);
 				return;
 			}
 			// Authorization requested; check it.
-			auto data = split(i->second, 1);
+			auto data = split(std::string(received_headers.get(HttpHeaders::AUTHORIZATION)), 1);
 			if (data.size() != 2 || data[0] != "basic") {
 				// Invalid authorization.
 				reply(400, {}, {}, {}, true);
@@ -1406,65 +2374,75 @@ private:
 		// Authorization successful or not needed.
 		// }}}
 
-		// Parse request: handle POST. {{{
-		if (method == "POST") {
-			// Handle POST requests.
-			auto p = received_headers.find("content-type");
-			if (p == received_headers.end()) {
-				WL_log("No Content-Type found in POST request");
-				reply(400, {}, {}, {}, true);
+		// Parse request: handle POST and PUT. {{{
+		if (method == "POST" || method == "PUT") {
+			if (httpd->post_cb == nullptr && httpd->upload_cb == nullptr) {
+				keep_alive = false;
+				reply(405, {}, {}, {}, true);
 				return;
 			}
-			auto ct = split(lower(p->second), 1, 0, ";");
-			if (ct.size() != 2 || lower(strip(ct[0])) != "multipart/form-data") {
-				WL_log("Wrong Content-Type found in POST request (must be multipart/form-data)");
-				reply(400, {}, {}, {}, true);
+			// Without a Content-Type, the body is taken to be binary data.
+			auto p = received_headers.find("content-type");
+			auto ct = split(p == received_headers.end() ? std::string("application/octet-stream") : std::string(p->second), 1, 0, ";");
+			std::string mime = ct.empty() ? std::string("application/octet-stream") : lower(strip(ct[0]));
+			saved_maxsize = socket.get_maxsize();
+			socket.set_maxsize(post_io_size);
+			if (method == "PUT" || mime != "multipart/form-data") {
+				start_body(mime);
 				return;
 			}
 			// Parse content-type arguments.
-			auto args = parse_args(ct[1]);
+			auto args = parse_args(ct.size() == 2 ? ct[1] : std::string());
 			// Compute boundary.
 			auto b = args.find("boundary");
-			if (b == args.end()) {
-				WL_log("POST request has no boundary");
-				reply(400, {}, {}, {}, false);
+			if (b == args.end() || b->second.empty()) {
+				post_error(400, "POST request has no boundary");
 				return;
 			}
 
-			post_boundary = "\r\n--" + args["boundary"];
+			post_boundary = std::make_unique <BoundarySearch> ("\r\n--" + b->second);
+			post_first = true;
+			post_scanned = 0;
 			// Start boundary: boundary + "\r\n".
 			// End boundary: boundary + "--\r\n".
 
-			// Prepare body for POST boundary search.
-			buffer = "\r\n" + buffer;
-
 			// Set read callback to POST handler.
 			socket.read(&Connection::read_post_header);
 			return;
 		} // }}}
 
 		// Handle request. Options:
+		// - Serve the metrics.
 		// - Create a websocket.
 		// - Serve a dynamic page.
 		// - Serve a static page.
-		auto c = received_headers.find("connection");
-		auto u = received_headers.find("upgrade");
-		if (c != received_headers.end() && u != received_headers.end() && lower(u->second) == "websocket") {
+		if (!httpd->metrics_path.empty() && method == "GET" && url.path == httpd->metrics_path) {
+			reply(200, Metrics::prometheus(), "text/plain; version=0.0.4; charset=utf-8");
+			return;
+		}
+		if (received_headers.has(HttpHeaders::CONNECTION) && lower(std::string(received_headers.get(HttpHeaders::UPGRADE))) == "websocket") {
 			// This is probably a websocket. "connection" must include "upgrade".
-			auto cc = split(lower(c->second), -1, 0, ",");
-			for (auto cci: cc) {
-				if (strip(cci) == "upgrade") {
-					// This is a websocket.
-					auto k = received_headers.find("sec-websocket-key");
-					if (method != "GET" || k == received_headers.end()) {
-						reply(400, {}, {}, {}, true);
-						return;
-					}
-					std::string key = b64encode(sha1(k->second + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
-					reply(101, {}, {}, {{"Sec-WebSocket-Accept", key}, {"Connection", "Upgrade"}, {"Upgrade", "WebSocket"}}, false);
-					((httpd->owner)->*(httpd->accept_cb))(*this);
+			if (http_has_token(received_headers.get(HttpHeaders::CONNECTION), "upgrade")) {
+				// This is a websocket.
+				if (method != "GET" || !received_headers.has(HttpHeaders::SEC_WEBSOCKET_KEY)) {
+					reply(400, {}, {}, {}, true);
 					return;
 				}
+				std::string key = b64encode(sha1(std::string(received_headers.get(HttpHeaders::SEC_WEBSOCKET_KEY)) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+				std::map <std::string, std::string> headers {{"Sec-WebSocket-Accept", key}, {"Connection", "Upgrade"}, {"Upgrade", "WebSocket"}};
+				// Negotiate compression; the websocket that is created by the accept callback takes it over.
+				auto e = received_headers.find("sec-websocket-extensions");
+				if (e != received_headers.end()) {
+					auto response = deflate.accept_offer(e->second, httpd->deflate_settings);
+					if (!response.empty())
+						headers["Sec-WebSocket-Extensions"] = response;
+				}
+				reply(101, {}, {}, headers, false);
+				((httpd->owner)->*(httpd->accept_cb))(*this);
+				// The accept callback normally takes the socket; the rest of this object is not needed after that.
+				if (!socket)
+					httpd->reap(*this);
+				return;
 			}
 			// Not a websocket after all.
 			WL_log("upgrade: websocket header found, but no connection: upgrade");
@@ -1523,7 +2501,7 @@ private:
 public:
 	Httpd <OwnerType> *httpd;
 	Socket <Connection> socket;
-	std::map <std::string, std::string> received_headers;
+	HttpHeaders received_headers;
 	std::string method;
 	URL url;
 	std::string http_version;
@@ -1532,6 +2510,8 @@ public:
 	std::string prefix;
 	std::map <std::string, PostData> post_data;
 	std::map <std::string, PostFile> post_file;
+	PostFile body;	// Body of a PUT request, or of a POST request that is not multipart/form-data.
+	WebsocketDeflate deflate;	// Negotiated websocket compression; pass it to Websocket::set_deflate() when accepting.
 	void reply(int code, std::string const &message = {}, std::string const &content_type = {}, std::map <std::string, std::string> const &sent_headers = {}, bool close = false) { // Send HTTP status code and headers, and optionally a message.  {{{
 		/* Reply to a request for a document.
 		There are three ways to call this function:
@@ -1542,7 +2522,8 @@ public:
 		assert(http_response.contains(code));
 		char const *response = http_response[code];
 		//WL_log('Debug: sending reply %d %s for %s\n' % (code, httpcodes[code], connection.address.path))
-		socket.send((std::ostringstream() << "HTTP/1.1 " << code << " " << response << "\r\n").str());
+		// Collect all headers, so they are sent together with the message.
+		std::string headers = (std::ostringstream() << "HTTP/1.1 " << code << " " << response << "\r\n").str();
 		std::string the_content_type;
 		std::string the_message;
 		if (message.empty() && code != 101) {
@@ -1550,59 +2531,195 @@ public:
 			the_content_type = "text/html;charset=utf-8";
 			the_message = (std::ostringstream() << "<!DOCTYPE html><html><head><meta charset='utf-8'/><title>" << code << ": " << response << "</title></head><body><h1>" << code << ": " << response << "</h1></body></html>").str();
 		}
-		else {
-			the_content_type = content_type;
-			the_message = message;
-		}
-		if (close && !sent_headers.contains("Connection")) {
-			socket.send("Connection:close\r\n");
-		}
-		if (!the_content_type.empty()) {
-			socket.send("Content-Type:" + the_content_type + "\r\n");
-			socket.send("Content-Length:" + (std::ostringstream() << the_message.size()).str() + "\r\n");
+		if (!keep_alive && code != 101)
+			close = true;
+		if (!sent_headers.contains("Connection"))
+			headers += connection_header(close);
+		std::string_view body = the_message.empty() ? std::string_view(message) : std::string_view(the_message);
+		if (!the_content_type.empty() || !content_type.empty()) {
+			headers += "Content-Type:" + (the_content_type.empty() ? content_type : the_content_type) + "\r\n";
+			headers += "Content-Length:" + std::to_string(body.size()) + "\r\n";
 		}
 		else {
 			assert(code == 101);
-			assert(the_message.empty());
+			assert(body.empty());
 		}
-		for (auto h: sent_headers)
-			socket.send(h.first + ":" + h.second + "\r\n");
-		socket.send("\r\n" + the_message);
+		for (auto &h: sent_headers)
+			headers += h.first + ":" + h.second + "\r\n";
+		headers += "\r\n";
+		// A reply to a HEAD request has the same headers, but no body.
+		socket.send({headers, method == "HEAD" ? std::string_view() : body});
 		if (close)
 			socket.close();
 	} // }}}
+	std::string_view connection_header(bool close) const { // {{{
+		// The Connection header for a reply, if one is needed.
+		if (close)
+			return "Connection:close\r\n";
+		if (keep_alive && http_version == "HTTP/1.0")
+			return "Connection:keep-alive\r\n";
+		return {};
+	} // }}}
 	void reply_file(std::filesystem::path const &path, std::string const &mime) { // {{{
 		// This should be called when a request is received (from read_header() or the server's overloaded page() function.
 		// It replies 200 OK and serves the file (which must exist) to the client.
-		// This reads the entire file into memory first, so it cannot be used for streamed content.
-		std::string content;
-		std::ifstream file(path, std::ios::binary);
-		if (!file.good()) {
+		// Small files are served from the server's cache if it is enabled; others are sent from the kernel by the socket.
+		// If a precompressed version (path.br or path.gz) exists and the client accepts it, that is sent instead.
+		// Conditional requests are answered with 304 Not Modified, a Range request for a single range with 206 Partial Content.
+		struct stat st;
+		if (::stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
 			// Service Unavailable.
 			reply(503, {}, {}, {}, true);
 			return;
 		}
-		while (true) {
-			if (!file.good()) {
+		// Select encoding. {{{
+		std::string file = path;
+		std::string encoding;
+		bool vary = false;
+		auto accept_encoding = received_headers.find("accept-encoding");
+		for (auto &coding: {std::pair <char const *, char const *>("br", ".br"), {"gzip", ".gz"}}) {
+			struct stat sibling;
+			std::string name = path.native() + coding.second;
+			if (::stat(name.c_str(), &sibling) < 0 || !S_ISREG(sibling.st_mode) || sibling.st_mtime < st.st_mtime)
+				continue;
+			vary = true;
+			if (encoding.empty() && accept_encoding != received_headers.end() && http_accepts_encoding(accept_encoding->second, coding.first)) {
+				file = name;
+				encoding = coding.first;
+				st = sibling;
+			}
+		}
+		// }}}
+		// Get the file, from cache if possible. {{{
+		int fd = -1;
+		auto asset = httpd->cache.get(file, st);
+		std::string headers;
+		std::string etag;
+		std::string last_modified;
+		if (asset == nullptr) {
+			fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				// Service Unavailable.
+				reply(503, {}, {}, {}, true);
+				return;
+			}
+			if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+				::close(fd);
 				// Internal server error.
 				reply(500, {}, {}, {}, true);
 				return;
 			}
-			char part[4096];
-			file.read(part, sizeof(part));
-			content += std::string(part, file.gcount());
-			if (file.eof())
+			etag = http_etag(st, encoding);
+			last_modified = http_date(st.st_mtime);
+			headers = "Content-Type:" + mime + "\r\n";
+			if (!encoding.empty())
+				headers += "Content-Encoding:" + encoding + "\r\n";
+			headers += "Accept-Ranges:bytes\r\nETag:" + etag + "\r\nLast-Modified:" + last_modified + "\r\n";
+			if (httpd->cache.fits(st.st_size)) {
+				asset = httpd->cache.load(file, fd, st, std::move(headers), std::move(etag), std::move(last_modified));
+				::close(fd);
+				fd = -1;
+				if (asset == nullptr) {
+					// Internal server error.
+					reply(500, {}, {}, {}, true);
+					return;
+				}
+			}
+		}
+		std::string_view the_headers = asset ? asset->headers : headers;
+		std::string_view the_etag = asset ? asset->etag : etag;
+		std::string_view the_last_modified = asset ? asset->last_modified : last_modified;
+		std::string_view vary_header = vary ? "Vary:Accept-Encoding\r\n" : "";
+		// }}}
+		// Handle conditional request. {{{
+		// If-None-Match takes precedence over If-Modified-Since.
+		auto if_none_match = received_headers.find("if-none-match");
+		auto if_modified_since = received_headers.find("if-modified-since");
+		bool not_modified;
+		if (if_none_match != received_headers.end())
+			not_modified = http_etag_match(if_none_match->second, the_etag);
+		else if (if_modified_since != received_headers.end()) {
+			time_t since = parse_http_date(if_modified_since->second);
+			not_modified = since >= 0 && st.st_mtime <= since;
+		}
+		else
+			not_modified = false;
+		if (not_modified) {
+			if (fd >= 0)
+				::close(fd);
+			std::string reply_headers = (std::ostringstream() << "HTTP/1.1 304 " << http_response[304] << "\r\nETag:" << the_etag << "\r\nLast-Modified:" << the_last_modified << "\r\n" << vary_header << connection_header(!keep_alive) << "\r\n").str();
+			socket.send(reply_headers);
+			if (!keep_alive)
+				socket.close();
+			reset();
+			return;
+		}
+		// }}}
+		// Handle range request. {{{
+		size_t size = st.st_size;
+		int code = 200;
+		size_t first = 0;
+		size_t length = size;
+		std::string content_range;
+		auto range = received_headers.find("range");
+		auto if_range = received_headers.find("if-range");
+		// If-Range only allows a partial reply if the file has not changed.
+		if (range != received_headers.end() && (if_range == received_headers.end() || if_range->second == the_etag || if_range->second == the_last_modified)) {
+			size_t last;
+			switch (parse_range(range->second, size, first, last)) {
+			case RANGE_OK:
+				code = 206;
+				length = last - first + 1;
+				content_range = "Content-Range:bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size) + "\r\n";
+				break;
+			case RANGE_UNSATISFIABLE:
+				if (fd >= 0)
+					::close(fd);
+				reply(416, {}, {}, {{"Content-Range", "bytes */" + std::to_string(size)}});
+				reset();
+				return;
+			case RANGE_IGNORE:
+				first = 0;
 				break;
+			}
 		}
-		// Send OK.
-		reply(200, content, mime, {{"Content-Length", std::to_string(content.size())}}, false);
+		// }}}
+		std::string status = (std::ostringstream() << "HTTP/1.1 " << code << " " << http_response[code] << "\r\nContent-Length:" << length << "\r\n" << content_range << vary_header << connection_header(!keep_alive)).str();
+		bool head = method == "HEAD";
+		if (asset != nullptr)
+			socket.send({status, the_headers, "\r\n", head ? std::string_view() : std::string_view(asset->content).substr(first, length)});
+		else {
+			socket.send({status, the_headers, "\r\n"});
+			if (head || length == 0)
+				::close(fd);
+			else
+				socket.send_file(fd, first, length);
+		}
+		if (!keep_alive)
+			socket.close();
 
 		// Prepare connection for next request.
 		reset();
 	} // }}}
 	Connection(Socket <Connection> *src, Httpd <OwnerType> *httpd) : // {{{
 			post_boundary(),
+			post_first(false),
 			post_header(),
+			post_scanned(0),
+			post_in_file(false),
+			post_decoded(),
+			post_base64(),
+			post_upload(),
+			post_target(nullptr),
+			post_fd(-1),
+			post_pipe{-1, -1},
+			post_remaining(0),
+			post_chunked(false),
+			saved_maxsize(0),
+			header_scanned(0),
+			keep_alive(false),
+			self(),
+			reaping(false),
 			httpd(httpd),
 			socket(std::move(*src), this),
 			received_headers{},
@@ -1613,17 +2730,202 @@ public:
 			password{},
 			prefix{},
 			post_data{},
-			post_file{}
+			post_file{},
+			body{},
+			deflate{}
 	{
-		socket.set_disconnect_cb(&Connection::ignore_disconnect);
+		socket.set_disconnect_cb(&Connection::closed);
 		socket.read(&Connection::read_header);
 		if (DEBUG > 2)
 			WL_log((std::ostringstream() << "new connection from " << socket.url.host << ":" << socket.url.service).str());
 	} // }}}
+	~Connection() { discard_post(); }
 }; // }}}
 // }}}
 
 // RPC. {{{
+class RPCBroadcast { // {{{
+	/* A call without a reply, like bgcall() without a reply callback,
+	that is encoded once for any number of RPC connections; send it
+	with RPC::broadcast().  The JSON and binary packets are encoded
+	when they are first needed, so the cost does not depend on the
+	number of connections.
+	*/
+	std::string target;
+	Args args;
+	KwArgs kwargs;
+	BroadcastMessage text;
+	BroadcastMessage binary;
+public:
+	RPCBroadcast(std::string const &target, Args args = {}, KwArgs kwargs = {});
+	// The call packet, without the "call" envelope; used for calls that wait for credit.
+	std::shared_ptr <WebObject> call() const;
+	// The framed packet in one of the formats.
+	BroadcastMessage const &message(bool use_binary);
+}; // }}}
+
+template <class Target>
+class PublishedMap { // {{{
+	/* Map of published functions, for RPC.
+	This can be used as the published map of a user object instead of a
+	std::map.  It can only be changed through its members, which give it
+	a new generation every time.  RPC objects compare the generation with
+	the one their dispatch table was built from, so changes are seen by
+	all connections without looking the target up in the map on every
+	call.  Generations are unique over all maps, so a new map at the
+	address of a destroyed one is never mistaken for it.
+	*/
+	std::map <std::string, Target, std::less <>> items;
+	uint64_t changes;
+	static inline std::atomic <uint64_t> next_generation {0};
+	static uint64_t new_generation() { return ++next_generation; }
+public:
+	typedef typename std::map <std::string, Target, std::less <>>::const_iterator const_iterator;
+	PublishedMap() : items(), changes(new_generation()) {}
+	PublishedMap(std::initializer_list <std::pair <std::string const, Target>> init) : items(init), changes(new_generation()) {}
+	PublishedMap(PublishedMap const &other) : items(other.items), changes(new_generation()) {}
+	PublishedMap &operator=(PublishedMap const &other) { items = other.items; changes = new_generation(); return *this; }
+	void set(std::string const &name, Target target) { items.insert_or_assign(name, target); changes = new_generation(); }
+	bool erase(std::string_view name) { // {{{
+		auto p = items.find(name);
+		if (p == items.end())
+			return false;
+		items.erase(p);
+		changes = new_generation();
+		return true;
+	} // }}}
+	void clear() { items.clear(); changes = new_generation(); }
+	const_iterator find(std::string_view name) const { return items.find(name); }
+	const_iterator begin() const { return items.begin(); }
+	const_iterator end() const { return items.end(); }
+	size_t size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+	uint64_t generation() const { return changes; }
+}; // }}}
+
+template <class Target>
+class DispatchTable { // {{{
+	/* Flat table of published functions, for RPC.
+	This is an open addressing hash table from names to targets, which is
+	built once from the published map of the user object, so that
+	looking up the target of a call does not walk a tree with string
+	compares and does not allocate.  Every slot also has the histogram
+	for the call latency of its function.
+	*/
+public:
+	struct Slot {
+		size_t hash;
+		std::string name;
+		Target target;	// nullptr for empty slots.
+		Metrics::Histogram *latency;
+	};
+private:
+	std::vector <Slot> slots;	// The size is 0 or a power of two.
+public:
+	Metrics::Histogram *fallback_latency;	// For calls to the fallback function; they all share it, so the number of metrics is bounded.
+	DispatchTable() : slots(), fallback_latency(nullptr) {}
+	static Metrics::Histogram &latency(Metrics &metrics, std::string const &method) { return metrics.histogram("webloop_rpc_call_seconds", "Time from receiving an RPC call to sending its return value, by method.", {{"method", method}}); }
+	template <class Map> void build(Map const *published, Metrics &metrics) { // {{{
+		slots.clear();
+		fallback_latency = &latency(metrics, "(fallback)");
+		if (published == nullptr || published->empty())
+			return;
+		size_t capacity = 8;
+		while (capacity < published->size() * 2)
+			capacity <<= 1;
+		slots.assign(capacity, Slot{0, std::string(), nullptr, nullptr});
+		for (auto const &item: *published) {
+			if (item.second == nullptr)
+				continue;
+			size_t hash = std::hash <std::string_view> ()(item.first);
+			size_t i = hash & (capacity - 1);
+			while (slots[i].target != nullptr)
+				i = (i + 1) & (capacity - 1);
+			slots[i] = Slot{hash, item.first, item.second, &latency(metrics, item.first)};
+		}
+	} // }}}
+	Slot const *find(std::string_view name) const { // {{{
+		if (slots.empty())
+			return nullptr;
+		size_t hash = std::hash <std::string_view> ()(name);
+		size_t mask = slots.size() - 1;
+		for (size_t i = hash & mask; slots[i].target != nullptr; i = (i + 1) & mask) {
+			if (slots[i].hash == hash && slots[i].name == name)
+				return &slots[i];
+		}
+		return nullptr;
+	} // }}}
+}; // }}}
+
+template <class T>
+class Slab { // {{{
+	/* Table of items, indexed by ids that are handed out on insertion.
+	An id contains a slot number and the generation of that slot, which is
+	incremented when the slot is freed, so a stale id (for example a
+	duplicate reply) never matches a newer item that reuses the slot.
+	Insert, find and erase are O(1), and freed slots are reused, so once
+	the table has grown they don't allocate.  Ids are never 0, and stay
+	below 2**52, so they are exact in JavaScript.
+	*/
+	static unsigned const slot_bits = 32;
+	static uint32_t const generation_mask = (1 << 20) - 1;
+	static uint32_t const no_slot = ~uint32_t(0);
+	struct Entry {
+		T value;
+		uint32_t generation;
+		uint32_t next_free;
+		bool used;
+	};
+	std::vector <Entry> entries;
+	uint32_t first_free;
+	size_t count;
+	Entry *entry(uint64_t id) { // {{{
+		uint64_t slot = id & ((uint64_t(1) << slot_bits) - 1);
+		if (slot == 0 || slot > entries.size())
+			return nullptr;
+		Entry &e = entries[slot - 1];
+		if (!e.used || e.generation != id >> slot_bits)
+			return nullptr;
+		return &e;
+	} // }}}
+public:
+	Slab() : entries(), first_free(no_slot), count(0) {}
+	uint64_t insert(T &&value) { // {{{
+		uint32_t slot = first_free;
+		if (slot == no_slot) {
+			slot = entries.size();
+			entries.push_back(Entry{T(), 0, no_slot, false});
+		}
+		else
+			first_free = entries[slot].next_free;
+		Entry &e = entries[slot];
+		e.value = std::move(value);
+		e.used = true;
+		++count;
+		return (uint64_t(e.generation) << slot_bits) | (slot + 1);
+	} // }}}
+	T *find(uint64_t id) { Entry *e = entry(id); return e == nullptr ? nullptr : &e->value; }
+	bool erase(uint64_t id) { // {{{
+		Entry *e = entry(id);
+		if (e == nullptr)
+			return false;
+		e->value = T();
+		e->used = false;
+		e->generation = (e->generation + 1) & generation_mask;
+		e->next_free = first_free;
+		first_free = e - entries.data();
+		--count;
+		return true;
+	} // }}}
+	size_t size() const { return count; }
+	template <class F> void for_each(F f) const { // {{{
+		for (size_t i = 0; i < entries.size(); ++i) {
+			if (entries[i].used)
+				f((uint64_t(entries[i].generation) << slot_bits) | (i + 1), entries[i].value);
+		}
+	} // }}}
+}; // }}}
+
 template <class UserType>
 class RPC { // {{{
 	/* Remote Procedure Call over Websocket.
@@ -1639,13 +2941,49 @@ class RPC { // {{{
 
 	If no communication object is given in the constructor, any calls that
 	the remote end attempts will fail.
+
+	user->published may point to a std::map or to a PublishedMap.  Calls
+	are dispatched through a table that is built from it when the first
+	call arrives, or when it changes.  Changes to a PublishedMap are seen
+	through its generation; a std::map is checked on every call, so a
+	function that was replaced or removed is never called from a stale
+	table, but the target is looked up in the map every time.
+
+	Packets are sent as JSON text frames by default.  A client can ask for
+	the compact binary format (see WebObject::load_binary()) by sending
+	the header "X-Webloop-Codec: binary", or with "codec=binary" in the
+	query string for clients that cannot set headers, such as browsers.
+	An RPC server then sends binary frames, and a client switches to
+	binary when it receives the first binary frame.  Peers that don't know
+	the binary format never receive it.  Incoming frames are decoded
+	according to their opcode, so both formats are always accepted.
+
+	With set_batching(true), packets are not sent immediately, but
+	collected until the end of the current loop iteration, and then sent
+	as a single "batch" packet, containing the list of packets.  This saves
+	a frame and usually a system call per packet when many calls are made
+	at once.  Batch packets are always accepted, but only enable sending
+	them if the peer is known to support them.
+
+	Received calls are limited with set_max_inbound().  When a limit is
+	set, the peer is told how many more calls it may send with "credit"
+	packets (["credit", count]), which are sent again as calls finish.  A
+	peer that receives credit holds back calls while it has none, so a
+	busy server slows its clients down instead of disconnecting them.
+	Calls that arrive anyway are queued, up to set_max_queued(), and
+	refused with an error after that.  set_max_outbound() limits the
+	number of calls to the peer that wait for a reply or for credit.
+	get_stats() returns the current depth of these queues.
 	*/
 public:
 	typedef void (UserType::*BgReply)(std::shared_ptr <WebObject>);
 	typedef coroutine (UserType::*Published)(Args args, KwArgs kwargs);
 	typedef coroutine (UserType::*PublishedFallback)(std::string const &target, Args args, KwArgs kwargs);
+	typedef Webloop::PublishedMap <Published> PublishedMap;
 	typedef void (UserType::*DisconnectCb)();
 	typedef void (UserType::*ErrorCb)(std::string const &message);
+	typedef void (UserType::*DrainCb)();
+	typedef void (UserType::*ConnectCb)();
 	struct Call {
 		std::shared_ptr <WebObject> code;
 		std::string target;
@@ -1653,120 +2991,243 @@ public:
 		KwArgs kwargs;
 		UserType *user;
 	};
+	struct Stats {
+		size_t inbound_running;		// Received calls that are running.
+		size_t inbound_queued;		// Received calls that wait for activation or for a free slot.
+		size_t outbound_pending;	// Sent calls that wait for a reply.
+		size_t outbound_queued;		// Calls that wait for credit from the peer.
+		int64_t peer_credit;		// Calls that may be sent before credit runs out, or -1 if the peer sets no limit.
+		uint64_t rejected;		// Received calls that were refused, because the queue was full.
+	};
 private:
 	DisconnectCb disconnect_cb;
 	ErrorCb error_cb;
-	Loop::IdleHandle activation_handle;
+	DrainCb drain_cb;
+	ConnectCb connect_cb;
+	Loop::DeferHandle activation_handle;
 	bool activated;
 	UserType *user;
+	bool binary_wanted;	// The client asked for binary packets.
+	bool binary;		// Packets are sent in binary format.
+	template <class Headers> static bool binary_requested(Headers const &headers, URL const &url);
+	std::string send_buffer;	// Serialization buffer for send(), reused between packets.
+	static size_t const max_send_buffer = 1 << 16;
+	size_t max_depth;	// Maximum nesting depth of received JSON packets.
+
+	// Members for batching.
+	bool batching;		// Packets are collected in batch_buffer.
+	bool batch_binary;	// The format of the current batch; binary can be enabled while collecting.
+	size_t batch_count;	// Number of packets in batch_buffer.
+	std::string batch_buffer;	// Serialized packets, after room for the batch header.
+	Loop::DeferHandle batch_handle;	// Deferred task that sends the batch.
+	static size_t const batch_header_room = 24;
+	void begin_batch_packet();
+	void end_batch_packet();
+	void flush_batch();
+	bool batch_task() { batch_handle = Loop::get()->invalid_deferred(); flush_batch(); return false; }
 
 	// Members for handling calls to remote.
-	int reply_index;	// Index that was passed with last command. Auto-increments on each call.
-	std::map <int, BgReply> expecting_reply_bg;	// Data for pending bgcalls, by reply_index.
-	std::map <int, coroutine::handle_type> expecting_reply_fg;	// Data for pending fgcalls, by reply_index.
+	struct Pending { // {{{
+		BgReply bg;	// Reply callback for bgcalls.
+		coroutine::handle_type fg;	// Waiting coroutine for fgcalls.
+	}; // }}}
+	Slab <Pending> pending;	// Calls that wait for a reply, by id.
+	size_t max_outbound;	// Maximum of pending plus credit_queue; 0 for no limit.
+	int64_t peer_credit;	// Number of calls that the peer allows, or -1 if it did not send credit.
+	std::list <std::shared_ptr <WebObject> > credit_queue;	// Call packets that wait for credit.
+	void send_call(std::shared_ptr <WebObject> call);
+
+	// Members for limiting calls from remote.
+	size_t max_inbound;	// Maximum number of running calls; 0 for no limit.
+	size_t max_queued;	// Maximum number of delayed_calls.
+	size_t advertised_credit;	// Credit that was sent to the peer and not used yet.
+	uint64_t rejected_calls;
+	void update_credit();
+	void call_finished();
 
 	// Members for handling calls from remote.
 	std::list <Call> delayed_calls;	// Pending received calls, to be made when socket is activated.
 	struct CalledData { // {{{
 		std::list <CalledData>::iterator iterator;
 		RPC <UserType> *rpc;
-		int id;
+		WebObject::IntType id;
+		bool reply;	// False for calls without id, which don't get a return packet.
+		Loop::Time start;
+		Metrics::Histogram *latency;
 		void called_return(std::shared_ptr <WebObject> ret);
 	}; // }}}
 	std::list <CalledData> called_data;
+	DispatchTable <Published> dispatch;	// Lookup table for published functions.
+	void const *dispatch_source;	// The published map that dispatch was built from.
+	uint64_t dispatch_generation;	// The generation of dispatch_source when dispatch was built, for a PublishedMap.
+
+	// Metrics in the loop of the connection; nullptr for empty objects.
+	Metrics::Gauge *running_calls;	// Received calls that have not returned yet.
+	Metrics::Gauge *waiting_calls;	// Sent calls that wait for a reply.
+	static Metrics::Gauge *running_metric(Loop *loop) { return &Loop::get(loop)->metrics().gauge("webloop_rpc_calls_running", "Received RPC calls that have not returned yet."); }
+	static Metrics::Gauge *waiting_metric(Loop *loop) { return &Loop::get(loop)->metrics().gauge("webloop_rpc_calls_waiting", "Sent RPC calls that wait for a reply."); }
 
-	int get_index();
 	bool activate();
 	void recv(std::string const &frame);
+	void handle_packet(std::shared_ptr <WebObject> data, bool in_batch);
 	void send(std::string const &code, std::shared_ptr <WebObject> object);
 	void called(std::shared_ptr <WebObject> id, std::string const &target, std::shared_ptr <WebVector> args, std::shared_ptr <WebMap> kwargs);
 	void disconnect_handler() { if (disconnect_cb) (user->*disconnect_cb)(); }
 	void error_handler(std::string const &message) { if (error_cb) (user->*error_cb)(message); }
+	void drain_handler() { if (drain_cb) (user->*drain_cb)(); }
+	void connect_handler() { if (connect_cb) (user->*connect_cb)(); }
 public:
 	Websocket <RPC <UserType> > websocket;
 
 	void set_disconnect_cb(DisconnectCb cb) { disconnect_cb = cb; }
 	void set_error_cb(ErrorCb cb) { error_cb = cb; }
+	// The drain callback is called when the output queue was congested and has drained; see is_congested().
+	void set_drain_cb(DrainCb cb) { drain_cb = cb; }
+	// The connect callback is called when the handshake of a client connection has completed; if the connection fails, the error and disconnect callbacks are called instead.
+	void set_connect_cb(ConnectCb cb) { connect_cb = cb; }
+	bool is_congested() const { return websocket.is_congested(); }
+	// A client connection is not open until the handshake has completed; calls made before that are lost.
+	bool is_open() const { return websocket.is_open(); }
+	// Wait until a client connection is open; use with YieldFrom. The result is a WebBool, which is false if the connection failed.
+	coroutine wait_for_init() { return websocket.wait_for_init(); }
+	// Received JSON packets that nest vectors and maps deeper than this are dropped; the default is 64.
+	void set_max_depth(size_t depth) { max_depth = depth; }
+	// Collect outgoing packets into one batch packet per loop iteration; see the class documentation.
+	void set_batching(bool enable) { if (!enable) flush_batch(); batching = enable; }
+	// Limits on calls; see the class documentation.  0 means no limit, which is the default, except for max_queued, which is 1024.
+	void set_max_inbound(size_t limit) { max_inbound = limit; update_credit(); }
+	void set_max_queued(size_t limit) { max_queued = limit; }
+	void set_max_outbound(size_t limit) { max_outbound = limit; }
+	Stats get_stats() const { return {called_data.size(), delayed_calls.size(), pending.size(), credit_queue.size(), peer_credit, rejected_calls}; }
 	void disconnect() { websocket.disconnect(); }
 
 	// Empty constructor, for moving a connected object into.
-	RPC() : disconnect_cb(nullptr), error_cb(nullptr), activation_handle(Loop::get()->invalid_idle()), activated(false), user(nullptr), reply_index(0), expecting_reply_bg{}, expecting_reply_fg{}, delayed_calls{}, called_data{}, websocket{} {}
+	RPC() : disconnect_cb(nullptr), error_cb(nullptr), drain_cb(nullptr), connect_cb(nullptr), activation_handle(Loop::get()->invalid_deferred()), activated(false), user(nullptr), binary_wanted(false), binary(false), send_buffer{}, max_depth(64), batching(false), batch_binary(false), batch_count(0), batch_buffer{}, batch_handle(Loop::get()->invalid_deferred()), pending{}, max_outbound(0), peer_credit(-1), credit_queue{}, max_inbound(0), max_queued(1024), advertised_credit(0), rejected_calls(0), delayed_calls{}, called_data{}, dispatch{}, dispatch_source(nullptr), dispatch_generation(0), running_calls(nullptr), waiting_calls(nullptr), websocket{} {}
 	// Constructor to connect to host.
 	RPC(std::string const &address, UserType *user = nullptr, Websocket <RPC <UserType> >::ConnectSettings const &connect_settings = {}, Websocket <RPC <UserType> >::RunSettings const &run_settings = {.loop = nullptr, .keepalive = 50s});
 	~RPC() { // {{{
 		STARTFUNC;
-		if (activation_handle != Loop::get()->invalid_idle())
-			Loop::get(websocket.run_settings.loop)->remove_idle(activation_handle);
-		activation_handle = Loop::get()->invalid_idle();
+		flush_batch();
+		if (running_calls != nullptr) {
+			running_calls->add(-int64_t(called_data.size()));
+			waiting_calls->add(-int64_t(pending.size()));
+		}
+		if (activation_handle != Loop::get()->invalid_deferred())
+			Loop::get(websocket.run_settings.loop)->remove_deferred(activation_handle);
+		activation_handle = Loop::get()->invalid_deferred();
 	} // }}}
 
-	RPC(RPC <UserType> &&other) : disconnect_cb(other.disconnect_cb), error_cb(other.error_cb), activation_handle(Loop::get()->invalid_idle()), activated(other.activated), user(other.user), reply_index(other.reply_index), expecting_reply_bg(std::move(other.expecting_reply_bg)), expecting_reply_fg(std::move(other.expecting_reply_fg)), delayed_calls(std::move(other.delayed_calls)), called_data(std::move(other.called_data)), websocket(std::move(other.websocket)) { // {{{
+	RPC(RPC <UserType> &&other) : disconnect_cb(other.disconnect_cb), error_cb(other.error_cb), drain_cb(other.drain_cb), connect_cb(other.connect_cb), activation_handle(Loop::get()->invalid_deferred()), activated(other.activated), user(other.user), binary_wanted(other.binary_wanted), binary(other.binary), send_buffer{}, max_depth(other.max_depth), batching(other.batching), batch_binary(other.batch_binary), batch_count(other.batch_count), batch_buffer(std::move(other.batch_buffer)), batch_handle(Loop::get()->invalid_deferred()), pending(std::move(other.pending)), max_outbound(other.max_outbound), peer_credit(other.peer_credit), credit_queue(std::move(other.credit_queue)), max_inbound(other.max_inbound), max_queued(other.max_queued), advertised_credit(other.advertised_credit), rejected_calls(other.rejected_calls), delayed_calls(std::move(other.delayed_calls)), called_data(std::move(other.called_data)), dispatch(std::move(other.dispatch)), dispatch_source(other.dispatch_source), dispatch_generation(other.dispatch_generation), running_calls(other.running_calls), waiting_calls(other.waiting_calls), websocket(std::move(other.websocket)) { // {{{
 		STARTFUNC;
 		websocket.update_user(this);
-		if (other.activation_handle != Loop::get()->invalid_idle()) {
-			Webloop::Loop::get(websocket.run_settings.loop)->remove_idle(other.activation_handle);
-			other.activation_handle = Loop::get()->invalid_idle();
-			activation_handle = Loop::get(websocket.run_settings.loop)->add_idle(Loop::IdleRecord(this, &RPC <UserType>::activate));
-		}
+		// The calls are counted by this object now.
+		other.pending = Slab <Pending> ();
+		other.called_data.clear();
+		if (other.activation_handle != Loop::get()->invalid_deferred()) {
+			Webloop::Loop::get(websocket.run_settings.loop)->remove_deferred(other.activation_handle);
+			other.activation_handle = Loop::get()->invalid_deferred();
+			activation_handle = Loop::get(websocket.run_settings.loop)->defer(Loop::DeferRecord(this, &RPC <UserType>::activate));
+		}
+		if (other.batch_handle != Loop::get()->invalid_deferred()) {
+			Webloop::Loop::get(websocket.run_settings.loop)->remove_deferred(other.batch_handle);
+			other.batch_handle = Loop::get()->invalid_deferred();
+			batch_handle = Loop::get(websocket.run_settings.loop)->defer(Loop::DeferRecord(this, &RPC <UserType>::batch_task));
+		}
+		other.batch_count = 0;
 	} // }}}
 
 	RPC <UserType> &operator=(RPC <UserType> &&other) { // {{{
 		STARTFUNC;
-		if (activation_handle != Loop::get()->invalid_idle()) {
-			Loop::get(websocket.run_settings.loop)->remove_idle(activation_handle);
-			activation_handle = Loop::get()->invalid_idle();
+		if (activation_handle != Loop::get()->invalid_deferred()) {
+			Loop::get(websocket.run_settings.loop)->remove_deferred(activation_handle);
+			activation_handle = Loop::get()->invalid_deferred();
+		}
+		flush_batch();
+		if (running_calls != nullptr) {
+			running_calls->add(-int64_t(called_data.size()));
+			waiting_calls->add(-int64_t(pending.size()));
 		}
 		disconnect_cb = other.disconnect_cb;
 		error_cb = other.error_cb;
+		drain_cb = other.drain_cb;
+		connect_cb = other.connect_cb;
 		activated = other.activated;
 		user = other.user;
-		reply_index = other.reply_index;
-		expecting_reply_bg = std::move(other.expecting_reply_bg);
-		expecting_reply_fg = std::move(other.expecting_reply_fg);
+		binary_wanted = other.binary_wanted;
+		binary = other.binary;
+		max_depth = other.max_depth;
+		batching = other.batching;
+		batch_binary = other.batch_binary;
+		batch_count = other.batch_count;
+		batch_buffer = std::move(other.batch_buffer);
+		other.batch_count = 0;
+		pending = std::move(other.pending);
+		max_outbound = other.max_outbound;
+		peer_credit = other.peer_credit;
+		credit_queue = std::move(other.credit_queue);
+		max_inbound = other.max_inbound;
+		max_queued = other.max_queued;
+		advertised_credit = other.advertised_credit;
+		rejected_calls = other.rejected_calls;
 		delayed_calls = std::move(other.delayed_calls);
 		called_data = std::move(other.called_data);
+		dispatch = std::move(other.dispatch);
+		dispatch_source = other.dispatch_source;
+		dispatch_generation = other.dispatch_generation;
+		running_calls = other.running_calls;
+		waiting_calls = other.waiting_calls;
+		other.pending = Slab <Pending> ();
+		other.called_data.clear();
 		websocket = std::move(other.websocket);
 		websocket.update_user(this);
-		if (other.activation_handle != Loop::get()->invalid_idle()) {
-			Webloop::Loop::get(websocket.run_settings.loop)->remove_idle(other.activation_handle);
-			other.activation_handle = Loop::get()->invalid_idle();
-			activation_handle = Loop::get(websocket.run_settings.loop)->add_idle(Loop::IdleRecord(this, &RPC <UserType>::activate));
+		if (other.activation_handle != Loop::get()->invalid_deferred()) {
+			Webloop::Loop::get(websocket.run_settings.loop)->remove_deferred(other.activation_handle);
+			other.activation_handle = Loop::get()->invalid_deferred();
+			activation_handle = Loop::get(websocket.run_settings.loop)->defer(Loop::DeferRecord(this, &RPC <UserType>::activate));
+		}
+		if (other.batch_handle != Loop::get()->invalid_deferred()) {
+			Webloop::Loop::get(websocket.run_settings.loop)->remove_deferred(other.batch_handle);
+			other.batch_handle = Loop::get()->invalid_deferred();
+			batch_handle = Loop::get(websocket.run_settings.loop)->defer(Loop::DeferRecord(this, &RPC <UserType>::batch_task));
 		}
 		return *this;
 	} // }}}
 
-	void update_user(UserType *new_user) { user = new_user; }
+	void update_user(UserType *new_user) { user = new_user; dispatch_source = nullptr; }
+	// Rebuild the dispatch table before the next call.  This is not needed for changes to user->published; they are always seen.
+	void refresh_published() { dispatch_source = nullptr; }
 
 	// Constructor for use by accepted sockets through Httpd.
 	template <class ConnectionType> explicit RPC(ConnectionType &connection, UserType *user);
 
 	// RPC calls.
 	void bgcall(std::string const &target, std::shared_ptr <WebVector> args = {}, std::shared_ptr <WebMap> kwargs = {}, BgReply reply = nullptr);
+	// Make a call without a reply, that was encoded once for all connections. Slow peers are handled by the broadcast policy of the websocket.
+	// Returns false if the call was not sent (yet), or if the connection is closed or congested.
+	bool broadcast(RPCBroadcast &message);
+	void set_broadcast_policy(BroadcastMessage::Policy policy) { websocket.set_broadcast_policy(policy); }
 	coroutine fgcall(std::string const &target, std::shared_ptr <WebVector> args = {}, std::shared_ptr <WebMap> kwargs = {});
 
 	// For debugging.
 	void print_expecting(std::string const &msg) {
 		//*
 		WL_log("expecting for " + msg + " of " + websocket.get_name() + ":");
-		for (auto fgid: expecting_reply_fg)
-			WL_log("fg: " + std::to_string(fgid.first));
-		for (auto bgid: expecting_reply_bg)
-			WL_log("bg: " + std::to_string(bgid.first));
+		pending.for_each([](uint64_t id, Pending const &p) { WL_log((p.fg ? "fg: " : "bg: ") + std::to_string(id)); });
 		WL_log("end of list");
 		//*/
 	}
 }; // }}}
 
 // RPC internals. {{{
-template <class UserType>
-int RPC <UserType>::get_index() { // {{{
-	STARTFUNC;
-	WL_log("this: " + std::to_string((long)this));
-	++reply_index;
-	//print_expecting("creating reply index");
-	while (expecting_reply_bg.contains(reply_index) || expecting_reply_fg.contains(reply_index) || reply_index == 0)
-		++reply_index;
-	return reply_index;
+template <class UserType> template <class Headers>
+bool RPC <UserType>::binary_requested(Headers const &headers, URL const &url) { // {{{
+	// Header names are compared case insensitively, because they are lower case for accepted connections, but not for sent_headers.
+	for (auto &h: headers) {
+		if (lower(std::string(h.first)) == "x-webloop-codec" && lower(strip(std::string(h.second))) == "binary")
+			return true;
+	}
+	auto q = url.query.find("codec");
+	return q != url.query.end() && q->second == "binary";
 } // }}}
 
 template <class UserType>
@@ -1775,14 +3236,21 @@ bool RPC <UserType>::activate() { // {{{
 	/* Internal use only.  Activate the websocket; send initial frames.
 	@return None.
 	*/
-	activation_handle = Loop::get()->invalid_idle();
-	while (!delayed_calls.empty()) {
-		auto calls = std::move(delayed_calls);
-		delayed_calls.clear();
-		for (auto this_call: calls)
+	activation_handle = Loop::get()->invalid_deferred();
+	activated = true;
+	// Start queued calls, as far as the limit allows. The rest is started when running calls finish.
+	while (!delayed_calls.empty() && (max_inbound == 0 || called_data.size() < max_inbound)) {
+		Call this_call = std::move(delayed_calls.front());
+		delayed_calls.pop_front();
+		try {
 			called(this_call.code, this_call.target, this_call.args, this_call.kwargs);
+		}
+		catch (...) {
+			WL_log("error: remote call failed");
+			send("error", WebVector::create(this_call.code, WebString::create("remote call failed")));
+		}
 	}
-	activated = true;
+	update_credit();
 	return false;
 } // }}}
 
@@ -1795,7 +3263,41 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 	*/
 	if (DEBUG > 2)
 		WL_log("frame: " + frame);
-	auto data = WebObject::load(frame);
+	std::shared_ptr <WebObject> data;
+	if (websocket.get_opcode() == 2) {
+		try {
+			data = WebObject::load_binary(frame);
+		}
+		catch (char const *msg) {
+			// Don't send errors back for unknown things, to lower risk of loops.
+			WL_log(std::string("error: invalid binary frame: ") + msg);
+			return;
+		}
+		// The server accepted the request for binary packets.
+		if (binary_wanted)
+			binary = true;
+	}
+	else {
+		try {
+			data = WebObject::load(frame, max_depth);
+		}
+		catch (char const *msg) {
+			// Don't send errors back for unknown things, to lower risk of loops.
+			WL_log(std::string("error: invalid JSON frame: ") + msg);
+			return;
+		}
+	}
+	handle_packet(data, false);
+} // }}}
+
+template <class UserType>
+void RPC <UserType>::handle_packet(std::shared_ptr <WebObject> data, bool in_batch) { // {{{
+	STARTFUNC;
+	/* Handle a received packet.
+	@param data: The decoded packet.
+	@param in_batch: True if the packet was part of a batch; batches cannot be nested.
+	@return None.
+	*/
 	if (DEBUG > 1)
 		WL_log("packet received: " + data->print());
 	if (data->get_type() != WebObject::VECTOR) {
@@ -1811,8 +3313,49 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 		return;
 	}
 	std::string const &ptype = *(*vdata)[0]->as_string();
+	// The packet types have different lengths, so only one compare is needed.
+	char kind = 0;
+	switch (ptype.size()) {
+	case 4:
+		kind = ptype == "call" ? 'c' : 0;
+		break;
+	case 5:
+		kind = ptype == "error" ? 'e' : ptype == "batch" ? 'b' : 0;
+		break;
+	case 6:
+		kind = ptype == "return" ? 'r' : ptype == "credit" ? 'k' : 0;
+		break;
+	}
+
+	if (kind == 'b') { // string:"batch", WebVector:packets {{{
+		if (in_batch || length != 2 || (*vdata)[1]->get_type() != WebObject::VECTOR) {
+			WL_log("error: invalid batch");
+			return;
+		}
+		auto packets = (*vdata)[1]->as_vector();
+		for (size_t i = 0; i < packets->size(); ++i)
+			handle_packet((*packets)[i], true);
+		return;
+	} // }}}
+
+	if (kind == 'k') { // string:"credit", int:count {{{
+		if (length != 2 || (*vdata)[1]->get_type() != WebObject::INT || *(*vdata)[1]->as_int() <= 0) {
+			WL_log("error: invalid credit");
+			return;
+		}
+		if (peer_credit < 0)
+			peer_credit = 0;
+		peer_credit = std::min <int64_t> (peer_credit + *(*vdata)[1]->as_int(), int64_t(1) << 40);
+		while (peer_credit > 0 && !credit_queue.empty()) {
+			auto call = std::move(credit_queue.front());
+			credit_queue.pop_front();
+			--peer_credit;
+			send("call", call);
+		}
+		return;
+	} // }}}
 
-	if (ptype == "error") { // string:"error", int:id, string:message {{{
+	if (kind == 'e') { // string:"error", int:id, string:message {{{
 		// Returning error on error is a looping risk, so any errors here are only logged to the user, not sent over the network.
 		if (DEBUG > 0)
 			WL_log("error frame received");
@@ -1821,32 +3364,33 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 			return;
 		}
 		auto payload = (*vdata)[length - 1];
+		std::shared_ptr <WebObject> idobj = length == 3 ? (*vdata)[1] : nullptr;
+		if (length == 2 && payload->get_type() == WebObject::VECTOR && payload->as_vector()->size() == 2) {
+			// Errors for failed calls are sent as ["error", [id, message]].
+			idobj = (*payload->as_vector())[0];
+			payload = (*payload->as_vector())[1];
+			if (idobj->get_type() == WebObject::NONE)
+				idobj = nullptr;
+		}
 		if (payload->get_type() != WebObject::STRING) {
 			WL_log("error payload is not a string");
 			return;
 		}
 
 		// Remove request from queue if an id was provided.
-		int id = 0;
-		if (length == 3) {
-			WL_log("error received");
-			print_expecting("error received");
-			auto idobj = (*vdata)[1];
+		WebObject::IntType id = 0;
+		if (idobj != nullptr) {
+			if (DEBUG > 2)
+				print_expecting("error received");
 			if (idobj->get_type() != WebObject::INT) {
 				WL_log("error id is not int");
 				return;
 			}
 			id = *idobj->as_int();
-			auto p = expecting_reply_bg.find(id);
-			if (p != expecting_reply_bg.end())
-				expecting_reply_bg.erase(p);
-			else {
-				auto q = expecting_reply_fg.find(id);
-				if (q != expecting_reply_fg.end())
-					expecting_reply_fg.erase(q);
-				else
-					WL_log("warning: error reply for unknown id");
-			}
+			if (!pending.erase(id))
+				WL_log("warning: error reply for unknown id");
+			else
+				waiting_calls->add(-1);
 		}
 
 		// Call error handler or throw exception.
@@ -1858,7 +3402,7 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 		return;
 	} // }}}
 
-	if (ptype == "return") { // string:"return", int:id, WebObject:value {{{
+	if (kind == 'r') { // string:"return", int:id, WebObject:value {{{
 		if (DEBUG > 2)
 			WL_log("return received");
 		//print_expecting("return received");
@@ -1882,31 +3426,29 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 			WL_log("return id is not int");
 			return;
 		}
-		int id = *idobj->as_int();
+		WebObject::IntType id = *idobj->as_int();
 
-		auto p = expecting_reply_bg.find(id);
-		if (p == expecting_reply_bg.end()) {
-			auto q = expecting_reply_fg.find(id);
-			if (q == expecting_reply_fg.end()) {
-				WL_log("invalid return id received: " + std::to_string(id));
-				print_expecting("invalid return id");
-				return;
-			}
+		Pending *p = pending.find(id);
+		if (p == nullptr) {
+			WL_log("invalid return id received: " + std::to_string(id));
+			print_expecting("invalid return id");
+			return;
+		}
+		Pending call = *p;
+		pending.erase(id);
+		waiting_calls->add(-1);
+		if (call.fg) {
 			// This is the return call of a fgcall().
-			auto handle = q->second;
-			expecting_reply_fg.erase(q);
-			coroutine::activate(&handle, payload);
+			coroutine::activate(&call.fg, payload);
 			return;
 		}
 
 		// This is the return call of a bgcall().
-		auto target = p->second;
-		expecting_reply_bg.erase(p);
-		(user->*target)(payload);
+		(user->*call.bg)(payload);
 		return;
 	} // }}}
 
-	if (ptype == "call") { // string:"call", int:id, string:target, WebVector:args, WebMap:kwargs {{{
+	if (kind == 'c') { // string:"call", int:id, string:target, WebVector:args, WebMap:kwargs {{{
 		if (length != 2 || (*vdata)[1]->get_type() != WebObject::VECTOR) {
 			WL_log("call did not get only a vector argument");
 			return;
@@ -1932,7 +3474,7 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 			WL_log("call kwargs is not map");
 			return;
 		}
-		std::string target = *targetobj->as_string();
+		std::string const &target = *targetobj->as_string();
 		auto args = std::dynamic_pointer_cast <WebVector> (argsobj);
 		auto kwargs = std::dynamic_pointer_cast <WebMap> (kwargsobj);
 		auto idtype = idobj->get_type();
@@ -1940,7 +3482,9 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 			WL_log("call id is not int or none");
 			return;
 		}
-		if (activated) {
+		if (advertised_credit > 0)
+			--advertised_credit;
+		if (activated && delayed_calls.empty() && (max_inbound == 0 || called_data.size() < max_inbound)) {
 			try {
 				called(idobj, target, args, kwargs);
 			}
@@ -1949,8 +3493,16 @@ void RPC <UserType>::recv(std::string const &frame) { // {{{
 				send("error", WebVector::create(idobj, WebString::create("remote call failed")));
 			}
 		}
+		else if (delayed_calls.size() >= max_queued) {
+			// Refuse the call instead of queueing without limit. A peer that respects credit does not get here.
+			++rejected_calls;
+			WL_log("warning: too many queued calls; refusing call");
+			if (idtype != WebObject::NONE)
+				send("error", WebVector::create(idobj, WebString::create("too many calls")));
+		}
 		else
 			delayed_calls.push_back(Call(idobj, target, args, kwargs, user));
+		update_credit();
 		return;
 	} // }}}
 
@@ -1968,16 +3520,161 @@ void RPC <UserType>::send(std::string const &code, std::shared_ptr <WebObject> o
 	*/
 	if (DEBUG > 1)
 		WL_log((std::ostringstream() << "sending: " << " " << object->print()).str());
-	auto obj = WebVector::create(WebString::create(code), object);
-	websocket.send(obj->dump());
+	if (batching) {
+		begin_batch_packet();
+		if (batch_binary) {
+			batch_buffer += "V\x02";
+			WebString::dump_binary_string(code, batch_buffer);
+			object->dump_binary(batch_buffer);
+		}
+		else {
+			batch_buffer += '[';
+			WebString::dump_string(code, batch_buffer);
+			batch_buffer += ',';
+			object->dump_to(batch_buffer);
+			batch_buffer += ']';
+		}
+		end_batch_packet();
+		return;
+	}
+	// The packet is [code, object]; write that envelope directly instead of building a WebVector for it.
+	// The buffer is kept between calls, so its capacity is reused and sending does not normally allocate.
+	send_buffer.clear();
+	if (binary) {
+		send_buffer += "V\x02";
+		WebString::dump_binary_string(code, send_buffer);
+		object->dump_binary(send_buffer);
+	}
+	else {
+		send_buffer += '[';
+		WebString::dump_string(code, send_buffer);
+		send_buffer += ',';
+		object->dump_to(send_buffer);
+		send_buffer += ']';
+	}
+	websocket.send(send_buffer, binary ? 2 : 1);
+	// Don't keep a huge buffer around after sending one large packet.
+	if (send_buffer.capacity() > max_send_buffer)
+		std::string().swap(send_buffer);
+} // }}}
+
+template <class UserType>
+void RPC <UserType>::begin_batch_packet() { // {{{
+	STARTFUNC;
+	// Prepare batch_buffer for appending a packet.
+	if (batch_count == 0) {
+		// Start a new batch. The header is written in front of the packets by flush_batch().
+		batch_binary = binary;
+		batch_buffer.assign(batch_header_room, '\0');
+		if (batch_handle == Loop::get()->invalid_deferred())
+			batch_handle = Loop::get(websocket.run_settings.loop)->defer(Loop::DeferRecord(this, &RPC <UserType>::batch_task));
+	}
+	else if (!batch_binary)
+		batch_buffer += ',';
+} // }}}
+
+template <class UserType>
+void RPC <UserType>::end_batch_packet() { // {{{
+	STARTFUNC;
+	++batch_count;
+	// Don't let a batch grow without limit.
+	if (batch_buffer.size() > max_send_buffer)
+		flush_batch();
+} // }}}
+
+template <class UserType>
+void RPC <UserType>::flush_batch() { // {{{
+	STARTFUNC;
+	/* Send the collected packets as one batch packet.
+	This is called from a deferred task at the end of the loop iteration in which the batch was started.
+	@return None.
+	*/
+	if (batch_handle != Loop::get()->invalid_deferred()) {
+		Loop::get(websocket.run_settings.loop)->remove_deferred(batch_handle);
+		batch_handle = Loop::get()->invalid_deferred();
+	}
+	if (batch_count == 0)
+		return;
+	// Write the header, ["batch",[ or its binary equivalent, right in front of the packets.
+	std::string header;
+	if (batch_binary) {
+		header = "V\x02";
+		WebString::dump_binary_string("batch", header);
+		header += 'V';
+		for (size_t n = batch_count; true; n >>= 7) {
+			if (n < 0x80) {
+				header += char(n);
+				break;
+			}
+			header += char(0x80 | (n & 0x7f));
+		}
+	}
+	else {
+		header = "[\"batch\",[";
+		batch_buffer += "]]";
+	}
+	assert(header.size() <= batch_header_room);
+	size_t start = batch_header_room - header.size();
+	batch_buffer.replace(start, header.size(), header);
+	batch_count = 0;
+	websocket.send(std::string_view(batch_buffer).substr(start), batch_binary ? 2 : 1);
+	if (batch_buffer.capacity() > max_send_buffer * 2)
+		std::string().swap(batch_buffer);
 } // }}}
 
 template <class UserType>
 void RPC <UserType>::CalledData::called_return(std::shared_ptr <WebObject> ret) { // {{{
 	STARTFUNC;
 	// "this" is invalidated by the erase() call, so do that last.
-	rpc->send("return", WebVector::create(WebInt::create(id), ret));
-	rpc->called_data.erase(iterator);
+	auto owner = rpc;
+	if (reply)
+		owner->send("return", WebVector::create(WebInt::create(id), ret));
+	latency->record(std::chrono::steady_clock::now() - start);
+	owner->running_calls->add(-1);
+	owner->called_data.erase(iterator);
+	owner->call_finished();
+} // }}}
+
+template <class UserType>
+void RPC <UserType>::call_finished() { // {{{
+	STARTFUNC;
+	// A call has finished, so a queued call can be started, or more credit can be given.
+	// Queued calls are started from a deferred task, so that finishing many calls does not recurse.
+	if (!delayed_calls.empty() && activated && activation_handle == Loop::get()->invalid_deferred())
+		activation_handle = Loop::get(websocket.run_settings.loop)->defer(Loop::DeferRecord(this, &RPC <UserType>::activate));
+	update_credit();
+} // }}}
+
+template <class UserType>
+void RPC <UserType>::update_credit() { // {{{
+	STARTFUNC;
+	/* Tell the peer how many more calls it may send, if that has changed enough.
+	@return None.
+	*/
+	if (max_inbound == 0 || !activated || !websocket.is_open())
+		return;
+	size_t busy = called_data.size() + delayed_calls.size();
+	size_t target = busy >= max_inbound ? 0 : max_inbound - busy;
+	if (target <= advertised_credit)
+		return;
+	// Don't send a packet for every finished call, unless the peer has run out.
+	if (advertised_credit > 0 && target - advertised_credit < std::max <size_t> (1, max_inbound / 4))
+		return;
+	send("credit", WebInt::create(target - advertised_credit));
+	advertised_credit = target;
+} // }}}
+
+template <class UserType>
+void RPC <UserType>::send_call(std::shared_ptr <WebObject> call) { // {{{
+	STARTFUNC;
+	// Send a call packet, or queue it if the peer has not given credit for it.
+	if (peer_credit == 0) {
+		credit_queue.push_back(call);
+		return;
+	}
+	if (peer_credit > 0)
+		--peer_credit;
+	send("call", call);
 } // }}}
 
 template <class UserType>
@@ -1997,17 +3694,43 @@ void RPC <UserType>::called(std::shared_ptr <WebObject> id, std::string const &t
 	auto pub = user->published;
 	if (!pub)
 		throw "no targets defined; unable to call";
-	auto co = pub->find(target);
-	if (co == pub->end() && user->published_fallback == nullptr) {
+	Metrics &metrics = Loop::get(websocket.run_settings.loop)->metrics();
+	typename DispatchTable <Published>::Slot const *slot;
+	if constexpr (requires { pub->generation(); }) {
+		if (dispatch_source != pub || dispatch_generation != pub->generation()) {
+			dispatch.build(pub, metrics);
+			dispatch_source = pub;
+			dispatch_generation = pub->generation();
+		}
+		slot = dispatch.find(target);
+	}
+	else {
+		if (dispatch_source != pub) {
+			dispatch.build(pub, metrics);
+			dispatch_source = pub;
+		}
+		slot = dispatch.find(target);
+		// The map may have changed since the table was built; only the map itself says what is published.
+		auto p = pub->find(target);
+		if (p == pub->end() || p->second == nullptr)
+			slot = nullptr;
+		else if (slot == nullptr || slot->target != p->second) {
+			dispatch.build(pub, metrics);
+			slot = dispatch.find(target);
+		}
+	}
+	if (slot == nullptr && user->published_fallback == nullptr) {
 		// Fail.
 		throw "trying to call unregistered target";
 	}
-	auto c = (co == pub->end() ? (user->*user->published_fallback)(target, args, kwargs) : (user->*co->second)(args, kwargs));
-	if (id->get_type() != WebObject::NONE) {
-		called_data.emplace_back(called_data.end(), this, int(*id->as_int()));
-		called_data.back().iterator = --called_data.end();
-		c.set_cb(&called_data.back(), &CalledData::called_return);
-	}
+	Loop::Time start = std::chrono::steady_clock::now();
+	auto c = (slot == nullptr ? (user->*user->published_fallback)(target, args, kwargs) : (user->*slot->target)(args, kwargs));
+	// All calls are tracked until they finish, so the number of running calls can be limited.
+	bool reply = id->get_type() != WebObject::NONE;
+	called_data.emplace_back(called_data.end(), this, reply ? WebObject::IntType(*id->as_int()) : 0, reply, start, slot == nullptr ? dispatch.fallback_latency : slot->latency);
+	running_calls->add();
+	called_data.back().iterator = --called_data.end();
+	c.set_cb(&called_data.back(), &CalledData::called_return);
 	c();	// Start coroutine.
 	return;
 } // }}}
@@ -2016,14 +3739,35 @@ template <class UserType>
 RPC <UserType>::RPC(std::string const &address, UserType *user, Websocket <RPC <UserType> >::ConnectSettings const &connect_settings, Websocket <RPC <UserType> >::RunSettings const &run_settings) : // {{{
 		disconnect_cb(),
 		error_cb(),
-		activation_handle(Loop::get()->invalid_idle()),
+		drain_cb(),
+		connect_cb(),
+		activation_handle(Loop::get()->invalid_deferred()),
 		activated(false),
 		user(user),
-		reply_index(0),
-		expecting_reply_bg(),
-		expecting_reply_fg(),
+		binary_wanted(binary_requested(connect_settings.sent_headers, URL(address))),
+		binary(false),
+		send_buffer(),
+		max_depth(64),
+		batching(false),
+		batch_binary(false),
+		batch_count(0),
+		batch_buffer(),
+		batch_handle(Loop::get()->invalid_deferred()),
+		pending(),
+		max_outbound(0),
+		peer_credit(-1),
+		credit_queue(),
+		max_inbound(0),
+		max_queued(1024),
+		advertised_credit(0),
+		rejected_calls(0),
 		delayed_calls{},
 		called_data(),
+		dispatch(),
+		dispatch_source(nullptr),
+		dispatch_generation(0),
+		running_calls(running_metric(run_settings.loop)),
+		waiting_calls(waiting_metric(run_settings.loop)),
 		websocket(address, connect_settings, this, &RPC <UserType>::recv, run_settings)
 {
 	STARTFUNC;
@@ -2035,29 +3779,54 @@ RPC <UserType>::RPC(std::string const &address, UserType *user, Websocket <RPC <
 	@param recv: Function (or class) that receives this object as
 		an argument and returns a communication object.
 	*/
-	// Note: not thread-safe.
+	// Note: not thread-safe; use Loop::post() to pass work to the thread that runs the loop of this object.
 	websocket.set_disconnect_cb(&RPC <UserType>::disconnect_handler);
 	websocket.set_error_cb(&RPC <UserType>::error_handler);
-	activation_handle = Loop::get(run_settings.loop)->add_idle(Loop::IdleRecord(this, &RPC <UserType>::activate));
+	websocket.set_drain_cb(&RPC <UserType>::drain_handler);
+	websocket.set_connect_cb(&RPC <UserType>::connect_handler);
+	activation_handle = Loop::get(run_settings.loop)->defer(Loop::DeferRecord(this, &RPC <UserType>::activate));
 } // }}}
 
 template <class UserType> template <class ConnectionType>
 RPC <UserType>::RPC(ConnectionType &connection, UserType *user) : // {{{
 		disconnect_cb(),
 		error_cb(),
-		activation_handle(Loop::get()->invalid_idle()),
+		drain_cb(),
+		connect_cb(),
+		activation_handle(Loop::get()->invalid_deferred()),
 		activated(true),
 		user(user),
-		reply_index(0),
-		expecting_reply_bg(),
-		expecting_reply_fg(),
+		binary_wanted(binary_requested(connection.received_headers, connection.url)),
+		binary(binary_wanted),
+		send_buffer(),
+		max_depth(64),
+		batching(false),
+		batch_binary(false),
+		batch_count(0),
+		batch_buffer(),
+		batch_handle(Loop::get()->invalid_deferred()),
+		pending(),
+		max_outbound(0),
+		peer_credit(-1),
+		credit_queue(),
+		max_inbound(0),
+		max_queued(1024),
+		advertised_credit(0),
+		rejected_calls(0),
 		delayed_calls{},
 		called_data(),
+		dispatch(),
+		dispatch_source(nullptr),
+		dispatch_generation(0),
+		running_calls(running_metric(connection.httpd->get_loop())),
+		waiting_calls(waiting_metric(connection.httpd->get_loop())),
 		websocket(std::move(connection.socket), this, &RPC <UserType>::recv, {connection.httpd->get_loop(), connection.httpd->get_keepalive()})
 {
 	STARTFUNC;
+	websocket.set_deflate(std::move(connection.deflate));
 	websocket.set_disconnect_cb(&RPC <UserType>::disconnect_handler);
 	websocket.set_error_cb(&RPC <UserType>::error_handler);
+	websocket.set_drain_cb(&RPC <UserType>::drain_handler);
 } // }}}
 
 template <class UserType>
@@ -2073,17 +3842,43 @@ void RPC <UserType>::bgcall( // {{{
 		args = WebVector::create();
 	if (!kwargs)
 		kwargs = WebMap::create();
-	int index;
+	if (max_outbound != 0 && pending.size() + credit_queue.size() >= max_outbound)
+		throw "too many pending RPC calls";
+	uint64_t index;
 	if (reply) {
-		index = get_index();
-		expecting_reply_bg[index] = reply;
+		index = pending.insert(Pending{reply, nullptr});
+		waiting_calls->add();
 	}
 	else
 		index = 0;
 	if (DEBUG > 3)
 		WL_log("sending bg call");
 	//print_expecting("send bg call");
-	send("call", WebVector::create(index == 0 ? std::dynamic_pointer_cast <WebObject> (WebNone::create()) : std::dynamic_pointer_cast <WebObject> (WebInt::create(index)), WebString::create(target), args, kwargs));
+	send_call(WebVector::create(index == 0 ? std::dynamic_pointer_cast <WebObject> (WebNone::create()) : std::dynamic_pointer_cast <WebObject> (WebInt::create(index)), WebString::create(target), args, kwargs));
+} // }}}
+
+template <class UserType>
+bool RPC <UserType>::broadcast(RPCBroadcast &message) { // {{{
+	STARTFUNC;
+	if (!websocket.is_open())
+		return false;
+	if (peer_credit == 0) {
+		// Like bgcall(), but a full queue drops the call instead of throwing.
+		if (max_outbound != 0 && pending.size() + credit_queue.size() >= max_outbound)
+			return false;
+		credit_queue.push_back(message.call());
+		return false;
+	}
+	if (peer_credit > 0)
+		--peer_credit;
+	if (batching) {
+		// Copy the packet into the batch; it still doesn't need to be encoded again.
+		begin_batch_packet();
+		batch_buffer += message.message(batch_binary).payload();
+		end_batch_packet();
+		return true;
+	}
+	return websocket.send(message.message(binary));
 } // }}}
 
 template <class UserType>
@@ -2093,13 +3888,14 @@ coroutine RPC <UserType>::fgcall(std::string const &target, std::shared_ptr <Web
 		args = WebVector::create();
 	if (!kwargs)
 		kwargs = WebMap::create();
-	WL_log("this: " + std::to_string((long)this));
-	int index = get_index();
-	expecting_reply_fg[index] = GetHandle();
+	if (max_outbound != 0 && pending.size() + credit_queue.size() >= max_outbound)
+		throw "too many pending RPC calls";
+	uint64_t index = pending.insert(Pending{nullptr, GetHandle()});
+	waiting_calls->add();
 	if (DEBUG > 4)
 		WL_log("sending fg call");
 	//print_expecting("send fg call");
-	send("call", WebVector::create(WebInt::create(index), WebString::create(target), args, kwargs));
+	send_call(WebVector::create(WebInt::create(index), WebString::create(target), args, kwargs));
 	auto ret = Yield(WebNone::create());
 	if (DEBUG > 4)
 		WL_log("fgcall returns " + (ret ? ret->print() : "nothing"));
@@ -3,7 +3,7 @@
 namespace Webloop {
 
 std::shared_ptr <WebObject> *debug_ptr;
-int coroutine::next_name_id;
+std::atomic <int> coroutine::next_name_id;
 
 // Final suspend awaiter for all coroutines: make continuation run, if it exists.
 std::coroutine_handle <> FinalSuspendAwaitable::await_suspend(coroutine::handle_type handle) noexcept { // {{{
@@ -26,6 +26,13 @@ std::coroutine_handle <> FinalSuspendAwaitable::await_suspend(coroutine::handle_
 	// Store return value into target.
 	auto *target = &continuation.promise();
 	target->to_coroutine.swap(promise->from_coroutine);
+	// If this coroutine was resumed by activate(), because it waited for an event, the continuation now runs on behalf of that call.
+	// That caller must not touch this handle anymore, and the continuation reports its own completion to it.
+	if (promise->is_done != nullptr) {
+		*promise->is_done = true;
+		target->is_done = promise->is_done;
+		target->retval = promise->retval;
+	}
 
 	// Return into new coroutine.
 	handle.destroy();
@@ -89,6 +96,7 @@ std::shared_ptr <WebObject> YieldAwaiter::await_resume() noexcept { // {{{
 // Suspend a coroutine using YieldFrom.
 coroutine::handle_type YieldFromAwaiter::await_suspend(coroutine::handle_type handle) noexcept { // {{{
 	STARTFUNC;
+	this->handle = handle;
 	target_handle.promise().set_continuation(handle);
 	return target_handle;
 } // }}}
@@ -96,8 +104,9 @@ coroutine::handle_type YieldFromAwaiter::await_suspend(coroutine::handle_type ha
 // Resume a coroutine that was suspended using YieldFrom.
 std::shared_ptr <WebObject> YieldFromAwaiter::await_resume() noexcept { // {{{
 	STARTFUNC;
+	// The target has been destroyed; it left its return value in the waiting coroutine.
 	std::shared_ptr <WebObject> ret;
-	my_handle.promise().to_coroutine.swap(ret);
+	handle.promise().to_coroutine.swap(ret);
 	return ret;
 } // }}}
 
@@ -1138,6 +1138,11 @@ static std::filesystem::path get_temp_name(std::string const &name) { // {{{
 	return _temp_file_dir / n.str();
 } // }}}
 
+std::filesystem::path write_temp_name(std::string const &name) { // {{{
+	// Return a new name in the temporary directory; the file is not created.
+	return get_temp_name(name);
+} // }}}
+
 std::ofstream write_temp_file(std::string const &name) { // {{{
 	return std::ofstream(get_temp_name(name), std::ios::in | std::ios::out | std::ios::trunc | std::ios::noreplace | std::ios::binary);
 } // }}}
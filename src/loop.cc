@@ -1,12 +1,250 @@
 #include "webloop/loop.hh"
 #include "webloop/tools.hh"
 #include <cassert>
+#include <cstdlib>
+#include <bit>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 using namespace std::literals;
 
 namespace Webloop {
 
-int Loop::PollItems::add(IoRecord const &item) { // {{{
+// Backends. {{{
+struct PollBackend : public Loop::Backend { // {{{
+	// Portable fallback: this passes all registered fds to poll() on every iteration.
+	std::vector <struct pollfd> data;	// Index is the IoHandle; unused slots have fd -1, which poll() ignores.
+	char const *name() const override { return "poll"; }
+	void add(Loop::IoHandle handle, int fd, short events) override {
+		if (size_t(handle) >= data.size())
+			data.resize(handle + 1, {-1, 0, 0});
+		data[handle] = {fd, events, 0};
+	}
+	void remove(Loop::IoHandle handle, int fd) override {
+		(void)fd;
+		data[handle].fd = -1;
+		while (!data.empty() && data.back().fd < 0)
+			data.pop_back();
+	}
+	void wait(int timeout, std::vector <Event> &ready) override {
+		int num = poll(data.data(), data.size(), timeout);
+		for (size_t i = 0; num > 0 && i < data.size(); ++i) {
+			if (data[i].fd < 0 || data[i].revents == 0)
+				continue;
+			ready.push_back({Loop::IoHandle(i), data[i].revents, 0});
+			--num;
+		}
+	}
+}; // }}}
+
+#ifdef HAVE_SYS_EPOLL_H
+// The event bits are shared between poll and epoll on Linux, so they are passed through unchanged.
+static_assert(EPOLLIN == POLLIN && EPOLLPRI == POLLPRI && EPOLLOUT == POLLOUT && EPOLLERR == POLLERR && EPOLLHUP == POLLHUP);
+
+struct EpollBackend : public Loop::Backend { // {{{
+	// Level triggered epoll. Only ready fds are returned by the kernel, so the cost of a wakeup does not depend on the number of idle fds.
+	struct FdData {
+		uint32_t events;	// Union of requested events, as registered with the kernel.
+		std::vector <std::pair <Loop::IoHandle, short> > handles;	// Multiple records may use the same fd.
+	};
+	int epfd;
+	std::vector <FdData> fds;	// Index is the fd.
+	std::vector <Loop::IoHandle> always_ready;	// Records with fds that epoll does not support (regular files); poll() reports them as ready.
+	std::vector <short> always_ready_events;
+	std::vector <struct epoll_event> events;
+	EpollBackend() : epfd(epoll_create1(EPOLL_CLOEXEC)), events(64) {
+		if (epfd < 0)
+			throw "unable to create epoll fd";
+	}
+	~EpollBackend() { ::close(epfd); }
+	char const *name() const override { return "epoll"; }
+	void update(int fd, bool is_new) {
+		uint32_t ev = 0;
+		for (auto &h: fds[fd].handles)
+			ev |= h.second;
+		if (!is_new && ev == fds[fd].events)
+			return;
+		struct epoll_event e;
+		e.events = ev;
+		e.data.fd = fd;
+		if (is_new || epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e) < 0) {
+			// If the fd was closed and reused without removing it first, the kernel has already dropped it, so MOD fails.
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) < 0 && errno != EEXIST)
+				throw "unable to add fd to epoll";
+		}
+		fds[fd].events = ev;
+	}
+	void add(Loop::IoHandle handle, int fd, short events) override {
+		if (size_t(fd) >= fds.size())
+			fds.resize(fd + 1);
+		bool is_new = fds[fd].handles.empty();
+		fds[fd].handles.push_back({handle, events});
+		try {
+			update(fd, is_new);
+		}
+		catch (...) {
+			fds[fd].handles.pop_back();
+			if (errno != EPERM)
+				throw;
+			always_ready.push_back(handle);
+			always_ready_events.push_back(events);
+		}
+	}
+	void remove(Loop::IoHandle handle, int fd) override {
+		for (size_t i = 0; i < always_ready.size(); ++i) {
+			if (always_ready[i] != handle)
+				continue;
+			always_ready[i] = always_ready.back();
+			always_ready.pop_back();
+			always_ready_events[i] = always_ready_events.back();
+			always_ready_events.pop_back();
+			return;
+		}
+		auto &h = fds[fd].handles;
+		for (size_t i = 0; i < h.size(); ++i) {
+			if (h[i].first != handle)
+				continue;
+			h.erase(h.begin() + i);
+			break;
+		}
+		if (!h.empty()) {
+			update(fd, false);
+			return;
+		}
+		// Errors are ignored: if the fd was already closed, the kernel has removed it.
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+		fds[fd].events = 0;
+	}
+	void wait(int timeout, std::vector <Event> &ready) override {
+		if (!always_ready.empty())
+			timeout = 0;
+		int num = epoll_wait(epfd, events.data(), events.size(), timeout);
+		for (int i = 0; i < num; ++i) {
+			int fd = events[i].data.fd;
+			for (auto &h: fds[fd].handles) {
+				short ev = events[i].events & (h.second | POLLERR | POLLHUP);
+				if (ev)
+					ready.push_back({h.first, ev, 0});
+			}
+		}
+		if (size_t(num) == events.size())
+			events.resize(events.size() * 2);
+		for (size_t i = 0; i < always_ready.size(); ++i) {
+			short ev = always_ready_events[i] & (POLLIN | POLLOUT);
+			if (ev)
+				ready.push_back({always_ready[i], ev, 0});
+		}
+	}
+}; // }}}
+#endif
+
+Loop::Loop(BackendType type) : // {{{
+		running(false),
+		aborting(false),
+		idle{},
+		next_idle_item(idle.end()),
+		deferred(),
+		deferred_head(0),
+		deferred_base(1),
+		metric_data(),
+		iteration_time(metric_data.histogram("webloop_loop_iteration_seconds", "Time to handle the events of one loop iteration, without waiting for them.")),
+		timeout_lag(metric_data.histogram("webloop_timeout_lag_seconds", "Time between the scheduled time of a timeout and its callback.")),
+		posted(nullptr)
+{
+	if (type == BACKEND_DEFAULT) {
+		// Allow forcing the fallback, for debugging.
+		char const *env = std::getenv("WEBLOOP_BACKEND");
+		type = env && env == "poll"s ? BACKEND_POLL : BACKEND_EPOLL;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	if (type == BACKEND_EPOLL)
+		backend.reset(new EpollBackend());
+	else
+#endif
+		backend.reset(new PollBackend());
+	// Set up wakeups for post().
+#ifdef HAVE_SYS_EVENTFD_H
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0)
+		throw "unable to create eventfd";
+	wake_write_fd = wake_fd;
+#else
+	int fds[2];
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+		throw "unable to create wakeup pipe";
+	wake_fd = fds[0];
+	wake_write_fd = fds[1];
+#endif
+	wake_handle = add_io(IoRecord("loop wakeup", this, wake_fd, POLLIN, &Loop::run_posted, (bool (Loop::*)())nullptr, (bool (Loop::*)())nullptr));
+	if (!default_loop)
+		default_loop = this;
+} // }}}
+
+Loop::~Loop() { // {{{
+	if (default_loop == this)
+		default_loop = nullptr;
+	// Tasks that were never run are discarded.
+	PostNode *node = posted.exchange(nullptr);
+	while (node) {
+		PostNode *next = node->next;
+		delete node;
+		node = next;
+	}
+	::close(wake_fd);
+	if (wake_write_fd != wake_fd)
+		::close(wake_write_fd);
+} // }}}
+
+void Loop::post(std::function <void ()> &&task) { // {{{
+	// Push the task on the stack; only the push that makes the stack non-empty needs to wake the loop.
+	// The node must not be touched after it is pushed, because the loop may already have run and deleted it.
+	PostNode *old = posted.load(std::memory_order_relaxed);
+	PostNode *node = new PostNode {std::move(task), old};
+	while (!posted.compare_exchange_weak(old, node, std::memory_order_release, std::memory_order_relaxed))
+		node->next = old;
+	if (old != nullptr)
+		return;
+	// An eventfd needs an 8 byte counter; for a pipe, any byte will do.
+	uint64_t one = 1;
+	while (::write(wake_write_fd, &one, wake_write_fd == wake_fd ? sizeof(one) : 1) < 0 && errno == EINTR) {}
+} // }}}
+
+bool Loop::run_posted() { // {{{
+	// Clear the wakeup before taking the tasks, so a task that is posted after this is not missed.
+	if (wake_write_fd == wake_fd) {
+		uint64_t count;
+		ssize_t r = ::read(wake_fd, &count, sizeof(count));
+		(void)r;
+	}
+	else {
+		char buffer[64];
+		while (::read(wake_fd, buffer, sizeof(buffer)) > 0) {}
+	}
+	PostNode *node = posted.exchange(nullptr, std::memory_order_acquire);
+	// Reverse the stack, so tasks run in the order in which they were posted.
+	PostNode *first = nullptr;
+	while (node) {
+		PostNode *next = node->next;
+		node->next = first;
+		first = node;
+		node = next;
+	}
+	while (first) {
+		std::unique_ptr <PostNode> current(first);
+		first = first->next;
+		current->task();
+	}
+	return true;
+} // }}}
+// }}}
+
+int Loop::IoItems::add(IoRecord const &item) { // {{{
 	// Add an fd; return index.
 	STARTFUNC;
 	size_t ret;
@@ -14,99 +252,367 @@ int Loop::PollItems::add(IoRecord const &item) { // {{{
 		// There is space at a removed index.
 		ret = *empty_items.begin();
 		empty_items.erase(empty_items.begin());
-	}
-	else {
-		if (num == capacity) {
-			// There is no space; extend capacity.
-			capacity *= 8;
-			struct pollfd *new_data = new struct pollfd[capacity];
-			for (int i = 0; i < num; ++i)
-				new_data[i] = data[i];
-			delete[] data;
-			data = new_data;
-		}
-		// Now there is space at the end.
-		ret = num++;
-	}
-	data[ret].fd = item.fd;
-	data[ret].events = item.events;
-	data[ret].revents = 0;
-	// Add item
-	if (ret < items.size())
 		items[ret] = item;
+	}
 	else {
-		//WL_log("adding new item; ret = " + std::to_string(ret) + "/" + std::to_string(items.size()));
-		assert(ret == items.size());
+		ret = items.size();
 		items.push_back(item);
+		if (serials.size() < items.size())
+			serials.push_back(0);
 	}
 	if (DEBUG > 3)
 		WL_log("adding loop item @" + std::to_string(uint64_t((void *)item.object)) + ": " + std::to_string(ret));
 	return ret;
 } // }}}
 
-void Loop::PollItems::remove(int index) { // {{{
+void Loop::IoItems::remove(int index) { // {{{
 	// Remove fd using index as returned by add.
 	STARTFUNC;
 	if (DEBUG > 3)
 		WL_log("removing loop item " + std::to_string(index));
 	assert(index >= 0);
-	assert(data[index].fd >= 0);
-	if (index == num - 1) {
-		--num;
+	assert(items[index].fd >= 0);
+	++serials[index];
+	if (size_t(index) == items.size() - 1) {
 		items.pop_back();
 		// Remove newly last elements if they were empty.
-		while (!empty_items.empty() && *--empty_items.end() == num - 1) {
+		while (!empty_items.empty() && size_t(*--empty_items.end()) == items.size() - 1) {
 			empty_items.erase(--empty_items.end());
-			--num;
 			items.pop_back();
 		}
-		// Shrink capacity if too many items are removed.
-		if (num * 8 * 2 < capacity && capacity > min_capacity) {
-			capacity /= 8;
-			struct pollfd *new_data = new struct pollfd[capacity];
-			for (int i = 0; i < num; ++i)
-				new_data[i] = data[i];
-			delete[] data;
-			data = new_data;
-		}
 		return;
 	}
-	data[index].fd = -1;
+	items[index].fd = -1;
 	empty_items.insert(index);
 } // }}}
 
-std::string Loop::PollItems::print() { // {{{
+std::string Loop::IoItems::print() { // {{{
 	STARTFUNC;
 	std::ostringstream ret;
-	ret << "PollItems num = " << num << "/" << capacity << "(minimum " << min_capacity << "); Items:";
-	for (size_t i = 0; i < (size_t)num; ++i) {
-		ret << "\n\t" << data[i].fd << ": ";
-		if (i < items.size()) {
-			IoRecord &r = items[i];
+	ret << "IoItems num = " << items.size() << "; Items:";
+	for (size_t i = 0; i < items.size(); ++i) {
+		IoRecord &r = items[i];
+		ret << "\n\t" << r.fd << ": ";
+		if (r.fd >= 0)
 			ret << r.name << " data:" << r.object << " fd:" << r.fd << " events:" << r.events << (r.read ? " read" : "") << (r.write ? " write" : "") << (r.error ? " error" : "");
-		}
 		else
 			ret << "X";
 	}
 	return ret.str();
 } // }}}
 
+Metrics::Histogram &Loop::io_timing(std::string const &name) { // {{{
+	return metric_data.histogram("webloop_io_callback_seconds", "Time spent in the callbacks of file descriptors, by name.", {{"name", name}});
+} // }}}
+
+Loop::IoHandle Loop::add_io(IoRecord const &item) { // {{{
+	STARTFUNC;
+	IoHandle ret = items.add(item);
+	if (item.timing == nullptr)
+		items.items[ret].timing = &io_timing(item.name);
+	try {
+		backend->add(ret, item.fd, item.events);
+	}
+	catch (...) {
+		items.remove(ret);
+		throw;
+	}
+	return ret;
+} // }}}
+
+void Loop::remove_io(IoHandle handle) { // {{{
+	STARTFUNC;
+	backend->remove(handle, items.items[handle].fd);
+	items.remove(handle);
+} // }}}
+
+// Timers. {{{
+Loop::Timers::Timers() : nodes(), free_node(-1), heap(), epoch(std::chrono::steady_clock::now()), clk(0), pending{}, wheel_size(0) { // {{{
+	for (auto &b: buckets)
+		b = -1;
+} // }}}
+
+uint64_t Loop::Timers::tick(Time time) const { // {{{
+	if (time <= epoch)
+		return 0;
+	return (time - epoch + 1ms - Duration(1)) / 1ms;
+} // }}}
+
+Loop::TimeoutHandle Loop::Timers::add(TimeoutRecord const &record) { // {{{
+	int index;
+	if (free_node >= 0) {
+		index = free_node;
+		free_node = nodes[index].next;
+	}
+	else {
+		index = nodes.size();
+		nodes.push_back({});
+		nodes[index].serial = 0;
+	}
+	Node &node = nodes[index];
+	node.time = record.time;
+	node.interval = record.interval;
+	node.object = record.object;
+	node.cb = record.cb;
+	node.coarse = record.coarse;
+	insert(index);
+	return TimeoutHandle(index, node.serial);
+} // }}}
+
+void Loop::Timers::insert(int index) { // {{{
+	Node &node = nodes[index];
+	if (!node.coarse) {
+		node.state = Node::HEAP;
+		node.pos = heap.size();
+		heap.push_back(index);
+		heap_up(node.pos);
+		return;
+	}
+	// Compute the bucket. This is calc_wheel_index() from the Linux kernel.
+	node.state = Node::WHEEL;
+	if (wheel_size == 0) {
+		// Don't compute buckets relative to a stale clock.
+		uint64_t now_tick = (std::chrono::steady_clock::now() - epoch) / 1ms;
+		if (now_tick > clk)
+			clk = now_tick;
+	}
+	node.expires = tick(node.time);
+	uint64_t expires = node.expires;
+	int lvl;
+	if (expires < clk)
+		expires = clk;
+	uint64_t delta = expires - clk;
+	for (lvl = 0; lvl < LVL_DEPTH - 1; ++lvl) {
+		if (delta < uint64_t(LVL_SIZE - 1) << (LVL_CLK_SHIFT * lvl))
+			break;
+	}
+	if (lvl == LVL_DEPTH - 1) {
+		// Timeouts beyond the wheel are put in the last bucket; they are reinserted when it expires.
+		uint64_t max = (uint64_t(LVL_SIZE - 1) << (LVL_CLK_SHIFT * lvl)) - 1;
+		if (delta > max)
+			expires = clk + max;
+	}
+	// Round up, so the bucket is collected at or after the expiry tick.
+	int shift = LVL_CLK_SHIFT * lvl;
+	int slot = ((expires + (uint64_t(1) << shift) - 1) >> shift) & (LVL_SIZE - 1);
+	int bucket = lvl * LVL_SIZE + slot;
+	node.pos = bucket;
+	node.prev = -1;
+	node.next = buckets[bucket];
+	if (node.next >= 0)
+		nodes[node.next].prev = index;
+	buckets[bucket] = index;
+	pending[lvl] |= uint64_t(1) << slot;
+	++wheel_size;
+} // }}}
+
+void Loop::Timers::unlink(int index) { // {{{
+	Node &node = nodes[index];
+	if (node.state == Node::HEAP) {
+		int pos = node.pos;
+		int last = heap.back();
+		heap.pop_back();
+		if (last != index) {
+			heap[pos] = last;
+			nodes[last].pos = pos;
+			heap_up(pos);
+			heap_down(nodes[last].pos);
+		}
+	}
+	else if (node.state == Node::WHEEL) {
+		if (node.prev >= 0)
+			nodes[node.prev].next = node.next;
+		else {
+			buckets[node.pos] = node.next;
+			if (node.next < 0)
+				pending[node.pos / LVL_SIZE] &= ~(uint64_t(1) << (node.pos % LVL_SIZE));
+		}
+		if (node.next >= 0)
+			nodes[node.next].prev = node.prev;
+		--wheel_size;
+	}
+} // }}}
+
+void Loop::Timers::release(int index) { // {{{
+	Node &node = nodes[index];
+	node.state = Node::FREE;
+	++node.serial;
+	node.next = free_node;
+	free_node = index;
+} // }}}
+
+void Loop::Timers::remove(TimeoutHandle handle) { // {{{
+	STARTFUNC;
+	if (!valid(handle))
+		return;
+	Node &node = nodes[handle.index];
+	if (node.state == Node::RUNNING) {
+		// Removed from its own callback; it is released when that returns.
+		node.state = Node::CANCELLED;
+		return;
+	}
+	unlink(handle.index);
+	release(handle.index);
+} // }}}
+
+void Loop::Timers::heap_up(int pos) { // {{{
+	int index = heap[pos];
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (nodes[heap[parent]].time <= nodes[index].time)
+			break;
+		heap[pos] = heap[parent];
+		nodes[heap[pos]].pos = pos;
+		pos = parent;
+	}
+	heap[pos] = index;
+	nodes[index].pos = pos;
+} // }}}
+
+void Loop::Timers::heap_down(int pos) { // {{{
+	int index = heap[pos];
+	int size = heap.size();
+	while (true) {
+		int child = pos * 2 + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && nodes[heap[child + 1]].time < nodes[heap[child]].time)
+			++child;
+		if (nodes[index].time <= nodes[heap[child]].time)
+			break;
+		heap[pos] = heap[child];
+		nodes[heap[pos]].pos = pos;
+		pos = child;
+	}
+	heap[pos] = index;
+	nodes[index].pos = pos;
+} // }}}
+
+uint64_t Loop::Timers::wheel_next() const { // {{{
+	// This is __next_timer_interrupt() from the Linux kernel.
+	if (wheel_size == 0)
+		return uint64_t(-1);
+	uint64_t next = uint64_t(-1);
+	uint64_t c = clk;
+	for (int lvl = 0; lvl < LVL_DEPTH; ++lvl) {
+		int start = c & (LVL_SIZE - 1);
+		uint64_t map = pending[lvl];
+		if (map) {
+			// Rotate the map so that bit 0 is the current bucket; the number of trailing zeros is the distance to the first pending bucket.
+			uint64_t rotated = start == 0 ? map : (map >> start) | (map << (LVL_SIZE - start));
+			uint64_t t = (c + std::countr_zero(rotated)) << (LVL_CLK_SHIFT * lvl);
+			if (t < next)
+				next = t;
+		}
+		// If the lower bits are not zero, the next bucket of the next level is the first one that expires.
+		bool adj = c & ((1 << LVL_CLK_SHIFT) - 1);
+		c >>= LVL_CLK_SHIFT;
+		c += adj;
+	}
+	return next;
+} // }}}
+
+void Loop::Timers::wheel_collect(std::vector <TimeoutHandle> &expired) { // {{{
+	uint64_t c = clk;
+	for (int lvl = 0; lvl < LVL_DEPTH; ++lvl) {
+		int slot = c & (LVL_SIZE - 1);
+		if (pending[lvl] & (uint64_t(1) << slot)) {
+			pending[lvl] &= ~(uint64_t(1) << slot);
+			int bucket = lvl * LVL_SIZE + slot;
+			int index = buckets[bucket];
+			buckets[bucket] = -1;
+			while (index >= 0) {
+				int next = nodes[index].next;
+				--wheel_size;
+				if (nodes[index].expires > clk)
+					insert(index);	// Beyond the range of the wheel; try again.
+				else {
+					nodes[index].state = Node::PENDING;
+					expired.push_back(TimeoutHandle(index, nodes[index].serial));
+				}
+				index = next;
+			}
+		}
+		if (c & ((1 << LVL_CLK_SHIFT) - 1))
+			break;
+		c >>= LVL_CLK_SHIFT;
+	}
+} // }}}
+
+void Loop::Timers::collect(Time current, std::vector <TimeoutHandle> &expired) { // {{{
+	// Move all expired timeouts to expired, preserving order for precise timeouts.
+	while (!heap.empty() && nodes[heap[0]].time <= current) {
+		int index = heap[0];
+		unlink(index);
+		nodes[index].state = Node::PENDING;
+		expired.push_back(TimeoutHandle(index, nodes[index].serial));
+	}
+	if (wheel_size == 0)
+		return;
+	uint64_t now_tick = (current - epoch) / 1ms;
+	while (clk <= now_tick && wheel_size > 0) {
+		// Skip ticks without expiring buckets.
+		uint64_t next = wheel_next();
+		if (next > now_tick) {
+			clk = now_tick + 1;
+			break;
+		}
+		clk = std::max(clk, next);
+		wheel_collect(expired);
+		++clk;
+	}
+} // }}}
+
+int Loop::Timers::next_timeout(Time current) { // {{{
+	Time next = Time::max();
+	if (!heap.empty())
+		next = nodes[heap[0]].time;
+	uint64_t wheel = wheel_next();
+	if (wheel != uint64_t(-1))
+		next = std::min(next, epoch + std::chrono::milliseconds(wheel));
+	if (next == Time::max())
+		return -1;
+	if (next <= current)
+		return 0;
+	return (next - current + 1ms - Duration(1)) / 1ms;
+} // }}}
+// }}}
+
 int Loop::handle_timeouts() { // {{{
 	STARTFUNC;
 	Time current = now();
-	while (!aborting && !timeouts.empty() && timeouts.begin()->time <= current) {
-		TimeoutRecord rec = *timeouts.begin();
-		timeouts.erase(timeouts.begin());
-		bool keep = (rec.object->*rec.cb)();
-		if (keep && rec.interval > Duration()) {
-			while (rec.time <= current)
-				rec.time += rec.interval;
-			add_timeout({rec.time, rec.interval, rec.object, rec.cb});
+	// Use a local list, in case a callback runs a nested iteration; the member only keeps the allocation around.
+	std::vector <TimeoutHandle> batch;
+	batch.swap(expired);
+	batch.clear();
+	timeouts.collect(current, batch);
+	for (size_t i = 0; i < batch.size(); ++i) {
+		TimeoutHandle h = batch[i];
+		// Skip timeouts that were removed by an earlier callback.
+		if (!timeouts.valid(h) || timeouts.nodes[h.index].state != Timers::Node::PENDING)
+			continue;
+		if (aborting) {
+			// Put it back, so it runs when the loop is restarted.
+			timeouts.insert(h.index);
+			continue;
+		}
+		timeouts.nodes[h.index].state = Timers::Node::RUNNING;
+		timeout_lag.record(current - timeouts.nodes[h.index].time);
+		bool keep = (timeouts.nodes[h.index].object->*timeouts.nodes[h.index].cb)();
+		// The callback may have added timeouts, so get a fresh reference.
+		auto &node = timeouts.nodes[h.index];
+		if (keep && node.interval > Duration() && node.state == Timers::Node::RUNNING) {
+			// Reschedule without changing the handle.
+			while (node.time <= current)
+				node.time += node.interval;
+			timeouts.insert(h.index);
 		}
+		else
+			timeouts.release(h.index);
 	}
-	if (timeouts.empty())
-		return -1;
-	return (timeouts.begin()->time - current) / 1ms;
+	if (expired.empty())
+		batch.swap(expired);
+	return timeouts.next_timeout(current);
 } // }}}
 
 Loop *Loop::get(Loop *arg) { // {{{
@@ -115,8 +621,10 @@ Loop *Loop::get(Loop *arg) { // {{{
 			default_loop = arg;
 		return arg;
 	}
-	if (!default_loop)
+	if (!default_loop) {
+		static thread_local Loop fallback_loop;
 		default_loop = &fallback_loop;
+	}
 	return default_loop;
 } // }}}
 
@@ -125,35 +633,79 @@ void Loop::iteration(bool block) { // {{{
 	// Do a single iteration of the main loop.
 	// @return None.
 	int t = handle_timeouts();
-	if (!block)
+	if (!block || deferred_head < deferred.size())
 		t = 0;
-	poll(items.data, items.num, t);
-	for (int i = 0; !aborting && i < items.num; ++i) {
-		if (items.data[i].fd < 0)
-			continue;
-		short ev = items.data[i].revents;
-		if (ev == 0)
+	ready.clear();
+	backend->wait(t, ready);
+	// The end of each callback is the start of the next, so timing them costs one clock read each.
+	Time start = now();
+	Time mark = start;
+	// Record the serials now, so events for items that are removed (and possibly replaced) by a callback are skipped.
+	for (auto &e: ready)
+		e.serial = items.serials[e.handle];
+	for (size_t i = 0; !aborting && i < ready.size(); ++i) {
+		IoHandle h = ready[i].handle;
+		unsigned serial = ready[i].serial;
+		short ev = ready[i].revents;
+		if (!items.valid(h, serial))
 			continue;
+		// Callbacks may add items, which can reallocate the vector; don't keep references into it.
+		CbBase *object = items.items[h].object;
+		short events = items.items[h].events;
+		// The record may be removed by its callback, so time it as a whole here.
+		struct Timing {
+			Time &mark;
+			Metrics::Histogram *timing;
+			~Timing() { Time done = std::chrono::steady_clock::now(); timing->record(done - mark); mark = done; }
+		} timing {mark, items.items[h].timing};
 		if (ev & (POLLERR | POLLNVAL)) {
-			if (!items.items[i].error || !(items.items[i].object->*(items.items[i].error))())
-				items.remove(i);
+			Cb error = items.items[h].error;
+			if ((!error || !(object->*error)()) && items.valid(h, serial))
+				remove_io(h);
+			continue;
 		}
-		else {
-			if (ev & (POLLIN | POLLPRI)) {
-				if (!items.items[i].read || !(items.items[i].object->*(items.items[i].read))()) {
-					if (items.data[i].fd >= 0)
-						items.remove(i);
-					continue;
-				}
-			}
-			if (ev & POLLOUT) {
-				if (!items.items[i].write || !(items.items[i].object->*(items.items[i].write))())
-					if (items.data[i].fd >= 0)
-						items.remove(i);
+		// A hangup without POLLIN (pipes) must also wake the reader, or it would never see end of file.
+		if ((ev & (POLLIN | POLLPRI | POLLHUP)) && (events & (POLLIN | POLLPRI))) {
+			Cb read = items.items[h].read;
+			if (!read || !(object->*read)()) {
+				if (items.valid(h, serial))
+					remove_io(h);
+				continue;
 			}
+			if (!items.valid(h, serial))
+				continue;
+		}
+		if ((ev & (POLLOUT | POLLHUP)) && (events & POLLOUT)) {
+			Cb write = items.items[h].write;
+			if (!write || !(object->*write)())
+				if (items.valid(h, serial))
+					remove_io(h);
 		}
 	}
 	handle_timeouts();
+	run_deferred();
+	iteration_time.record(now() - start);
+} // }}}
+
+void Loop::run_deferred() { // {{{
+	STARTFUNC;
+	// Positions are tracked as handles, because a task that runs a nested iteration can shift the queue.
+	DeferHandle end = deferred_base + std::min(deferred.size(), deferred_head + max_deferred_batch);
+	while (!aborting && deferred_base + deferred_head < end) {
+		DeferRecord record = deferred[deferred_head++];
+		if (record.object != nullptr && (record.object->*record.cb)())
+			defer(record);
+	}
+	if (deferred_head == deferred.size()) {
+		deferred_base += deferred.size();
+		deferred.clear();
+		deferred_head = 0;
+	}
+	else if (deferred_head >= max_deferred_batch && deferred_head * 2 >= deferred.size()) {
+		deferred.erase(deferred.begin(), deferred.begin() + deferred_head);
+		deferred_base += deferred_head;
+		deferred_head = 0;
+	}
 } // }}}
 
 void Loop::run() { // {{{
@@ -202,8 +754,7 @@ void Loop::remove_idle(IdleHandle handle) { // {{{
 	idle.erase(handle);
 } // }}}
 
-Loop *Loop::default_loop;
-Loop Loop::fallback_loop;
+thread_local Loop *Loop::default_loop;
 
 }
 
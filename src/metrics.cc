@@ -0,0 +1,184 @@
+#include "webloop/metrics.hh"
+#include <set>
+#include <vector>
+#include <cstdio>
+
+namespace Webloop {
+
+// All Metrics objects, for prometheus(). {{{
+// This is a function, so it exists before the first Loop is constructed, even if that is a static object.
+struct AllMetrics {
+	std::mutex lock;
+	std::set <Metrics *> items;
+};
+static AllMetrics &all_metrics() {
+	static AllMetrics all;
+	return all;
+}
+// }}}
+
+Metrics::Metrics() : families(), traffics(), lock() { // {{{
+	auto &all = all_metrics();
+	std::lock_guard <std::mutex> guard(all.lock);
+	all.items.insert(this);
+} // }}}
+
+Metrics::~Metrics() { // {{{
+	auto &all = all_metrics();
+	std::lock_guard <std::mutex> guard(all.lock);
+	all.items.erase(this);
+} // }}}
+
+std::string Metrics::format_labels(Labels labels) { // {{{
+	std::string ret;
+	for (auto &label: labels) {
+		if (!ret.empty())
+			ret += ',';
+		ret += label.first;
+		ret += "=\"";
+		for (char c: label.second) {
+			switch (c) {
+			case '\\':
+				ret += "\\\\";
+				break;
+			case '"':
+				ret += "\\\"";
+				break;
+			case '\n':
+				ret += "\\n";
+				break;
+			default:
+				ret += c;
+			}
+		}
+		ret += '"';
+	}
+	return ret;
+} // }}}
+
+Metrics::Family &Metrics::family(std::string const &name, std::string const &help, Type type) { // {{{
+	// The caller holds the lock.
+	auto f = families.find(name);
+	if (f == families.end())
+		return families.emplace(name, Family {help, type, {}, {}, {}}).first->second;
+	if (f->second.type != type)
+		throw "metric is already defined with a different type";
+	return f->second;
+} // }}}
+
+Metrics::Counter &Metrics::counter(std::string const &name, std::string const &help, Labels labels) { // {{{
+	std::lock_guard <std::mutex> guard(lock);
+	auto &target = family(name, help, COUNTER).counters[format_labels(labels)];
+	if (!target)
+		target.reset(new Counter());
+	return *target;
+} // }}}
+
+Metrics::Gauge &Metrics::gauge(std::string const &name, std::string const &help, Labels labels) { // {{{
+	std::lock_guard <std::mutex> guard(lock);
+	auto &target = family(name, help, GAUGE).gauges[format_labels(labels)];
+	if (!target)
+		target.reset(new Gauge());
+	return *target;
+} // }}}
+
+Metrics::Histogram &Metrics::histogram(std::string const &name, std::string const &help, Labels labels) { // {{{
+	std::lock_guard <std::mutex> guard(lock);
+	auto &target = family(name, help, HISTOGRAM).histograms[format_labels(labels)];
+	if (!target)
+		target.reset(new Histogram());
+	return *target;
+} // }}}
+
+Metrics::Traffic &Metrics::traffic(std::string const &protocol) { // {{{
+	{
+		std::lock_guard <std::mutex> guard(lock);
+		auto t = traffics.find(protocol);
+		if (t != traffics.end())
+			return *t->second;
+	}
+	Labels labels {{"protocol", protocol}};
+	Traffic *ret = new Traffic {
+		counter("webloop_frames_received_total", "Frames that were received.", labels),
+		counter("webloop_frames_sent_total", "Frames that were sent.", labels),
+		counter("webloop_received_bytes_total", "Bytes that were received, including framing.", labels),
+		counter("webloop_sent_bytes_total", "Bytes that were sent, including framing.", labels)
+	};
+	std::lock_guard <std::mutex> guard(lock);
+	traffics[protocol].reset(ret);
+	return *ret;
+} // }}}
+
+void Metrics::collect(std::map <std::string, std::pair <Family const *, std::map <std::string, std::vector <double> > > > &target) const { // {{{
+	// Add the values of all metrics to target. Histograms have the bucket counts, followed by the sum in seconds.
+	std::lock_guard <std::mutex> guard(lock);
+	for (auto &f: families) {
+		auto &entry = target[f.first];
+		if (entry.first == nullptr)
+			entry.first = &f.second;
+		else if (entry.first->type != f.second.type)
+			continue;	// Defined differently in another loop; skip it.
+		for (auto &c: f.second.counters) {
+			auto &values = entry.second[c.first];
+			values.resize(1);
+			values[0] += c.second->get();
+		}
+		for (auto &g: f.second.gauges) {
+			auto &values = entry.second[g.first];
+			values.resize(1);
+			values[0] += g.second->get();
+		}
+		for (auto &h: f.second.histograms) {
+			auto &values = entry.second[h.first];
+			values.resize(Histogram::num_buckets + 1);
+			for (int i = 0; i < Histogram::num_buckets; ++i)
+				values[i] += h.second->get_bucket(i);
+			values[Histogram::num_buckets] += h.second->get_sum_ns() / 1e9;
+		}
+	}
+} // }}}
+
+std::string Metrics::prometheus() { // {{{
+	auto &all = all_metrics();
+	std::lock_guard <std::mutex> guard(all.lock);
+	std::map <std::string, std::pair <Family const *, std::map <std::string, std::vector <double> > > > values;
+	for (auto metrics: all.items)
+		metrics->collect(values);
+	std::string ret;
+	char number[32];
+	auto format = [&number](double value) { snprintf(number, sizeof(number), "%.17g", value); return number; };
+	for (auto &f: values) {
+		Family const &family = *f.second.first;
+		ret += "# HELP " + f.first + " " + family.help + "\n";
+		ret += "# TYPE " + f.first + (family.type == COUNTER ? " counter\n" : family.type == GAUGE ? " gauge\n" : " histogram\n");
+		for (auto &item: f.second.second) {
+			auto &labels = item.first;
+			auto &v = item.second;
+			if (family.type != HISTOGRAM) {
+				ret += f.first + (labels.empty() ? std::string() : "{" + labels + "}") + " " + format(v[0]) + "\n";
+				continue;
+			}
+			std::string prefix = f.first + "_bucket{" + labels + (labels.empty() ? "le=\"" : ",le=\"");
+			double total = 0;
+			for (int i = 0; i < Histogram::num_buckets; ++i) {
+				total += v[i];
+				if (i < Histogram::num_buckets - 1) {
+					snprintf(number, sizeof(number), "%.9g", Histogram::upper_bound(i));
+					ret += prefix + number + "\"} ";
+				}
+				else
+					ret += prefix + "+Inf\"} ";
+				ret += format(total);
+				ret += "\n";
+			}
+			std::string suffix = labels.empty() ? std::string() : "{" + labels + "}";
+			ret += f.first + "_sum" + suffix + " " + format(v[Histogram::num_buckets]) + "\n";
+			ret += f.first + "_count" + suffix + " " + format(total) + "\n";
+		}
+	}
+	return ret;
+} // }}}
+
+}
+
+// vim: set foldmethod=marker :
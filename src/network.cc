@@ -34,6 +34,16 @@ sockets.  Connection targets can be specified in several ways.
 
 #include <cassert>
 #include <fcntl.h>
+#include <netinet/tcp.h>
+#include <cstring>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <map>
+#include <deque>
+#include <array>
+#include <mutex>
+#include <thread>
 #include "webloop/webobject.hh"
 #include "webloop/network.hh"
 
@@ -54,6 +64,561 @@ namespace Webloop {
 // }}} */
 
 // Network sockets. {{{
+namespace {
+struct AliveGuard { // {{{
+	// While a function that runs callbacks is active, an object points a member at a local flag of that function. The
+	// destructor of the object clears the flag, so the function can see that the object is gone. This resets the
+	// member when the function leaves, also through an exception, unless the object no longer exists.
+	bool *&target;
+	bool const &alive;
+	AliveGuard(bool *&target, bool const &alive) : target(target), alive(alive) {}
+	~AliveGuard() { if (alive) target = nullptr; }
+	AliveGuard(AliveGuard const &) = delete;
+	AliveGuard &operator=(AliveGuard const &) = delete;
+}; // }}}
+}
+
+// Output internals. {{{
+static size_t const default_high_watermark = 1 << 20;
+static size_t const default_low_watermark = 1 << 18;
+// Time that output of a closed socket may take to be written, before it is discarded.
+static Loop::Duration const linger_timeout = 30s;
+// Maximum number of queued chunks that are written in one system call.
+static int const max_iov = 64;
+
+static ssize_t write_fd(int fd, bool &not_socket, char const *data, size_t size) { // {{{
+	// Write as much as possible without blocking. Return number of bytes written, or -1 on error.
+	while (true) {
+		// Use send() if possible, to avoid SIGPIPE.
+		ssize_t n = not_socket ? ::write(fd, data, size) : ::send(fd, data, size, MSG_NOSIGNAL);
+		if (n >= 0)
+			return n;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if (errno == ENOTSOCK && !not_socket) {
+			not_socket = true;
+			continue;
+		}
+		return -1;
+	}
+} // }}}
+
+static ssize_t writev_fd(int fd, bool &not_socket, struct iovec *iov, int num) { // {{{
+	// Like write_fd, for multiple buffers.
+	while (true) {
+		ssize_t n;
+		if (not_socket)
+			n = ::writev(fd, iov, num);
+		else {
+			struct msghdr msg {};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = num;
+			n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+		}
+		if (n >= 0)
+			return n;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if (errno == ENOTSOCK && !not_socket) {
+			not_socket = true;
+			continue;
+		}
+		return -1;
+	}
+} // }}}
+
+struct NoSigpipe { // {{{
+	// Block SIGPIPE during system calls that cannot use MSG_NOSIGNAL; a SIGPIPE that is raised meanwhile is discarded.
+	sigset_t pipe_set;
+	sigset_t old_mask;
+	bool was_pending;
+	NoSigpipe() {
+		sigemptyset(&pipe_set);
+		sigaddset(&pipe_set, SIGPIPE);
+		sigset_t pending;
+		sigpending(&pending);
+		was_pending = sigismember(&pending, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipe_set, &old_mask);
+	}
+	~NoSigpipe() {
+		if (!was_pending) {
+			sigset_t pending;
+			sigpending(&pending);
+			if (sigismember(&pending, SIGPIPE)) {
+				struct timespec zero {};
+				sigtimedwait(&pipe_set, nullptr, &zero);
+			}
+		}
+		pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+	}
+}; // }}}
+
+static ssize_t write_file(int fd, bool &not_socket, int file, bool pipe, off_t offset, size_t size) { // {{{
+	// Send part of a file without copying it through user space. Return number of bytes written, or -1 on error.
+	NoSigpipe guard;
+	while (true) {
+		ssize_t n = pipe ? ::splice(file, nullptr, fd, nullptr, size, SPLICE_F_MOVE | SPLICE_F_MORE) : ::sendfile(fd, file, &offset, size);
+		if (n > 0)
+			return n;
+		if (n == 0) {
+			// The file is shorter than expected.
+			errno = EIO;
+			return -1;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if (!pipe && (errno == EINVAL || errno == ENOSYS)) {
+			// This file does not support sendfile(); copy it through user space instead.
+			char buffer[1 << 16];
+			ssize_t r = ::pread(file, buffer, std::min(size, sizeof(buffer)), offset);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				if (r == 0)
+					errno = EIO;
+				return -1;
+			}
+			return write_fd(fd, not_socket, buffer, r);
+		}
+		return -1;
+	}
+} // }}}
+
+SocketBase::OutputChunk &SocketBase::OutputChunk::operator=(OutputChunk &&other) { // {{{
+	if (file >= 0)
+		::close(file);
+	data = std::move(other.data);
+	shared = std::move(other.shared);
+	file = other.file;
+	pipe = other.pipe;
+	file_offset = other.file_offset;
+	file_size = other.file_size;
+	other.file = -1;
+	return *this;
+} // }}}
+
+ssize_t SocketBase::write_output(int fd, bool &not_socket, std::vector <OutputChunk> &output, size_t &head, size_t &offset) { // {{{
+	// Write queued chunks until they are all written, or fd is not ready for more.
+	// Return the number of bytes that were written, or -1 on error.
+	size_t total = 0;
+	while (head < output.size()) {
+		size_t size;
+		ssize_t num;
+		if (output[head].file >= 0) {
+			OutputChunk &chunk = output[head];
+			size = chunk.file_size - offset;
+			num = size == 0 ? 0 : write_file(fd, not_socket, chunk.file, chunk.pipe, chunk.file_offset + offset, size);
+		}
+		else {
+			// Write consecutive data chunks with one system call.
+			struct iovec iov[max_iov];
+			int n = 0;
+			size = 0;
+			for (size_t i = head; i < output.size() && output[i].file < 0 && n < max_iov; ++i, ++n) {
+				size_t skip = i == head ? offset : 0;
+				std::string_view chunk = output[i].view();
+				iov[n] = {const_cast <char *>(chunk.data()) + skip, chunk.size() - skip};
+				size += iov[n].iov_len;
+			}
+			num = writev_fd(fd, not_socket, iov, n);
+		}
+		if (num < 0)
+			return -1;
+		total += num;
+		// Skip the chunks that were completely written.
+		size_t left = num;
+		while (head < output.size() && left >= output[head].size() - offset) {
+			left -= output[head].size() - offset;
+			offset = 0;
+			if (output[head].file >= 0)
+				output[head] = OutputChunk(std::string());	// Close the file now.
+			++head;
+		}
+		offset += left;
+		if (size_t(num) < size)
+			break;
+	}
+	return total;
+} // }}}
+
+struct SocketBase::Linger : public Loop::CbBase { // {{{
+	// Owner of the fd of a closed socket that still had pending output. It deletes itself when done.
+	Loop *loop;
+	int fd;
+	bool not_socket;
+	std::vector <OutputChunk> output;
+	size_t head;
+	size_t offset;
+	Loop::IoHandle write_handle;
+	Loop::TimeoutHandle timeout_handle;
+	Linger(Loop *loop, int fd, bool not_socket, std::vector <OutputChunk> &&chunks, size_t first, size_t offset) : loop(loop), fd(fd), not_socket(not_socket), output(std::move(chunks)), head(first), offset(offset) {
+		write_handle = loop->add_io(Loop::IoRecord("linger", this, fd, POLLOUT, (bool (Linger::*)())nullptr, &Linger::write, &Linger::finish));
+		timeout_handle = loop->add_timeout(Loop::TimeoutRecord(loop->now() + linger_timeout, Loop::Duration(), this, &Linger::finish, true));
+	}
+	bool write() {
+		if (write_output(fd, not_socket, output, head, offset) < 0 || head == output.size())
+			return finish();
+		return true;
+	}
+	bool finish() {
+		loop->remove_io(write_handle);
+		loop->remove_timeout(timeout_handle);
+		::close(fd);
+		delete this;
+		return true;
+	}
+}; // }}}
+// }}}
+
+// Connection setup. {{{
+// If an attempt to connect has not completed after this time, the next address is tried next to it; this is the value that RFC 8305 recommends.
+static Loop::Duration const attempt_delay = 250ms;
+// Maximum number of threads that look up names at the same time; further lookups wait in a queue.
+static int const max_resolver_threads = 4;
+
+struct SocketBase::Connector : public Loop::CbBase { // {{{
+	/* Set up the connection of a client socket, without blocking the loop.
+	Names are looked up in a few separate threads, because getaddrinfo()
+	blocks, and the results are cached.  The addresses are tried in
+	turn, alternating between address families.  When an attempt has
+	not completed after attempt_delay, the next one is started next to
+	it, like "Happy Eyeballs" (RFC 8305) does; the first connection
+	that succeeds is used.
+	*/
+	struct Address {
+		sockaddr_storage addr;
+		socklen_t size;
+	};
+	typedef std::vector <Address> Addresses;
+	struct Attempt : public Loop::CbBase {
+		Connector *connector;
+		int fd;
+		Loop::IoHandle handle;
+		Attempt(Connector *connector, int fd) : connector(connector), fd(fd), handle(-1) {}
+		bool done() { return connector->finish_attempt(this); }	// Called when the socket is writable, or has an error.
+	};
+
+	// Name lookups; these are shared by all threads. {{{
+	typedef std::pair <std::string, std::string> Key;	// Host and service.
+	struct Waiter {
+		Loop *loop;
+		std::weak_ptr <Connector> connector;
+	};
+	struct Cached {
+		Addresses addresses;
+		Loop::Time expires;
+	};
+	struct Resolver {
+		std::mutex lock;
+		Loop::Duration ttl;
+		std::map <Key, Cached> cache;	// Expired entries are removed when a result is added.
+		std::map <Key, std::list <Waiter> > running;	// Lookups that are queued or in progress, with the connectors that wait for them.
+		std::deque <Key> queue;	// Lookups that wait for a thread.
+		int threads;	// Number of running lookup threads.
+		Resolver() : lock(), ttl(60s), cache(), running(), queue(), threads(0) {}
+	};
+	// This is never destroyed, so lookups that finish while the program exits can still use it.
+	static Resolver &resolver() { static Resolver *instance = new Resolver; return *instance; }
+	static int get_addresses(std::string const &host, std::string const &service, int flags, Addresses &result);
+	static void lookup();	// Runs in its own thread, until the queue is empty.
+	static void finish_lookup(Resolver &r, Key const &key, Addresses const &result, std::string const &message);	// Called with the lock held.
+	// }}}
+
+	SocketBase *socket;
+	Loop *loop;
+	Key key;	// Set while a lookup is running.
+	Addresses addresses;
+	size_t next_address;
+	std::list <Attempt> attempts;
+	std::string error;	// Reason of the last failure.
+	Loop::TimeoutHandle deadline;
+	Loop::TimeoutHandle delay;	// Starts the next attempt, or reports failure.
+
+	Connector(SocketBase *socket, Loop *loop, Loop::Duration timeout);
+	~Connector();
+	void resolve(std::string const &host, std::string const &service, std::shared_ptr <Connector> const &self);
+	void start(Addresses &&result);
+	bool start_next();
+	bool finish_attempt(Attempt *attempt);
+	void fail(std::string const &message);
+	bool report_failure();
+	bool expire() { error = "connection timed out"; return report_failure(); }
+}; // }}}
+
+int SocketBase::Connector::get_addresses(std::string const &host, std::string const &service, int flags, Addresses &result) { // {{{
+	// Look up host and service. Return 0 on success, or an error code for gai_strerror().
+	struct addrinfo addr_hint {};
+	addr_hint.ai_family = AF_UNSPEC;
+	addr_hint.ai_socktype = SOCK_STREAM;
+	addr_hint.ai_protocol = IPPROTO_TCP;
+	addr_hint.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED | flags;
+	struct addrinfo *addr;
+	int code = getaddrinfo(host.c_str(), service.c_str(), &addr_hint, &addr);
+	if (code != 0)
+		return code;
+	for (auto rp = addr; rp; rp = rp->ai_next) {
+		Address address {};
+		memcpy(&address.addr, rp->ai_addr, rp->ai_addrlen);
+		address.size = rp->ai_addrlen;
+		result.push_back(address);
+	}
+	freeaddrinfo(addr);
+	return 0;
+} // }}}
+
+void SocketBase::Connector::lookup() { // {{{
+	Resolver &r = resolver();
+	std::unique_lock <std::mutex> guard(r.lock);
+	while (!r.queue.empty()) {
+		Key key = std::move(r.queue.front());
+		r.queue.pop_front();
+		auto waiters = r.running.find(key);
+		if (waiters == r.running.end() || waiters->second.empty()) {
+			// All connectors that wanted this have gone.
+			if (waiters != r.running.end())
+				r.running.erase(waiters);
+			continue;
+		}
+		guard.unlock();
+		Addresses result;
+		int code = get_addresses(key.first, key.second, 0, result);
+		std::string message = code == 0 ? std::string() : "unable to resolve " + key.first + ": " + gai_strerror(code);
+		guard.lock();
+		finish_lookup(r, key, result, message);
+	}
+	--r.threads;
+} // }}}
+
+void SocketBase::Connector::finish_lookup(Resolver &r, Key const &key, Addresses const &result, std::string const &message) { // {{{
+	if (message.empty()) {
+		auto now = std::chrono::steady_clock::now();
+		std::erase_if(r.cache, [now](auto const &item) { return item.second.expires <= now; });
+		r.cache[key] = Cached {result, now + r.ttl};
+	}
+	// Post while holding the lock: connectors remove themselves under the lock when they are destroyed, so the loops of those that are left still exist.
+	auto waiters = r.running.find(key);
+	if (waiters == r.running.end())
+		return;
+	for (auto &waiter: waiters->second) {
+		if (waiter.connector.expired())
+			continue;
+		waiter.loop->post([connector = waiter.connector, result = Addresses(result), message]() mutable {
+			auto target = connector.lock();
+			if (!target)
+				return;
+			target->key = Key();
+			if (!message.empty())
+				target->fail(message);
+			else
+				target->start(std::move(result));
+		});
+	}
+	r.running.erase(waiters);
+} // }}}
+
+SocketBase::Connector::Connector(SocketBase *socket, Loop *loop, Loop::Duration timeout) : // {{{
+		socket(socket),
+		loop(loop),
+		key(),
+		addresses(),
+		next_address(0),
+		attempts(),
+		error("no address to connect to"),
+		deadline(),
+		delay()
+{
+	if (timeout != Loop::Duration())
+		deadline = loop->add_timeout(Loop::TimeoutRecord(loop->now() + timeout, Loop::Duration(), this, &Connector::expire));
+} // }}}
+
+SocketBase::Connector::~Connector() { // {{{
+	loop->remove_timeout(deadline);
+	loop->remove_timeout(delay);
+	for (auto &attempt: attempts) {
+		loop->remove_io(attempt.handle);
+		::close(attempt.fd);
+	}
+	if (!key.first.empty()) {
+		// Stop waiting for the lookup; this connector is already expired.
+		Resolver &r = resolver();
+		std::lock_guard <std::mutex> guard(r.lock);
+		auto waiters = r.running.find(key);
+		if (waiters != r.running.end())
+			waiters->second.remove_if([](Waiter const &waiter) { return waiter.connector.expired(); });
+	}
+} // }}}
+
+void SocketBase::Connector::resolve(std::string const &host, std::string const &service, std::shared_ptr <Connector> const &self) { // {{{
+	// Numeric addresses don't need a lookup.
+	Addresses result;
+	if (get_addresses(host, service, AI_NUMERICHOST, result) == 0) {
+		start(std::move(result));
+		return;
+	}
+	Resolver &r = resolver();
+	std::unique_lock <std::mutex> guard(r.lock);
+	Key target(host, service);
+	auto cached = r.cache.find(target);
+	if (cached != r.cache.end()) {
+		if (cached->second.expires > loop->now()) {
+			result = cached->second.addresses;
+			guard.unlock();
+			start(std::move(result));
+			return;
+		}
+		r.cache.erase(cached);
+	}
+	auto [waiters, first] = r.running.try_emplace(target);
+	waiters->second.push_back(Waiter {loop, self});
+	key = target;
+	if (!first)
+		return;	// The lookup is already queued or running.
+	r.queue.push_back(target);
+	if (r.threads < max_resolver_threads) {
+		++r.threads;
+		try {
+			std::thread(&Connector::lookup).detach();
+		}
+		catch (...) {
+			--r.threads;
+			throw;
+		}
+	}
+} // }}}
+
+void SocketBase::Connector::start(Addresses &&result) { // {{{
+	// Alternate between address families, starting with the one that getaddrinfo() prefers.
+	addresses.clear();
+	next_address = 0;
+	int family = result.empty() ? AF_UNSPEC : result.front().addr.ss_family;
+	auto other = std::stable_partition(result.begin(), result.end(), [family](Address const &a) { return a.addr.ss_family == family; });
+	for (auto first = result.begin(), second = other; first != other || second != result.end(); ) {
+		if (first != other)
+			addresses.push_back(*first++);
+		if (second != result.end())
+			addresses.push_back(*second++);
+	}
+	start_next();
+} // }}}
+
+bool SocketBase::Connector::start_next() { // {{{
+	// Start an attempt with the next address. This is also the callback of the delay timeout.
+	loop->remove_timeout(delay);
+	delay = Loop::TimeoutHandle();
+	while (next_address < addresses.size()) {
+		Address const &address = addresses[next_address++];
+		int fd = ::socket(address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd < 0) {
+			error = std::string("unable to open socket: ") + strerror(errno);
+			continue;
+		}
+		if (::connect(fd, reinterpret_cast <sockaddr const *>(&address.addr), address.size) < 0 && errno != EINPROGRESS) {
+			error = std::string("unable to connect socket: ") + strerror(errno);
+			::close(fd);
+			continue;
+		}
+		attempts.emplace_back(this, fd);
+		Attempt &attempt = attempts.back();
+		attempt.handle = loop->add_io(Loop::IoRecord("connect", &attempt, fd, POLLOUT, (bool (Attempt::*)())nullptr, &Attempt::done, &Attempt::done));
+		if (next_address < addresses.size())
+			delay = loop->add_timeout(Loop::TimeoutRecord(loop->now() + attempt_delay, Loop::Duration(), this, &Connector::start_next));
+		return false;
+	}
+	if (attempts.empty())
+		fail(error);
+	return false;
+} // }}}
+
+bool SocketBase::Connector::finish_attempt(Attempt *attempt) { // {{{
+	int code = 0;
+	socklen_t size = sizeof(code);
+	if (::getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &code, &size) < 0)
+		code = errno;
+	int fd = attempt->fd;
+	loop->remove_io(attempt->handle);
+	attempts.remove_if([attempt](Attempt const &a) { return &a == attempt; });
+	if (code != 0) {
+		::close(fd);
+		error = std::string("unable to connect socket: ") + strerror(code);
+		// Don't wait for the delay when an attempt fails.
+		if (next_address < addresses.size())
+			start_next();
+		else if (attempts.empty())
+			fail(error);
+		return true;
+	}
+	// This destroys the connector, so it must be the last thing that is done.
+	socket->connected(fd);
+	return true;
+} // }}}
+
+void SocketBase::Connector::fail(std::string const &message) { // {{{
+	// Report the failure from a timeout, so the socket is never closed from its constructor.
+	error = message;
+	loop->remove_timeout(delay);
+	delay = loop->add_timeout(Loop::TimeoutRecord(loop->now(), Loop::Duration(), this, &Connector::report_failure));
+} // }}}
+
+bool SocketBase::Connector::report_failure() { // {{{
+	// This destroys the connector, so keep a copy of the message.
+	std::string message = error;
+	socket->connect_failed(message);
+	return false;
+} // }}}
+
+void SocketBase::connected(int new_fd) { // {{{
+	STARTFUNC;
+	// Called by the connector when the connection has been set up. Register the callbacks that were set while connecting.
+	fd = new_fd;
+	connector.reset();
+	if (rawread_cb != nullptr)
+		read_handle = current_loop->add_io(Loop::IoRecord(name, this, fd, POLLIN | POLLPRI, &SocketBase::rawread_impl, CbType(), &SocketBase::error_impl, get_io_timing()));
+	else if (read_cb != nullptr || read_view_cb != nullptr || read_lines_cb != nullptr || read_waiter != nullptr)
+		read_handle = current_loop->add_io(Loop::IoRecord(name, this, fd, POLLIN | POLLPRI, &SocketBase::read_impl, CbType(), &SocketBase::error_impl, get_io_timing()));
+	if (output_size > 0)
+		write_handle = current_loop->add_io(Loop::IoRecord(name, this, fd, POLLOUT, CbType(), &SocketBase::write_impl, &SocketBase::error_impl, get_io_timing()));
+	if (connect_cb != nullptr)
+		(user->*connect_cb)();
+	if (connect_waiter != coroutine::handle_type()) {
+		auto waiter = connect_waiter;
+		connect_waiter = coroutine::handle_type();
+		coroutine::activate(&waiter);
+	}
+} // }}}
+
+void SocketBase::connect_failed(std::string const &message) { // {{{
+	STARTFUNC;
+	// Called by the connector when no connection could be made. Closing the socket wakes wait_for_connect().
+	if (error_cb != nullptr)
+		(user->*error_cb)(message);
+	else
+		std::cerr << "unable to connect to " << url.src << ": " << message << std::endl;
+	close();
+} // }}}
+
+coroutine SocketBase::wait_for_connect() { // {{{
+	STARTFUNC;
+	if (connector != nullptr) {
+		connect_waiter = GetHandle();
+		co_yield WebNone::create();
+	}
+	co_return WebBool::create(fd >= 0);
+} // }}}
+
+void SocketBase::set_resolve_ttl(Loop::Duration ttl) { // {{{
+	auto &r = Connector::resolver();
+	std::lock_guard <std::mutex> guard(r.lock);
+	r.ttl = ttl;
+	r.cache.clear();
+} // }}}
+// }}}
+
 // Read internals. {{{
 bool SocketBase::rawread_impl() { // {{{
 	STARTFUNC;
@@ -63,72 +628,214 @@ bool SocketBase::rawread_impl() { // {{{
 	return true;
 } // }}}
 
-bool SocketBase::read_impl() { // {{{
-	STARTFUNC;
-	if (buffer.empty())
-		buffer = recv();	// Allow moving.
+// Buffer pool. {{{
+thread_local SocketBase::BufferPool SocketBase::pool;
+bool SocketBase::debug_names = true;
+
+void SocketBase::take_buffer() { // {{{
+	// Use a buffer from the pool for receiving data, if the socket has none.
+	if (!buffer.empty() || buffer.capacity() >= maxsize || pool.buffers.empty())
+		return;
+	buffer.swap(pool.buffers.back());
+	pool.buffers.pop_back();
+} // }}}
+
+void SocketBase::release_buffer() { // {{{
+	// All received data has been handled; give the buffer back to the pool.
+	buffer.clear();
+	buffer_start = 0;
+	if (buffer.capacity() <= std::string().capacity())
+		return;
+	if (buffer.capacity() <= BufferPool::max_capacity && pool.buffers.size() < BufferPool::max_buffers) {
+		pool.buffers.emplace_back();
+		pool.buffers.back().swap(buffer);
+	}
 	else
-		buffer += recv();
-	if (DEBUG > 3)
-		WL_log("new data; buffer:" + WebString(buffer).dump());
-	if (read_cb == nullptr)
+		std::string().swap(buffer);
+} // }}}
+
+void SocketBase::release_output() { // {{{
+	// All output has been written; give the queue back to the pool.
+	output.clear();
+	output_head = 0;
+	if (output.capacity() == 0)
+		return;
+	if (output.capacity() <= BufferPool::max_chunks && pool.queues.size() < BufferPool::max_buffers) {
+		pool.queues.emplace_back();
+		pool.queues.back().swap(output);
+	}
+	else
+		std::vector <OutputChunk>().swap(output);
+} // }}}
+// }}}
+
+bool SocketBase::fill() { // {{{
+	STARTFUNC;
+	// Append newly received data to the buffer.
+	// @return False if the socket was closed.
+	take_buffer();
+	if (buffer_start > 0 && buffer_start >= buffer.size() - buffer_start) {
+		// Discard consumed data. This never moves more bytes than were consumed, so the cost is amortised.
+		buffer.erase(0, buffer_start);
+		buffer_start = 0;
+	}
+	size_t old_size = buffer.size();
+	ssize_t num;
+	int error;
+	buffer.resize_and_overwrite(old_size + maxsize, [this, old_size, &num, &error](char *data, size_t) {
+		num = ::read(fd, data + old_size, maxsize);
+		error = errno;
+		return old_size + (num > 0 ? num : 0);
+	});
+	if (num < 0) {
+		if (error == EWOULDBLOCK || error == EAGAIN || error == EINTR)
+			return true;
+		WL_log(std::string("Error reading from socket: ") + strerror(error));
+		close();
 		return false;
-	(user->*read_cb)(buffer);
+	}
+	if (num == 0) {
+		bool have_server = server;
+		bool have_disconnect_cb = disconnect_cb != nullptr;
+		close();
+		if (DEBUG > 3)
+			WL_log("closed");
+		if (!have_disconnect_cb && !have_server)
+			throw "network connection closed";
+		return false;
+	}
+	if (DEBUG > 3)
+		WL_log("new data; buffer:" + WebString(buffer.substr(buffer_start)).dump());
 	return true;
 } // }}}
 
-bool SocketBase::handle_read_line_data(std::string &&data) { // {{{
+void SocketBase::dispatch() { // {{{
 	STARTFUNC;
-	if (buffer.empty())
-		buffer = std::move(data);
-	else
-		buffer += data;
-	if (read_lines_cb == nullptr)
-		return false;
-	auto p = buffer.find_first_of("\r\n");
-	while (p != std::string::npos) {
-		std::string line = buffer.substr(0, p);
-		if (buffer[p] == '\r' && p + 1 < buffer.size() && buffer[p + 1] == '\n')
-			buffer = buffer.substr(p + 2);
+	// Pass buffered data to the read callback.
+	// If a callback switches to another read mode, the remaining data is passed to the new callback.
+	if (dispatch_alive != nullptr)
+		return;	// Called from a read callback; the running dispatch will handle the new callback.
+	bool alive = true;
+	dispatch_alive = &alive;
+	AliveGuard guard(dispatch_alive, alive);
+	while (fd >= 0 && buffer_start < buffer.size()) {
+		unsigned generation = buffer_generation;
+		if (read_waiter != nullptr) {
+			if (!read_waiter->take())
+				break;
+			auto handle = read_waiter->handle;
+			read_waiter = nullptr;
+			coroutine::activate(&handle, nullptr);
+			if (!alive)
+				return;
+			// If the coroutine does not wait again and there is no callback, stop reading until it does, so the buffer does not grow.
+			if (read_waiter == nullptr && read_cb == nullptr && read_view_cb == nullptr && read_lines_cb == nullptr && rawread_cb == nullptr && read_handle != current_loop->invalid_io()) {
+				current_loop->remove_io(read_handle);
+				read_handle = current_loop->invalid_io();
+			}
+		}
+		else if (read_view_cb != nullptr) {
+			auto cb = read_view_cb;
+			size_t start = buffer_start;
+			size_t used = (user->*cb)(std::string_view(buffer).substr(start));
+			if (!alive)
+				return;
+			if (generation != buffer_generation)
+				continue;	// The buffer was taken away by the callback.
+			buffer_start = std::max(buffer_start, std::min(start + used, buffer.size()));
+			// The callback is called again until it does not use any data.
+			if (buffer_start == start && read_view_cb == cb)
+				break;
+		}
+		else if (read_cb != nullptr) {
+			auto cb = read_cb;
+			if (buffer_start > 0) {
+				buffer.erase(0, buffer_start);
+				buffer_start = 0;
+			}
+			(user->*cb)(buffer);
+			if (!alive)
+				return;
+			if (read_cb == cb)
+				break;
+		}
+		else if (read_lines_cb != nullptr) {
+			auto p = buffer.find_first_of("\r\n", buffer_start);
+			if (p == std::string::npos)
+				break;
+			std::string line = buffer.substr(buffer_start, p - buffer_start);
+			if (buffer[p] == '\r' && p + 1 < buffer.size() && buffer[p + 1] == '\n')
+				buffer_start = p + 2;
+			else
+				buffer_start = p + 1;
+			(user->*read_lines_cb)(line);
+			if (!alive)
+				return;
+		}
 		else
-			buffer = buffer.substr(p + 1);
-		(user->*read_lines_cb)(line);
-		p = buffer.find_first_of("\r\n");
+			break;	// Not reading, or using rawread; the data is kept for unread().
 	}
-	return true;
+	if (buffer_start == buffer.size())
+		release_buffer();
 } // }}}
 
-bool SocketBase::read_lines_impl() { // {{{
+bool SocketBase::read_impl() { // {{{
 	STARTFUNC;
-	return handle_read_line_data(recv());
+	if (fill())
+		dispatch();
+	return true;
 } // }}}
 
 void SocketBase::finish_move(SocketBase &&other) { // {{{
 	STARTFUNC;
 	if (server_data != std::list <SocketBase *>::iterator())
 		*server_data = this;
+	// The fd (or the connection that is being set up) is now owned by this socket.
+	if (connector != nullptr)
+		connector->socket = this;
+	if (read_waiter != nullptr)
+		read_waiter->socket = this;
+	if (write_waiter != nullptr)
+		write_waiter->socket = this;
+	other.read_waiter = nullptr;
+	other.write_waiter = nullptr;
+	other.connect_waiter = coroutine::handle_type();
+	other.fd = -1;
+	other.server = nullptr;
+	other.output.clear();
+	other.output_head = 0;
+	other.output_offset = 0;
+	other.output_size = 0;
+	other.congested = false;
+	other.flush_waiter = coroutine::handle_type();
+	other.buffer.clear();
+	other.buffer_start = 0;
+	++other.buffer_generation;
+	if (other.write_handle != current_loop->invalid_io()) {
+		current_loop->remove_io(other.write_handle);
+		other.write_handle = current_loop->invalid_io();
+		write_handle = current_loop->add_io(Loop::IoRecord(name, this, fd, POLLOUT, CbType(), &SocketBase::write_impl, &SocketBase::error_impl, get_io_timing()));
+	}
 	if (other.read_handle != current_loop->invalid_io()) {
 		//WL_log("resetting callback");
 		// Remove old read callback.
 		current_loop->remove_io(other.read_handle);
 		other.read_handle = current_loop->invalid_io();
-		other.fd = -1;
 		other.rawread_cb = SocketBase::RawReadType();
 		other.read_cb = SocketBase::ReadType();
+		other.read_view_cb = SocketBase::ReadViewType();
 		other.read_lines_cb = SocketBase::ReadLinesType();
 
 		// Set new read callback.
 		CbType read;
 		if (rawread_cb != nullptr)
 			read = &SocketBase::rawread_impl;
-		else if (read_cb != nullptr)
+		else if (read_cb != nullptr || read_view_cb != nullptr || read_lines_cb != nullptr || read_waiter != nullptr)
 			read = &SocketBase::read_impl;
-		else if (read_lines_cb != nullptr)
-			read = &SocketBase::read_lines_impl;
 		else
 			throw "read_handle was valid, but no callback was set";
 
-		read_handle = current_loop->add_io(Loop::IoRecord(name, this, fd, POLLIN | POLLPRI, read, CbType(), &SocketBase::error_impl));
+		read_handle = current_loop->add_io(Loop::IoRecord(name, this, fd, POLLIN | POLLPRI, read, CbType(), &SocketBase::error_impl, get_io_timing()));
 	}
 	//else
 		//WL_log("not resetting callback");
@@ -152,43 +859,119 @@ std::string SocketBase::recv() { // {{{
 		WL_log("recv on closed socket");
 		throw "recv on closed socket";
 	}
-	char buffer[maxsize];
-	auto num = ::read(fd, buffer, maxsize);
+	std::string ret;
+	ssize_t num;
+	int error;
+	ret.resize_and_overwrite(maxsize, [this, &num, &error](char *data, size_t size) {
+		num = ::read(fd, data, size);
+		error = errno;
+		return num > 0 ? num : 0;
+	});
 	if (num < 0) {
-		if (errno == EWOULDBLOCK || errno == EAGAIN)
+		if (error == EWOULDBLOCK || error == EAGAIN)
 			return std::string();
-		WL_log(std::string("Error reading from socket: ") + strerror(errno));
+		WL_log(std::string("Error reading from socket: ") + strerror(error));
 		return close();
 	}
 	if (num == 0) {
 		bool have_server = server;
-		std::string ret = close();
+		std::string pending = close();
 		if (DEBUG > 3)
 			WL_log("closed");
 		if (!disconnect_cb && !have_server)
 			throw "network connection closed";
-		return ret;
+		return pending;
 	}
-	return std::string(buffer, num);
+	return ret;
+} // }}}
+
+ssize_t SocketBase::recv_file(int file, size_t size, int const pipe[2]) { // {{{
+	STARTFUNC;
+	/* Move received data into a file without copying it through user space.
+	The data goes through pipe with splice().  This reads from the
+	socket directly, so it must only be used from a rawread()
+	callback, after the data that was buffered has been handled.
+	On EOF or error, the socket is closed.
+	@param file: fd to write the data to, at its current position.
+	@param size: maximum number of bytes to move.
+	@param pipe: an empty pipe, as created by pipe2(); it is
+		empty again when this returns.
+	@return The number of bytes that were written to file, or -1 if
+		the socket was closed.
+	*/
+	if (fd < 0)
+		return -1;
+	size_t done = 0;
+	while (done < size) {
+		ssize_t num = ::splice(fd, nullptr, pipe[1], nullptr, size - done, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (num < 0) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+				break;
+			WL_log(std::string("Error reading from socket: ") + strerror(errno));
+			close();
+			return -1;
+		}
+		if (num == 0) {
+			bool have_server = server;
+			bool have_disconnect_cb = disconnect_cb != nullptr;
+			close();
+			if (!have_disconnect_cb && !have_server)
+				throw "network connection closed";
+			return -1;
+		}
+		// Empty the pipe before reading more.
+		for (ssize_t left = num; left > 0; ) {
+			ssize_t written = ::splice(pipe[0], nullptr, file, nullptr, left, SPLICE_F_MOVE);
+			if (written <= 0) {
+				WL_log(std::string("Error writing received data to file: ") + strerror(errno));
+				close();
+				return -1;
+			}
+			left -= written;
+		}
+		done += num;
+	}
+	return done;
 } // }}}
 // }}}
 
 // Constructor- and destructor-related. {{{
-SocketBase::SocketBase(std::string const &name, int new_fd, URL const &address, UserBase *user, Loop *loop) : // {{{
+SocketBase::SocketBase(std::string const &name, int new_fd, URL const &address, UserBase *user, Loop *loop, Loop::Duration connect_timeout) : // {{{
 		fd(new_fd),
 		maxsize(4096),
 		current_loop(Loop::get(loop)),
 		read_handle(current_loop->invalid_io()),
+		write_handle(current_loop->invalid_io()),
 		buffer(),
+		buffer_start(0),
+		buffer_generation(0),
+		dispatch_alive(nullptr),
+		read_waiter(nullptr),
+		output(),
+		output_head(0),
+		output_offset(0),
+		output_size(0),
+		high_watermark(default_high_watermark),
+		low_watermark(default_low_watermark),
+		congested(false),
+		not_socket(false),
+		flush_waiter(),
+		write_waiter(nullptr),
+		connector(),
+		connect_waiter(),
 		server(nullptr),
 		server_data(),
-		name(name),
+		name(debug_names ? name : std::string()),
+		io_timing(nullptr),
 		user(user),
 		rawread_cb(nullptr),
 		read_cb(nullptr),
+		read_view_cb(nullptr),
 		read_lines_cb(nullptr),
 		disconnect_cb(nullptr),
 		error_cb(nullptr),
+		drain_cb(nullptr),
+		connect_cb(nullptr),
 		url(address)
 {
 	STARTFUNC;
@@ -199,6 +982,10 @@ SocketBase::SocketBase(std::string const &name, int new_fd, URL const &address,
 	socket, it is a port number or service name, optionally
 	prefixed with a hostname and a :.  If no hostname is present,
 	localhost is used.
+	@param connect_timeout: time that setting up the connection may
+		take, including the name lookup; 0 for no limit.  When it
+		fails, the error callback is called and the socket is
+		closed.
 	*/
 	
 	// Only connect to url if fd is invalid.
@@ -212,58 +999,19 @@ SocketBase::SocketBase(std::string const &name, int new_fd, URL const &address,
 		url.host = "localhost";
 	}
 
-	// Set up the connection.
+	// Set up the connection in the background.
+	connector = std::make_shared <Connector> (this, current_loop, connect_timeout);
 	if (!url.unix.empty()) {
 		// Unix domain socket.
-		fd = socket(AF_UNIX, SOCK_STREAM, 0);
-		struct sockaddr_un addr;
-		addr.sun_family = AF_UNIX;
-		strncpy(addr.sun_path, url.unix.c_str(), sizeof(addr.sun_path) - 1);
-		connect(fd, reinterpret_cast <sockaddr *>(&addr), sizeof(addr));
-	}
-	else {
-		struct addrinfo addr_hint;
-		addr_hint.ai_family = AF_UNSPEC;
-		addr_hint.ai_socktype = SOCK_STREAM;
-		addr_hint.ai_protocol = IPPROTO_TCP;
-		addr_hint.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
-		struct addrinfo *addr;
-		int code = getaddrinfo(url.host.c_str(), url.service.c_str(), &addr_hint, &addr);
-		if (code != 0) {
-			std::cerr << url.src << std::endl;
-			std::cerr << "unable to open socket: " << gai_strerror(code) << std::endl;
-			throw "unable to open socket";
-		}
-		fd = -1;
-		for (auto rp = addr; rp; rp = rp->ai_next) {
-			fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-			if (DEBUG > 3)
-				WL_log("attempt to connect; fd = " + std::to_string(fd));
-			if (fd < 0) {
-				std::cerr << "unable to open socket: " << strerror(errno) << std::endl;
-				continue;
-			}
-			if (connect(fd, rp->ai_addr, rp->ai_addrlen) < 0) {
-				if (!rp->ai_next || errno != ECONNREFUSED) {
-					std::cerr << url.src << std::endl;
-					std::cerr << "unable to connect socket: " << strerror(errno) << std::endl;
-				}
-				fd = -1;
-				continue;
-			}
-			break;
-		}
-		freeaddrinfo(addr);
-		if (fd < 0) {
-			std::cerr << "unable to connect any socket" << std::endl;
-			throw "unable to connect any socket";
-		}
-	}
-	int flags = fcntl(fd, F_GETFL);
-	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
-		std::cerr << "unable to set socket to nonblocking: " << strerror(errno) << std::endl;
-		throw "unable to set socket to nonblocking";
+		Connector::Address address {};
+		sockaddr_un *addr = reinterpret_cast <sockaddr_un *>(&address.addr);
+		addr->sun_family = AF_UNIX;
+		strncpy(addr->sun_path, url.unix.c_str(), sizeof(addr->sun_path) - 1);
+		address.size = sizeof(sockaddr_un);
+		connector->start({address});
 	}
+	else
+		connector->resolve(url.host, url.service, connector);
 } // }}}
 
 SocketBase::SocketBase(std::string const &name) : // {{{
@@ -271,16 +1019,37 @@ SocketBase::SocketBase(std::string const &name) : // {{{
 		maxsize(4096),
 		current_loop(Loop::get()),
 		read_handle(current_loop->invalid_io()),
+		write_handle(current_loop->invalid_io()),
 		buffer(),
+		buffer_start(0),
+		buffer_generation(0),
+		dispatch_alive(nullptr),
+		read_waiter(nullptr),
+		output(),
+		output_head(0),
+		output_offset(0),
+		output_size(0),
+		high_watermark(default_high_watermark),
+		low_watermark(default_low_watermark),
+		congested(false),
+		not_socket(false),
+		flush_waiter(),
+		write_waiter(nullptr),
+		connector(),
+		connect_waiter(),
 		server(nullptr),
 		server_data(),
-		name(name),
+		name(debug_names ? name : std::string()),
+		io_timing(nullptr),
 		user(nullptr),
 		rawread_cb(nullptr),
 		read_cb(nullptr),
+		read_view_cb(nullptr),
 		read_lines_cb(nullptr),
 		disconnect_cb(nullptr),
 		error_cb(nullptr),
+		drain_cb(nullptr),
+		connect_cb(nullptr),
 		url()
 {
 	STARTFUNC;
@@ -292,16 +1061,37 @@ SocketBase::SocketBase(SocketBase &&other) : // {{{
 		maxsize(other.maxsize),
 		current_loop(other.current_loop),
 		read_handle(current_loop->invalid_io()),
+		write_handle(current_loop->invalid_io()),
 		buffer(std::move(other.buffer)),
+		buffer_start(other.buffer_start),
+		buffer_generation(0),
+		dispatch_alive(nullptr),
+		read_waiter(other.read_waiter),
+		output(std::move(other.output)),
+		output_head(other.output_head),
+		output_offset(other.output_offset),
+		output_size(other.output_size),
+		high_watermark(other.high_watermark),
+		low_watermark(other.low_watermark),
+		congested(other.congested),
+		not_socket(other.not_socket),
+		flush_waiter(other.flush_waiter),
+		write_waiter(other.write_waiter),
+		connector(std::move(other.connector)),
+		connect_waiter(other.connect_waiter),
 		server(other.server),
 		server_data(other.server_data),
 		name(other.name),
+		io_timing(other.io_timing),
 		user(other.user),
 		rawread_cb(other.rawread_cb),
 		read_cb(other.read_cb),
+		read_view_cb(other.read_view_cb),
 		read_lines_cb(other.read_lines_cb),
 		disconnect_cb(other.disconnect_cb),
 		error_cb(other.error_cb),
+		drain_cb(other.drain_cb),
+		connect_cb(other.connect_cb),
 		url(std::move(other.url))
 {
 	STARTFUNC;
@@ -312,22 +1102,42 @@ SocketBase::SocketBase(SocketBase &&other) : // {{{
 SocketBase &SocketBase::operator=(SocketBase &&other) { // {{{
 	STARTFUNC;
 	unread();
+	clear_output();
 	fd = other.fd;
 	maxsize = other.maxsize;
 	current_loop = other.current_loop;
 	read_handle = current_loop->invalid_io();
-	read_cb = other.read_cb;
+	write_handle = current_loop->invalid_io();
 	buffer = std::move(other.buffer);
+	buffer_start = other.buffer_start;
+	++buffer_generation;
+	read_waiter = other.read_waiter;
+	output = std::move(other.output);
+	output_head = other.output_head;
+	output_offset = other.output_offset;
+	output_size = other.output_size;
+	high_watermark = other.high_watermark;
+	low_watermark = other.low_watermark;
+	congested = other.congested;
+	not_socket = other.not_socket;
+	flush_waiter = other.flush_waiter;
+	write_waiter = other.write_waiter;
+	connector = std::move(other.connector);
+	connect_waiter = other.connect_waiter;
 	server = other.server;
 	server_data = other.server_data;
 	name = other.name;
+	io_timing = other.io_timing;
 	disconnect_cb = other.disconnect_cb;
 	user = other.user;
 	rawread_cb = other.rawread_cb;
 	read_cb = other.read_cb;
+	read_view_cb = other.read_view_cb;
 	read_lines_cb = other.read_lines_cb;
 	disconnect_cb = other.disconnect_cb;
 	error_cb = other.error_cb;
+	drain_cb = other.drain_cb;
+	connect_cb = other.connect_cb;
 	url = std::move(other.url);
 	finish_move(std::move(other));
 	return *this;
@@ -337,45 +1147,309 @@ std::string SocketBase::close() { // {{{
 	STARTFUNC;
 	// Close the network connection.
 	// @return The data that was remaining in the line buffer, if any.
-	if (fd < 0)
+	if (!*this)
 		return "";
 	std::string pending = unread();
-	::close(fd);
+	if (write_handle != current_loop->invalid_io()) {
+		current_loop->remove_io(write_handle);
+		write_handle = current_loop->invalid_io();
+	}
+	if (connector != nullptr)
+		connector.reset();	// There is no fd yet; output that was queued is discarded.
+	else if (output_size > 0) {
+		// Let the remaining output be written in the background; the linger object closes the fd when it is done.
+		new Linger(current_loop, fd, not_socket, std::move(output), output_head, output_offset);
+		output.clear();
+	}
+	else
+		::close(fd);
 	fd = -1;
+	clear_output();
 	if (server)
 		server->remote_disconnect(this->server_data);
 	if (disconnect_cb != nullptr) {
 		assert(user != nullptr);
 		(user->*disconnect_cb)();
 	}
+	if (flush_waiter != coroutine::handle_type()) {
+		auto waiter = flush_waiter;
+		flush_waiter = coroutine::handle_type();
+		coroutine::activate(&waiter);
+	}
+	if (connect_waiter != coroutine::handle_type()) {
+		auto waiter = connect_waiter;
+		connect_waiter = coroutine::handle_type();
+		coroutine::activate(&waiter);
+	}
+	// Cancel the awaiters; their results are already empty and false.
+	if (read_waiter != nullptr) {
+		auto handle = read_waiter->handle;
+		read_waiter = nullptr;
+		coroutine::activate(&handle, nullptr);
+	}
+	if (write_waiter != nullptr) {
+		auto handle = write_waiter->handle;
+		write_waiter = nullptr;
+		coroutine::activate(&handle, nullptr);
+	}
 	return pending;
 } // }}}
 // }}}
 
-void SocketBase::send(std::string const &data) { // {{{
+bool SocketBase::send(std::initializer_list <std::string_view> data) { // {{{
 	STARTFUNC;
 	/* Send data over the network.
-	Send data over the network.  Block until all data is in the buffer.
-	@param data: data to write.  This should be of type bytes.
-	@return None.
+	Send data over the network.  This does not block: data that
+	cannot be written immediately is queued and written when the
+	socket is ready for it.  All parts are written with one system
+	call, if possible.
+	@param data: parts of the data to write.
+	@return False if the socket is closed or the output queue is
+		larger than the high watermark; the caller should then
+		stop producing data until drain_cb is called.
 	*/
-	if (fd < 0)
-		return;
-	if (DEBUG > 3)
-		WL_log("Sending: " + WebString(data).dump());
-	size_t p = 0;
-	while (p < data.size()) {
-		ssize_t n = write(fd, &data[p], data.size() - p);
+	if (!*this)
+		return false;
+	size_t total = 0;
+	for (auto &part: data) {
+		if (DEBUG > 3)
+			WL_log("Sending: " + WebString(std::string(part)).dump());
+		total += part.size();
+	}
+	size_t written = 0;
+	if (output_size == 0 && fd >= 0 && data.size() <= size_t(max_iov)) {
+		// Nothing is queued, so data can be written directly. With more parts than fit in one call, they are all queued.
+		std::array <struct iovec, max_iov> iov;
+		int n = 0;
+		for (auto &part: data)
+			iov[n++] = {const_cast <char *>(part.data()), part.size()};
+		ssize_t num = writev_fd(fd, not_socket, iov.data(), n);
 		if (DEBUG > 4)
-			WL_log("written " + std::to_string(n) + " bytes");
-		if (n <= 0) {
-			std::cerr << "failed to write data to socket";
+			WL_log("written " + std::to_string(num) + " bytes");
+		if (num < 0) {
+			std::cerr << "failed to write data to socket: " << strerror(errno) << std::endl;
+			close();
+			return false;
+		}
+		written = num;
+		if (written == total)
+			return true;
+	}
+	// Queue the remaining data as a single chunk.
+	std::string rest;
+	rest.reserve(total - written);
+	for (auto &part: data) {
+		if (written >= part.size()) {
+			written -= part.size();
+			continue;
+		}
+		rest.append(part.substr(written));
+		written = 0;
+	}
+	queue_output(OutputChunk(std::move(rest)));
+	return !congested;
+} // }}}
+
+bool SocketBase::send_file(int file, off_t offset, size_t size) { // {{{
+	STARTFUNC;
+	/* Send part of a file over the network.
+	The data is sent with sendfile(), or splice() if file is a pipe,
+	so it is not copied through user space.  Like send(), this does
+	not block.
+	@param file: fd to send data from; it is closed by the socket
+		after the data has been sent, or when the socket is closed.
+	@param offset: position in the file of the first byte to send;
+		ignored for pipes.
+	@param size: number of bytes to send.
+	@return False if the socket is closed or congested.
+	*/
+	if (!*this) {
+		::close(file);
+		return false;
+	}
+	struct stat st;
+	bool pipe = ::fstat(file, &st) == 0 && S_ISFIFO(st.st_mode);
+	bool idle = output_size == 0 && fd >= 0;
+	queue_output(OutputChunk(file, pipe, offset, size));
+	if (idle) {
+		// Nothing was queued before, so start sending immediately.
+		if (!flush())
+			return false;
+		if (output_size == 0) {
+			current_loop->remove_io(write_handle);
+			write_handle = current_loop->invalid_io();
+			congested = false;
+		}
+	}
+	return !congested;
+} // }}}
+
+bool SocketBase::send_shared(std::shared_ptr <std::string const> const &data) { // {{{
+	STARTFUNC;
+	/* Send a buffer that is shared, for example by many sockets.
+	This works like send(), but if the data cannot be written
+	immediately, the queue keeps a reference to the buffer instead
+	of a copy of the data.
+	@param data: the data to send; it must not be changed after this
+		call.
+	@return False if the socket is closed or congested.
+	*/
+	if (!*this)
+		return false;
+	size_t written = 0;
+	if (output_size == 0 && fd >= 0) {
+		struct iovec iov {const_cast <char *>(data->data()), data->size()};
+		ssize_t num = writev_fd(fd, not_socket, &iov, 1);
+		if (num < 0) {
+			std::cerr << "failed to write data to socket: " << strerror(errno) << std::endl;
 			close();
+			return false;
 		}
-		p += n;
+		written = num;
+		if (written == data->size())
+			return true;
 	}
+	// The queue was empty if anything was written, so this chunk is the head, and written is its offset.
+	// output_size is 0 then; subtracting first wraps it, but queue_output() adds the whole chunk, so the congestion check sees the right size.
+	output_offset += written;
+	output_size -= written;
+	queue_output(OutputChunk(data));
+	return !congested;
 } // }}}
 
+void SocketBase::queue_output(OutputChunk &&chunk) { // {{{
+	STARTFUNC;
+	output_size += chunk.size();
+	if (output.capacity() == 0 && !pool.queues.empty()) {
+		output.swap(pool.queues.back());
+		pool.queues.pop_back();
+	}
+	output.push_back(std::move(chunk));
+	if (output_size > high_watermark)
+		congested = true;
+	// While connecting, the write handle is registered when the connection is set up.
+	if (write_handle == current_loop->invalid_io() && fd >= 0)
+		write_handle = current_loop->add_io(Loop::IoRecord(name, this, fd, POLLOUT, CbType(), &SocketBase::write_impl, &SocketBase::error_impl, get_io_timing()));
+} // }}}
+
+bool SocketBase::flush() { // {{{
+	STARTFUNC;
+	// Write as much queued data as possible. Return false if the socket was closed because of an error.
+	ssize_t num = write_output(fd, not_socket, output, output_head, output_offset);
+	if (num < 0) {
+		std::cerr << "failed to write data to socket: " << strerror(errno) << std::endl;
+		clear_output();
+		close();
+		return false;
+	}
+	output_size -= num;
+	if (output_head == output.size())
+		release_output();
+	else if (output_head >= 32 && output_head * 2 >= output.size()) {
+		// Drop written chunks once they are the majority, so a socket that never drains completely doesn't grow without bounds.
+		output.erase(output.begin(), output.begin() + output_head);
+		output_head = 0;
+	}
+	return true;
+} // }}}
+
+bool SocketBase::write_impl() { // {{{
+	STARTFUNC;
+	// The write handle is managed here, so this always returns true.
+	if (!flush())
+		return true;
+	if (output_size == 0) {
+		current_loop->remove_io(write_handle);
+		write_handle = current_loop->invalid_io();
+	}
+	if (congested && output_size <= low_watermark) {
+		congested = false;
+		if (drain_cb != nullptr)
+			(user->*drain_cb)();
+	}
+	if (output_size == 0 && flush_waiter != coroutine::handle_type()) {
+		auto waiter = flush_waiter;
+		flush_waiter = coroutine::handle_type();
+		coroutine::activate(&waiter);
+	}
+	if (output_size == 0 && write_waiter != nullptr) {
+		auto handle = write_waiter->handle;
+		write_waiter->result = true;
+		write_waiter = nullptr;
+		coroutine::activate(&handle, nullptr);
+	}
+	return true;
+} // }}}
+
+void SocketBase::clear_output() { // {{{
+	STARTFUNC;
+	// Discard pending output.
+	if (write_handle != current_loop->invalid_io()) {
+		current_loop->remove_io(write_handle);
+		write_handle = current_loop->invalid_io();
+	}
+	release_output();
+	output_offset = 0;
+	output_size = 0;
+	congested = false;
+} // }}}
+
+coroutine SocketBase::wait_for_flush() { // {{{
+	STARTFUNC;
+	if (bool(*this) && output_size > 0) {
+		flush_waiter = GetHandle();
+		co_yield WebNone::create();
+	}
+	co_return WebNone::create();
+} // }}}
+
+// Awaitables. {{{
+bool SocketBase::ReadAwaiter::take() { // {{{
+	STARTFUNC;
+	size_t available = socket->buffer.size() - socket->buffer_start;
+	if (available == 0)
+		return false;
+	size_t size = std::min(available, limit);
+	if (!delimiter.empty()) {
+		if (searched > available)
+			searched = 0;	// The buffer was taken away with unread().
+		// Only search the new data, and the end of the old data in case the delimiter started there.
+		size_t from = searched >= delimiter.size() ? searched - delimiter.size() + 1 : 0;
+		size_t p = socket->buffer.find(delimiter, socket->buffer_start + from);
+		if (p != std::string::npos)
+			size = std::min(p - socket->buffer_start + delimiter.size(), limit);
+		else if (available < limit) {
+			searched = available;
+			return false;
+		}
+	}
+	result.assign(socket->buffer, socket->buffer_start, size);
+	socket->buffer_start += size;
+	if (socket->buffer_start == socket->buffer.size())
+		socket->release_buffer();
+	return true;
+} // }}}
+
+void SocketBase::ReadAwaiter::await_suspend(coroutine::handle_type handle) { // {{{
+	STARTFUNC;
+	if (socket->read_waiter != nullptr)
+		throw "another coroutine is already reading from this socket";
+	this->handle = handle;
+	socket->read_waiter = this;
+	// The coroutine is resumed from dispatch(), when enough data has been received.
+	socket->start_reading();
+} // }}}
+
+void SocketBase::WriteAwaiter::await_suspend(coroutine::handle_type handle) { // {{{
+	STARTFUNC;
+	if (socket->write_waiter != nullptr)
+		throw "another coroutine is already waiting for writing to this socket";
+	this->handle = handle;
+	result = false;	// Unless the output is flushed before the socket is closed.
+	socket->write_waiter = this;
+} // }}}
+// }}}
+
 // Reading. {{{
 std::string SocketBase::rawread_base(RawReadType callback) { // {{{
 	STARTFUNC;
@@ -387,15 +1461,32 @@ std::string SocketBase::rawread_base(RawReadType callback) { // {{{
 	@param error: function to be called if there is an error on the socket.
 	@return The data that was remaining in the line buffer, if any.
 	*/
-	if (fd < 0)
+	if (!*this)
 		return std::string();
 	std::string ret = unread();
 	rawread_cb = callback;
-	Loop::IoRecord read_item {name, this, fd, POLLIN | POLLPRI, &SocketBase::rawread_impl, CbType(), &SocketBase::error_impl};
+	if (fd < 0)
+		return ret;	// Registered when the connection is set up.
+	Loop::IoRecord read_item {name, this, fd, POLLIN | POLLPRI, &SocketBase::rawread_impl, CbType(), &SocketBase::error_impl, get_io_timing()};
 	read_handle = current_loop->add_io(read_item);
 	return ret;
 } // }}}
 
+void SocketBase::start_reading() { // {{{
+	STARTFUNC;
+	// Register read_impl in the loop, unless it is already registered.
+	if (read_handle != current_loop->invalid_io()) {
+		if (rawread_cb == nullptr)
+			return;
+		current_loop->remove_io(read_handle);
+	}
+	rawread_cb = nullptr;
+	if (fd < 0)
+		return;	// Registered when the connection is set up.
+	Loop::IoRecord read_item {name, this, fd, POLLIN | POLLPRI, &SocketBase::read_impl, CbType(), &SocketBase::error_impl, get_io_timing()};
+	read_handle = current_loop->add_io(read_item);
+} // }}}
+
 void SocketBase::read_base(ReadType callback) { // {{{
 	STARTFUNC;
 	/* Register function to be called when data is received.
@@ -403,23 +1494,39 @@ void SocketBase::read_base(ReadType callback) { // {{{
 	data that was remaining in the line buffer, if any, is sent to
 	the callback immediately.
 	@param callback: function to call when data is available.  The
-	data is passed as a parameter.
-	@param error: function to be called if there is an error on the
-	socket.
-	@param maxsize: buffer size that is used for the recv call.
+	buffer is passed as a parameter; the callback should remove the
+	data that it has handled from it.
 	@return None.
 	*/
 	if (DEBUG > 4)
 		WL_log("fd:" + std::to_string(fd));
-	if (fd < 0)
+	if (!*this)
 		return;
-	std::string first = unread();
-	maxsize = maxsize;
+	read_view_cb = nullptr;
+	read_lines_cb = nullptr;
 	read_cb = callback;
-	Loop::IoRecord read_item {name, this, fd, POLLIN | POLLPRI, &SocketBase::read_impl, CbType(), &SocketBase::error_impl};
-	read_handle = current_loop->add_io(read_item);
-	if (!first.empty())
-		(user->*read_cb)(first);
+	start_reading();
+	dispatch();
+} // }}}
+
+void SocketBase::read_base(ReadViewType callback) { // {{{
+	STARTFUNC;
+	/* Register function to be called when data is received.
+	The callback is passed a view of all pending data, and returns
+	the number of bytes it has used; the rest is passed again when
+	more data arrives.  While it uses data, it is called again with
+	what remains.  Data that was remaining in the line buffer, if
+	any, is sent to the callback immediately.
+	@param callback: function to call when data is available.
+	@return None.
+	*/
+	if (!*this)
+		return;
+	read_cb = nullptr;
+	read_lines_cb = nullptr;
+	read_view_cb = callback;
+	start_reading();
+	dispatch();
 } // }}}
 
 void SocketBase::read_lines_base(ReadLinesType callback) { // {{{
@@ -429,22 +1536,27 @@ void SocketBase::read_lines_base(ReadLinesType callback) { // {{{
 	decoded as an utf-8 string and passed to the callback.
 	@param callback: function that is called when a line is
 	received.  The line is passed as a str parameter.
-	@param error: function that is called when there is an error on
-	the socket.
-	@param maxsize: used for the recv calls that are made.  The
-	returned data accumulates until a newline is received; this is
-	not a limit on the line length.
 	@return None.
 	*/
-	if (fd < 0)
+	if (!*this)
 		return;
-	std::string first = unread();
-	maxsize = maxsize;
+	read_cb = nullptr;
+	read_view_cb = nullptr;
 	read_lines_cb = callback;
-	Loop::IoRecord read_item {name, this, fd, POLLIN | POLLPRI, &SocketBase::read_lines_impl, CbType(), &SocketBase::error_impl};
-	read_handle = current_loop->add_io(read_item);
-	if (!first.empty())
-		handle_read_line_data(std::move(first));
+	start_reading();
+	dispatch();
+} // }}}
+
+void SocketBase::stop_reading() { // {{{
+	STARTFUNC;
+	if (read_handle != current_loop->invalid_io()) {
+		current_loop->remove_io(read_handle);
+		read_handle = current_loop->invalid_io();
+	}
+	rawread_cb = SocketBase::RawReadType();
+	read_cb = SocketBase::ReadType();
+	read_view_cb = SocketBase::ReadViewType();
+	read_lines_cb = SocketBase::ReadLinesType();
 } // }}}
 
 std::string SocketBase::unread() { // {{{
@@ -454,17 +1566,11 @@ std::string SocketBase::unread() { // {{{
 	@return Bytes left in the line buffer, if any.  The line buffer
 		is cleared.
 	*/
-	//WL_log("unreading");
-	if (read_handle != current_loop->invalid_io()) {
-		//WL_log("unreading active");
-		current_loop->remove_io(read_handle);
-		read_handle = current_loop->invalid_io();
-		rawread_cb = SocketBase::RawReadType();
-		read_cb = SocketBase::ReadType();
-		read_lines_cb = SocketBase::ReadLinesType();
-	}
-	std::string ret = std::move(buffer);
+	stop_reading();
+	std::string ret = buffer_start == 0 ? std::move(buffer) : buffer.substr(buffer_start);
 	buffer.clear();
+	buffer_start = 0;
+	++buffer_generation;
 	return ret;
 } // }}}
 // }}}
@@ -475,6 +1581,8 @@ void ServerBase::remote_disconnect(std::list <SocketBase *>::iterator socket) {
 	STARTFUNC;
 	(*socket)->server = nullptr;
 	remotes.erase(socket);
+	if (paused)
+		resume();
 } // }}}
 
 void ServerBase::open_socket(std::string const &service, int backlog) { // {{{
@@ -483,7 +1591,7 @@ void ServerBase::open_socket(std::string const &service, int backlog) { // {{{
 	auto p = service.find("/");
 	if (p != std::string::npos) {
 		// Unix domain socket.
-		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 		if (fd < 0) {
 			std::cerr << "unable to open unix socket: " << strerror(errno) << std::endl;
 			throw "unable to open socket";
@@ -495,7 +1603,12 @@ void ServerBase::open_socket(std::string const &service, int backlog) { // {{{
 			std::cerr << "unable to bind unix socket: " << strerror(errno) << std::endl;
 			throw "unable to open socket";
 		}
-		listeners.emplace_back("unix domain", this, fd);
+		if (listen(fd, backlog) < 0) {
+			std::cerr << "unable to listen on unix socket: " << strerror(errno) << std::endl;
+			::close(fd);
+			throw "unable to open socket";
+		}
+		listeners.emplace_back("unix domain", this, fd, listenloop, false);
 	}
 	else {
 		struct addrinfo addr_hint;
@@ -510,13 +1623,16 @@ void ServerBase::open_socket(std::string const &service, int backlog) { // {{{
 			throw "unable to open socket";
 		}
 		for (auto rp = addr; rp; rp = rp->ai_next) {
-			int fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+			// Listening sockets must not block, so they can be drained with accept() until it fails.
+			int fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
 			if (fd < 0) {
 				std::cerr << "unable to create socket: " << strerror(errno) << std::endl;
 				continue;
 			}
 			int t = 1;
 			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t));
+			if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t)) < 0)
+				std::cerr << "unable to set SO_REUSEPORT: " << strerror(errno) << std::endl;
 			if (bind(fd, rp->ai_addr, rp->ai_addrlen) < 0) {
 				if (listeners.empty() || errno != EADDRINUSE)
 					std::cerr << "unable to bind: " << strerror(errno) << std::endl;
@@ -528,7 +1644,7 @@ void ServerBase::open_socket(std::string const &service, int backlog) { // {{{
 				::close(fd);
 				continue;
 			}
-			listeners.emplace_back("tcp/ip", this, fd);
+			listeners.emplace_back("tcp/ip", this, fd, listenloop, true);
 		}
 		freeaddrinfo(addr);
 		if (listeners.empty()) {
@@ -536,26 +1652,50 @@ void ServerBase::open_socket(std::string const &service, int backlog) { // {{{
 			throw "unable to bind socket";
 		}
 	}
-	for (auto &s: listeners) {
-		int flags = fcntl(s.fd, F_GETFL);
-		if (flags == -1 || fcntl(s.fd, F_SETFL, flags | O_NONBLOCK) != 0) {
-			std::cerr << "unable to set socket to nonblocking: " << strerror(errno) << std::endl;
-			throw "unable to set socket to nonblocking";
+} // }}}
+
+void ServerBase::Listener::accept_remote() { // {{{
+	STARTFUNC;
+	// Accept all pending connections, so a burst of them doesn't need a wakeup per connection.
+	// The create callback may close the server, which destroys this object.
+	bool is_alive = true;
+	alive = &is_alive;
+	AliveGuard guard(alive, is_alive);
+	for (int i = 0; i < max_accept_batch && server->admit(); ++i) {
+		struct sockaddr_un addr;	// Use largest struct; cast down for others.
+		socklen_t addrlen = sizeof(addr);
+		// Writes must not block.
+		int new_fd = ::accept4(fd, reinterpret_cast <struct sockaddr *>(&addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				// Out of file descriptors; the connection stays in the backlog. Retry later instead of waking up for it continuously.
+				std::cerr << "unable to accept connection: " << strerror(errno) << std::endl;
+				server->pause();
+				server->schedule_resume(server->listenloop->now() + accept_retry_delay);
+			}
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+				std::cerr << "unable to accept connection: " << strerror(errno) << std::endl;
+			break;
 		}
+		if (server->accept_rate > 0)
+			server->accept_tokens -= 1;
+		create_remote(new_fd, addr, addrlen);
+		if (!is_alive)
+			return;
 	}
 } // }}}
 
-void ServerBase::Listener::accept_remote() { // {{{
+void ServerBase::Listener::create_remote(int new_fd, struct sockaddr_un &addr, socklen_t addrlen) { // {{{
 	STARTFUNC;
-	struct sockaddr_un addr;	// Use largest struct; cast down for others.
-	socklen_t addrlen = sizeof(addr);
-	int new_fd = ::accept(fd, reinterpret_cast <struct sockaddr *>(&addr), &addrlen);
 	if (addrlen > sizeof(addr)) {
 		std::cerr << "Warning: remote address is truncated" << std::endl;
 		addrlen = sizeof(addr);
 	}
 	// Create a generic socket; move it to the correct type later.
-	Socket <SocketBase::UserBase> remote("incoming on " + name, new_fd, nullptr);
+	// The connection is handled by the loop that accepted it.
+	Socket <SocketBase::UserBase> remote("incoming on " + name, new_fd, nullptr, server->listenloop);
 	server->remotes.push_back(&remote);
 	remote.server = server;
 	remote.server_data = --server->remotes.end();
@@ -608,12 +1748,23 @@ ServerBase::ServerBase( // {{{
 		ClosedType closed,
 		ErrorType error,
 		Loop *loop,
-		int backlog
+		int backlog,
+		bool reuse_port
 	) :
 		listenloop(Loop::get(loop)),
 		listeners(),
 		active_backlog(backlog),
+		reuse_port(reuse_port),
 		remotes(),
+		max_connections(0),
+		accept_rate(0),
+		accept_burst(1),
+		accept_tokens(1),
+		accept_refill(listenloop->now()),
+		resume_handle(),
+		resume_time(),
+		paused(false),
+		pauses(&listenloop->metrics().counter("webloop_accept_pauses_total", "Times that a server stopped accepting connections, because of a limit.")),
 		owner(owner),
 		create_cb(create),
 		closed_cb(closed),
@@ -630,7 +1781,17 @@ ServerBase::ServerBase(ServerBase &&other) : // {{{
 	listenloop(other.listenloop),
 	listeners(std::move(other.listeners)),
 	active_backlog(other.active_backlog),
+	reuse_port(other.reuse_port),
 	remotes(std::move(other.remotes)),
+	max_connections(other.max_connections),
+	accept_rate(other.accept_rate),
+	accept_burst(other.accept_burst),
+	accept_tokens(other.accept_tokens),
+	accept_refill(other.accept_refill),
+	resume_handle(),
+	resume_time(),
+	paused(other.paused),
+	pauses(other.pauses),
 	owner(other.owner),
 	create_cb(other.create_cb),
 	closed_cb(other.closed_cb),
@@ -639,6 +1800,9 @@ ServerBase::ServerBase(ServerBase &&other) : // {{{
 	STARTFUNC;
 	for (auto &l: listeners)
 		l.server = this;
+	for (auto r: remotes)
+		r->server = this;
+	take_resume(other);
 } // }}}
 
 ServerBase &ServerBase::operator=(ServerBase &&other) { // {{{
@@ -646,24 +1810,163 @@ ServerBase &ServerBase::operator=(ServerBase &&other) { // {{{
 	listenloop = other.listenloop;
 	listeners = std::move(other.listeners);
 	active_backlog = other.active_backlog;
+	reuse_port = other.reuse_port;
 	remotes = std::move(other.remotes);
+	max_connections = other.max_connections;
+	accept_rate = other.accept_rate;
+	accept_burst = other.accept_burst;
+	accept_tokens = other.accept_tokens;
+	accept_refill = other.accept_refill;
+	paused = other.paused;
+	pauses = other.pauses;
 	owner = other.owner;
 	create_cb = other.create_cb;
 	closed_cb = other.closed_cb;
 	error_cb = other.error_cb;
 	for (auto &l: listeners)
 		l.server = this;
+	for (auto r: remotes)
+		r->server = this;
+	take_resume(other);
 	return *this;
 } // }}}
 
 void ServerBase::close() { // {{{
 	STARTFUNC;
-	while (!remotes.empty())
-		remotes.back()->close();
+	// Close the listeners first, so closing the remotes doesn't resume them.
+	cancel_resume();
 	while (!listeners.empty()) {
 		listeners.back().socket.close();
 		listeners.pop_back();
 	}
+	paused = false;
+	while (!remotes.empty())
+		remotes.back()->close();
+} // }}}
+
+void ServerBase::set_backlog(int backlog) { // {{{
+	STARTFUNC;
+	// Calling listen() again changes the backlog of a listening socket.
+	active_backlog = backlog;
+	for (auto &l: listeners) {
+		if (listen(l.fd, backlog) < 0)
+			std::cerr << "unable to change backlog: " << strerror(errno) << std::endl;
+	}
+} // }}}
+
+void ServerBase::set_tcp_option(int option, int value, char const *name) { // {{{
+	STARTFUNC;
+	for (auto &l: listeners) {
+		if (!l.tcp)
+			continue;
+		if (setsockopt(l.fd, IPPROTO_TCP, option, &value, sizeof(value)) < 0)
+			std::cerr << "unable to set " << name << ": " << strerror(errno) << std::endl;
+	}
+} // }}}
+
+void ServerBase::set_defer_accept(int timeout) { // {{{
+	STARTFUNC;
+	set_tcp_option(TCP_DEFER_ACCEPT, timeout, "TCP_DEFER_ACCEPT");
+} // }}}
+
+void ServerBase::set_fastopen(int queue_length) { // {{{
+	STARTFUNC;
+	set_tcp_option(TCP_FASTOPEN, queue_length, "TCP_FASTOPEN");
+} // }}}
+// }}}
+
+// Admission control. {{{
+void ServerBase::set_max_connections(size_t max) { // {{{
+	STARTFUNC;
+	max_connections = max;
+	if (paused)
+		resume();
+} // }}}
+
+void ServerBase::set_accept_rate(double rate, double burst) { // {{{
+	STARTFUNC;
+	accept_rate = rate;
+	accept_burst = std::max(burst, 1.);
+	accept_tokens = accept_burst;
+	accept_refill = listenloop->now();
+	cancel_resume();
+	if (paused)
+		resume();
+} // }}}
+
+bool ServerBase::admit() { // {{{
+	STARTFUNC;
+	if (max_connections != 0 && remotes.size() >= max_connections) {
+		// Resumed when a connection is closed.
+		pause();
+		return false;
+	}
+	if (accept_rate > 0) {
+		// Refill the token bucket.
+		auto now = listenloop->now();
+		accept_tokens = std::min(accept_burst, accept_tokens + std::chrono::duration <double> (now - accept_refill).count() * accept_rate);
+		accept_refill = now;
+		if (accept_tokens < 1) {
+			// Resume when the next token is available.
+			pause();
+			schedule_resume(now + std::chrono::duration_cast <Loop::Duration> (std::chrono::duration <double> ((1 - accept_tokens) / accept_rate)));
+			return false;
+		}
+	}
+	return true;
+} // }}}
+
+void ServerBase::pause() { // {{{
+	STARTFUNC;
+	if (paused)
+		return;
+	paused = true;
+	pauses->add();
+	for (auto &l: listeners)
+		l.socket.unread();
+} // }}}
+
+bool ServerBase::resume() { // {{{
+	STARTFUNC;
+	// Don't resume while a timeout is pending, or while there are too many connections; resume() is called again when that changes.
+	if (!paused || resume_handle != Loop::TimeoutHandle() || (max_connections != 0 && remotes.size() >= max_connections))
+		return false;
+	paused = false;
+	for (auto &l: listeners)
+		l.socket.rawread(&Listener::accept_remote);
+	return false;
+} // }}}
+
+bool ServerBase::resume_timeout() { // {{{
+	STARTFUNC;
+	resume_handle = Loop::TimeoutHandle();
+	return resume();
+} // }}}
+
+void ServerBase::schedule_resume(Loop::Time time) { // {{{
+	STARTFUNC;
+	if (resume_handle != Loop::TimeoutHandle())
+		return;
+	resume_time = time;
+	resume_handle = listenloop->add_timeout(Loop::TimeoutRecord(time, Loop::Duration(), this, &ServerBase::resume_timeout));
+} // }}}
+
+void ServerBase::cancel_resume() { // {{{
+	STARTFUNC;
+	if (resume_handle == Loop::TimeoutHandle())
+		return;
+	listenloop->remove_timeout(resume_handle);
+	resume_handle = Loop::TimeoutHandle();
+} // }}}
+
+void ServerBase::take_resume(ServerBase &other) { // {{{
+	STARTFUNC;
+	// The pending timeout of a moved server must call the new object.
+	cancel_resume();
+	if (other.resume_handle == Loop::TimeoutHandle())
+		return;
+	other.cancel_resume();
+	schedule_resume(other.resume_time);
 } // }}}
 // }}}
 
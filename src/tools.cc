@@ -4,6 +4,11 @@
 #include <ctime>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <array>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace Webloop {
 
@@ -99,39 +104,183 @@ std::string lower(std::string const &src) { // {{{
 // }}}
 
 // Base64 encoding and decoding. {{{
-// Encode single base64 index into base64 output character.
-static char toalphabet(int index) { // {{{
-	// Index must be valid.
-	static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	assert(index >= 0 && index <= 0x3f);
-	return alphabet[index];
+// The kernels handle whole units (3 bytes, or 4 letters) and pass the rest on to a smaller kernel, down to the scalar code.
+// The best kernels for this CPU are selected on first use.
+static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Index of every letter: 0 to 63 for the alphabet, -1 for padding, -2 for invalid letters.
+static constexpr std::array <int8_t, 256> make_letter_index() { // {{{
+	std::array <int8_t, 256> ret {};
+	for (auto &index: ret)
+		index = -2;
+	for (int i = 0; i < 64; ++i)
+		ret[uint8_t(alphabet[i])] = i;
+	ret['='] = -1;
+	return ret;
+} // }}}
+static constexpr std::array <int8_t, 256> letter_index = make_letter_index();
+
+// Encode whole units; returns the number of bytes that were used.
+static size_t encode_scalar(uint8_t const *src, size_t size, char *dst) { // {{{
+	size_t i = 0;
+	for (; i + 3 <= size; i += 3) {
+		uint32_t v = (uint32_t(src[i]) << 16) | (uint32_t(src[i + 1]) << 8) | src[i + 2];
+		*dst++ = alphabet[v >> 18];
+		*dst++ = alphabet[(v >> 12) & 0x3f];
+		*dst++ = alphabet[(v >> 6) & 0x3f];
+		*dst++ = alphabet[v & 0x3f];
+	}
+	return i;
+} // }}}
+
+// Decode whole units, up to the first one that contains padding or an invalid letter; returns the number of letters that were used.
+static size_t decode_scalar(char const *src, size_t size, uint8_t *dst) { // {{{
+	size_t i = 0;
+	for (; i + 4 <= size; i += 4) {
+		int a = letter_index[uint8_t(src[i])];
+		int b = letter_index[uint8_t(src[i + 1])];
+		int c = letter_index[uint8_t(src[i + 2])];
+		int d = letter_index[uint8_t(src[i + 3])];
+		if ((a | b | c | d) < 0)
+			break;
+		uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+		*dst++ = v >> 16;
+		*dst++ = v >> 8;
+		*dst++ = v;
+	}
+	return i;
+} // }}}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The vector kernels split 3 byte groups into 6 bit indices with multiplies, and translate between indices and letters with byte shuffles.
+// Decoding checks each block for invalid letters, and leaves a block that has them to the next kernel.
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(uint8_t const *src, size_t size, char *dst) { // {{{
+	// Every step reads 16 bytes and uses 12 of them.
+	__m128i const spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m128i const offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 12, dst += 16) {
+		__m128i in = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast <__m128i const *> (src + i)), spread);
+		__m128i high = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+		__m128i low = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+		__m128i indices = _mm_or_si128(high, low);
+		// Map 0-25 to 13, 26-51 to 0, and 52-63 to 1-12; those select the offset from the index to the letter.
+		__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+		__m128i letters = _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range));
+		_mm_storeu_si128(reinterpret_cast <__m128i *> (dst), letters);
+	}
+	return i + encode_scalar(src + i, size - i, dst);
 } // }}}
 
-// Decode single base64 alphabet letter into base64 index.
-static int fromalphabet(char letter) { // {{{
-	// Returns index for valid regular letters, -1 for padding, -2 for invalid letters.
-	if (letter >= 'A' && letter <= 'Z')
-		return letter - 'A';
-	if (letter >= 'a' && letter <= 'z')
-		return letter - 'a' + 26;
-	if (letter >= '0' && letter <= '9')
-		return letter - '0' + 52;
-	if (letter == '+')
-		return 62;
-	if (letter == '/')
-		return 63;
-	if (letter == '=')
-		return -1;
-	return -2;
+__attribute__((target("avx2")))
+static size_t encode_avx2(uint8_t const *src, size_t size, char *dst) { // {{{
+	// Every step reads 16 bytes into each lane, of which 12 are used, so the lanes overlap in the input.
+	__m256i const spread = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	__m256i const offsets = _mm256_broadcastsi128_si256(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+	size_t i = 0;
+	for (; i + 28 <= size; i += 24, dst += 32) {
+		__m128i lo = _mm_loadu_si128(reinterpret_cast <__m128i const *> (src + i));
+		__m128i hi = _mm_loadu_si128(reinterpret_cast <__m128i const *> (src + i + 12));
+		__m256i in = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), spread);
+		__m256i high = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		__m256i low = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(high, low);
+		__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+		__m256i letters = _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range));
+		_mm256_storeu_si256(reinterpret_cast <__m256i *> (dst), letters);
+	}
+	return i + encode_ssse3(src + i, size - i, dst);
 } // }}}
 
-// Encode 3 binary characters into 4 base64 characters.
-static void encode(std::string const &src, std::string::size_type &pos, char ret[4]) { // {{{
-	ret[0] = toalphabet((src[pos] >> 2) & 0x3f);
-	ret[1] = toalphabet(((src[pos] << 4) & 0x30) | ((src[pos + 1] >> 4) & 0x0f));
-	ret[2] = toalphabet(((src[pos + 1] << 2) & 0x3c) | ((src[pos + 2] >> 6) & 0x03));
-	ret[3] = toalphabet(src[pos + 2] & 0x3f);
-	pos += 3;
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(char const *src, size_t size, uint8_t *dst) { // {{{
+	// Every step reads 16 letters and stores 16 bytes, of which 12 are used.
+	// The last 8 letters are always left to the scalar code, so nothing is stored past the decoded data.
+	// The nibbles of each letter select bits from lut_lo and lut_hi that only overlap for invalid letters.
+	__m128i const lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	__m128i const lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	__m128i const lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i const nibble = _mm_set1_epi8(0x0f);
+	__m128i const pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t i = 0;
+	for (; i + 24 <= size; i += 16, dst += 12) {
+		__m128i in = _mm_loadu_si128(reinterpret_cast <__m128i const *> (src + i));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, nibble));
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+			break;
+		// '/' shares its high nibble with '+', so it gets its own offset.
+		__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), hi_nibbles));
+		__m128i indices = _mm_add_epi8(in, roll);
+		__m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(indices, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128(reinterpret_cast <__m128i *> (dst), _mm_shuffle_epi8(merged, pack));
+	}
+	return i + decode_scalar(src + i, size - i, dst);
+} // }}}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(char const *src, size_t size, uint8_t *dst) { // {{{
+	// Every step reads 32 letters and stores 32 bytes, of which 24 are used; see decode_ssse3().
+	__m256i const lut_lo = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a));
+	__m256i const lut_hi = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+	__m256i const lut_roll = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+	__m256i const nibble = _mm256_set1_epi8(0x0f);
+	__m256i const pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	__m256i const join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	size_t i = 0;
+	for (; i + 44 <= size; i += 32, dst += 24) {
+		__m256i in = _mm256_loadu_si256(reinterpret_cast <__m256i const *> (src + i));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibble);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, nibble));
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')), hi_nibbles));
+		__m256i indices = _mm256_add_epi8(in, roll);
+		__m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(indices, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+		merged = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack), join);
+		_mm256_storeu_si256(reinterpret_cast <__m256i *> (dst), merged);
+	}
+	return i + decode_ssse3(src + i, size - i, dst);
+} // }}}
+#endif
+
+typedef size_t (*EncodeType)(uint8_t const *src, size_t size, char *dst);
+typedef size_t (*DecodeType)(char const *src, size_t size, uint8_t *dst);
+struct Base64Kernels {
+	EncodeType encode;
+	DecodeType decode;
+};
+
+static Base64Kernels select_base64() { // {{{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return {encode_avx2, decode_avx2};
+	if (__builtin_cpu_supports("ssse3"))
+		return {encode_ssse3, decode_ssse3};
+#endif
+	return {encode_scalar, decode_scalar};
+} // }}}
+
+static Base64Kernels const &base64() { // {{{
+	static Base64Kernels const kernels = select_base64();
+	return kernels;
+} // }}}
+
+// Decode whole units and append them to target; returns the number of letters that were used.
+static size_t decode_append(char const *src, size_t size, std::string &target) { // {{{
+	size_t old = target.size();
+	size_t used = 0;
+	target.resize_and_overwrite(old + size / 4 * 3, [&](char *dst, size_t) {
+		used = base64().decode(src, size, reinterpret_cast <uint8_t *> (dst + old));
+		return old + used / 4 * 3;
+	});
+	return used;
 } // }}}
 
 // State for decoding result.
@@ -142,21 +291,17 @@ enum State { // {{{
 	BAD	// Decoding error.
 }; // }}}
 
-// Decode 4 base64 characters into 3 binary characters.
-static void decode(std::string const &src, std::string::size_type &pos, char ret[3], State &state) { // {{{
-	// Decode one unit of 4 base64 letters into 3 bytes. Updates pos. Sets state.
+// Decode 4 base64 letters, which may include padding, and append the result to target.
+static State decode_unit(char const *src, std::string &target) { // {{{
 	int indices[4];
 	for (int i = 0; i < 4; ++i) {
-		indices[i] = fromalphabet(src[pos + i]);
-		if (indices[i] < -1) {
-			state = BAD;
-			return;
-		}
-	}
-	if (indices[0] < 0 || indices[1] < 0 || (indices[2] < 0 && indices[3] >= 0)) {
-		state = BAD;
-		return;
+		indices[i] = letter_index[uint8_t(src[i])];
+		if (indices[i] < -1)
+			return BAD;
 	}
+	if (indices[0] < 0 || indices[1] < 0 || (indices[2] < 0 && indices[3] >= 0))
+		return BAD;
+	State state = GOOD;
 	if (indices[2] < 0) {
 		state = PAD2;
 		indices[2] = 0;
@@ -166,35 +311,33 @@ static void decode(std::string const &src, std::string::size_type &pos, char ret
 		state = PAD1;
 		indices[3] = 0;
 	}
-	else
-		state = GOOD;
-	pos += 4;
-	// Characters have been converted to indices and state has been set. Now decode the indices.
+	// Letters have been converted to indices and state has been set. Now decode the indices.
+	char ret[3];
 	ret[0] = ((indices[0] << 2) & 0xfc) | ((indices[1] >> 4) & 0x03);
 	ret[1] = ((indices[1] << 4) & 0xf0) | ((indices[2] >> 2) & 0x0f);
 	ret[2] = ((indices[2] << 6) & 0xc0) | (indices[3] & 0x3f);
+	target.append(ret, state == GOOD ? 3 : state == PAD1 ? 2 : 1);
+	return state;
 } // }}}
 
 // Encode a binary string into base64 encoding.
 std::string b64encode(std::string const &src) { // {{{
-	std::string::size_type pos = 0;
 	std::string ret;
-	char buffer[4];
-	while (pos + 3 <= src.size()) {
-		encode(src, pos, buffer);
-		ret += std::string(buffer, 4);
-	}
-	int padlen = src.size() - pos;
-	if (padlen > 0) {
-		std::string f = src.substr(pos) + std::string("\0", 2);
-		pos = 0;
-		encode(f, pos, buffer);
-		buffer[3] = '=';
-		if (padlen == 1)
-			buffer[2] = '=';
-		ret += std::string(buffer, 4);
-		pos = src.size();
-	}
+	size_t size = (src.size() + 2) / 3 * 4;
+	ret.resize_and_overwrite(size, [&src, size](char *dst, size_t) {
+		auto data = reinterpret_cast <uint8_t const *> (src.data());
+		size_t pos = base64().encode(data, src.size(), dst);
+		size_t padlen = src.size() - pos;
+		if (padlen > 0) {
+			dst += pos / 3 * 4;
+			uint32_t v = (uint32_t(data[pos]) << 16) | (padlen == 2 ? uint32_t(data[pos + 1]) << 8 : 0);
+			dst[0] = alphabet[v >> 18];
+			dst[1] = alphabet[(v >> 12) & 0x3f];
+			dst[2] = padlen == 2 ? alphabet[(v >> 6) & 0x3f] : '=';
+			dst[3] = '=';
+		}
+		return size;
+	});
 	return ret;
 } // }}}
 
@@ -203,63 +346,80 @@ std::string b64decode(std::string const &src, std::string::size_type &pos, bool
 	// Return empty string and set pos to std::string::npos when any error is encountered.
 	// With no error, pos will not be std::string::npos.
 	std::string ret;
-	char buffer[3];
-	State state;
-	if (allow_whitespace) {
-		pos = src.find_first_not_of(" \t\r\n", pos);
-		if (pos == std::string::npos)
-			pos = src.size();
-	}
 	if (pos > src.size()) {
 		pos = std::string::npos;
 		return {};
 	}
-	if (pos == src.size())
-		return {};
 	while (true) {
 		// (Maybe) allow whitespace between units.
 		if (allow_whitespace) {
 			pos = src.find_first_not_of(" \t\r\n", pos);
-			if (pos == std::string::npos) {
+			if (pos == std::string::npos)
 				pos = src.size();
-				return ret;
-			}
-		}
-
-		// Check if we are done.
-		if (pos == src.size())
-			return ret;
-
-		// Check that there are enough characters for a unit.
-		if (!(pos + 4 <= src.size())) {
-			return ret;
 		}
 
-		// If the next character is not a valid base64 letter, finish.
-		if (fromalphabet(src[pos]) < 0)
+		// Stop at the end of the data, at an incomplete unit, or if the next character is not a valid base64 letter.
+		if (src.size() - pos < 4 || letter_index[uint8_t(src[pos])] < 0)
 			return ret;
 
-		// Decode the unit.
-		decode(src, pos, buffer, state);
+		// Decode as many units as possible at once.
+		size_t used = decode_append(src.data() + pos, src.size() - pos, ret);
+		pos += used;
+		if (used > 0)
+			continue;
 
-		// Handle result.
-		switch (state) {
-		case GOOD:	// Unit has been decoded normally; store it and continue.
-			ret += std::string(buffer, 3);
+		// The unit contains padding or an invalid letter.
+		switch (decode_unit(src.data() + pos, ret)) {
+		case GOOD:
+			pos += 4;
 			break;
-		case PAD1:	// Unit contained padding; store it and return.
-			return ret + std::string(buffer, 2);
-		case PAD2:	// Unit contained padding; store it and return.
-			return ret + std::string(buffer, 1);
+		case PAD1:
+		case PAD2:
+			pos += 4;
+			return ret;
 		default:
-			assert(state == BAD);
+			pos = std::string::npos;
 			return {};
 		}
 	}
 } // }}}
+
+bool B64Decoder::decode(std::string_view data, std::string &target) { // {{{
+	size_t pos = 0;
+	while (pos < data.size()) {
+		if (num_pending == 0 && !padded) {
+			// Decode whole units directly from the input.
+			pos += decode_append(data.data() + pos, data.size() - pos, target);
+			if (pos == data.size())
+				break;
+		}
+		char c = data[pos++];
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+			continue;
+		// Nothing may follow the padding; other letters are collected until their unit is complete.
+		if (padded || letter_index[uint8_t(c)] < -1)
+			return false;
+		pending[num_pending++] = c;
+		if (num_pending < 4)
+			continue;
+		num_pending = 0;
+		State state = decode_unit(pending, target);
+		if (state == BAD)
+			return false;
+		padded = state != GOOD;
+	}
+	return true;
+} // }}}
+
+bool B64Decoder::finish() { // {{{
+	bool ret = num_pending == 0;
+	reset();
+	return ret;
+} // }}}
 // }}}
 
 // Sha1 digest // {{{
+// The kernels process whole blocks of 64 bytes.
 static void sha1rotate(uint32_t *a, uint32_t f) { // {{{
 	uint32_t temp = ((a[0] << 5) | (a[0] >> (32 - 5))) + a[4] + f;
 	a[4] = a[3];
@@ -269,26 +429,14 @@ static void sha1rotate(uint32_t *a, uint32_t f) { // {{{
 	a[0] = temp;
 } // }}}
 
-std::string sha1(std::string const &src) { // {{{
-	// Constants.
-	// Initial hash, in host endian.
-	uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
-
-	// Preprocess the message.
-	std::string message = src + std::string("\x80", 1);
-	uint64_t belen = htobe64(8 * src.size());
-	int pad = 64 - (message.size() + 8) % 64;
-	message += std::string(pad, '\0') + std::string(reinterpret_cast <char *>(&belen), 8);
-	assert(message.size() % 64 == 0);
-
-	// Handle chunks.
-	std::string::size_type pos = 0;
-	while (pos < message.size()) {
+static void sha1_scalar(uint32_t h[5], uint8_t const *data, size_t blocks) { // {{{
+	for (; blocks > 0; --blocks, data += 64) {
 		// Extract data.
 		uint32_t w[80];
 		for (int i = 0; i < 16; ++i) {
-			w[i] = be32toh(*reinterpret_cast <uint32_t *>(&message.data()[pos]));
-			pos += 4;
+			uint32_t word;
+			std::memcpy(&word, data + 4 * i, 4);
+			w[i] = be32toh(word);
 		}
 
 		// Generate extra words.
@@ -328,6 +476,90 @@ std::string sha1(std::string const &src) { // {{{
 		for (int i = 0; i < 5; ++i)
 			h[i] += a[i];
 	}
+} // }}}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sha,sse4.1")))
+static __m128i sha1_rounds(__m128i abcd, __m128i e, int group) { // {{{
+	// Do 4 rounds. The round function must be a constant, and it changes every 5 groups.
+	switch (group / 5) {
+	case 0:
+		return _mm_sha1rnds4_epu32(abcd, e, 0);
+	case 1:
+		return _mm_sha1rnds4_epu32(abcd, e, 1);
+	case 2:
+		return _mm_sha1rnds4_epu32(abcd, e, 2);
+	default:
+		return _mm_sha1rnds4_epu32(abcd, e, 3);
+	}
+} // }}}
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_shani(uint32_t h[5], uint8_t const *data, size_t blocks) { // {{{
+	// The SHA extensions keep a, b, c and d in one register, with a in the highest lane, and e in the highest lane of another.
+	__m128i const byteswap = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast <__m128i const *> (h)), 0x1b);
+	__m128i e = _mm_set_epi32(int(h[4]), 0, 0, 0);
+	for (; blocks > 0; --blocks, data += 64) {
+		__m128i abcd_save = abcd;
+		__m128i e_save = e;
+		// msg[g % 4] holds the words for group g; from group 4 on, they are computed from the previous 4 groups.
+		__m128i msg[4];
+		for (int i = 0; i < 4; ++i)
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast <__m128i const *> (data + 16 * i)), byteswap);
+		__m128i prev = abcd;
+		#pragma GCC unroll 20
+		for (int g = 0; g < 20; ++g) {
+			__m128i &m = msg[g % 4];
+			if (g >= 4)
+				m = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(m, msg[(g + 1) % 4]), msg[(g + 2) % 4]), msg[(g + 3) % 4]);
+			// The e of every group is derived from the a of 4 rounds earlier.
+			__m128i ge = g == 0 ? _mm_add_epi32(e, m) : _mm_sha1nexte_epu32(prev, m);
+			prev = abcd;
+			abcd = sha1_rounds(abcd, ge, g);
+		}
+		e = _mm_sha1nexte_epu32(prev, e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+	_mm_storeu_si128(reinterpret_cast <__m128i *> (h), _mm_shuffle_epi32(abcd, 0x1b));
+	h[4] = uint32_t(_mm_extract_epi32(e, 3));
+} // }}}
+#endif
+
+typedef void (*Sha1Type)(uint32_t h[5], uint8_t const *data, size_t blocks);
+
+static Sha1Type select_sha1() { // {{{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+		return sha1_shani;
+#endif
+	return sha1_scalar;
+} // }}}
+
+std::string sha1(std::string const &src) { // {{{
+	// The best kernel for this CPU is selected on first use.
+	static Sha1Type const process = select_sha1();
+
+	// Initial hash, in host endian.
+	uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+	// Whole blocks are processed from the source; the rest is padded in a separate buffer.
+	auto data = reinterpret_cast <uint8_t const *> (src.data());
+	size_t blocks = src.size() / 64;
+	if (blocks > 0)
+		process(h, data, blocks);
+
+	// The padding is a 1 bit, zeroes, and the length in bits; that takes one or two blocks.
+	uint8_t tail[128] = {};
+	size_t rest = src.size() - blocks * 64;
+	std::memcpy(tail, data + blocks * 64, rest);
+	tail[rest] = 0x80;
+	size_t tail_size = rest + 9 <= 64 ? 64 : 128;
+	uint64_t belen = htobe64(8 * uint64_t(src.size()));
+	std::memcpy(tail + tail_size - 8, &belen, 8);
+	process(h, tail, tail_size / 64);
+
 	//Result: hh = (h0 leftshift 128) or (h1 leftshift 96) or (h2 leftshift 64) or (h3 leftshift 32) or h4
 	uint32_t hh[5];
 	for (int i = 0; i < 5; ++i)
@@ -2,66 +2,224 @@
 #include "webloop/network.hh"
 #include "webloop/coroutine.hh"
 #include <cmath>
+#include <charconv>
+#include <cstring>
+#include <mutex>
+#include <bit>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 namespace Webloop {
 
 std::shared_ptr <WebNone> WebNone::instance = std::shared_ptr <WebNone>(new WebNone());
 
-// Print and dump for default object types. {{{
-std::string WebFloat::dump() const { // {{{
-#ifdef WEBOBJECT_DUMPS_JSON
-	if (std::isnan(value))
-		return "NaN";
-	if (std::isinf(value)) {
-		if (value < 0)
-			return "-Infinity";
-		return "Infinity";
-	}
-	return std::to_string(value);
-#else
-	ieee754_double v = {.d = value};
-	uint64_t mantissa = htole64((uint64_t(v.ieee.mantissa1) << 20) | v.ieee.mantissa0);
-	uint16_t exponent = htole16(v.ieee.exponent | (v.ieee.negative ? (1 << 14) : 0));
-	return "F" + std::string(reinterpret_cast <char const *>(&mantissa), sizeof(uint64_t)) + std::string(reinterpret_cast <char const *>(&exponent), sizeof(uint16_t));
+// Object pool. {{{
+// Blocks of up to pool_max_size bytes are carved from chunks, which are never returned to the system.
+// Small blocks (WebObjects) use size classes in steps of pool_granularity; larger blocks (coroutine frames) use powers of two.
+// A freed block goes on the free list of the thread that frees it. When a thread exits, or when one of its free lists
+// holds more than pool_cache_size bytes, the list is handed over to a shared list, which other threads use before they
+// allocate new chunks. That way blocks that are allocated by one thread and freed by another are reused, instead of
+// piling up on the free lists of the second thread while the first keeps allocating chunks.
+#ifndef WEBLOOP_NO_POOL
+static size_t const pool_granularity = 16;
+static size_t const pool_small_classes = 8;
+static size_t const pool_small_size = pool_small_classes * pool_granularity;
+static size_t const pool_classes = pool_small_classes + 4;
+static size_t const pool_max_size = pool_small_size << (pool_classes - pool_small_classes);
+static size_t const pool_chunk_size = 16 << 10;
+static size_t const pool_cache_size = 4 * pool_chunk_size;	// Per size class and thread.
+
+static inline size_t pool_class(size_t size) { // {{{
+	if (size <= pool_small_size)
+		return (size - 1) / pool_granularity;
+	return pool_small_classes - 1 + std::bit_width(size - 1) - std::bit_width(pool_small_size - 1);
+} // }}}
+
+static inline size_t pool_class_size(size_t c) { // {{{
+	if (c < pool_small_classes)
+		return (c + 1) * pool_granularity;
+	return pool_small_size << (c + 1 - pool_small_classes);
+} // }}}
+
+struct PoolBlock { // {{{
+	PoolBlock *next;
+}; // }}}
+
+struct PoolShared { // {{{
+	std::mutex lock;
+	std::vector <void *> chunks;	// Only kept so the chunks are still referenced.
+	std::vector <std::pair <PoolBlock *, size_t> > orphans[pool_classes];	// Free lists that threads handed over, with their lengths.
+}; // }}}
+
+static PoolShared &pool_shared() { // {{{
+	// This is never destroyed, because blocks can be freed during static destruction.
+	static PoolShared *shared = new PoolShared();
+	return *shared;
+} // }}}
+
+// The free lists are trivial, so they remain usable after pool_releaser has been destroyed.
+static thread_local PoolBlock *pool_free[pool_classes];
+static thread_local size_t pool_count[pool_classes];	// Length of pool_free.
+static thread_local bool pool_closed;
+
+static void pool_hand_over(size_t c, PoolBlock *list, size_t count) { // {{{
+	auto &shared = pool_shared();
+	std::lock_guard <std::mutex> guard(shared.lock);
+	shared.orphans[c].emplace_back(list, count);
+} // }}}
+
+struct PoolReleaser { // {{{
+	~PoolReleaser() {
+		auto &shared = pool_shared();
+		std::lock_guard <std::mutex> guard(shared.lock);
+		for (size_t c = 0; c < pool_classes; ++c) {
+			if (pool_free[c] != nullptr)
+				shared.orphans[c].emplace_back(pool_free[c], pool_count[c]);
+			pool_free[c] = nullptr;
+			pool_count[c] = 0;
+		}
+		pool_closed = true;
+	}
+}; // }}}
+static thread_local PoolReleaser pool_releaser;
+
+static void pool_refill(size_t c) { // {{{
+	(void)&pool_releaser;	// Make sure the free lists are released when this thread exits.
+	auto &shared = pool_shared();
+	size_t size = pool_class_size(c);
+	char *chunk;
+	{
+		std::lock_guard <std::mutex> guard(shared.lock);
+		if (!shared.orphans[c].empty()) {
+			auto [list, count] = shared.orphans[c].back();
+			pool_free[c] = list;
+			pool_count[c] = count;
+			shared.orphans[c].pop_back();
+			return;
+		}
+		chunk = static_cast <char *>(::operator new(pool_chunk_size));
+		shared.chunks.push_back(chunk);
+	}
+	PoolBlock *list = nullptr;
+	for (size_t offset = pool_chunk_size / size * size; offset > 0; offset -= size) {
+		auto block = reinterpret_cast <PoolBlock *>(chunk + offset - size);
+		block->next = list;
+		list = block;
+	}
+	pool_free[c] = list;
+	pool_count[c] = pool_chunk_size / size;
+} // }}}
+#endif
+
+void *pool_allocate(size_t size) { // {{{
+#ifndef WEBLOOP_NO_POOL
+	if (size > 0 && size <= pool_max_size) {
+		size_t c = pool_class(size);
+		if (pool_closed) {
+			// Allocating while the thread exits; use a full size block, so it can be freed into the pool.
+			return ::operator new(pool_class_size(c));
+		}
+		if (pool_free[c] == nullptr)
+			pool_refill(c);
+		PoolBlock *block = pool_free[c];
+		pool_free[c] = block->next;
+		--pool_count[c];
+		return block;
+	}
 #endif
+	return ::operator new(size);
 } // }}}
 
-std::string WebString::dump() const { // {{{
-#ifdef WEBOBJECT_DUMPS_JSON
-	std::string ret = "\"";
-	for (auto c: value) {
-		if (c != '\\' && c >= 0x20 && c <= 0x7e)
-			ret += c;
-		else {
-			ret += "\\x" + (std::ostringstream() << std::hex << std::setw(2) << std::setfill('0') << unsigned(c & 0xff)).str();
+void pool_deallocate(void *ptr, size_t size) noexcept { // {{{
+#ifndef WEBLOOP_NO_POOL
+	if (size > 0 && size <= pool_max_size) {
+		size_t c = pool_class(size);
+		auto block = static_cast <PoolBlock *>(ptr);
+		if (pool_closed) {
+			// This thread's free lists have been released; give this block to the shared pool.
+			block->next = nullptr;
+			pool_hand_over(c, block, 1);
+			return;
+		}
+		if (pool_count[c] >= pool_cache_size / pool_class_size(c)) {
+			// This thread frees more than it allocates (for example, it frees blocks of another thread); give the list to the shared pool.
+			pool_hand_over(c, pool_free[c], pool_count[c]);
+			pool_free[c] = nullptr;
+			pool_count[c] = 0;
 		}
+		if (pool_count[c] == 0)
+			(void)&pool_releaser;	// A thread that only frees blocks must also release them when it exits.
+		block->next = pool_free[c];
+		pool_free[c] = block;
+		++pool_count[c];
+		return;
 	}
-	ret += "\"";
-	return ret;
-#else
-	return "S" + value;
 #endif
+	::operator delete(ptr);
 } // }}}
+// }}}
 
-std::string WebVector::dump() const { // {{{
-#ifdef WEBOBJECT_DUMPS_JSON
-	std::string ret = "[";
-	std::string sep = "";
-	for (auto i: value) {
-		ret += sep;
-		ret += i->dump();
-		sep = ",";
+// Print and dump for default object types. {{{
+void WebInt::dump_to(std::string &out) const { // {{{
+	char buffer[24];
+	auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+	out.append(buffer, result.ptr);
+} // }}}
+
+void WebFloat::dump_to(std::string &out) const { // {{{
+	if (std::isnan(value)) {
+		out += "NaN";
+		return;
 	}
-	return ret + "]";
-#else
-	std::string ret = "V" + WebInt(value.size()).dump();
-	for (auto i: value) {
-		std::string e = i->dump();
-		ret += WebInt(e.size()).dump();
-		ret += std::move(e);
+	if (std::isinf(value)) {
+		out += value < 0 ? "-Infinity" : "Infinity";
+		return;
+	}
+	// Shortest representation that reads back as the same value.
+	char buffer[32];
+	auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+	out.append(buffer, result.ptr);
+	// Make sure it is not parsed back as an int.
+	if (std::string_view(buffer, result.ptr).find_first_of(".e") == std::string_view::npos)
+		out += ".0";
+} // }}}
+
+void WebString::dump_string(std::string_view s, std::string &out) { // {{{
+	static char const digits[] = "0123456789abcdef";
+	out += '"';
+	size_t run = 0;
+	for (size_t i = 0; i < s.size(); ++i) {
+		unsigned char c = s[i];
+		if (c != '\\' && c != '"' && c >= 0x20 && c <= 0x7e)
+			continue;
+		// Copy the plain characters before this one in one go.
+		out.append(s.data() + run, i - run);
+		run = i + 1;
+		char escape[4] = {'\\', 'x', digits[c >> 4], digits[c & 0xf]};
+		out.append(escape, 4);
+	}
+	out.append(s.data() + run, s.size() - run);
+	out += '"';
+} // }}}
+
+void WebVector::dump_to(std::string &out) const { // {{{
+	out += '[';
+	bool first = true;
+	for (auto const &i: value) {
+		if (!first)
+			out += ',';
+		first = false;
+		i->dump_to(out);
 	}
+	out += ']';
+} // }}}
+
+size_t WebVector::dump_size_hint() const { // {{{
+	size_t ret = 2 + value.size();
+	for (auto const &i: value)
+		ret += i->dump_size_hint();
 	return ret;
-#endif
 } // }}}
 
 std::string WebVector::print() const { // {{{
@@ -72,29 +230,25 @@ std::string WebVector::print() const { // {{{
 	return ret;
 } // }}}
 
-std::string WebMap::dump() const { // {{{
-#ifdef WEBOBJECT_DUMPS_JSON
-	std::string ret = "{";
-	std::string sep = "";
-	for (auto i: value) {
-		ret += sep;
-		ret += WebString(i.first).dump() + ":" + i.second->dump();
-		sep = ",";
+void WebMap::dump_to(std::string &out) const { // {{{
+	out += '{';
+	bool first = true;
+	for (auto const &i: value) {
+		if (!first)
+			out += ',';
+		first = false;
+		WebString::dump_string(i.first, out);
+		out += ':';
+		i.second->dump_to(out);
 	}
-	return ret + "}";
-#else
-	std::string ret = "M" + WebInt(value.size()).dump();
-	for (auto i: value) {
-		std::string const &key = i.first;
-		ret += WebInt(key.size()).dump();
-		ret += key;
+	out += '}';
+} // }}}
 
-		std::string v = i.second->dump();
-		ret += WebInt(v.size()).dump();
-		ret += std::move(v);
-	}
+size_t WebMap::dump_size_hint() const { // {{{
+	size_t ret = 2;
+	for (auto const &i: value)
+		ret += i.first.size() + 4 + i.second->dump_size_hint();
 	return ret;
-#endif
 } // }}}
 
 std::string WebMap::print() const { // {{{
@@ -106,338 +260,464 @@ std::string WebMap::print() const { // {{{
 	return ret;
 } // }}}
 
-#ifdef WEBOBJECT_DUMPS_JSON
-static int parse_digit(char d) { // {{{
-	if (d >= '0' && d <= '9')
-		return d - '0';
-	if (d >= 'a' && d <= 'f')
-		return d - 'a' + 10;
-	WL_log("invalid hex digit " + std::string(&d, 1));
-	return 0;
+// JSON parser. {{{
+// Values are dispatched on their first character; strings are scanned for their end or an escape
+// a block at a time with SIMD when available, and numbers are parsed with std::from_chars.
+// Besides standard JSON, NaN, Infinity, -Infinity and \x escapes in strings are accepted, because
+// dump() produces them.
+// Errors are thrown as char const *; nothing is returned for invalid input.
+static inline bool is_json_space(char c) { // {{{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
 } // }}}
 
-static std::string read_string(std::string const &data, std::string::size_type &pos) { // {{{
-	// Read a string.
-	// Pos is updated to position after final '"'.
-	// data[pos] must initially be '"'.
-	std::string ret;
-	++pos;
-	while (true) {
-		auto p = data.find_first_of("\\\"", pos);
-		if (p == std::string::npos) {
-			WL_log("unfinished string");
-			ret += data.substr(pos);
-			pos = std::string::npos;
-			return ret;
-		}
-		ret += data.substr(pos, p - pos);
-		pos = p;
+static inline void skip_json_space(std::string_view data, size_t &pos) { // {{{
+	while (pos < data.size() && is_json_space(data[pos]))
+		++pos;
+} // }}}
 
-		if (data[pos] == '"') {
-			++pos;
-			return ret;
-		}
+static size_t find_string_special(std::string_view data, size_t pos) { // {{{
+	// Return the position of the first '"' or '\\' at or after pos, or npos.
+#if defined(__AVX2__)
+	__m256i const quote32 = _mm256_set1_epi8('"');
+	__m256i const backslash32 = _mm256_set1_epi8('\\');
+	while (pos + 32 <= data.size()) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast <__m256i const *>(data.data() + pos));
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote32), _mm256_cmpeq_epi8(chunk, backslash32)));
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i const quote = _mm_set1_epi8('"');
+	__m128i const backslash = _mm_set1_epi8('\\');
+	while (pos + 16 <= data.size()) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast <__m128i const *>(data.data() + pos));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	for (; pos < data.size(); ++pos) {
+		if (data[pos] == '"' || data[pos] == '\\')
+			return pos;
+	}
+	return std::string_view::npos;
+} // }}}
 
-		assert(data[pos] == '\\');
-		++pos;
-		if (pos >= data.size()) {
-			WL_log("unfinished string");
-			pos = std::string::npos;
-			return ret;
-		}
-		switch (data[pos]) {
-		case '\\':
+static unsigned load_json_hex(std::string_view data, size_t &pos, int digits) { // {{{
+	if (pos + digits > data.size())
+		throw "Truncated JSON string";
+	unsigned ret = 0;
+	for (int i = 0; i < digits; ++i) {
+		char d = data[pos++];
+		ret <<= 4;
+		if (d >= '0' && d <= '9')
+			ret |= d - '0';
+		else if (d >= 'a' && d <= 'f')
+			ret |= d - 'a' + 10;
+		else if (d >= 'A' && d <= 'F')
+			ret |= d - 'A' + 10;
+		else
+			throw "Invalid hex digit in JSON string";
+	}
+	return ret;
+} // }}}
+
+static void append_utf8(std::string &out, unsigned code) { // {{{
+	if (code < 0x80)
+		out += char(code);
+	else if (code < 0x800) {
+		out += char(0xc0 | (code >> 6));
+		out += char(0x80 | (code & 0x3f));
+	}
+	else if (code < 0x10000) {
+		out += char(0xe0 | (code >> 12));
+		out += char(0x80 | ((code >> 6) & 0x3f));
+		out += char(0x80 | (code & 0x3f));
+	}
+	else {
+		out += char(0xf0 | (code >> 18));
+		out += char(0x80 | ((code >> 12) & 0x3f));
+		out += char(0x80 | ((code >> 6) & 0x3f));
+		out += char(0x80 | (code & 0x3f));
+	}
+} // }}}
+
+static void load_json_string(std::string_view data, size_t &pos, std::string &out) { // {{{
+	// Read a string into out.
+	// data[pos] must initially be '"'; pos is updated to the position after the final '"'.
+	++pos;
+	while (true) {
+		size_t p = find_string_special(data, pos);
+		if (p == std::string_view::npos)
+			throw "Truncated JSON string";
+		out.append(data.data() + pos, p - pos);
+		pos = p + 1;
+		if (data[p] == '"')
+			return;
+		if (pos >= data.size())
+			throw "Truncated JSON string";
+		char c = data[pos++];
+		switch (c) {
 		case '"':
-			ret += data[p];
+		case '\\':
+		case '/':
+			out += c;
+			break;
+		case 'b':
+			out += '\b';
+			break;
+		case 'f':
+			out += '\f';
 			break;
 		case 'n':
-			ret += "\n";
+			out += '\n';
 			break;
 		case 'r':
-			ret += "\r";
-			break;
-		case 'v':
-			ret += "\v";
+			out += '\r';
 			break;
 		case 't':
-			ret += "\t";
+			out += '\t';
 			break;
-		case 'f':
-			ret += "\r";
+		case 'v':
+			out += '\v';
 			break;
 		case 'a':
-			ret += "\a";
+			out += '\a';
 			break;
 		case 'x':
+			out += char(load_json_hex(data, pos, 2));
+			break;
+		case 'u':
 		{
-			if (pos + 3 >= data.size()) {
-				WL_log("unfinished string");
-				ret += "x";
-			}
-			else {
-				int d1 = parse_digit(data[pos + 1]);
-				int d2 = parse_digit(data[pos + 2]);
-				ret += char(d1 << 4 | d2);
-				pos += 2;
+			unsigned code = load_json_hex(data, pos, 4);
+			if (code >= 0xd800 && code < 0xdc00 && pos + 1 < data.size() && data[pos] == '\\' && data[pos + 1] == 'u') {
+				// Surrogate pair.
+				size_t low_pos = pos + 2;
+				unsigned low = load_json_hex(data, low_pos, 4);
+				if (low >= 0xdc00 && low < 0xe000) {
+					code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+					pos = low_pos;
+				}
 			}
+			append_utf8(out, code);
 			break;
 		}
 		default:
-			WL_log("unrecognized escape sequence in JSON string: " + data.substr(pos - 1, 2));
-			ret += data[pos];
-			break;
+			throw "Invalid escape sequence in JSON string";
 		}
-		++pos;
 	}
 } // }}}
 
-static std::shared_ptr <WebObject> load_item(std::string const &data, std::string::size_type &pos) { // {{{
-	STARTFUNC;
-	//WL_log("loading " + data.substr(pos));
-	pos = data.find_first_not_of(" \t\n\r\v\f", pos);
-	if (pos == std::string::npos)
-		return WebNone::create();
-	if (startswith(data, "null", pos)) {
-		pos += 4;
-		return WebNone::create();
-	}
-	if (startswith(data, "false", pos)) {
-		pos += 5;
-		return WebBool::create(false);
-	}
-	if (startswith(data, "true", pos)) {
-		pos += 4;
-		return WebBool::create(true);
-	}
-	if (startswith(data, "NaN", pos)) {
-		pos += 3;
-		return WebFloat::create(NAN);
-	}
-	if (startswith(data, "-Infinity", pos)) {
-		pos += 9;
-		return WebFloat::create(-INFINITY);
+static void load_json_literal(std::string_view data, size_t &pos, std::string_view literal) { // {{{
+	if (data.substr(pos, literal.size()) != literal)
+		throw "Invalid JSON value";
+	pos += literal.size();
+} // }}}
+
+static std::shared_ptr <WebObject> load_json_number(std::string_view data, size_t &pos) { // {{{
+	size_t start = pos;
+	bool is_float = false;
+	for (; pos < data.size(); ++pos) {
+		char c = data[pos];
+		if ((c >= '0' && c <= '9') || c == '-' || c == '+')
+			continue;
+		if (c == '.' || c == 'e' || c == 'E') {
+			is_float = true;
+			continue;
+		}
+		break;
 	}
-	if (startswith(data, "Infinity", pos)) {
-		pos += 8;
-		return WebFloat::create(INFINITY);
+	char const *first = data.data() + start;
+	char const *last = data.data() + pos;
+	// A leading '+' is not JSON, but it used to be accepted, and from_chars does not skip it.
+	if (first < last && *first == '+')
+		++first;
+	if (first == last)
+		throw "Invalid JSON value";
+	if (!is_float) {
+		WebObject::IntType i;
+		auto result = std::from_chars(first, last, i);
+		if (result.ec == std::errc() && result.ptr == last)
+			return WebInt::create(i);
+		if (result.ec != std::errc::result_out_of_range)
+			throw "Invalid JSON number";
+		// Too large for an int; use a float instead.
 	}
-	switch(data[pos]) {
-	case '[': // vector
+	WebObject::FloatType f;
+	auto result = std::from_chars(first, last, f);
+	if (result.ec != std::errc() || result.ptr != last)
+		throw "Invalid JSON number";
+	return WebFloat::create(f);
+} // }}}
+
+static std::shared_ptr <WebObject> load_json_item(std::string_view data, size_t &pos, size_t depth, size_t max_depth) { // {{{
+	skip_json_space(data, pos);
+	if (pos >= data.size())
+		throw "Truncated JSON";
+	switch (data[pos]) {
+	case '[':
 	{
-		auto vector = WebVector::create();
-		pos = data.find_first_not_of(" \t\n\r\v\f", pos + 1);
-		if (pos == std::string::npos) {
-			WL_log("incomplete vector");
-			return vector;
-		}
-		if (data[pos] == ']') {
+		if (depth >= max_depth)
+			throw "JSON nesting too deep";
+		auto ret = WebVector::create();
+		++pos;
+		skip_json_space(data, pos);
+		if (pos < data.size() && data[pos] == ']') {
 			++pos;
-			return vector;
+			return ret;
 		}
 		while (true) {
-			auto item = load_item(data, pos);
-			//WL_log("loaded vector element: " + item->print());
-			vector->push_back(item);
-			if (pos == std::string::npos || pos >= data.size()) {
-				WL_log("incomplete vector");
-				pos = std::string::npos;
-				return vector;
-			}
-			pos = data.find_first_not_of(" \t\n\r\v\f", pos);
-			if (pos == std::string::npos) {
-				WL_log("incomplete vector");
-				return vector;
-			}
-			if (data[pos] == ']') {
-				++pos;
-				return vector;
-			}
-			if (data[pos] != ',')
-				WL_log("expected ',' after vector item");
-			pos = data.find_first_not_of(" \t\n\r\v\f", pos + 1);
-			if (pos == std::string::npos) {
-				WL_log("incomplete vector");
-				return vector;
-			}
+			ret->push_back(load_json_item(data, pos, depth + 1, max_depth));
+			skip_json_space(data, pos);
+			if (pos >= data.size())
+				throw "Truncated JSON";
+			char c = data[pos++];
+			if (c == ']')
+				return ret;
+			if (c != ',')
+				throw "Expected ',' or ']' in JSON array";
 		}
 	}
-	case '{': // map
+	case '{':
 	{
-		auto map = WebMap::create();
-		pos = data.find_first_not_of(" \t\n\r\v\f", pos + 1);
-		if (pos == std::string::npos) {
-			WL_log("incomplete map");
-			return map;
-		}
-		if (data[pos] == '}') {
+		if (depth >= max_depth)
+			throw "JSON nesting too deep";
+		++pos;
+		skip_json_space(data, pos);
+		if (pos < data.size() && data[pos] == '}') {
 			++pos;
-			return map;
+			return WebMap::create();
 		}
+		// Sort once at the end, so building a large map from untrusted input is not quadratic.
+		WebObject::MapType items;
 		while (true) {
+			skip_json_space(data, pos);
+			if (pos >= data.size())
+				throw "Truncated JSON";
 			if (data[pos] != '"')
-				WL_log("no string as map key");
-			std::string key = read_string(data, pos);
-			pos = data.find_first_not_of(" \t\n\r\v\f", pos);
-			if (pos == std::string::npos) {
-				WL_log("incomplete map");
-				return map;
-			}
+				throw "Expected string as JSON object key";
+			std::string key;
+			load_json_string(data, pos, key);
+			skip_json_space(data, pos);
+			if (pos >= data.size())
+				throw "Truncated JSON";
 			if (data[pos] != ':')
-				WL_log("':' expected after map key");
-			pos = data.find_first_not_of(" \t\n\r\v\f", pos + 1);
-			if (pos == std::string::npos) {
-				WL_log("incomplete map");
-				return map;
-			}
-			auto item = load_item(data, pos);
-			(*map)[key] = item;
-			pos = data.find_first_not_of(" \t\n\r\v\f", pos);
-			if (pos == std::string::npos) {
-				WL_log("incomplete map");
-				return map;
-			}
-			if (data[pos] == '}') {
-				++pos;
-				return map;
-			}
-			if (data[pos] != ',')
-				WL_log("expected ',' after map item");
-			pos = data.find_first_not_of(" \t\n\r\v\f", pos + 1);
-			if (pos == std::string::npos) {
-				WL_log("incomplete map");
-				return map;
+				throw "Expected ':' after JSON object key";
+			++pos;
+			items.append_unsorted(std::move(key), load_json_item(data, pos, depth + 1, max_depth));
+			skip_json_space(data, pos);
+			if (pos >= data.size())
+				throw "Truncated JSON";
+			char c = data[pos++];
+			if (c == '}') {
+				items.sort();
+				return WebMap::create(std::move(items));
 			}
+			if (c != ',')
+				throw "Expected ',' or '}' in JSON object";
 		}
 	}
-	case '"': // string
+	case '"':
 	{
-		return WebString::create(read_string(data, pos));
+		std::string value;
+		load_json_string(data, pos, value);
+		return WebString::create(std::move(value));
 	}
-	default: // int or float
-	{
-		auto pi = data.find_first_not_of("0123456789-+", pos);
-		auto pf = data.find_first_not_of("0123456789-+.e", pos);
-		if (pi == pf) {
-			// This is an int.
-			WebObject::IntType i;
-			std::istringstream s(data.substr(pos, pi - pos));
-			s >> i;
-			if (std::string::size_type(s.tellg()) < pi)
-				WL_log("junk in JSON int");
-			pos = pi;
-			return WebInt::create(i);
-		}
-		else {
-			// This is a float.
-			WebObject::FloatType f;
-			std::istringstream s(data.substr(pos, pf - pos));
-			s >> f;
-			if (std::string::size_type(s.tellg()) < pf)
-				WL_log("junk in JSON int");
-			pos = pf;
-			return WebFloat::create(f);
+	case 'n':
+		load_json_literal(data, pos, "null");
+		return WebNone::create();
+	case 't':
+		load_json_literal(data, pos, "true");
+		return WebBool::create(true);
+	case 'f':
+		load_json_literal(data, pos, "false");
+		return WebBool::create(false);
+	case 'N':
+		load_json_literal(data, pos, "NaN");
+		return WebFloat::create(NAN);
+	case 'I':
+		load_json_literal(data, pos, "Infinity");
+		return WebFloat::create(INFINITY);
+	case '-':
+		if (pos + 1 < data.size() && data[pos + 1] == 'I') {
+			load_json_literal(data, pos, "-Infinity");
+			return WebFloat::create(-INFINITY);
 		}
+		return load_json_number(data, pos);
+	default:
+		return load_json_number(data, pos);
 	}
+} // }}}
+
+std::shared_ptr <WebObject> WebObject::load(std::string_view data, size_t max_depth) { // {{{
+	/* Parse JSON data.
+	@param data: The JSON text; it must contain exactly one value, optionally surrounded by white space.
+	@param max_depth: Maximum nesting depth of vectors and maps; use a low value for untrusted input.
+	@return The parsed object.
+	Throws a char const * describing the problem if the data is not valid.
+	*/
+	size_t pos = 0;
+	auto ret = load_json_item(data, pos, 0, max_depth);
+	skip_json_space(data, pos);
+	if (pos != data.size())
+		throw "Junk after JSON value";
+	return ret;
+} // }}}
+// }}}
+
+// Binary format. {{{
+// Every object starts with a type byte:
+// N: None; T, F: true, false; I: int, as zigzag encoded varint; D: float, as 8 byte little endian IEEE 754 double;
+// S: string, as varint length and bytes; V: vector, as varint count and items;
+// M: map, as varint count and pairs of key (varint length and bytes) and item.
+// Varints are little endian base 128: 7 bits per byte, with the high bit set on all bytes except the last.
+static size_t const max_binary_depth = 256;
+
+static void dump_varint(std::string &out, uint64_t value) { // {{{
+	char buffer[10];
+	int n = 0;
+	while (value >= 0x80) {
+		buffer[n++] = char(value | 0x80);
+		value >>= 7;
 	}
+	buffer[n++] = char(value);
+	out.append(buffer, n);
 } // }}}
 
-std::shared_ptr <WebObject> WebObject::load(std::string const &data) { // {{{
-	assert(!data.empty());
-	std::string::size_type pos = 0;
-	return load_item(data, pos);
-} // }}}
-#else
-void WebFloat::load_impl(std::string const &data) { // {{{
-	assert(data.length() == 1 + sizeof(uint64_t) + sizeof(uint16_t));
-	ieee754_double v;
-	uint64_t mantissa = le64toh(*reinterpret_cast <uint64_t const *>(&data.data()[1]));
-	v.ieee.mantissa0 = mantissa & ((1 << 20) - 1);
-	v.ieee.mantissa1 = mantissa >> 20;
-	uint16_t exponent = le16toh(*reinterpret_cast <uint16_t const *>(&data.data()[1 + sizeof(uint64_t)]));
-	v.ieee.negative = (exponent >> 14) & 1;
-	v.ieee.exponent = exponent & ((1 << 11) - 1);
-	value = v.d;
-} // }}}
-
-void WebVector::load_impl(std::string const &data) { // {{{
-	value.clear();
-	WebInt num;
-	assert(data.size() >= 1 + 9);
-	num.load(data.substr(1, 9));
-	std::string::size_type pos = 1 + 9;
-	for (ssize_t i = 0; i < int64_t(num); ++i) {
-		WebInt l;
-		assert(data.size() >= pos + 9);
-		l.load(data.substr(pos, 9));
-		pos += 9;
-		size_t len = int64_t(l);
-		assert(data.size() >= pos + len);
-		value.push_back(load(data.substr(pos, len)));
-		pos += len;
-	}
-} // }}}
-
-void WebMap::load_impl(std::string const &data) { // {{{
-	value.clear();
-	WebInt num;
-	assert(data.size() >= 1 + 9);
-	num.load(data.substr(1, 9));
-	std::string::size_type pos = 1 + 9;
-	for (ssize_t i = 0; i < int64_t(num); ++i) {
-		WebInt l;
-		assert(data.size() >= pos + 9);
-		l.load(data.substr(pos, 9));
-		pos += 9;
-		size_t len = int64_t(l);
-		assert(data.size() >= pos + len);
-		std::string key = data.substr(pos, len);
-		pos += len;
-
-		assert(data.size() >= pos + 9);
-		l.load(data.substr(pos, 9));
-		pos += 9;
-		len = int64_t(l);
-		assert(data.size() >= pos + len);
-		value[key] = load(data.substr(pos, len));
-		pos += len;
-	}
-} // }}}
-
-std::shared_ptr <WebObject> WebObject::load(std::string const &data) { // {{{
-	assert(!data.empty());
-	WebObject *ret;
-	switch(data[0]) {
-	case 'N': // None
-		ret = new WebNone();
-		break;
-	case 'F': // Bool: false
-		ret = new WebBool(false);
-		break;
-	case 'T': // Bool: true
-		ret = new WebBool(true);
-		break;
-	case 'I': // Int
-		ret = new WebInt();
-		break;
-	case 'F': // Float
-		ret = new WebFloat();
-		break;
-	case 'S': // String
-		ret = new WebString();
-		break;
-	case 'V': // Vector
-		ret = new WebVector();
-		break;
-	case 'M': // Map
-		ret = new WebMap();
-		break;
+static uint64_t load_varint(std::string_view data, size_t &pos) { // {{{
+	uint64_t ret = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (pos >= data.size())
+			throw "Truncated binary WebObject";
+		uint8_t c = data[pos++];
+		ret |= uint64_t(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return ret;
+	}
+	throw "Invalid varint in binary WebObject";
+} // }}}
+
+static std::string_view load_bytes(std::string_view data, size_t &pos) { // {{{
+	uint64_t len = load_varint(data, pos);
+	if (len > data.size() - pos)
+		throw "Truncated binary WebObject";
+	auto ret = data.substr(pos, len);
+	pos += len;
+	return ret;
+} // }}}
+
+void WebInt::dump_binary(std::string &out) const { // {{{
+	out += 'I';
+	uint64_t v = value;
+	dump_varint(out, (v << 1) ^ uint64_t(value >> 63));
+} // }}}
+
+void WebFloat::dump_binary(std::string &out) const { // {{{
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	bits = htole64(bits);
+	out += 'D';
+	out.append(reinterpret_cast <char const *>(&bits), sizeof(bits));
+} // }}}
+
+void WebString::dump_binary_string(std::string_view s, std::string &out) { // {{{
+	out += 'S';
+	dump_varint(out, s.size());
+	out += s;
+} // }}}
+
+void WebVector::dump_binary(std::string &out) const { // {{{
+	out += 'V';
+	dump_varint(out, value.size());
+	for (auto &i: value)
+		i->dump_binary(out);
+} // }}}
+
+void WebMap::dump_binary(std::string &out) const { // {{{
+	out += 'M';
+	dump_varint(out, value.size());
+	for (auto &i: value) {
+		dump_varint(out, i.first.size());
+		out += i.first;
+		i.second->dump_binary(out);
+	}
+} // }}}
+
+static std::shared_ptr <WebObject> load_binary_item(std::string_view data, size_t &pos, size_t depth) { // {{{
+	if (pos >= data.size())
+		throw "Truncated binary WebObject";
+	switch (data[pos++]) {
+	case 'N':
+		return WebNone::create();
+	case 'T':
+		return WebBool::create(true);
+	case 'F':
+		return WebBool::create(false);
+	case 'I':
+	{
+		uint64_t v = load_varint(data, pos);
+		return WebInt::create(WebObject::IntType((v >> 1) ^ -(v & 1)));
+	}
+	case 'D':
+	{
+		uint64_t bits;
+		if (data.size() - pos < sizeof(bits))
+			throw "Truncated binary WebObject";
+		std::memcpy(&bits, data.data() + pos, sizeof(bits));
+		pos += sizeof(bits);
+		bits = le64toh(bits);
+		WebObject::FloatType f;
+		std::memcpy(&f, &bits, sizeof(f));
+		return WebFloat::create(f);
+	}
+	case 'S':
+		return WebString::create(std::string(load_bytes(data, pos)));
+	case 'V':
+	{
+		if (depth >= max_binary_depth)
+			throw "Binary WebObject is nested too deeply";
+		uint64_t num = load_varint(data, pos);
+		// Every item takes at least one byte; this prevents huge allocations for invalid input.
+		if (num > data.size() - pos)
+			throw "Truncated binary WebObject";
+		auto ret = WebVector::create();
+		for (uint64_t i = 0; i < num; ++i)
+			ret->push_back(load_binary_item(data, pos, depth + 1));
+		return ret;
+	}
+	case 'M':
+	{
+		if (depth >= max_binary_depth)
+			throw "Binary WebObject is nested too deeply";
+		uint64_t num = load_varint(data, pos);
+		if (num > data.size() - pos)
+			throw "Truncated binary WebObject";
+		WebObject::MapType items;
+		items.reserve(std::min <uint64_t> (num, 1024));
+		for (uint64_t i = 0; i < num; ++i) {
+			std::string key(load_bytes(data, pos));
+			items.append_unsorted(std::move(key), load_binary_item(data, pos, depth + 1));
+		}
+		items.sort();
+		return WebMap::create(std::move(items));
+	}
 	default:
-		throw "Invalid type in serialized string";
+		throw "Invalid type in binary WebObject";
 	}
-	ret->load_impl(data);
-	return std::shared_ptr <WebObject> (ret);
 } // }}}
-#endif
+
+std::shared_ptr <WebObject> WebObject::load_binary(std::string_view data) { // {{{
+	// Parse a serialized object. Throws a string on invalid input.
+	size_t pos = 0;
+	auto ret = load_binary_item(data, pos, 0);
+	if (pos != data.size())
+		throw "Junk after binary WebObject";
+	return ret;
+} // }}}
+// }}}
 // }}}
 
 coroutine WebCoroutinePointer::operator()(std::shared_ptr <WebObject> args, std::shared_ptr <WebObject> kwargs) { // {{{
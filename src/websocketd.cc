@@ -14,8 +14,168 @@
 # }}} */
 
 #include "webloop/websocketd.hh"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#include <climits>
+#endif
 
 namespace Webloop {
+// Static file cache. {{{
+void AssetCache::evict(size_t needed) { // {{{
+	// Remove least recently used files until needed bytes are available.
+	while (!lru.empty() && used + needed > max_size) {
+		used -= lru.back().asset.content.size();
+		index.erase(lru.back().key);
+		lru.pop_back();
+	}
+} // }}}
+
+void AssetCache::set_limits(size_t new_max_size, size_t new_max_file) { // {{{
+	max_size = new_max_size;
+	max_file = new_max_file;
+	evict(0);
+} // }}}
+
+AssetCache::Asset const *AssetCache::get(std::string const &key, struct stat const &st) { // {{{
+	auto p = index.find(key);
+	if (p == index.end())
+		return nullptr;
+	auto entry = p->second;
+	if (entry->dev != st.st_dev || entry->ino != st.st_ino || entry->size != st.st_size || entry->mtime.tv_sec != st.st_mtim.tv_sec || entry->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+		// The file has changed; drop the stale version.
+		used -= entry->asset.content.size();
+		lru.erase(entry);
+		index.erase(p);
+		return nullptr;
+	}
+	lru.splice(lru.begin(), lru, entry);
+	return &entry->asset;
+} // }}}
+
+AssetCache::Asset const *AssetCache::load(std::string const &key, int fd, struct stat const &st, std::string &&headers, std::string &&etag, std::string &&last_modified) { // {{{
+	std::string content;
+	size_t size = st.st_size;
+	bool ok = true;
+	content.resize_and_overwrite(size, [fd, &ok](char *buffer, size_t size) {
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = ::pread(fd, buffer + done, size - done, done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				ok = false;
+				break;
+			}
+			done += n;
+		}
+		return done;
+	});
+	if (!ok)
+		return nullptr;
+	auto old = index.find(key);
+	if (old != index.end()) {
+		used -= old->second->asset.content.size();
+		lru.erase(old->second);
+		index.erase(old);
+	}
+	evict(size);
+	lru.push_front(Entry {key, Asset {std::move(content), std::move(headers), std::move(etag), std::move(last_modified)}, st.st_dev, st.st_ino, st.st_size, st.st_mtim});
+	index[key] = lru.begin();
+	used += size;
+	return &lru.front().asset;
+} // }}}
+// }}}
+
+// Websocket unmasking. {{{
+// All kernels handle whole blocks and pass the rest on; blocks are a multiple of 4 bytes, so the mask stays in phase.
+static void unmask_scalar(char *data, size_t size, uint32_t mask) { // {{{
+	uint64_t mask64 = (uint64_t(mask) << 32) | mask;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		std::memcpy(&word, data + i, 8);
+		word ^= mask64;
+		std::memcpy(data + i, &word, 8);
+	}
+	uint8_t m[4];
+	std::memcpy(m, &mask, 4);
+	for (; i < size; ++i)
+		data[i] ^= m[i & 3];
+} // }}}
+
+#if defined(__SSE2__)
+static void unmask_sse2(char *data, size_t size, uint32_t mask) { // {{{
+	__m128i m = _mm_set1_epi32(int(mask));
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i *p = reinterpret_cast <__m128i *> (data + i);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), m));
+	}
+	unmask_scalar(data + i, size - i, mask);
+} // }}}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void unmask_avx2(char *data, size_t size, uint32_t mask) { // {{{
+	__m256i m = _mm256_set1_epi32(int(mask));
+	size_t i = 0;
+	for (; i + 64 <= size; i += 64) {
+		__m256i *p = reinterpret_cast <__m256i *> (data + i);
+		__m256i a = _mm256_xor_si256(_mm256_loadu_si256(p), m);
+		__m256i b = _mm256_xor_si256(_mm256_loadu_si256(p + 1), m);
+		_mm256_storeu_si256(p, a);
+		_mm256_storeu_si256(p + 1, b);
+	}
+	for (; i + 32 <= size; i += 32) {
+		__m256i *p = reinterpret_cast <__m256i *> (data + i);
+		_mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), m));
+	}
+	unmask_scalar(data + i, size - i, mask);
+} // }}}
+#endif
+
+#if defined(__ARM_NEON)
+static void unmask_neon(char *data, size_t size, uint32_t mask) { // {{{
+	uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		uint8_t *p = reinterpret_cast <uint8_t *> (data + i);
+		vst1q_u8(p, veorq_u8(vld1q_u8(p), m));
+	}
+	unmask_scalar(data + i, size - i, mask);
+} // }}}
+#endif
+
+typedef void (*UnmaskType)(char *data, size_t size, uint32_t mask);
+
+static UnmaskType select_unmask() { // {{{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return unmask_avx2;
+#endif
+#if defined(__SSE2__)
+	return unmask_sse2;
+#elif defined(__ARM_NEON)
+	return unmask_neon;
+#else
+	return unmask_scalar;
+#endif
+} // }}}
+
+void websocket_unmask(char *data, size_t size, uint32_t mask) { // {{{
+	// The best kernel for this CPU is selected on first use.
+	static UnmaskType const unmask = select_unmask();
+	unmask(data, size, mask);
+} // }}}
+// }}}
+
 std::map <int, char const *> http_response = { // {{{
 	// 1xx: informational
 	{100, "Continue"},
@@ -89,6 +249,735 @@ std::map <int, char const *> http_response = { // {{{
 	{510, "Not Extended"},
 	{511, "Network Authentication Required"}
 }; // }}}
+
+std::string http_date(time_t time) { // {{{
+	// Format a time as an HTTP date (RFC 9110), which is independent of the locale.
+	static char const *const days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static char const *const months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	struct tm tm;
+	gmtime_r(&time, &tm);
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	return buffer;
+} // }}}
+
+static bool parse_number(std::string_view &str, size_t &value) { // {{{
+	// Parse a decimal number from the start of str and remove it. Return false if there is no number or it overflows.
+	auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+	if (result.ec != std::errc())
+		return false;
+	str.remove_prefix(result.ptr - str.data());
+	return true;
+} // }}}
+
+time_t parse_http_date(std::string_view date) { // {{{
+	// Parse an HTTP date as produced by http_date(). The obsolete formats are not supported.
+	struct tm tm {};
+	std::string str(date);
+	char const *end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end == nullptr || *end != '\0')
+		return -1;
+	return timegm(&tm);
+} // }}}
+
+std::string http_etag(struct stat const &st, std::string_view encoding) { // {{{
+	// The tag changes when the file is replaced (inode), modified (mtime) or truncated (size).
+	std::ostringstream tag;
+	tag << std::hex << '"' << st.st_ino << '-' << st.st_size << '-' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+	if (!encoding.empty())
+		tag << '-' << encoding;
+	tag << '"';
+	return tag.str();
+} // }}}
+
+static std::string_view strip_view(std::string_view str) { // {{{
+	while (!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+		str.remove_prefix(1);
+	while (!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+		str.remove_suffix(1);
+	return str;
+} // }}}
+
+bool http_etag_match(std::string_view header, std::string_view etag) { // {{{
+	if (etag.starts_with("W/"))
+		etag.remove_prefix(2);
+	while (!header.empty()) {
+		auto p = header.find(',');
+		auto tag = strip_view(header.substr(0, p));
+		header.remove_prefix(p == std::string_view::npos ? header.size() : p + 1);
+		if (tag == "*")
+			return true;
+		if (tag.starts_with("W/"))
+			tag.remove_prefix(2);
+		if (tag == etag)
+			return true;
+	}
+	return false;
+} // }}}
+
+bool http_accepts_encoding(std::string_view header, std::string_view coding) { // {{{
+	// A coding is accepted if it is listed (or * is) without q=0.
+	bool star = false;
+	while (!header.empty()) {
+		auto p = header.find(',');
+		auto item = strip_view(header.substr(0, p));
+		header.remove_prefix(p == std::string_view::npos ? header.size() : p + 1);
+		auto s = item.find(';');
+		auto name = strip_view(item.substr(0, s));
+		bool allowed = true;
+		if (s != std::string_view::npos) {
+			auto q = strip_view(item.substr(s + 1));
+			if (q.starts_with("q=") || q.starts_with("Q=")) {
+				q.remove_prefix(2);
+				allowed = q.find_first_not_of("0.") != std::string_view::npos;
+			}
+		}
+		if (name.size() == coding.size() && std::equal(name.begin(), name.end(), coding.begin(), [](char a, char b) { return std::tolower(a) == b; }))
+			return allowed;
+		if (name == "*")
+			star = allowed;
+	}
+	return star;
+} // }}}
+
+bool http_has_token(std::string_view header, std::string_view token) { // {{{
+	while (!header.empty()) {
+		auto p = header.find(',');
+		auto item = strip_view(header.substr(0, p));
+		header.remove_prefix(p == std::string_view::npos ? header.size() : p + 1);
+		if (item.size() == token.size() && std::equal(item.begin(), item.end(), token.begin(), [](char a, char b) { return std::tolower(a) == std::tolower(b); }))
+			return true;
+	}
+	return false;
+} // }}}
+
+// Request headers. {{{
+HttpHeaders::HttpHeaders() : data(), fields(), known(), method(), target(), version() { // {{{
+	for (auto &k: known)
+		k = -1;
+} // }}}
+
+HttpHeaders::HttpHeaders(HttpHeaders const &other) : data(other.data), fields(other.fields), known(), method(other.method), target(other.target), version(other.version) { // {{{
+	std::copy(std::begin(other.known), std::end(other.known), known);
+	rebase(other.data.data());
+} // }}}
+
+HttpHeaders::HttpHeaders(HttpHeaders &&other) : data(), fields(std::move(other.fields)), known(), method(other.method), target(other.target), version(other.version) { // {{{
+	// A short string is stored inside the object, so moving it can change its address.
+	char const *old_base = other.data.data();
+	data = std::move(other.data);
+	std::copy(std::begin(other.known), std::end(other.known), known);
+	rebase(old_base);
+	other.clear();
+} // }}}
+
+HttpHeaders &HttpHeaders::operator=(HttpHeaders const &other) { // {{{
+	if (this == &other)
+		return *this;
+	data = other.data;
+	fields = other.fields;
+	std::copy(std::begin(other.known), std::end(other.known), known);
+	method = other.method;
+	target = other.target;
+	version = other.version;
+	rebase(other.data.data());
+	return *this;
+} // }}}
+
+HttpHeaders &HttpHeaders::operator=(HttpHeaders &&other) { // {{{
+	if (this == &other)
+		return *this;
+	char const *old_base = other.data.data();
+	data = std::move(other.data);
+	fields = std::move(other.fields);
+	std::copy(std::begin(other.known), std::end(other.known), known);
+	method = other.method;
+	target = other.target;
+	version = other.version;
+	rebase(old_base);
+	other.clear();
+	return *this;
+} // }}}
+
+void HttpHeaders::rebase(char const *old_base) { // {{{
+	// Make the views point into data, after they have been copied from an object with the same contents at old_base.
+	auto move = [this, old_base](std::string_view &view) {
+		if (view.data() != nullptr)
+			view = std::string_view(data.data() + (view.data() - old_base), view.size());
+	};
+	move(method);
+	move(target);
+	move(version);
+	for (auto &field: fields) {
+		move(field.first);
+		move(field.second);
+	}
+} // }}}
+
+void HttpHeaders::clear() { // {{{
+	data.clear();
+	fields.clear();
+	for (auto &k: known)
+		k = -1;
+	method = {};
+	target = {};
+	version = {};
+} // }}}
+
+static int known_header(std::string_view name) { // {{{
+	// Name is lower case.
+	switch (name.size()) {
+	case 4:
+		return name == "host" ? HttpHeaders::HOST : -1;
+	case 7:
+		return name == "upgrade" ? HttpHeaders::UPGRADE : -1;
+	case 10:
+		return name == "connection" ? HttpHeaders::CONNECTION : -1;
+	case 13:
+		return name == "authorization" ? HttpHeaders::AUTHORIZATION : -1;
+	case 14:
+		return name == "content-length" ? HttpHeaders::CONTENT_LENGTH : -1;
+	case 17:
+		return name == "sec-websocket-key" ? HttpHeaders::SEC_WEBSOCKET_KEY : name == "transfer-encoding" ? HttpHeaders::TRANSFER_ENCODING : -1;
+	default:
+		return -1;
+	}
+} // }}}
+
+static std::string_view strip_header_space(std::string_view str) { // {{{
+	while (!str.empty() && (str.front() == ' ' || str.front() == '\t' || str.front() == '\r'))
+		str.remove_prefix(1);
+	while (!str.empty() && (str.back() == ' ' || str.back() == '\t' || str.back() == '\r'))
+		str.remove_suffix(1);
+	return str;
+} // }}}
+
+HttpHeaders::Result HttpHeaders::parse(std::string_view header, size_t max_fields) { // {{{
+	clear();
+	data.assign(header);
+	char *base = data.data();
+	size_t size = data.size();
+	// Request line: method, target and version, separated by white space.
+	char *eol = static_cast <char *> (std::memchr(base, '\n', size));
+	if (eol == nullptr)
+		return INVALID;
+	size_t pos = eol + 1 - base;
+	if (pos < size && (base[pos] == ' ' || base[pos] == '\t')) {
+		// A continuation of the request line MUST be rejected (or ignored) according to HTTP.
+		return INVALID;
+	}
+	std::string_view line = strip_header_space(std::string_view(base, eol - base));
+	std::string_view *parts[3] = {&method, &target, &version};
+	for (int i = 0; i < 3; ++i) {
+		auto p = line.find_first_of(" \t");
+		if ((p == std::string_view::npos) != (i == 2) || p == 0)
+			return INVALID;
+		*parts[i] = line.substr(0, p);
+		line = strip_header_space(line.substr(p == std::string_view::npos ? line.size() : p));
+	}
+	// Fields.
+	while (pos < size) {
+		size_t start = pos;
+		eol = static_cast <char *> (std::memchr(base + pos, '\n', size - pos));
+		if (eol == nullptr)
+			return INVALID;
+		pos = eol + 1 - base;
+		if (strip_header_space(std::string_view(base + start, pos - 1 - start)).empty())
+			break;	// End of header.
+		// Continuation lines are joined to the field, by replacing the line break with spaces.
+		while (pos < size && (base[pos] == ' ' || base[pos] == '\t')) {
+			*eol = ' ';
+			if (eol > base + start && eol[-1] == '\r')
+				eol[-1] = ' ';
+			eol = static_cast <char *> (std::memchr(base + pos, '\n', size - pos));
+			if (eol == nullptr)
+				return INVALID;
+			pos = eol + 1 - base;
+		}
+		std::string_view line(base + start, eol - (base + start));
+		auto colon = line.find(':');
+		if (colon == std::string_view::npos) {
+			WL_log("Warning: ignoring http header without : " + std::string(strip_header_space(line)));
+			continue;
+		}
+		if (fields.size() >= max_fields)
+			return TOO_MANY_FIELDS;
+		for (size_t i = 0; i < colon; ++i) {
+			// White space in or after the field name MUST be rejected, because other parsers may not see the same field.
+			if (base[start + i] == ' ' || base[start + i] == '\t' || base[start + i] == '\r')
+				return BAD_REQUEST;
+			base[start + i] = std::tolower(static_cast <unsigned char> (base[start + i]));
+		}
+		auto name = line.substr(0, colon);
+		if (name.empty())
+			return BAD_REQUEST;
+		auto value = strip_header_space(line.substr(colon + 1));
+		int k = known_header(name);
+		if (k == CONTENT_LENGTH) {
+			// Repeated values are allowed if they are identical (RFC 9112, section 6.3).
+			if (value.empty() || value.find_first_not_of("0123456789") != std::string_view::npos)
+				return BAD_REQUEST;
+			if (known[k] >= 0 && fields[known[k]].second != value)
+				return BAD_REQUEST;
+		}
+		fields.emplace_back(name, value);
+		if (k >= 0)
+			known[k] = fields.size() - 1;
+	}
+	if (known[TRANSFER_ENCODING] >= 0) {
+		// The length of the body is only known if chunked is the final coding, and then Content-Length must be ignored;
+		// a request with both is refused, because another parser may have used Content-Length (RFC 9112, section 6.1).
+		if (known[CONTENT_LENGTH] >= 0)
+			return BAD_REQUEST;
+		auto codings = fields[known[TRANSFER_ENCODING]].second;
+		auto comma = codings.rfind(',');
+		auto last = strip_header_space(comma == std::string_view::npos ? codings : codings.substr(comma + 1));
+		if (last.size() != 7 || lower(std::string(last)) != "chunked")
+			return BAD_REQUEST;
+	}
+	return OK;
+} // }}}
+
+HttpHeaders::const_iterator HttpHeaders::find(std::string_view name) const { // {{{
+	for (size_t i = fields.size(); i > 0; --i) {
+		if (fields[i - 1].first == name)
+			return fields.begin() + (i - 1);
+	}
+	return fields.end();
+} // }}}
+// }}}
+
+// Multipart boundaries. {{{
+BoundarySearch::BoundarySearch(std::string const &needle) : needle(), skip() { // {{{
+	set(needle);
+} // }}}
+
+void BoundarySearch::set(std::string const &new_needle) { // {{{
+	needle = new_needle;
+	size_t n = needle.size();
+	for (size_t i = 0; i < 256; ++i)
+		skip[i] = n;
+	// The last byte is not in the table, so a match of only that byte still shifts forward.
+	for (size_t i = 0; i + 1 < n; ++i)
+		skip[static_cast <unsigned char>(needle[i])] = n - 1 - i;
+} // }}}
+
+size_t BoundarySearch::find(std::string_view haystack, size_t pos) const { // {{{
+	size_t n = needle.size();
+	if (n == 0)
+		return pos <= haystack.size() ? pos : std::string::npos;
+	char const *data = haystack.data();
+	char const *pattern = needle.data();
+	char last = pattern[n - 1];
+	while (pos + n <= haystack.size()) {
+		char c = data[pos + n - 1];
+		if (c == last && memcmp(data + pos, pattern, n - 1) == 0)
+			return pos;
+		pos += skip[static_cast <unsigned char>(c)];
+	}
+	return std::string::npos;
+} // }}}
+// }}}
+
+RangeResult parse_range(std::string_view header, size_t size, size_t &first, size_t &last) { // {{{
+	// Parse the value of a Range header for a resource of size bytes.
+	// Only a single byte range is supported; anything else is ignored, so the full resource is served.
+	auto strip = [](std::string_view &str) {
+		while (!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+			str.remove_prefix(1);
+		while (!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+			str.remove_suffix(1);
+	};
+	strip(header);
+	if (!header.starts_with("bytes="))
+		return RANGE_IGNORE;
+	header.remove_prefix(6);
+	strip(header);
+	if (header.find(',') != std::string_view::npos)
+		return RANGE_IGNORE;
+	if (header.starts_with('-')) {
+		// Suffix range: the last n bytes.
+		header.remove_prefix(1);
+		size_t n;
+		if (!parse_number(header, n) || !header.empty())
+			return RANGE_IGNORE;
+		if (n == 0 || size == 0)
+			return RANGE_UNSATISFIABLE;
+		first = n >= size ? 0 : size - n;
+		last = size - 1;
+		return RANGE_OK;
+	}
+	if (!parse_number(header, first) || !header.starts_with('-'))
+		return RANGE_IGNORE;
+	header.remove_prefix(1);
+	if (header.empty())
+		last = size - 1;
+	else if (!parse_number(header, last) || !header.empty() || last < first)
+		return RANGE_IGNORE;
+	if (first >= size)
+		return RANGE_UNSATISFIABLE;
+	if (last >= size)
+		last = size - 1;
+	return RANGE_OK;
+} // }}}
+
+// Websocket compression. {{{
+namespace {
+struct DeflateParams { // {{{
+	bool server_no_context_takeover = false;
+	bool client_no_context_takeover = false;
+	int server_max_window_bits = -1;	// -1: not present.
+	int client_max_window_bits = -1;	// -1: not present; 0: present without a value.
+}; // }}}
+}
+
+static bool parse_window_bits(std::string_view value, int &bits) { // {{{
+	if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+		value = value.substr(1, value.size() - 2);
+	auto result = std::from_chars(value.data(), value.data() + value.size(), bits);
+	return result.ec == std::errc() && result.ptr == value.data() + value.size() && bits >= 8 && bits <= 15;
+} // }}}
+
+static bool parse_deflate_params(std::string_view item, DeflateParams &params) { // {{{
+	// Parse one extension from a Sec-WebSocket-Extensions header: "permessage-deflate; param; param=value".
+	// Return false if it is another extension, or if it has unknown, invalid or duplicate parameters.
+	auto p = item.find(';');
+	if (lower(std::string(strip_view(item.substr(0, p)))) != "permessage-deflate")
+		return false;
+	while (p != std::string_view::npos) {
+		item.remove_prefix(p + 1);
+		p = item.find(';');
+		auto param = strip_view(item.substr(0, p));
+		auto eq = param.find('=');
+		auto name = lower(std::string(strip_view(param.substr(0, eq))));
+		std::string_view value;
+		if (eq != std::string_view::npos)
+			value = strip_view(param.substr(eq + 1));
+		if (name == "server_no_context_takeover" && eq == std::string_view::npos && !params.server_no_context_takeover)
+			params.server_no_context_takeover = true;
+		else if (name == "client_no_context_takeover" && eq == std::string_view::npos && !params.client_no_context_takeover)
+			params.client_no_context_takeover = true;
+		else if (name == "server_max_window_bits" && params.server_max_window_bits < 0) {
+			if (!parse_window_bits(value, params.server_max_window_bits))
+				return false;
+		}
+		else if (name == "client_max_window_bits" && params.client_max_window_bits < 0) {
+			if (eq == std::string_view::npos)
+				params.client_max_window_bits = 0;
+			else if (!parse_window_bits(value, params.client_max_window_bits))
+				return false;
+		}
+		else
+			return false;
+	}
+	return true;
+} // }}}
+
+struct WebsocketDeflate::State { // {{{
+	Settings settings;
+	int send_window;	// Window bits for compressing.
+	bool send_reset;	// Reset the compressor after every message.
+	int receive_window;	// Window bits for decompressing.
+	bool receive_reset;	// Reset the decompressor after every message.
+	std::string send_buffer;	// Output of the last call to compress().
+	std::string receive_buffer;	// Output of the last call to decompress(); separate, because a receiver may send a reply.
+#ifdef HAVE_ZLIB_H
+	bool have_deflater;
+	bool have_inflater;
+	z_stream deflater;
+	z_stream inflater;
+	State() : settings(), send_window(15), send_reset(false), receive_window(15), receive_reset(false), send_buffer(), receive_buffer(), have_deflater(false), have_inflater(false), deflater(), inflater() {}
+	~State() {
+		if (have_deflater)
+			deflateEnd(&deflater);
+		if (have_inflater)
+			inflateEnd(&inflater);
+	}
+#endif
+	static void trim(std::string &buffer) {
+		// Don't keep the memory of a single huge message for the rest of the connection.
+		if (buffer.capacity() > 1 << 20)
+			std::string().swap(buffer);
+	}
+}; // }}}
+
+WebsocketDeflate::WebsocketDeflate() : state() {}
+WebsocketDeflate::WebsocketDeflate(WebsocketDeflate &&other) : state(std::move(other.state)) {}
+WebsocketDeflate &WebsocketDeflate::operator=(WebsocketDeflate &&other) { state = std::move(other.state); return *this; }
+WebsocketDeflate::~WebsocketDeflate() {}
+
+bool WebsocketDeflate::available() { // {{{
+#ifdef HAVE_ZLIB_H
+	return true;
+#else
+	return false;
+#endif
+} // }}}
+
+void WebsocketDeflate::configure(Settings const &settings, int send_window, bool send_reset, int receive_window, bool receive_reset) { // {{{
+	state = std::make_unique <State> ();
+	state->settings = settings;
+	state->send_window = send_window;
+	state->send_reset = send_reset;
+	state->receive_window = receive_window;
+	state->receive_reset = receive_reset;
+} // }}}
+
+std::string WebsocketDeflate::offer(Settings const &settings) { // {{{
+	if (!settings.enable || !available())
+		return {};
+	std::string ret = "permessage-deflate; client_max_window_bits";
+	if (settings.window_bits < 15)
+		ret += "=" + std::to_string(settings.window_bits) + "; server_max_window_bits=" + std::to_string(settings.window_bits);
+	if (!settings.context_takeover)
+		ret += "; client_no_context_takeover";
+	if (!settings.peer_context_takeover)
+		ret += "; server_no_context_takeover";
+	return ret;
+} // }}}
+
+bool WebsocketDeflate::accept_response(std::string_view response, Settings const &settings) { // {{{
+	// The server may only accept one of the offers, and there was only one.
+	state.reset();
+	DeflateParams params;
+	if (!settings.enable || !available() || response.find(',') != std::string_view::npos || !parse_deflate_params(response, params))
+		return false;
+	// In a response, client_max_window_bits must have a value; it limits the window that is used for sending.
+	if (params.client_max_window_bits == 0)
+		return false;
+	int send_window = settings.window_bits;
+	if (params.client_max_window_bits > 0 && params.client_max_window_bits < send_window)
+		send_window = params.client_max_window_bits;
+	// Zlib cannot compress with a window of 256 bytes.
+	if (send_window < 9)
+		return false;
+	int receive_window = params.server_max_window_bits > 0 ? params.server_max_window_bits : 15;
+	configure(settings, send_window, params.client_no_context_takeover || !settings.context_takeover, receive_window, params.server_no_context_takeover);
+	return true;
+} // }}}
+
+std::string WebsocketDeflate::accept_offer(std::string_view offers, Settings const &settings) { // {{{
+	state.reset();
+	if (!settings.enable || !available())
+		return {};
+	// Offers are listed in order of preference; use the first one that is acceptable.
+	while (!offers.empty()) {
+		auto p = offers.find(',');
+		auto item = offers.substr(0, p);
+		offers.remove_prefix(p == std::string_view::npos ? offers.size() : p + 1);
+		DeflateParams params;
+		if (!parse_deflate_params(item, params))
+			continue;
+		int send_window = settings.window_bits;
+		if (params.server_max_window_bits > 0 && params.server_max_window_bits < send_window)
+			send_window = params.server_max_window_bits;
+		// Zlib cannot compress with a window of 256 bytes.
+		if (send_window < 9)
+			continue;
+		bool send_reset = params.server_no_context_takeover || !settings.context_takeover;
+		bool receive_reset = params.client_no_context_takeover || !settings.peer_context_takeover;
+		int receive_window = 15;
+		std::string response = "permessage-deflate";
+		if (send_reset)
+			response += "; server_no_context_takeover";
+		if (receive_reset)
+			response += "; client_no_context_takeover";
+		if (params.server_max_window_bits > 0)
+			response += "; server_max_window_bits=" + std::to_string(send_window);
+		if (params.client_max_window_bits >= 0) {
+			// The client supports a limit on its window; use it to save memory here.
+			receive_window = settings.window_bits;
+			if (params.client_max_window_bits > 0 && params.client_max_window_bits < receive_window)
+				receive_window = params.client_max_window_bits;
+			if (receive_window < 15)
+				response += "; client_max_window_bits=" + std::to_string(receive_window);
+		}
+		configure(settings, send_window, send_reset, receive_window, receive_reset);
+		return response;
+	}
+	return {};
+} // }}}
+
+bool WebsocketDeflate::should_compress(size_t size) const { // {{{
+	return state != nullptr && size >= state->settings.threshold;
+} // }}}
+
+bool WebsocketDeflate::compress(std::string_view data, std::string_view &result) { // {{{
+#ifdef HAVE_ZLIB_H
+	if (state == nullptr || data.size() > UINT_MAX)
+		return false;
+	z_stream &z = state->deflater;
+	if (!state->have_deflater) {
+		if (deflateInit2(&z, state->settings.level, Z_DEFLATED, -state->send_window, state->settings.mem_level, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+		state->have_deflater = true;
+	}
+	auto &out = state->send_buffer;
+	State::trim(out);
+	z.next_in = reinterpret_cast <Bytef *> (const_cast <char *> (data.data()));
+	z.avail_in = data.size();
+	// The bound does not include the empty block of the flush; add room for it.
+	size_t room = deflateBound(&z, data.size()) + 16;
+	size_t used = 0;
+	int code = Z_OK;
+	while (true) {
+		out.resize_and_overwrite(used + room, [&z, &code, used](char *buffer, size_t size) {
+			z.next_out = reinterpret_cast <Bytef *> (buffer + used);
+			z.avail_out = size - used;
+			code = deflate(&z, Z_SYNC_FLUSH);
+			return size - z.avail_out;
+		});
+		used = out.size();
+		if (code != Z_OK && code != Z_BUF_ERROR)
+			return false;
+		if (z.avail_out != 0)
+			break;
+	}
+	// The flush ends with an empty stored block; it is not sent (RFC 7692, section 7.2.1).
+	if (used >= 4 && std::memcmp(out.data() + used - 4, "\0\0\xff\xff", 4) == 0)
+		out.resize(used - 4);
+	if (state->send_reset)
+		deflateReset(&z);
+	result = out;
+	return true;
+#else
+	(void)&data;
+	(void)&result;
+	return false;
+#endif
+} // }}}
+
+WebsocketDeflate::Status WebsocketDeflate::decompress(std::string_view data, std::string_view &result, size_t max_size) { // {{{
+#ifdef HAVE_ZLIB_H
+	if (state == nullptr || data.size() > UINT_MAX)
+		return INVALID;
+	z_stream &z = state->inflater;
+	if (!state->have_inflater) {
+		if (inflateInit2(&z, -state->receive_window) != Z_OK)
+			return INVALID;
+		state->have_inflater = true;
+	}
+	auto &out = state->receive_buffer;
+	State::trim(out);
+	size_t used = 0;
+	Status status = OK;
+	// The output buffer never grows beyond max_size + 1 bytes; filling that last byte means that the message is too large.
+	size_t limit = max_size == 0 ? size_t(-1) : max_size + 1;
+	// The sender has removed the empty stored block at the end of the message; put it back.
+	static Bytef const tail[4] = {0, 0, 0xff, 0xff};
+	auto run = [&z, &out, &used, &status, limit](Bytef const *in, size_t size) {
+		z.next_in = const_cast <Bytef *> (in);
+		z.avail_in = size;
+		while (status == OK) {
+			size_t room = std::min(std::max(used, size * 3 + 256), limit - used);
+			if (room > UINT_MAX)
+				room = UINT_MAX;
+			// The size that is passed to the callback may be the capacity, which can be larger than the limit; use room.
+			out.resize_and_overwrite(used + room, [&z, &status, used, room](char *buffer, size_t) {
+				z.next_out = reinterpret_cast <Bytef *> (buffer + used);
+				z.avail_out = room;
+				int code = inflate(&z, Z_SYNC_FLUSH);
+				if (code == Z_STREAM_END)
+					inflateReset(&z);	// The sender has ended the stream with a final block; the next message starts a new one.
+				else if (code != Z_OK && code != Z_BUF_ERROR)
+					status = INVALID;
+				return used + room - z.avail_out;
+			});
+			used = out.size();
+			if (status == OK && used == limit) {
+				status = TOO_LARGE;
+				break;
+			}
+			if (z.avail_in == 0 && z.avail_out != 0)
+				break;
+		}
+	};
+	run(reinterpret_cast <Bytef const *> (data.data()), data.size());
+	run(tail, sizeof(tail));
+	if (status != OK) {
+		inflateReset(&z);
+		State::trim(out);
+		return status;
+	}
+	if (state->receive_reset)
+		inflateReset(&z);
+	result = out;
+	return OK;
+#else
+	(void)&data;
+	(void)&result;
+	(void)&max_size;
+	return INVALID;
+#endif
+} // }}}
+// }}}
+
+// Broadcasting. {{{
+size_t websocket_frame_header(char *header, int opcode, bool compressed, size_t length, bool mask) { // {{{
+	size_t size = 2;
+	uint8_t maskchar = mask ? 0x80 : 0;
+	header[0] = 0x80 | (compressed ? 0x40 : 0) | opcode;
+	if (length < 0x7e)
+		header[1] = maskchar | length;
+	else if (length < 1 << 16) {
+		header[1] = maskchar | 0x7e;
+		header[2] = (length >> 8) & 0xff;
+		header[3] = length & 0xff;
+		size = 4;
+	}
+	else {
+		header[1] = maskchar | 0x7f;
+		for (int i = 0; i < 8; ++i)
+			header[2 + i] = (length >> (8 * (7 - i))) & 0xff;
+		size = 10;
+	}
+	if (mask) {
+		// Masks are stupid, but the standard requires them.  Don't waste time on encoding (or decoding, if also using this library).
+		for (int i = 0; i < 4; ++i)
+			header[size++] = 0;
+	}
+	return size;
+} // }}}
+
+BroadcastMessage::BroadcastMessage(std::string_view data, int opcode) : frame(), header_size(0), opcode(opcode) { // {{{
+	char header[14];
+	header_size = websocket_frame_header(header, opcode, false, data.size(), false);
+	auto buffer = std::make_shared <std::string> ();
+	buffer->reserve(header_size + data.size());
+	buffer->append(header, header_size);
+	buffer->append(data);
+	frame = std::move(buffer);
+} // }}}
+
+RPCBroadcast::RPCBroadcast(std::string const &target, Args args, KwArgs kwargs) : target(target), args(args ? args : WebVector::create()), kwargs(kwargs ? kwargs : WebMap::create()), text(), binary() { // {{{
+} // }}}
+
+std::shared_ptr <WebObject> RPCBroadcast::call() const { // {{{
+	return WebVector::create(WebNone::create(), WebString::create(target), args, kwargs);
+} // }}}
+
+BroadcastMessage const &RPCBroadcast::message(bool use_binary) { // {{{
+	// Encode the packet like RPC::send() does, the first time that it is needed in this format.
+	BroadcastMessage &ret = use_binary ? binary : text;
+	if (ret)
+		return ret;
+	std::string packet;
+	if (use_binary) {
+		packet = "V\x02";
+		WebString::dump_binary_string("call", packet);
+		call()->dump_binary(packet);
+	}
+	else {
+		packet = "[";
+		WebString::dump_string("call", packet);
+		packet += ',';
+		call()->dump_to(packet);
+		packet += ']';
+	}
+	ret = BroadcastMessage(packet, use_binary ? 2 : 1);
+	return ret;
+} // }}}
+// }}}
 }
 
 // vim: set fileencoding=utf-8 foldmethod=marker :
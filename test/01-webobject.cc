@@ -4,6 +4,9 @@
 
 #include <webloop.hh>
 #include <iostream>
+#include <thread>
+#include <future>
+#include <sys/resource.h>
 
 /*
 TEST OUTPUT: Calling function.
@@ -21,6 +24,15 @@ TEST OUTPUT: Member coro called with args [ "coro", "member", ] and kwargs { }
 TEST OUTPUT: yielded 56
 TEST OUTPUT: Received None
 TEST OUTPUT: returned 3.5
+TEST OUTPUT: Binary: [ None, true, false, -1, 300, 0.1, "Hoi", { a: [ ], b: -9223372036854775808, }, ]
+TEST OUTPUT: Float is exact: true
+TEST OUTPUT: Truncated: Truncated binary WebObject
+TEST OUTPUT: JSON: [ 1, -2500, "a"b\é😀A", { k: [ true, false, None, ], }, nan, 1.23457e+19, ]
+TEST OUTPUT: Round trip: true
+TEST OUTPUT: Too deep: JSON nesting too deep
+TEST OUTPUT: Junk: Junk after JSON value
+TEST OUTPUT: Map: { a: 2, b: 3, c: [ ], } has c: true, has d: false
+TEST OUTPUT: Freed by another thread: memory is reused: true
 */
 
 using namespace Webloop;
@@ -90,6 +102,64 @@ void runner() {
 	f = WebCoroutineMemberPointer <testclass>::create(&tc, &testclass::coro_member);
 	c = (*f)(WV("coro", "member"));
 	run_coroutine(c);
+
+	// Binary serialization.
+	std::string binary;
+	WV(WN(), true, false, -1, 300, 0.1, "Hoi", WM(WT("a", WV()), WT("b", INT64_MIN)))->dump_binary(binary);
+	auto loaded = WebObject::load_binary(binary);
+	std::cout << "Binary: " << loaded->print() << std::endl;
+	std::cout << "Float is exact: " << (double(*(*loaded->as_vector())[5]->as_float()) == 0.1 ? "true" : "false") << std::endl;
+	try {
+		WebObject::load_binary(binary.substr(0, binary.size() - 1));
+	}
+	catch (char const *msg) {
+		std::cout << "Truncated: " << msg << std::endl;
+	}
+
+	// JSON parsing.
+	auto json = WebObject::load(" [1, -2.5e3, \"a\\\"b\\\\\\u00e9\\ud83d\\ude00\\x41\", {\"k\": [true, false, null]}, NaN, 12345678901234567890] ");
+	std::cout << "JSON: " << json->print() << std::endl;
+	std::cout << "Round trip: " << (WebObject::load(json->dump())->dump() == json->dump() ? "true" : "false") << std::endl;
+	try {
+		WebObject::load("[[[1]]]", 2);
+	}
+	catch (char const *msg) {
+		std::cout << "Too deep: " << msg << std::endl;
+	}
+	try {
+		WebObject::load("[1] x");
+	}
+	catch (char const *msg) {
+		std::cout << "Junk: " << msg << std::endl;
+	}
+	auto map_obj = WebObject::load("{\"b\": 1, \"c\": [], \"a\": 2, \"b\": 3}");
+	auto map = map_obj->as_map();
+	std::cout << "Map: " << map->print() << " has c: " << (map->contains("c") ? "true" : "false") << ", has d: " << (map->get("d") ? "true" : "false") << std::endl;
+
+	// Objects that are created in this thread and freed in another one must not use new memory every time.
+	int const rounds = 100;
+	std::vector <std::promise <std::vector <std::shared_ptr <WebObject> > > > batches(rounds);
+	std::vector <std::promise <void> > freed(rounds);
+	std::thread consumer([&] {
+		for (int i = 0; i < rounds; ++i) {
+			batches[i].get_future().get();	// The batch is freed here.
+			freed[i].set_value();
+		}
+	});
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	long start = usage.ru_maxrss;
+	for (int i = 0; i < rounds; ++i) {
+		std::vector <std::shared_ptr <WebObject> > batch;
+		for (int n = 0; n < 100000; ++n)
+			batch.push_back(WebInt::create(n));
+		batches[i].set_value(std::move(batch));
+		freed[i].get_future().get();
+	}
+	consumer.join();
+	getrusage(RUSAGE_SELF, &usage);
+	// Without reuse, this grows by more than 400 MiB; ru_maxrss is in KiB.
+	std::cout << "Freed by another thread: memory is reused: " << (usage.ru_maxrss - start < (64 << 10) ? "true" : "false") << std::endl;
 }
 
 int main(int argc, char **argv) {
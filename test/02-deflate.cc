@@ -0,0 +1,66 @@
+#define WEBLOOP_HELP "Test program for websocket compression."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-test"
+
+#include <webloop.hh>
+#include <iostream>
+
+/*
+TEST OUTPUT: Negotiated: true
+TEST OUTPUT: Round trip: 0 true
+TEST OUTPUT: At limit: 0
+TEST OUTPUT: Over limit: 2
+TEST OUTPUT: Bomb: 2 compressed to less than 1 MiB: true
+TEST OUTPUT: After refusal: 0 true
+TEST OUTPUT: Invalid: 1
+*/
+
+using namespace Webloop;
+
+static void runner() {
+	WebsocketDeflate::Settings settings;
+	settings.enable = true;
+	// Negotiate like a client and a server; every message is compressed independently, so a refused message does not affect the next one.
+	settings.context_takeover = false;
+	settings.peer_context_takeover = false;
+	WebsocketDeflate client, server;
+	std::string response = server.accept_offer(WebsocketDeflate::offer(settings), settings);
+	std::cout << "Negotiated: " << (client.accept_response(response, settings) && client.active() && server.active() ? "true" : "false") << std::endl;
+
+	std::string text;
+	for (int i = 0; i < 1000; ++i)
+		text += "message " + std::to_string(i) + "; ";
+	std::string_view compressed, result;
+	client.compress(text, compressed);
+	std::string copy(compressed);
+	auto status = server.decompress(copy, result);
+	std::cout << "Round trip: " << status << " " << (result == text ? "true" : "false") << std::endl;
+	std::cout << "At limit: " << server.decompress(copy, result, text.size()) << std::endl;
+	std::cout << "Over limit: " << server.decompress(copy, result, text.size() - 1) << std::endl;
+
+	// A highly compressible message must be refused without inflating all of it.
+	std::string zeros(256 << 20, '\0');
+	client.compress(zeros, compressed);
+	std::string bomb(compressed);
+	zeros.clear();
+	zeros.shrink_to_fit();
+	std::cout << "Bomb: " << server.decompress(bomb, result, 1 << 20) << " compressed to less than 1 MiB: " << (bomb.size() < (1 << 20) ? "true" : "false") << std::endl;
+
+	status = server.decompress(copy, result, 1 << 20);
+	std::cout << "After refusal: " << status << " " << (result == text ? "true" : "false") << std::endl;
+	std::cout << "Invalid: " << server.decompress("\xff\xff\xff\xff", result) << std::endl;
+}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	try {
+		runner();
+	}
+	catch (char const *msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	catch (std::string msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,269 @@
+#define WEBLOOP_HELP "Test program for receiving websocket messages."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-test"
+
+#include <webloop.hh>
+#include <iostream>
+#include <thread>
+#include <netdb.h>
+#include <sys/socket.h>
+
+/*
+TEST OUTPUT: Streamed: true parts: many first: 1 last: 1
+TEST OUTPUT: Fragmented: true first: 1 last: 1 pong: 8a 2 68 69
+TEST OUTPUT: Empty: parts: 1 first: 1 last: 1
+TEST OUTPUT: Whole: true messages: 1
+TEST OUTPUT: Message limit: messages: 1 closed: true close frame: 88 2 3 f1
+TEST OUTPUT: Frame limit: closed: true close frame: 88 2 3 f1
+TEST OUTPUT: Compressed: true messages: 1
+TEST OUTPUT: Compressed limit: messages: 1 closed: true close frame: 88 2 3 f1
+TEST OUTPUT: Keepalive: timer before: true
+TEST OUTPUT: Keepalive, frame too large: closed: true timer left: false
+TEST OUTPUT: Keepalive, invalid compressed message: closed: true timer left: false
+TEST OUTPUT: Keepalive, invalid fragment: closed: true timer left: false
+TEST OUTPUT: Keepalive, RSV1 on continuation: closed: true timer left: false
+*/
+
+// The server side runs in the loop of the main thread; a client thread writes raw frames, in small pieces, to a plain socket.
+
+using namespace Webloop;
+
+static std::string const port = "5396";
+
+struct Service { // {{{
+	Websocket <Service> websocket;
+	std::string data;
+	int parts = 0, firsts = 0, lasts = 0, messages = 0;
+	void stream(std::string_view part, bool first, bool last) { data += part; ++parts; firsts += first; lasts += last; }
+	void receive(std::string_view message) { data = message; ++messages; }
+	void accept(Httpd <Service>::Connection &connection) {
+		websocket = Websocket <Service> (std::move(connection.socket), this, nullptr, {nullptr, Loop::Duration()});
+		websocket.set_deflate(std::move(connection.deflate));
+	}
+	void reset() { data.clear(); parts = firsts = lasts = messages = 0; }
+}; // }}}
+
+// Client. {{{
+struct Client {
+	int fd;
+	std::string extensions;	// Sec-WebSocket-Extensions header of the response.
+	Client(bool compress) : fd(-1), extensions() {
+		addrinfo *info;
+		if (getaddrinfo("localhost", port.c_str(), nullptr, &info) != 0)
+			throw "unable to resolve localhost";
+		for (auto *a = info; a; a = a->ai_next) {
+			fd = socket(a->ai_family, SOCK_STREAM, 0);
+			if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+				break;
+			::close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(info);
+		// Don't hang if the server doesn't reply.
+		timeval timeout {2, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		std::string request = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n";
+		if (compress)
+			request += "Sec-WebSocket-Extensions: permessage-deflate; client_no_context_takeover\r\n";
+		write_all(request + "\r\n", 4096);
+		std::string response;
+		char buffer[4096];
+		while (response.find("\r\n\r\n") == std::string::npos) {
+			int n = ::read(fd, buffer, sizeof(buffer));
+			if (n <= 0)
+				break;
+			response.append(buffer, n);
+		}
+		auto p = response.find("Sec-WebSocket-Extensions:");
+		if (p != std::string::npos) {
+			p = response.find_first_not_of(" ", p + 25);
+			extensions = response.substr(p, response.find("\r\n", p) - p);
+		}
+	}
+	~Client() { ::close(fd); }
+	void write_all(std::string const &data, size_t step) {
+		// Send in pieces with pauses, so the server receives partial frames.
+		for (size_t i = 0; i < data.size(); i += step) {
+			if (::write(fd, data.data() + i, std::min(step, data.size() - i)) < 0)
+				return;
+			usleep(2000);
+		}
+	}
+	std::string read_frames() {
+		char buffer[100];
+		int n = ::read(fd, buffer, sizeof(buffer));
+		std::ostringstream ret;
+		ret << std::hex;
+		for (int i = 0; i < n; ++i)
+			ret << (i > 0 ? " " : "") << (buffer[i] & 0xff);
+		return ret.str();
+	}
+};
+
+static std::string frame(int opcode, bool fin, std::string const &payload, bool compressed = false) {
+	std::string ret(1, char((fin ? 0x80 : 0) | (compressed ? 0x40 : 0) | opcode));
+	size_t size = payload.size();
+	if (size < 126)
+		ret += char(0x80 | size);
+	else if (size < 65536) {
+		ret += char(0xfe);
+		ret += char(size >> 8);
+		ret += char(size & 0xff);
+	}
+	else {
+		ret += char(0xff);
+		for (int i = 0; i < 8; ++i)
+			ret += char((size >> (8 * (7 - i))) & 0xff);
+	}
+	unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+	ret.append(reinterpret_cast <char *> (mask), 4);
+	for (size_t i = 0; i < size; ++i)
+		ret += char(payload[i] ^ mask[i % 4]);
+	return ret;
+}
+
+static std::string pattern(size_t size) {
+	std::string ret(size, '\0');
+	for (size_t i = 0; i < size; ++i)
+		ret[i] = 'a' + (i * 7) % 26;
+	return ret;
+}
+// }}}
+
+template <class F> static void run(F client, int ms = 800) { // {{{
+	// Run the loop while the client does its work.
+	Loop *loop = Loop::get();
+	std::thread thread(client);
+	auto end = loop->now() + std::chrono::milliseconds(ms);
+	while (loop->now() < end)
+		loop->iteration(false);
+	thread.join();
+} // }}}
+
+static void runner() {
+	// The connections that are refused are logged; keep that out of the output.
+	std::ostringstream log;
+	set_log_output(log);
+	Service service;
+	Httpd <Service> httpd(&service, port, "");
+	httpd.set_accept(&Service::accept);
+	WebsocketDeflate::Settings settings;
+	settings.enable = true;
+	httpd.set_deflate(settings);
+	std::string big = pattern(300000), p1 = pattern(1001), p2 = pattern(5003), p3 = pattern(7);
+	std::unique_ptr <Client> client;
+
+	// Streaming. {{{
+	run([&] { client = std::make_unique <Client> (false); }, 200);
+	service.websocket.set_stream_receiver(&Service::stream);
+	run([&] { client->write_all(frame(2, true, big), 7777); }, 3000);
+	std::cout << "Streamed: " << (service.data == big ? "true" : "false") << " parts: " << (service.parts > 10 ? "many" : std::to_string(service.parts)) << " first: " << service.firsts << " last: " << service.lasts << std::endl;
+	service.reset();
+	// A ping between the fragments must not end the message.
+	run([&] { client->write_all(frame(1, false, p1) + frame(9, true, "hi") + frame(0, false, p2) + frame(0, false, "") + frame(0, true, p3), 333); });
+	std::cout << "Fragmented: " << (service.data == p1 + p2 + p3 ? "true" : "false") << " first: " << service.firsts << " last: " << service.lasts << " pong: " << client->read_frames() << std::endl;
+	service.reset();
+	run([&] { client->write_all(frame(1, true, ""), 100); });
+	std::cout << "Empty: parts: " << service.parts << " first: " << service.firsts << " last: " << service.lasts << std::endl;
+	service.reset();
+	// }}}
+
+	// Limits. {{{
+	service.websocket.set_stream_receiver(nullptr);
+	service.websocket.set_view_receiver(&Service::receive);
+	run([&] { client->write_all(frame(1, false, p1) + frame(0, true, p2), 1000); });
+	std::cout << "Whole: " << (service.data == p1 + p2 ? "true" : "false") << " messages: " << service.messages << std::endl;
+	service.reset();
+	// Every frame is allowed, but the message is not; the first message is.
+	service.websocket.set_max_sizes(4000, 6000);
+	run([&] { client->write_all(frame(1, true, p1) + frame(1, false, p1) + frame(0, false, p1) + frame(0, false, p1) + frame(0, false, p1) + frame(0, false, p1) + frame(0, false, p1) + frame(0, true, p1), 100000); });
+	std::cout << "Message limit: messages: " << service.messages << " closed: " << (service.websocket.closed() ? "true" : "false") << " close frame: " << client->read_frames() << std::endl;
+	service.reset();
+	// The frame is refused as soon as its header arrives.
+	run([&] { client = std::make_unique <Client> (false); }, 200);
+	service.websocket.set_view_receiver(&Service::receive);
+	service.websocket.set_max_sizes(4000, 6000);
+	run([&] { std::string f = frame(2, true, p2); client->write_all(f.substr(0, 20), 100); });
+	std::cout << "Frame limit: closed: " << (service.websocket.closed() ? "true" : "false") << " close frame: " << client->read_frames() << std::endl;
+	service.reset();
+	// }}}
+
+	// Compressed messages. {{{
+	run([&] { client = std::make_unique <Client> (true); }, 200);
+	service.websocket.set_view_receiver(&Service::receive);
+	service.websocket.set_max_sizes(100000, 100000);
+	WebsocketDeflate deflate;
+	settings.context_takeover = false;
+	deflate.accept_response(client->extensions, settings);
+	std::string_view compressed;
+	deflate.compress(p2, compressed);
+	std::string small(compressed);
+	// This inflates to 64 MiB; it must be refused after inflating no more than the message limit.
+	deflate.compress(std::string(64 << 20, '\0'), compressed);
+	std::string bomb(compressed);
+	run([&] { client->write_all(frame(2, true, small, true), 1000); });
+	std::cout << "Compressed: " << (service.data == p2 ? "true" : "false") << " messages: " << service.messages << std::endl;
+	run([&] { client->write_all(frame(2, true, bomb, true), 100000); });
+	std::cout << "Compressed limit: messages: " << service.messages << " closed: " << (service.websocket.closed() ? "true" : "false") << " close frame: " << client->read_frames() << std::endl;
+	// }}}
+}
+
+static void keepalive_check(std::string const &name, std::string const &data) { // {{{
+	// A websocket that closes because of what the peer sent must stop its keepalive timer; otherwise the timer fires after the
+	// object has been destroyed. Nothing else in this loop has timers, so any timer that is left belongs to it.
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0)
+		throw "unable to create socket pair";
+	Service service;
+	auto websocket = std::make_unique <Websocket <Service> > (fds[0], &service, nullptr, Websocket <Service>::RunSettings {nullptr, std::chrono::milliseconds(50)});
+	websocket->set_view_receiver(&Service::receive);
+	websocket->set_max_sizes(4000, 6000);
+	WebsocketDeflate::Settings settings;
+	settings.enable = true;
+	WebsocketDeflate deflate;
+	deflate.accept_offer(WebsocketDeflate::offer(settings), settings);
+	websocket->set_deflate(std::move(deflate));
+	Loop *loop = Loop::get();
+	if (name.empty())
+		std::cout << "Keepalive: timer before: " << (loop->handle_timeouts() >= 0 ? "true" : "false") << std::endl;
+	else {
+		if (::write(fds[1], data.data(), data.size()) != ssize_t(data.size()))
+			throw "unable to write frame";
+		for (int i = 0; i < 5; ++i)
+			loop->iteration(false);
+		std::cout << "Keepalive, " << name << ": closed: " << (websocket->closed() ? "true" : "false") << " timer left: " << (loop->handle_timeouts() >= 0 ? "true" : "false") << std::endl;
+	}
+	websocket.reset();
+	// Let a timer that was left behind fire on the destroyed object.
+	auto end = loop->now() + std::chrono::milliseconds(120);
+	while (loop->now() < end)
+		loop->iteration(false);
+	::close(fds[1]);
+} // }}}
+
+static void keepalive_runner() {
+	std::ostringstream log;
+	set_log_output(log);
+	keepalive_check("", "");
+	keepalive_check("frame too large", frame(2, true, pattern(5003)).substr(0, 20));
+	keepalive_check("invalid compressed message", frame(2, true, "\xff\xff\xff\xff", true));
+	keepalive_check("invalid fragment", frame(0, true, "x"));
+	keepalive_check("RSV1 on continuation", frame(2, false, "x") + frame(0, true, "y", true));
+}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	try {
+		runner();
+		keepalive_runner();
+	}
+	catch (char const *msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	catch (std::string msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	return 0;
+}
+
+// vim: set foldmethod=marker :
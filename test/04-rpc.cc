@@ -0,0 +1,107 @@
+#define WEBLOOP_HELP "Test program for changing the published functions of an RPC server."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-test"
+
+#include <webloop.hh>
+#include <iostream>
+
+/*
+TEST OUTPUT: std::map: published: 1 1 replaced: 2 removed: remote call failed, remote call failed added: 1 1
+TEST OUTPUT: PublishedMap: published: 1 1 replaced: 2 removed: remote call failed, remote call failed added: 1 1
+*/
+
+// Both connections must see every change to the published map of the server, without refreshing them.
+
+using namespace Webloop;
+
+static std::string const port = "5397";
+
+template <bool tracked>
+struct Service { // {{{
+	typedef typename RPC <Service>::Published Published;
+	typedef std::conditional_t <tracked, typename RPC <Service>::PublishedMap, std::map <std::string, Published> > Map;
+	Map table;
+	Map *published;
+	typename RPC <Service>::PublishedFallback published_fallback;
+	std::list <RPC <Service> > rpcs;
+	Service() : table(), published(&table), published_fallback(nullptr), rpcs() {}
+	coroutine one(Args, KwArgs) { co_return WebInt::create(1); }
+	coroutine two(Args, KwArgs) { co_return WebInt::create(2); }
+	void change(std::string const &name, Published target) {
+		if constexpr (tracked) {
+			if (target == nullptr)
+				table.erase(name);
+			else
+				table.set(name, target);
+		}
+		else {
+			// A std::map is changed directly.
+			if (target == nullptr)
+				table.erase(name);
+			else
+				table[name] = target;
+		}
+	}
+	void accept(typename Httpd <Service>::Connection &connection) { rpcs.emplace_back(connection, this); }
+}; // }}}
+
+struct Client { // {{{
+	std::map <std::string, RPC <Client>::Published> *published;
+	RPC <Client>::PublishedFallback published_fallback;
+	std::string result;
+	RPC <Client> rpc;
+	Client() : published(nullptr), published_fallback(nullptr), result(), rpc("ws://localhost:" + port + "/", this) {
+		rpc.set_error_cb(&Client::error);
+	}
+	void error(std::string const &message) { result = message; }
+	void reply(std::shared_ptr <WebObject> value) { result = value->print(); }
+	std::string call() {
+		result.clear();
+		rpc.bgcall("f", WV(), WM(), &Client::reply);
+		while (result.empty())
+			Loop::get()->iteration(true);
+		return result;
+	}
+}; // }}}
+
+template <bool tracked> static void run(std::string const &name) { // {{{
+	typedef Service <tracked> S;
+	S service;
+	Httpd <S> httpd(&service, port, "");
+	httpd.set_accept(&S::accept);
+	Client client, other;
+	while (!client.rpc.is_open() || !other.rpc.is_open())
+		Loop::get()->iteration(true);
+	service.change("f", &S::one);
+	std::cout << name << ": published: " << client.call() << " " << other.call();
+	service.change("f", &S::two);
+	std::cout << " replaced: " << client.call();
+	service.change("f", nullptr);
+	std::cout << " removed: " << client.call() << ", " << other.call();
+	service.change("f", &S::one);
+	std::cout << " added: " << client.call() << " " << other.call() << std::endl;
+} // }}}
+
+static void runner() {
+	// Refused calls are logged; keep that out of the output.
+	std::ostringstream log;
+	set_log_output(log);
+	run <false> ("std::map");
+	run <true> ("PublishedMap");
+}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	try {
+		runner();
+	}
+	catch (char const *msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	catch (std::string msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	return 0;
+}
+
+// vim: set foldmethod=marker :
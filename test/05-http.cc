@@ -0,0 +1,134 @@
+#define WEBLOOP_HELP "Test program for parsing http request headers."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-test"
+
+#include <webloop.hh>
+#include <iostream>
+#include <thread>
+#include <netdb.h>
+
+/*
+TEST OUTPUT: Simple: OK host: localhost
+TEST OUTPUT: Folded: OK x-folded: a   b
+TEST OUTPUT: Space before colon: BAD_REQUEST
+TEST OUTPUT: Tab before colon: BAD_REQUEST
+TEST OUTPUT: Space in name: BAD_REQUEST
+TEST OUTPUT: Empty name: BAD_REQUEST
+TEST OUTPUT: Same Content-Length: OK content-length: 5
+TEST OUTPUT: Different Content-Length: BAD_REQUEST
+TEST OUTPUT: Content-Length list: BAD_REQUEST
+TEST OUTPUT: Negative Content-Length: BAD_REQUEST
+TEST OUTPUT: Chunked: OK transfer-encoding: chunked
+TEST OUTPUT: Chunked last: OK transfer-encoding: gzip, Chunked
+TEST OUTPUT: Chunked not last: BAD_REQUEST
+TEST OUTPUT: Chunked in earlier field: BAD_REQUEST
+TEST OUTPUT: Transfer-Encoding and Content-Length: BAD_REQUEST
+TEST OUTPUT: Content-Length and Transfer-Encoding: BAD_REQUEST
+TEST OUTPUT: Invalid request line: INVALID
+TEST OUTPUT: Too many fields: TOO_MANY_FIELDS
+TEST OUTPUT: Server: HTTP/1.1 400 closed: true
+*/
+
+using namespace Webloop;
+
+static std::string const port = "5398";
+
+static char const *names[] = {"OK", "INVALID", "TOO_MANY_FIELDS", "BAD_REQUEST"};
+
+static void parse(std::string const &name, std::string const &fields, char const *show = nullptr) { // {{{
+	HttpHeaders headers;
+	auto result = headers.parse("POST / HTTP/1.1\r\nHost: localhost\r\n" + fields + "\r\n", 10);
+	std::cout << name << ": " << names[result];
+	if (result == HttpHeaders::OK && show != nullptr) {
+		auto field = headers.find(show);
+		std::cout << " " << show << ": " << (field == headers.end() ? "(none)" : std::string(field->second));
+	}
+	std::cout << std::endl;
+} // }}}
+
+struct Service { // {{{
+}; // }}}
+
+static std::string request(std::string const &data) { // {{{
+	// Send a request from a plain socket and return the status line of the reply, and whether the connection was closed.
+	addrinfo *info;
+	if (getaddrinfo("localhost", port.c_str(), nullptr, &info) != 0)
+		throw "unable to resolve localhost";
+	int fd = -1;
+	for (auto *a = info; a; a = a->ai_next) {
+		fd = socket(a->ai_family, SOCK_STREAM, 0);
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(info);
+	timeval timeout {2, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (::write(fd, data.data(), data.size()) < 0)
+		throw "unable to write request";
+	std::string response;
+	char buffer[4096];
+	int n;
+	while ((n = ::read(fd, buffer, sizeof(buffer))) > 0)
+		response.append(buffer, n);
+	::close(fd);
+	return response.substr(0, 12) + " closed: " + (n == 0 ? "true" : "false");
+} // }}}
+
+static void runner() {
+	// Refused requests are logged; keep that out of the output.
+	std::ostringstream log;
+	set_log_output(log);
+
+	parse("Simple", "", "host");
+	parse("Folded", "X-Folded: a\r\n b\r\n", "x-folded");
+	parse("Space before colon", "Content-Length : 5\r\n");
+	parse("Tab before colon", "Transfer-Encoding\t: chunked\r\n");
+	parse("Space in name", "Content Length: 5\r\n");
+	parse("Empty name", ": 5\r\n");
+	parse("Same Content-Length", "Content-Length: 5\r\nContent-Length: 5\r\n", "content-length");
+	parse("Different Content-Length", "Content-Length: 5\r\nContent-Length: 50\r\n");
+	parse("Content-Length list", "Content-Length: 5, 5\r\n");
+	parse("Negative Content-Length", "Content-Length: -5\r\n");
+	parse("Chunked", "Transfer-Encoding: chunked\r\n", "transfer-encoding");
+	parse("Chunked last", "Transfer-Encoding: gzip, Chunked\r\n", "transfer-encoding");
+	parse("Chunked not last", "Transfer-Encoding: chunked, gzip\r\n");
+	parse("Chunked in earlier field", "Transfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n");
+	parse("Transfer-Encoding and Content-Length", "Transfer-Encoding: chunked\r\nContent-Length: 5\r\n");
+	parse("Content-Length and Transfer-Encoding", "Content-Length: 5\r\nTransfer-Encoding: chunked\r\n");
+	HttpHeaders headers;
+	std::cout << "Invalid request line: " << names[headers.parse("GET\r\n\r\n", 10)] << std::endl;
+	std::string many;
+	for (int i = 0; i < 11; ++i)
+		many += "X-" + std::to_string(i) + ": " + std::to_string(i) + "\r\n";
+	parse("Too many fields", many);
+
+	// The server replies 400 and closes the connection, so the smuggled request after it is never handled.
+	Service service;
+	Httpd <Service> httpd(&service, port, "");
+	std::string result;
+	std::thread client([&] { result = request("POST / HTTP/1.1\r\nHost: localhost\r\nContent-Length: 6\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\nGET /smuggled HTTP/1.1\r\nHost: localhost\r\n\r\n"); });
+	Loop *loop = Loop::get();
+	auto end = loop->now() + std::chrono::milliseconds(500);
+	while (loop->now() < end)
+		loop->iteration(false);
+	client.join();
+	std::cout << "Server: " << result << std::endl;
+}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	try {
+		runner();
+	}
+	catch (char const *msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	catch (std::string msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	return 0;
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,95 @@
+#define WEBLOOP_HELP "Test program for exceptions from socket callbacks."
+#define WEBLOOP_CONTACT "Bas Wijnen <wijnen@debian.org>"
+#define WEBLOOP_PACKAGE_NAME "webloop-test"
+
+#include <webloop.hh>
+#include <iostream>
+#include <sys/socket.h>
+#include <utility>
+
+/*
+TEST OUTPUT: Thrown: refused a
+TEST OUTPUT: Received after exception: b
+TEST OUTPUT: Thrown: refused c
+TEST OUTPUT: Destroyed after exception
+TEST OUTPUT: Many parts: true
+*/
+
+// A read callback that throws must leave the socket usable, and it must be safe to destroy it afterwards.
+// A send() with more parts than one system call takes must still send all of them.
+
+using namespace Webloop;
+
+struct Reader { // {{{
+	Socket <Reader> socket;
+	Reader(int fd) : socket("reader", fd, this) { socket.read(&Reader::read); }
+	size_t read(std::string_view data) {
+		if (data[0] != 'b')
+			throw "refused " + std::string(data.substr(0, 1));
+		std::cout << "Received after exception: " << data.substr(0, 1) << std::endl;
+		return 1;
+	}
+}; // }}}
+
+static void deliver(int fd, char const *data) { // {{{
+	if (::write(fd, data, 1) != 1)
+		throw "unable to write";
+	try {
+		Loop::get()->iteration(true);
+	}
+	catch (std::string msg) {
+		std::cout << "Thrown: " << msg << std::endl;
+	}
+} // }}}
+
+static void runner() {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0)
+		throw "unable to create socket pair";
+	auto reader = std::make_unique <Reader> (fds[0]);
+	deliver(fds[1], "a");
+	// The refused byte is still buffered; consume it so the next one is seen.
+	reader->socket.consume(1);
+	deliver(fds[1], "b");
+	deliver(fds[1], "c");
+	reader.reset();
+	std::cout << "Destroyed after exception" << std::endl;
+	::close(fds[1]);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0)
+		throw "unable to create socket pair";
+	Socket <Reader> writer("writer", fds[0]);
+	std::vector <std::string> parts;
+	std::string expected;
+	for (int i = 0; i < 100; ++i) {
+		parts.push_back(std::to_string(i) + ",");
+		expected += parts.back();
+	}
+	[&] <size_t... I> (std::index_sequence <I...>) { writer.send({std::string_view(parts[I])...}); } (std::make_index_sequence <100> ());
+	std::string received;
+	char buffer[1000];
+	for (int i = 0; i < 10 && received.size() < expected.size(); ++i) {
+		Loop::get()->iteration(false);
+		int n = ::read(fds[1], buffer, sizeof(buffer));
+		if (n > 0)
+			received.append(buffer, n);
+	}
+	std::cout << "Many parts: " << (received == expected ? "true" : "false") << std::endl;
+	::close(fds[1]);
+}
+
+int main(int argc, char **argv) {
+	fhs_init(argc, argv);
+	try {
+		runner();
+	}
+	catch (char const *msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	catch (std::string msg) {
+		std::cerr << "Exception: " << msg << std::endl;
+	}
+	return 0;
+}
+
+// vim: set foldmethod=marker :